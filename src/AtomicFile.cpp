@@ -0,0 +1,36 @@
+//
+// Created by tray-control on 2024/06/15.
+//
+
+#include "AtomicFile.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <unistd.h>
+
+std::expected<void, Error> writeFileAtomically(const std::string &path, std::string_view bytes) {
+    const std::string tmpPath = path + ".tmp." + std::to_string(getpid());
+    // error 在删除临时文件之前取得，remove 可能改写 errno
+    auto fail = [&tmpPath](const std::string &what, int error) {
+        std::remove(tmpPath.c_str());
+        return makeError(ErrorKind::IOError, what + ": " + std::strerror(error));
+    };
+
+    FILE *file = std::fopen(tmpPath.c_str(), "wb");
+    if (!file)
+        return makeError(ErrorKind::IOError, "Could not create " + tmpPath + ": " + std::strerror(errno));
+
+    if (std::fwrite(bytes.data(), 1, bytes.size(), file) != bytes.size()) {
+        const int error = errno;
+        std::fclose(file);
+        return fail("Could not write " + tmpPath, error);
+    }
+    // 缓冲区在 fclose 时才写出，磁盘已满等错误在这里报告
+    if (std::fclose(file) != 0)
+        return fail("Could not write " + tmpPath, errno);
+
+    if (std::rename(tmpPath.c_str(), path.c_str()) != 0)
+        return fail("Could not replace " + path, errno);
+    return {};
+}
@@ -0,0 +1,14 @@
+//
+// Created by tray-control on 2024/06/15.
+//
+#pragma once
+
+#include <expected>
+#include <string>
+#include <string_view>
+
+#include "Errors.h"
+
+// 先写同目录下的临时文件 path.tmp.<pid> 再 rename 到 path，读者要么看到旧文件，要么看到完整的新文件。
+// 任何一步失败都删除临时文件，错误中带有出错的路径和 errno 的说明
+std::expected<void, Error> writeFileAtomically(const std::string &path, std::string_view bytes);
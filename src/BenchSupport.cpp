@@ -0,0 +1,350 @@
+//
+// Created by tray-control on 2024/04/27.
+//
+
+#include "BenchSupport.h"
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+#include <fmt/format.h>
+
+#include "DBusMenu.h"
+#include "DBusUtils.h"
+#include "MemStats.h"
+#include "StatusNotifierItem.h"
+
+#ifdef TRAY_CONTROL_MEM_STATS
+// core 已经替换了全局 operator new，直接汇总各阶段的计数
+size_t allocationCount() {
+    size_t total = 0;
+    for (const auto &phase : memStats().phases)
+        total += phase.allocations;
+    return total;
+}
+#else
+namespace {
+
+std::atomic<size_t> allocations{0};
+
+} // namespace
+
+// 统计全局堆分配次数
+void *operator new(size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void *p = std::malloc(size ? size : 1))
+        return p;
+    throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept { std::free(p); }
+void operator delete(void *p, size_t) noexcept { std::free(p); }
+
+size_t allocationCount() { return allocations.load(std::memory_order_relaxed); }
+#endif
+
+namespace {
+
+// 合成数据只需可重复，不需要随机性
+std::vector<uint8_t> fakePng(size_t size, uint32_t seed) {
+    std::vector<uint8_t> data(size);
+    for (size_t i = 0; i < size; ++i) {
+        seed = seed * 1103515245 + 12345;
+        data[i] = static_cast<uint8_t>(seed >> 16);
+    }
+    return data;
+}
+
+// 在消息中逐层写出布局，children 为空的节点是叶子
+struct FixtureNode {
+    MenuPropertyMap properties;
+    std::vector<FixtureNode> children;
+};
+
+void writeNode(sdbus::Message &message, const FixtureNode &node, int32_t &nextId, LayoutFixture &fixture) {
+    const int32_t id = nextId++;
+    fixture.lastId = id;
+    ++fixture.nodes;
+
+    message.openStruct("ia{sv}av");
+    message << id << node.properties;
+    message.openContainer("v");
+    for (const auto &child : node.children) {
+        message.openVariant("(ia{sv}av)");
+        writeNode(message, child, nextId, fixture);
+        message.closeVariant();
+    }
+    message.closeContainer();
+    message.closeStruct();
+}
+
+LayoutFixture makeFixture(std::string name, const FixtureNode &root) {
+    LayoutFixture fixture{std::move(name), sdbus::createPlainMessage()};
+    int32_t nextId = 0;
+    writeNode(fixture.message, root, nextId, fixture);
+    fixture.message.seal();
+    return fixture;
+}
+
+FixtureNode submenu(std::string label) {
+    return FixtureNode{{{"label", std::move(label)}, {"children-display", std::string("submenu")}}, {}};
+}
+
+FixtureNode uniformNode(uint32_t breadth, uint32_t depth, uint32_t index) {
+    FixtureNode node{
+        {{"type", std::string("standard")},
+         {"label", fmt::format("Menu item number {}", index)},
+         {"enabled", true},
+         {"visible", true},
+         {"toggle-type", std::string("checkmark")},
+         {"toggle-state", static_cast<int32_t>(index % 2)}},
+        {}
+    };
+    if (depth > 0) {
+        node.properties.emplace("children-display", std::string("submenu"));
+        for (uint32_t i = 0; i < breadth; ++i) {
+            node.children.push_back(uniformNode(breadth, depth - 1, index * breadth + i + 1));
+        }
+    }
+    return node;
+}
+
+FixtureNode electronMenu() {
+    const char *menus[] = {"_File", "_Edit", "_Selection", "_View", "_Go", "_Run", "_Terminal", "_Help"};
+    FixtureNode root{{{"children-display", std::string("submenu")}}, {}};
+    uint32_t seed = 1;
+    for (const char *menuLabel : menus) {
+        auto menu = submenu(menuLabel);
+        for (int i = 0; i < 24; ++i) {
+            if (i % 6 == 5) {
+                menu.children.push_back(FixtureNode{{{"type", std::string("separator")}}, {}});
+                continue;
+            }
+
+            FixtureNode item{
+                {{"label", fmt::format("{} action _{}", menuLabel + 1, i)}, {"enabled", i % 9 != 0}, {"visible", true}},
+                {}
+            };
+            if (i % 3 == 0) {
+                item.properties.emplace(
+                    "shortcut", std::vector<std::vector<std::string>>{{"Control", "Shift", std::string(1, 'A' + i)}}
+                );
+            }
+            if (i % 8 == 1) {
+                item.properties.emplace("toggle-type", std::string("checkmark"));
+                item.properties.emplace("toggle-state", static_cast<int32_t>(i % 2));
+            }
+            if (i % 10 == 2) {
+                item.properties.emplace("icon-data", IconData(fakePng(1536, seed++)));
+            }
+            if (i % 7 == 3) {
+                // 最近打开的文件之类的二级菜单
+                auto recent = submenu(fmt::format("Open _Recent {}", i));
+                for (int j = 0; j < 12; ++j) {
+                    recent.children.push_back(FixtureNode{
+                        {{"label", fmt::format("~/projects/workspace-{}/src/module_{}/file_{}.ts", i, j, j * 7)},
+                         {"enabled", true},
+                         {"visible", true}},
+                        {}
+                    });
+                }
+                menu.children.push_back(std::move(recent));
+                continue;
+            }
+            menu.children.push_back(std::move(item));
+        }
+        root.children.push_back(std::move(menu));
+    }
+    return root;
+}
+
+FixtureNode clipboardMenu() {
+    FixtureNode root{{{"children-display", std::string("submenu")}}, {}};
+    root.children.reserve(5000);
+    for (int i = 0; i < 5000; ++i) {
+        // 历史条目长短不一，截断到 60 个字符左右
+        std::string text = fmt::format("{}: ", i);
+        while (text.size() < static_cast<size_t>(12 + (i * 37) % 50)) {
+            text += "lorem ipsum ";
+        }
+        root.children.push_back(FixtureNode{
+            {{"label", std::move(text)},
+             {"enabled", true},
+             {"visible", true},
+             {"icon-name", std::string(i % 4 == 0 ? "image-x-generic" : "edit-paste")}},
+            {}
+        });
+    }
+    return root;
+}
+
+FixtureNode bookmarkFolder(int depth, const std::string &path) {
+    auto folder = submenu(path.empty() ? "Bookmarks" : path.substr(path.rfind('/') + 1));
+    for (int i = 0; i < 3; ++i) {
+        folder.children.push_back(FixtureNode{
+            {{"label", fmt::format("Bookmark {} in {}", i, path.empty() ? "/" : path)},
+             {"enabled", true},
+             {"visible", true},
+             {"icon-name", std::string("text-html")}},
+            {}
+        });
+    }
+    if (depth > 0) {
+        for (int i = 0; i < 2; ++i) {
+            folder.children.push_back(bookmarkFolder(depth - 1, fmt::format("{}/folder-{}", path, i)));
+        }
+    }
+    return folder;
+}
+
+} // namespace
+
+LayoutFixture makeUniformLayout(uint32_t breadth, uint32_t depth) {
+    return makeFixture(fmt::format("uniform-{}x{}", breadth, depth), uniformNode(breadth, depth, 0));
+}
+
+std::vector<LayoutFixture> makeLayoutFixtures() {
+    std::vector<LayoutFixture> fixtures;
+    fixtures.push_back(makeFixture("electron", electronMenu()));
+    fixtures.push_back(makeFixture("clipboard", clipboardMenu()));
+    fixtures.push_back(makeFixture("bookmarks", bookmarkFolder(10, "")));
+    return fixtures;
+}
+
+sdbus::PlainMessage makeGroupPropertiesFixture(size_t count) {
+    std::vector<sdbus::Struct<int32_t, MenuPropertyMap>> items;
+    items.reserve(count);
+    for (size_t i = 0; i < count; ++i) {
+        items.emplace_back(
+            static_cast<int32_t>(i + 1),
+            MenuPropertyMap{
+                {"label", fmt::format("Item _{}", i)},
+                {"enabled", i % 5 != 0},
+                {"visible", true},
+                {"toggle-type", std::string("checkmark")},
+                {"toggle-state", static_cast<int32_t>(i % 2)}
+            }
+        );
+    }
+
+    auto message = sdbus::createPlainMessage();
+    message << items;
+    message.seal();
+    return message;
+}
+
+sdbus::PlainMessage makeSNIPropertiesFixture() {
+    SNIPropertySet properties;
+    properties.get<SNIProperty::Category>() = "ApplicationStatus";
+    properties.get<SNIProperty::Id>() = "chrome_status_icon_1";
+    properties.get<SNIProperty::Title>() = "Chromium";
+    properties.get<SNIProperty::Status>() = "Active";
+    properties.get<SNIProperty::WindowId>() = 0;
+    properties.get<SNIProperty::IconName>() = "chromium";
+    properties.get<SNIProperty::IconThemePath>() = "/tmp/.org.chromium.Chromium.XXXXXX";
+    properties.get<SNIProperty::Menu>() = sdbus::ObjectPath{"/com/canonical/dbusmenu"};
+    properties.get<SNIProperty::ItemIsMenu>() = false;
+
+    std::vector<sdbus::Struct<int32_t, int32_t, std::vector<uint8_t>>> pixmaps;
+    for (int32_t size : {16, 22, 32}) {
+        pixmaps.emplace_back(size, size, fakePng(static_cast<size_t>(size * size * 4), size));
+    }
+    properties.get<SNIProperty::ToolTip>() =
+        SNIToolTip{"chromium", std::move(pixmaps), "Chromium", "3 tabs playing audio"};
+
+    auto message = sdbus::createPlainMessage();
+    message << toSNIVariantMap(properties);
+    message.seal();
+    return message;
+}
+
+MockTray::MockTray(uint32_t breadth, uint32_t depth) {
+    int32_t nextId = 0;
+    buildNode(breadth, depth, nextId);
+}
+
+MockTray::~MockTray() {
+    if (connection_)
+        connection_->leaveEventLoop();
+    // 先注销对象再关闭连接
+    menu_.reset();
+    item_.reset();
+}
+
+MenuLayoutStruct MockTray::buildNode(uint32_t breadth, uint32_t depth, int32_t &nextId) {
+    const int32_t id = nextId++;
+    MenuPropertyMap properties{
+        {"label", fmt::format("Mock item _{}", id)}, {"enabled", true}, {"visible", true}
+    };
+    std::vector<sdbus::Variant> children;
+    if (depth > 0) {
+        properties.emplace("children-display", std::string("submenu"));
+        for (uint32_t i = 0; i < breadth; ++i) {
+            children.emplace_back(buildNode(breadth, depth - 1, nextId));
+        }
+    }
+
+    properties_.emplace(id, properties);
+    MenuLayoutStruct node{id, std::move(properties), std::move(children)};
+    subtrees_.emplace(id, node);
+    return node;
+}
+
+std::expected<void, Error> MockTray::start() {
+    return safelyExec([this] -> std::expected<void, Error> {
+        connection_ = sdbus::createSessionBusConnection();
+
+        item_ = sdbus::createObject(*connection_, sdbus::ObjectPath{ITEM_PATH});
+        item_
+            ->addVTable(
+                sdbus::registerProperty("Category").withGetter([] { return std::string("ApplicationStatus"); }),
+                sdbus::registerProperty("Id").withGetter([] { return std::string("mock-tray"); }),
+                sdbus::registerProperty("Title").withGetter([] { return std::string("Mock Tray"); }),
+                sdbus::registerProperty("Status").withGetter([] { return std::string("Active"); }),
+                sdbus::registerProperty("IconName").withGetter([] { return std::string("application-x-executable"); }),
+                sdbus::registerProperty("Menu").withGetter([] { return sdbus::ObjectPath{MENU_PATH}; }),
+                sdbus::registerProperty("ItemIsMenu").withGetter([] { return false; }),
+                sdbus::registerMethod("Activate").implementedAs([](int32_t, int32_t) {}),
+                sdbus::registerMethod("SecondaryActivate").implementedAs([](int32_t, int32_t) {}),
+                sdbus::registerMethod("ContextMenu").implementedAs([](int32_t, int32_t) {})
+            )
+            .forInterface(sdbus::InterfaceName{"org.kde.StatusNotifierItem"});
+
+        menu_ = sdbus::createObject(*connection_, sdbus::ObjectPath{MENU_PATH});
+        menu_
+            ->addVTable(
+                sdbus::registerProperty("Version").withGetter([] { return uint32_t{3}; }),
+                sdbus::registerProperty("Status").withGetter([] { return std::string("normal"); }),
+                sdbus::registerMethod("GetLayout")
+                    .implementedAs([this](int32_t parentId, int32_t, const std::vector<std::string> &) {
+                        const auto it = subtrees_.find(parentId);
+                        if (it == subtrees_.end())
+                            throw sdbus::Error(sdbus::Error::Name{"com.canonical.dbusmenu.UnknownId"}, "Unknown id");
+                        return std::make_tuple(uint32_t{1}, it->second);
+                    }),
+                sdbus::registerMethod("GetGroupProperties")
+                    .implementedAs([this](const std::vector<int32_t> &ids, const std::vector<std::string> &) {
+                        std::vector<sdbus::Struct<int32_t, MenuPropertyMap>> items;
+                        for (int32_t id : ids) {
+                            if (const auto it = properties_.find(id); it != properties_.end())
+                                items.emplace_back(id, it->second);
+                        }
+                        return items;
+                    }),
+                sdbus::registerMethod("Event").implementedAs(
+                    [this](int32_t, const std::string &, const sdbus::Variant &, uint32_t) {
+                        events_.fetch_add(1, std::memory_order_relaxed);
+                    }
+                ),
+                sdbus::registerMethod("AboutToShow").implementedAs([](int32_t) { return false; })
+            )
+            .forInterface(sdbus::InterfaceName{"com.canonical.dbusmenu"});
+
+        connection_->enterEventLoopAsync();
+        return {};
+    });
+}
+
+std::string MockTray::service() const {
+    return connection_ ? std::string(connection_->getUniqueName()) : std::string();
+}
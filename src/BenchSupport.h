@@ -0,0 +1,113 @@
+//
+// Created by tray-control on 2024/04/27.
+//
+// 基准测试程序共用的工具：全局分配计数、计时循环和合成的 DBus 回复消息。
+// 只链接进基准测试程序，不属于 core
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <expected>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+#include <sdbus-c++/sdbus-c++.h>
+
+#include "DBusMenu.h"
+#include "Errors.h"
+
+// 进程启动以来全局 operator new 的调用次数（由 BenchSupport.cpp 替换的 operator new 统计，
+// 以 TRAY_CONTROL_MEM_STATS 构建时改为汇总 memStats() 的各阶段计数）
+size_t allocationCount();
+
+struct BenchResult {
+    uint64_t iterations = 0;
+    double nsPerIteration = 0;
+    double allocationsPerIteration = 0;
+};
+
+// 先预热一次，然后重复调用 f 直到累计耗时不少于 minTime
+template <typename F> BenchResult measure(std::chrono::nanoseconds minTime, F &&f) {
+    f();
+
+    BenchResult result;
+    const size_t allocationsBefore = allocationCount();
+    const auto start = std::chrono::steady_clock::now();
+    auto elapsed = std::chrono::steady_clock::duration::zero();
+    // 每轮的次数翻倍，减少读时钟的开销
+    for (uint64_t batch = 1; elapsed < minTime; batch *= 2) {
+        for (uint64_t i = 0; i < batch; ++i) {
+            f();
+        }
+        result.iterations += batch;
+        elapsed = std::chrono::steady_clock::now() - start;
+    }
+    const size_t allocations = allocationCount() - allocationsBefore;
+
+    result.nsPerIteration = std::chrono::duration<double, std::nano>(elapsed).count() / result.iterations;
+    result.allocationsPerIteration = static_cast<double>(allocations) / result.iterations;
+    return result;
+}
+
+// 已封口、可以反复 rewind 读取的回复消息，内容与真实应用返回的形状相近
+struct LayoutFixture {
+    std::string name;
+    sdbus::PlainMessage message; // GetLayout 回复中的 (ia{sv}av) 部分
+    size_t nodes = 0;
+    int32_t lastId = 0; // 前序遍历中最后一个菜单项，用作查找的最坏情况
+};
+
+// 每个子菜单有 breadth 个子项、共 depth 层的均匀布局
+LayoutFixture makeUniformLayout(uint32_t breadth, uint32_t depth);
+
+// electron：Electron 应用的菜单栏，带快捷键、勾选项和少量 icon-data；
+// clipboard：剪贴板管理器的 5000 条历史记录，平铺在根节点下；
+// bookmarks：浏览器书签，文件夹嵌套十层
+std::vector<LayoutFixture> makeLayoutFixtures();
+
+// GetGroupProperties 回复的 a(ia{sv})，count 个菜单项
+sdbus::PlainMessage makeGroupPropertiesFixture(size_t count);
+
+// Properties.GetAll(org.kde.StatusNotifierItem) 回复的 a{sv}，包含带三种尺寸图标的 ToolTip
+sdbus::PlainMessage makeSNIPropertiesFixture();
+
+// 进程内的模拟托盘项：在自己的会话总线连接上导出 StatusNotifierItem 和 dbusmenu，
+// 事件循环运行在连接自己的线程上，和真实应用一样逐个处理请求。
+// 菜单是 breadth×depth 的均匀布局；GetLayout 忽略 recursionDepth 和属性过滤，总是返回完整子树
+class MockTray {
+  public:
+    static constexpr const char *ITEM_PATH = "/StatusNotifierItem";
+    static constexpr const char *MENU_PATH = "/MenuBar";
+
+    MockTray(uint32_t breadth, uint32_t depth);
+    ~MockTray();
+
+    MockTray(const MockTray &) = delete;
+    MockTray &operator=(const MockTray &) = delete;
+
+    std::expected<void, Error> start();
+
+    // 连接的唯一名，作为托盘项和菜单的服务名
+    std::string service() const;
+
+    // 菜单项总数（含根节点）
+    size_t menuItems() const { return subtrees_.size(); }
+
+    // 收到的 Event 调用数
+    uint64_t events() const { return events_.load(std::memory_order_relaxed); }
+
+  private:
+    // id -> 以该菜单项为根的子树，GetLayout 按 parentId 直接返回
+    std::map<int32_t, MenuLayoutStruct> subtrees_;
+    std::map<int32_t, MenuPropertyMap> properties_;
+    std::atomic<uint64_t> events_{0};
+
+    std::unique_ptr<sdbus::IConnection> connection_;
+    std::unique_ptr<sdbus::IObject> item_;
+    std::unique_ptr<sdbus::IObject> menu_;
+
+    MenuLayoutStruct buildNode(uint32_t breadth, uint32_t depth, int32_t &nextId);
+};
@@ -0,0 +1,40 @@
+//
+// Created by tray-control on 2024/05/04.
+//
+
+#include "BusThread.h"
+
+#include <sdbus-c++/sdbus-c++.h>
+
+#include "DBusUtils.h"
+#include "SessionBus.h"
+
+BusThread::BusThread(std::string bus) : bus_(std::move(bus)) {}
+
+BusThread::~BusThread() { stop(); }
+
+std::expected<void, Error> BusThread::start() {
+    return safelyExec([this] -> std::expected<void, Error> {
+        if (connection_)
+            return {};
+
+        connection_ = connectSessionBus(bus_);
+        if (!connection_)
+            return makeError(ErrorKind::ConnectionError, "Failed to connect to the session bus");
+
+        connection_->enterEventLoopAsync();
+        return {};
+    });
+}
+
+void BusThread::stop() {
+    if (!connection_)
+        return;
+
+    try {
+        connection_->leaveEventLoop();
+    } catch (const sdbus::Error &) {
+        // 连接已经断开，事件循环线程会自行退出
+    }
+    connection_.reset();
+}
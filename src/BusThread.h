@@ -0,0 +1,41 @@
+//
+// Created by tray-control on 2024/05/04.
+//
+#pragma once
+
+#include <expected>
+#include <memory>
+#include <string>
+
+#include "Errors.h"
+
+namespace sdbus {
+class IConnection;
+}
+
+// 在一个专用线程上运行会话总线连接的事件循环。
+// 默认情况下每个代理各自持有连接和事件循环线程，信号回调分散在多个线程上；
+// 通过 DBusMenu::connect(BusThread &) 等共享这条连接后，所有信号都在这一个线程上分发，
+// 可以配合 EventQueue 把事件交给使用者线程。使用这条连接的代理必须先于 BusThread 销毁
+class BusThread {
+  public:
+    // bus 为会话总线地址，空表示默认会话总线
+    explicit BusThread(std::string bus = {});
+    ~BusThread();
+
+    BusThread(const BusThread &) = delete;
+    BusThread &operator=(const BusThread &) = delete;
+
+    // 连接会话总线并启动事件循环线程
+    std::expected<void, Error> start();
+
+    // 停止事件循环并等待线程退出；析构时自动调用
+    void stop();
+
+    // start 成功之后有效
+    sdbus::IConnection &connection() { return *connection_; }
+
+  private:
+    std::string bus_;
+    std::unique_ptr<sdbus::IConnection> connection_;
+};
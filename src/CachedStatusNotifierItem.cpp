@@ -0,0 +1,124 @@
+//
+// Created by tray-control on 2024/03/16.
+//
+
+#include "CachedStatusNotifierItem.h"
+
+#include <algorithm>
+#include <string_view>
+#include <vector>
+
+namespace {
+
+// 应用不再提供这个属性：Properties.Get 对不存在的属性返回 UnknownProperty，部分实现返回 InvalidArgs
+bool propertyAbsent(const Error &error) {
+    static constexpr std::string_view absentNames[] = {
+        "org.freedesktop.DBus.Error.UnknownProperty",
+        "org.freedesktop.DBus.Error.InvalidArgs",
+    };
+    return error.kind == ErrorKind::DBusError &&
+           std::ranges::find(absentNames, error.name.view()) != std::end(absentNames);
+}
+
+} // namespace
+
+CachedStatusNotifierItem::CachedStatusNotifierItem(std::string_view destination, std::string_view objectPath)
+    : item_(destination, objectPath) {}
+
+CachedStatusNotifierItem::~CachedStatusNotifierItem() = default;
+
+std::expected<void, Error> CachedStatusNotifierItem::connect() {
+    if (auto connRes = item_.connect(); !connRes)
+        return connRes;
+
+    // 先订阅再获取，避免错过两者之间发生的变化
+    if (auto subRes = item_.registerSignalCallback([this](SNISignal signal, const std::string &status) {
+            onSignal(signal, status);
+        });
+        !subRes)
+        return subRes;
+
+    return refresh();
+}
+
+std::expected<void, Error> CachedStatusNotifierItem::refresh() {
+    MemPhaseScope memPhase(MemPhase::Properties);
+    auto all = item_.getAll();
+    if (!all)
+        return std::unexpected(all.error());
+
+    std::vector<SNIProperty> changed;
+    {
+        std::unique_lock lock(mutex_);
+        forEachSNIProperty([&]<SNIProperty P>() {
+            if (properties_.get<P>() != all->get<P>())
+                changed.push_back(P);
+        });
+        properties_ = std::move(all.value());
+    }
+
+    for (auto property : changed)
+        notifyChanged(property);
+    return {};
+}
+
+SNIPropertySet CachedStatusNotifierItem::snapshot() const {
+    std::shared_lock lock(mutex_);
+    return properties_;
+}
+
+void CachedStatusNotifierItem::registerChangeCallback(ChangeCallback callback) {
+    std::lock_guard lock(callbackMutex_);
+    changeCallback_ = std::move(callback);
+}
+
+void CachedStatusNotifierItem::onSignal(SNISignal signal, const std::string &status) {
+    // NewStatus 直接携带新值，无需再访问总线
+    if (signal == SNISignal::NewStatus) {
+        bool changed;
+        {
+            std::unique_lock lock(mutex_);
+            auto &cached = properties_.get<SNIProperty::Status>();
+            changed = cached != status;
+            cached = status;
+        }
+        if (changed)
+            notifyChanged(SNIProperty::Status);
+        return;
+    }
+
+    for (auto property : sniSignalProperties(signal))
+        refetch(property);
+}
+
+void CachedStatusNotifierItem::refetch(SNIProperty property) {
+    forEachSNIProperty([&]<SNIProperty P>() {
+        if (P != property)
+            return;
+
+        // 属性不存在（例如应用清除了图标名）时清空缓存；超时等其他错误说明应用暂时没有回答，
+        // 保留旧值，也不通知变化
+        auto value = item_.get<P>();
+        std::optional<SNIPropertyType<P>> fresh;
+        if (value)
+            fresh = std::move(value.value());
+        else if (!propertyAbsent(value.error()))
+            return;
+
+        bool changed;
+        {
+            std::unique_lock lock(mutex_);
+            auto &cached = properties_.get<P>();
+            changed = cached != fresh;
+            cached = std::move(fresh);
+        }
+        if (changed)
+            notifyChanged(P);
+    });
+}
+
+void CachedStatusNotifierItem::notifyChanged(SNIProperty property) {
+    std::lock_guard lock(callbackMutex_);
+    if (changeCallback_)
+        changeCallback_(property);
+}
@@ -0,0 +1,59 @@
+//
+// Created by tray-control on 2024/03/16.
+//
+#pragma once
+
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
+#include <string>
+
+#include "StatusNotifierItem.h"
+
+// 带属性缓存的 StatusNotifierItem：连接时通过一次 GetAll 填充缓存，
+// 之后由 New* 信号使对应属性失效并单独重新获取，读取直接从内存返回
+class CachedStatusNotifierItem {
+  public:
+    // 属性值发生变化时调用，在连接的事件循环线程上执行
+    using ChangeCallback = std::function<void(SNIProperty)>;
+
+    CachedStatusNotifierItem(std::string_view destination, std::string_view objectPath);
+    ~CachedStatusNotifierItem();
+
+    CachedStatusNotifierItem(const CachedStatusNotifierItem &) = delete;
+    CachedStatusNotifierItem &operator=(const CachedStatusNotifierItem &) = delete;
+
+    // 连接、订阅信号并批量获取全部属性
+    std::expected<void, Error> connect();
+
+    // 重新批量获取全部属性
+    std::expected<void, Error> refresh();
+
+    template <SNIProperty P> std::optional<SNIPropertyType<P>> get() const {
+        std::shared_lock lock(mutex_);
+        return properties_.get<P>();
+    }
+
+    // 当前缓存的完整副本
+    SNIPropertySet snapshot() const;
+
+    void registerChangeCallback(ChangeCallback callback);
+
+    // 用于调用 Activate/ContextMenu 等方法
+    StatusNotifierItem &item() { return item_; }
+
+  private:
+    mutable std::shared_mutex mutex_;
+    SNIPropertySet properties_;
+
+    std::mutex callbackMutex_;
+    ChangeCallback changeCallback_;
+
+    // 最后声明、最先析构，保证信号回调运行时其余成员仍然有效
+    StatusNotifierItem item_;
+
+    void onSignal(SNISignal signal, const std::string &status);
+    void refetch(SNIProperty property);
+    void notifyChanged(SNIProperty property);
+};
@@ -4,64 +4,156 @@
 
 #include "DBusMenu.h"
 #include <sdbus-c++/sdbus-c++.h>
+#include "BusThread.h"
 #include "DBusUtils.h"
+#include "EventQueue.h"
+#include "MemStats.h"
+#include "MenuLayoutArena.h"
+#include "MenuUpdateCoalescer.h"
+#include "SessionBus.h"
+#include "SignalMatch.h"
+#include <algorithm>
+#include <cstring>
 #include <iostream>
 
-DBusMenu::DBusMenu(const std::string &service, const std::string &path) : service_(service), path_(path) {}
+namespace {
 
-DBusMenu::~DBusMenu() = default;
+// 估算一组属性在 DBus 线上格式中的大小：键、变体签名和值
+size_t propertiesPayloadSize(const MenuPropertyMap &properties) {
+    size_t bytes = 0;
+    for (const auto &[key, value] : properties) {
+        bytes += key.size() + 8;
+        bytes += std::visit(
+            [](const auto &arg) -> size_t {
+                using T = std::decay_t<decltype(arg)>;
+                if constexpr (std::is_same_v<T, std::string>) {
+                    return arg.size() + 5;
+                } else if constexpr (std::is_same_v<T, IconData>) {
+                    return arg.size() + 4;
+                } else if constexpr (std::is_same_v<T, std::vector<std::vector<std::string>>>) {
+                    size_t size = 4;
+                    for (const auto &keys : arg) {
+                        size += 4;
+                        for (const auto &k : keys) {
+                            size += k.size() + 5;
+                        }
+                    }
+                    return size;
+                } else {
+                    return sizeof(T);
+                }
+            },
+            value
+        );
+    }
+    return bytes;
+}
+
+} // namespace
+
+DBusMenu::DBusMenu(const std::string &service, const std::string &path, const std::string &bus)
+    : service_(service), path_(path), bus_(bus), proxies_(service, path, bus) {}
+
+DBusMenu::~DBusMenu() {
+    // 先停止合并线程，它可能仍在通过代理刷新属性；
+    // 再销毁代理停止事件循环，之后信号处理函数不会再访问其余成员
+    disableCoalescing();
+    // 显式移除匹配规则，再销毁代理停止事件循环
+    {
+        std::lock_guard lock(subscriptionMutex_);
+        itemsPropertiesUpdatedSlot_.reset();
+        layoutUpdatedSlot_.reset();
+        itemActivationRequestedSlot_.reset();
+    }
+    proxies_.reset(nullptr);
+}
 
 std::expected<void, Error> DBusMenu::connect() {
+    MemPhaseScope memPhase(MemPhase::Discovery);
     return safelyExec([this] -> std::expected<void, Error> {
-        proxy_ = sdbus::createProxy(
-            sdbus::createSessionBusConnection(), sdbus::ServiceName{service_}, sdbus::ObjectPath{path_}
-        );
+        auto proxy =
+            sdbus::createProxy(connectSessionBus(bus_), sdbus::ServiceName{service_}, sdbus::ObjectPath{path_});
 
-        if (!proxy_) {
+        if (!proxy) {
             return makeError(ErrorKind::ConnectionError, "Failed to create DBus proxy");
         }
 
-        // 注册信号处理
-        registerSignalHandlers();
+        proxies_.reset(std::move(proxy));
+        return {};
+    });
+}
+
+std::expected<void, Error> DBusMenu::connect(BusThread &bus) {
+    MemPhaseScope memPhase(MemPhase::Discovery);
+    return safelyExec([this, &bus] -> std::expected<void, Error> {
+        auto proxy = sdbus::createProxy(bus.connection(), sdbus::ServiceName{service_}, sdbus::ObjectPath{path_});
 
+        if (!proxy) {
+            return makeError(ErrorKind::ConnectionError, "Failed to create DBus proxy");
+        }
+
+        proxies_.reset(std::move(proxy));
         return {};
     });
 }
 
 std::expected<uint32_t, Error> DBusMenu::getVersion() const {
-    return safelyGetProperty<uint32_t>(proxy_, "com.canonical.dbusmenu", "Version");
+    if (versionKnown_.load(std::memory_order_acquire)) {
+        return version_.load(std::memory_order_relaxed);
+    }
+
+    auto version = safelyGetProperty<uint32_t>(proxies_.get(), service_, "com.canonical.dbusmenu", "Version");
+    if (version) {
+        // 并发的首次调用会写入相同的值
+        version_.store(*version, std::memory_order_relaxed);
+        versionKnown_.store(true, std::memory_order_release);
+    }
+    return version;
 }
 
 std::expected<std::string, Error> DBusMenu::getStatus() const {
-    return safelyGetProperty<std::string>(proxy_, "com.canonical.dbusmenu", "Status");
+    return safelyGetProperty<std::string>(proxies_.get(), service_, "com.canonical.dbusmenu", "Status");
 }
 
 std::expected<std::pair<uint32_t, MenuLayoutItem>, Error>
 DBusMenu::getLayout(int32_t parentId, int32_t recursionDepth, const std::vector<std::string> &propertyNames) {
+    MemPhaseScope memPhase(MemPhase::Layout);
 
-    return safelyExec(
+    return safelyCall(
+        service_,
         [this, parentId, recursionDepth,
          &propertyNames]() -> std::expected<std::pair<uint32_t, MenuLayoutItem>, Error> {
-            if (!proxy_) {
+            auto *proxy = proxies_.get();
+            if (!proxy) {
                 return makeError(ErrorKind::ConnectionError, "DBus proxy not initialized");
             }
 
             try {
                 // 直接按签名接收结果，不使用Variant
                 uint32_t revision;
-                sdbus::Struct<int32_t, MenuPropertyMap, std::vector<sdbus::Variant>> layout;
+                MenuLayoutStruct layout;
 
-                proxy_->callMethod("GetLayout")
+                proxy->callMethod("GetLayout")
                     .onInterface("com.canonical.dbusmenu")
                     .withArguments(parentId, recursionDepth, propertyNames)
                     .storeResultsTo(revision, layout);
 
                 // 使用递归函数解析布局
-                MenuLayoutItem rootItem = parseLayout(layout);
+                size_t bytes = sizeof(revision);
+                MenuLayoutItem rootItem = parseMenuLayout(layout, bytes);
+                recordTransfer(bytes);
 
-                return std::make_pair(revision, rootItem);
+                // 记录父子关系，供信号合并计算最低公共父节点
+                {
+                    std::lock_guard lock(coalescerMutex_);
+                    if (coalescer_) {
+                        coalescer_->recordParents(rootItem);
+                    }
+                }
+
+                return std::make_pair(revision, std::move(rootItem));
             } catch (const sdbus::Error &err) {
-                return makeError(ErrorKind::DBusError, err.what());
+                return makeError(err);
             } catch (const std::exception &e) {
                 return makeError(ErrorKind::UnknownError, e.what());
             }
@@ -69,59 +161,304 @@ DBusMenu::getLayout(int32_t parentId, int32_t recursionDepth, const std::vector<
     );
 }
 
-std::expected<std::vector<MenuItem>, Error>
-DBusMenu::getGroupProperties(const std::vector<int32_t> &ids, const std::vector<std::string> &propertyNames) {
-
-    return safelyExec([this, &ids, &propertyNames]() -> std::expected<std::vector<MenuItem>, Error> {
-        if (!proxy_) {
+std::expected<std::pair<uint32_t, const PmrMenuLayoutItem *>, Error> DBusMenu::getLayoutInto(
+    MenuLayoutArena &arena, int32_t parentId, int32_t recursionDepth, const std::vector<std::string> &propertyNames
+) {
+    MemPhaseScope memPhase(MemPhase::Layout);
+    return safelyCall(service_, [&] -> std::expected<std::pair<uint32_t, const PmrMenuLayoutItem *>, Error> {
+        auto *proxy = proxies_.get();
+        if (!proxy) {
             return makeError(ErrorKind::ConnectionError, "DBus proxy not initialized");
         }
 
-        try {
-            // 调用 GetGroupProperties 方法并直接获取结果
-            std::vector<sdbus::Variant> itemsData;
+        auto call = proxy->createMethodCall("com.canonical.dbusmenu", "GetLayout");
+        call << parentId << recursionDepth << propertyNames;
+        auto reply = proxy->callMethod(call);
 
-            proxy_->callMethod("GetGroupProperties")
-                .onInterface("com.canonical.dbusmenu")
-                .withArguments(ids, propertyNames)
-                .storeResultsTo(itemsData);
-
-            // 转换为 MenuItem 结构
-            std::vector<MenuItem> items;
-            for (const auto &itemVariant : itemsData) {
-                try {
-                    // 简化处理，只获取基本结构
-                    MenuItem item;
-                    item.id = 0; // 默认值
-
-                    // 尝试获取属性
-                    if (itemVariant.containsValueOfType<sdbus::Struct<int32_t, MenuPropertyMap>>()) {
-                        auto itemStruct = itemVariant.get<sdbus::Struct<int32_t, MenuPropertyMap>>();
-                        item.id = std::get<0>(itemStruct);
-                        item.properties = std::get<1>(itemStruct);
+        uint32_t revision;
+        reply >> revision;
+
+        // 回复到手后再 reset，调用失败时上一次的布局仍然有效
+        arena.reset();
+        PmrMenuLayoutItem *root = arena.newRoot();
+        size_t bytes = sizeof(revision);
+        parseMenuLayout(reply, *root, bytes);
+        recordTransfer(bytes);
+
+        {
+            std::lock_guard lock(coalescerMutex_);
+            if (coalescer_) {
+                coalescer_->recordParents(*root);
+            }
+        }
+
+        return std::make_pair(revision, static_cast<const PmrMenuLayoutItem *>(root));
+    });
+}
+
+namespace {
+
+using MenuPropertyEntry = std::pair<std::string_view, MenuPropertyView>;
+
+// 解码一个属性值，不支持流式访问的类型返回 nullopt
+std::optional<MenuPropertyView> readPropertyView(sdbus::Message &message, std::string_view signature, size_t &bytes) {
+    std::optional<MenuPropertyView> value;
+    if (signature == "b") {
+        bool b;
+        message.enterVariant("b");
+        message >> b;
+        value = b;
+        bytes += sizeof(bool);
+    } else if (signature == "i") {
+        int32_t i;
+        message.enterVariant("i");
+        message >> i;
+        value = i;
+        bytes += sizeof(int32_t);
+    } else if (signature == "s") {
+        char *str = nullptr;
+        message.enterVariant("s");
+        message >> str;
+        const std::string_view view = str ? str : "";
+        value = view;
+        bytes += view.size() + 5;
+    } else if (signature == "ay") {
+        // 字节数组直接借用消息中的存储
+        std::span<uint8_t> data;
+        message.enterVariant("ay");
+        message >> data;
+        value = std::span<const uint8_t>(data);
+        bytes += data.size() + 4;
+    } else {
+        sdbus::Variant ignored;
+        message >> ignored;
+        return value;
+    }
+    message.exitVariant();
+    return value;
+}
+
+// 递归解码 (ia{sv}av) 并调用访问者；silent 时只解码不回调。返回 false 表示访问者要求停止。
+// properties 在所有层之间复用：当前菜单项的属性在 enter 之后即被丢弃，子项不会看到父节点的属性
+bool visitLayoutMessage(
+    sdbus::Message &message, const MenuLayoutVisitor &visitor, int depth, bool silent,
+    std::vector<MenuPropertyEntry> &properties, size_t &bytes
+) {
+    int32_t id;
+    message.enterStruct("ia{sv}av");
+    message >> id;
+    bytes += sizeof(int32_t);
+
+    properties.clear();
+    if (message.enterContainer("{sv}")) {
+        while (message.enterDictEntry("sv")) {
+            char *key = nullptr;
+            message >> key;
+            const char *contents = message.peekType().second;
+            auto value = readPropertyView(message, contents ? contents : "", bytes);
+            if (value && !silent) {
+                properties.emplace_back(key ? key : "", *value);
+            }
+            bytes += (key ? std::strlen(key) : 0) + 8;
+            message.exitDictEntry();
+        }
+        message.clearFlags();
+        message.exitContainer();
+    }
+
+    auto action = MenuVisitAction::Continue;
+    if (!silent && visitor.enter) {
+        action = visitor.enter(MenuNodeView{id, depth, properties});
+    }
+    properties.clear();
+    if (action == MenuVisitAction::Stop) {
+        return false;
+    }
+
+    const bool silentChildren = silent || action == MenuVisitAction::SkipChildren;
+    if (message.enterContainer("v")) {
+        while (message.enterVariant("(ia{sv}av)")) {
+            if (!visitLayoutMessage(message, visitor, depth + 1, silentChildren, properties, bytes)) {
+                return false;
+            }
+            message.exitVariant();
+        }
+        message.clearFlags();
+        message.exitContainer();
+    }
+    message.exitStruct();
+
+    return silent || !visitor.leave || visitor.leave(id, depth) != MenuVisitAction::Stop;
+}
+
+// 在布局树上按同样的顺序调用访问者
+bool visitLayoutTree(
+    const MenuLayoutItem &item, const MenuLayoutVisitor &visitor, int depth, std::vector<MenuPropertyEntry> &properties
+) {
+    auto action = MenuVisitAction::Continue;
+    if (visitor.enter) {
+        properties.clear();
+        for (const auto &[key, value] : item.properties) {
+            std::visit(
+                [&properties, &key](const auto &arg) {
+                    using T = std::decay_t<decltype(arg)>;
+                    if constexpr (std::is_same_v<T, std::string>) {
+                        properties.emplace_back(key, std::string_view(arg));
+                    } else if constexpr (std::is_same_v<T, IconData>) {
+                        properties.emplace_back(key, arg.bytes());
+                    } else if constexpr (std::is_same_v<T, bool> || std::is_same_v<T, int32_t>) {
+                        properties.emplace_back(key, arg);
                     }
+                },
+                value
+            );
+        }
+        action = visitor.enter(MenuNodeView{item.id, depth, properties});
+        properties.clear();
+    }
+    if (action == MenuVisitAction::Stop) {
+        return false;
+    }
 
-                    items.push_back(std::move(item));
-                } catch (const std::exception &e) {
-                    // 忽略单个项的错误，继续处理其他项
-                    continue;
-                }
+    // 树已经在内存中，跳过的子树不必再走一遍
+    if (action != MenuVisitAction::SkipChildren) {
+        for (const auto &child : item.children) {
+            if (!visitLayoutTree(child, visitor, depth + 1, properties)) {
+                return false;
             }
+        }
+    }
 
-            return items;
-        } catch (const sdbus::Error &err) {
-            return makeError(ErrorKind::DBusError, err.what());
-        } catch (const std::exception &e) {
-            return makeError(ErrorKind::UnknownError, e.what());
+    return !visitor.leave || visitor.leave(item.id, depth) != MenuVisitAction::Stop;
+}
+
+} // namespace
+
+void visitMenuLayout(uint32_t revision, const MenuLayoutItem &root, const MenuLayoutVisitor &visitor) {
+    if (visitor.begin) {
+        visitor.begin(revision);
+    }
+    std::vector<MenuPropertyEntry> properties;
+    visitLayoutTree(root, visitor, 0, properties);
+}
+
+void visitMenuLayout(sdbus::Message &message, const MenuLayoutVisitor &visitor, size_t &bytes) {
+    std::vector<MenuPropertyEntry> properties;
+    visitLayoutMessage(message, visitor, 0, false, properties, bytes);
+}
+
+std::expected<uint32_t, Error> DBusMenu::visitLayout(
+    int32_t parentId, int32_t recursionDepth, const MenuLayoutVisitor &visitor,
+    const std::vector<std::string> &propertyNames, std::chrono::milliseconds timeout
+) {
+    MemPhaseScope memPhase(MemPhase::Layout);
+    return safelyCall(service_, [&] -> std::expected<uint32_t, Error> {
+        auto *proxy = proxies_.get();
+        if (!proxy) {
+            return makeError(ErrorKind::ConnectionError, "DBus proxy not initialized");
+        }
+
+        auto call = proxy->createMethodCall("com.canonical.dbusmenu", "GetLayout");
+        call << parentId << recursionDepth << propertyNames;
+        auto reply = timeout.count() > 0 ? proxy->callMethod(call, timeout) : proxy->callMethod(call);
+
+        uint32_t revision;
+        reply >> revision;
+        if (visitor.begin) {
+            visitor.begin(revision);
         }
+
+        size_t bytes = sizeof(revision);
+        visitMenuLayout(reply, visitor, bytes);
+        recordTransfer(bytes);
+        return revision;
+    });
+}
+
+std::vector<MenuItem> parseGroupProperties(sdbus::Message &message, size_t &bytes) {
+    // 回复的签名是 a(ia{sv})，按签名直接解码，不经过 Variant
+    std::vector<sdbus::Struct<int32_t, MenuPropertyMap>> itemsData;
+    message >> itemsData;
+
+    std::vector<MenuItem> items;
+    items.reserve(itemsData.size());
+    for (auto &itemData : itemsData) {
+        MenuItem item{std::get<0>(itemData), std::move(std::get<1>(itemData))};
+        bytes += sizeof(int32_t) + propertiesPayloadSize(item.properties);
+        items.push_back(std::move(item));
+    }
+    return items;
+}
+
+std::expected<std::vector<MenuItem>, Error>
+DBusMenu::getGroupProperties(const std::vector<int32_t> &ids, const std::vector<std::string> &propertyNames) {
+    MemPhaseScope memPhase(MemPhase::Properties);
+
+    return safelyCall(service_, [this, &ids, &propertyNames]() -> std::expected<std::vector<MenuItem>, Error> {
+        auto *proxy = proxies_.get();
+        if (!proxy) {
+            return makeError(ErrorKind::ConnectionError, "DBus proxy not initialized");
+        }
+
+        auto call = proxy->createMethodCall("com.canonical.dbusmenu", "GetGroupProperties");
+        call << ids << propertyNames;
+        auto reply = proxy->callMethod(call);
+
+        size_t bytes = 0;
+        auto items = parseGroupProperties(reply, bytes);
+        recordTransfer(bytes);
+        return items;
     });
 }
 
+MenuEntryState menuEntryState(const MenuItem &item) {
+    MenuEntryState state;
+    state.id = item.id;
+    for (const auto &[key, value] : item.properties) {
+        if (key == "type") {
+            if (const auto *type = std::get_if<std::string>(&value))
+                state.type = *type;
+        } else if (key == "enabled") {
+            if (const auto *enabled = std::get_if<bool>(&value))
+                state.enabled = *enabled;
+        } else if (key == "visible") {
+            if (const auto *visible = std::get_if<bool>(&value))
+                state.visible = *visible;
+        } else if (key == "toggle-type") {
+            if (const auto *toggleType = std::get_if<std::string>(&value))
+                state.toggleType = *toggleType;
+        } else if (key == "toggle-state") {
+            if (const auto *toggleState = std::get_if<int32_t>(&value))
+                state.toggleState = *toggleState;
+        }
+    }
+    return state;
+}
+
+std::expected<std::vector<MenuEntryState>, Error> DBusMenu::getEntryStates(const std::vector<int32_t> &ids) {
+    MemPhaseScope memPhase(MemPhase::Properties);
+    auto items = getGroupProperties(ids, MENU_ENTRY_PROPERTIES);
+    if (!items)
+        return std::unexpected(items.error());
+
+    std::vector<MenuEntryState> states;
+    states.reserve(items->size());
+    for (const auto &item : *items) {
+        // 只保留请求过的 ID，同一 ID 只取第一项
+        if (std::ranges::find(ids, item.id) != ids.end() &&
+            std::ranges::find(states, item.id, &MenuEntryState::id) == states.end())
+            states.push_back(menuEntryState(item));
+    }
+    return states;
+}
+
 std::expected<std::variant<bool, int32_t, std::string>, Error>
 DBusMenu::getProperty(int32_t id, const std::string &name) {
+    MemPhaseScope memPhase(MemPhase::Properties);
 
-    return safelyExec([this, id, &name]() -> std::expected<std::variant<bool, int32_t, std::string>, Error> {
-        if (!proxy_) {
+    return safelyCall(service_, [this, id, &name]() -> std::expected<std::variant<bool, int32_t, std::string>, Error> {
+        auto *proxy = proxies_.get();
+        if (!proxy) {
             return makeError(ErrorKind::ConnectionError, "DBus proxy not initialized");
         }
 
@@ -129,7 +466,7 @@ DBusMenu::getProperty(int32_t id, const std::string &name) {
             // 调用 GetProperty 方法并直接获取结果
             sdbus::Variant value;
 
-            proxy_->callMethod("GetProperty")
+            proxy->callMethod("GetProperty")
                 .onInterface("com.canonical.dbusmenu")
                 .withArguments(id, name)
                 .storeResultsTo(value);
@@ -145,7 +482,7 @@ DBusMenu::getProperty(int32_t id, const std::string &name) {
                 return makeError(ErrorKind::TypeError, "Unsupported property type");
             }
         } catch (const sdbus::Error &err) {
-            return makeError(ErrorKind::DBusError, err.what());
+            return makeError(err);
         } catch (const std::exception &e) {
             return makeError(ErrorKind::UnknownError, e.what());
         }
@@ -157,12 +494,13 @@ std::expected<void, Error> DBusMenu::sendEvent(
 ) {
 
     return safelyExec([this, id, &eventId, &data, timestamp]() -> std::expected<void, Error> {
-        if (!proxy_) {
+        auto *proxy = proxies_.get();
+        if (!proxy) {
             return makeError(ErrorKind::ConnectionError, "DBus proxy not initialized");
         }
 
         // 调用 Event 方法
-        proxy_->callMethod("Event")
+        proxy->callMethod("Event")
             .onInterface("com.canonical.dbusmenu")
             .withArguments(id, eventId, data, timestamp)
             .dontExpectReply();
@@ -171,9 +509,97 @@ std::expected<void, Error> DBusMenu::sendEvent(
     });
 }
 
+void DBusMenu::sendEventAsync(
+    int32_t id, const std::string &eventId, const std::variant<bool, int32_t, std::string> &data, uint32_t timestamp,
+    std::function<void(std::expected<void, Error>)> done
+) {
+    auto res = safelyExec([&]() -> std::expected<void, Error> {
+        // 主代理的连接有事件循环，回复在那里处理；线程代理没有事件循环，收不到异步回复
+        auto *proxy = proxies_.primary();
+        if (!proxy) {
+            return makeError(ErrorKind::ConnectionError, "DBus proxy not initialized");
+        }
+
+        proxy->callMethodAsync("Event")
+            .onInterface("com.canonical.dbusmenu")
+            .withArguments(id, eventId, data, timestamp)
+            .uponReplyInvoke([done](std::optional<sdbus::Error> error) {
+                if (error) {
+                    done(makeError(*error));
+                } else {
+                    done({});
+                }
+            });
+        return {};
+    });
+    if (!res) {
+        done(std::move(res));
+    }
+}
+
+std::expected<std::vector<int32_t>, Error> DBusMenu::sendEventGroup(const std::vector<MenuEvent> &events) {
+    if (events.empty()) {
+        return std::vector<int32_t>{};
+    }
+    // 逐个调用 Event 并等待回复。sendEvent 不等待回复，发给已经退出的应用也会"成功"
+    const auto sendEach = [this, &events]() -> std::expected<std::vector<int32_t>, Error> {
+        for (const auto &event : events) {
+            auto res = safelyCall(service_, [this, &event]() -> std::expected<void, Error> {
+                auto *proxy = proxies_.get();
+                if (!proxy) {
+                    return makeError(ErrorKind::ConnectionError, "DBus proxy not initialized");
+                }
+
+                auto call = proxy->createMethodCall("com.canonical.dbusmenu", "Event");
+                call << event.id << event.eventId << event.data << event.timestamp;
+                proxy->callMethod(call);
+                return {};
+            });
+            if (!res) {
+                return std::unexpected(res.error());
+            }
+        }
+        return std::vector<int32_t>{};
+    };
+
+    // 单个事件直接用所有版本都支持的 Event，不必先查询 Version
+    if (events.size() == 1) {
+        return sendEach();
+    }
+
+    // EventGroup 从 dbusmenu v3 开始提供
+    auto version = getVersion();
+    if (!version || *version < 3) {
+        return sendEach();
+    }
+
+    return safelyCall(service_, [this, &events]() -> std::expected<std::vector<int32_t>, Error> {
+        auto *proxy = proxies_.get();
+        if (!proxy) {
+            return makeError(ErrorKind::ConnectionError, "DBus proxy not initialized");
+        }
+
+        std::vector<sdbus::Struct<int32_t, std::string, std::variant<bool, int32_t, std::string>, uint32_t>> group;
+        group.reserve(events.size());
+        for (const auto &event : events) {
+            group.emplace_back(event.id, event.eventId, event.data, event.timestamp);
+        }
+
+        std::vector<int32_t> idErrors;
+        proxy->callMethod("EventGroup")
+            .onInterface("com.canonical.dbusmenu")
+            .withArguments(group)
+            .storeResultsTo(idErrors);
+
+        return idErrors;
+    });
+}
+
 std::expected<bool, Error> DBusMenu::aboutToShow(int32_t id) {
-    return safelyExec([this, id]() -> std::expected<bool, Error> {
-        if (!proxy_) {
+    MemPhaseScope memPhase(MemPhase::Layout);
+    return safelyCall(service_, [this, id]() -> std::expected<bool, Error> {
+        auto *proxy = proxies_.get();
+        if (!proxy) {
             return makeError(ErrorKind::ConnectionError, "DBus proxy not initialized");
         }
 
@@ -181,134 +607,471 @@ std::expected<bool, Error> DBusMenu::aboutToShow(int32_t id) {
             // 调用 AboutToShow 方法并直接获取结果
             bool needUpdate;
 
-            proxy_->callMethod("AboutToShow")
+            proxy->callMethod("AboutToShow")
                 .onInterface("com.canonical.dbusmenu")
                 .withArguments(id)
                 .storeResultsTo(needUpdate);
 
             return needUpdate;
         } catch (const sdbus::Error &err) {
-            return makeError(ErrorKind::DBusError, err.what());
+            return makeError(err);
         } catch (const std::exception &e) {
             return makeError(ErrorKind::UnknownError, e.what());
         }
     });
 }
 
+std::expected<std::pair<std::vector<int32_t>, std::vector<int32_t>>, Error>
+DBusMenu::aboutToShowGroup(const std::vector<int32_t> &ids) {
+    MemPhaseScope memPhase(MemPhase::Layout);
+    using Result = std::pair<std::vector<int32_t>, std::vector<int32_t>>;
+    if (ids.empty()) {
+        return Result{};
+    }
+
+    // AboutToShowGroup 从 dbusmenu v3 开始提供
+    auto version = getVersion();
+    if (!version || *version < 3) {
+        Result result;
+        for (int32_t id : ids) {
+            auto needUpdate = aboutToShow(id);
+            if (!needUpdate) {
+                result.second.push_back(id);
+            } else if (*needUpdate) {
+                result.first.push_back(id);
+            }
+        }
+        return result;
+    }
+
+    return safelyCall(service_, [this, &ids]() -> std::expected<Result, Error> {
+        auto *proxy = proxies_.get();
+        if (!proxy) {
+            return makeError(ErrorKind::ConnectionError, "DBus proxy not initialized");
+        }
+
+        Result result;
+        proxy->callMethod("AboutToShowGroup")
+            .onInterface("com.canonical.dbusmenu")
+            .withArguments(ids)
+            .storeResultsTo(result.first, result.second);
+
+        return result;
+    });
+}
+
+namespace {
+
+bool isSubmenu(const MenuLayoutItem &item) {
+    if (!item.children.empty()) {
+        return true;
+    }
+    auto it = item.properties.find("children-display");
+    return it != item.properties.end() && std::holds_alternative<std::string>(it->second) &&
+           std::get<std::string>(it->second) == "submenu";
+}
+
+template <typename Item> Item *findLayoutItem(Item &item, int32_t id) {
+    if (item.id == id) {
+        return &item;
+    }
+    for (auto &child : item.children) {
+        if (auto *found = findLayoutItem(child, id)) {
+            return found;
+        }
+    }
+    return nullptr;
+}
+
+bool isDescendantOf(const MenuLayoutItem &root, int32_t ancestorId, int32_t id) {
+    const auto *ancestor = findLayoutItem(root, ancestorId);
+    return ancestor && ancestor->id != id && findLayoutItem(*ancestor, id);
+}
+
+} // namespace
+
+std::expected<std::pair<uint32_t, MenuLayoutItem>, Error> DBusMenu::getLayoutPrefetched(
+    const std::vector<std::string> &propertyNames, int maxRounds, std::chrono::milliseconds timeout
+) {
+    MemPhaseScope memPhase(MemPhase::Layout);
+    // 需要 children-display 来识别尚未填充的子菜单
+    std::vector<std::string> names = propertyNames;
+    if (!names.empty() && std::ranges::find(names, "children-display") == names.end()) {
+        names.emplace_back("children-display");
+    }
+
+    auto layout = getLayout(0, -1, names);
+    if (!layout) {
+        return layout;
+    }
+    auto &[revision, root] = layout.value();
+
+    std::vector<int32_t> shown;
+    // 每次调用各自收集信号，多个线程可以同时预取
+    std::vector<std::pair<uint32_t, int32_t>> layoutUpdates;
+    for (int round = 0; round < maxRounds; ++round) {
+        // 收集本轮尚未通知过的子菜单
+        std::vector<int32_t> ids;
+        std::vector<const MenuLayoutItem *> stack{&root};
+        while (!stack.empty()) {
+            const auto *item = stack.back();
+            stack.pop_back();
+            if (isSubmenu(*item) && std::ranges::find(shown, item->id) == shown.end()) {
+                ids.push_back(item->id);
+            }
+            for (const auto &child : item->children) {
+                stack.push_back(&child);
+            }
+        }
+        if (ids.empty()) {
+            break;
+        }
+        shown.insert(shown.end(), ids.begin(), ids.end());
+
+        // 先开始收集信号再发送请求，避免错过应用立即发出的 LayoutUpdated
+        subscribeLayoutUpdated();
+        {
+            std::lock_guard lock(layoutUpdatesMutex_);
+            layoutUpdates.clear();
+            layoutCollectors_.push_back(&layoutUpdates);
+        }
+
+        auto group = aboutToShowGroup(ids);
+        std::vector<int32_t> dirty = group ? group->first : std::vector<int32_t>{};
+
+        {
+            std::unique_lock lock(layoutUpdatesMutex_);
+            if (!dirty.empty()) {
+                const auto deadline = std::chrono::steady_clock::now() + timeout;
+                layoutUpdatesCv_.wait_until(lock, deadline, [&layoutUpdates] { return !layoutUpdates.empty(); });
+                // 应用通常会连续发出多个 LayoutUpdated，再稍等一小段时间收集完整
+                layoutUpdatesCv_.wait_until(
+                    lock, std::min(deadline, std::chrono::steady_clock::now() + timeout / 10), [] { return false; }
+                );
+            }
+            for (const auto &[updatedRevision, parent] : layoutUpdates) {
+                revision = std::max(revision, updatedRevision);
+                if (std::ranges::find(dirty, parent) == dirty.end()) {
+                    dirty.push_back(parent);
+                }
+            }
+            std::erase(layoutCollectors_, &layoutUpdates);
+        }
+
+        if (dirty.empty()) {
+            break;
+        }
+
+        // 根节点变化时整体重新获取，否则只获取变化的子树（跳过已被其他脏子树包含的节点）
+        if (std::ranges::find(dirty, root.id) != dirty.end()) {
+            auto full = getLayout(0, -1, names);
+            if (!full) {
+                return full;
+            }
+            revision = std::max(revision, full->first);
+            root = std::move(full->second);
+            continue;
+        }
+
+        for (int32_t id : dirty) {
+            bool covered = std::ranges::any_of(dirty, [&](int32_t other) {
+                return other != id && isDescendantOf(root, other, id);
+            });
+            if (covered) {
+                continue;
+            }
+
+            auto *target = findLayoutItem(root, id);
+            if (!target) {
+                continue;
+            }
+            if (auto subtree = getLayout(id, -1, names)) {
+                revision = std::max(revision, subtree->first);
+                target->properties = std::move(subtree->second.properties);
+                target->children = std::move(subtree->second.children);
+            }
+        }
+    }
+
+    return layout;
+}
+
 void DBusMenu::registerItemsPropertiesUpdatedCallback(
     std::function<
         void(const std::vector<MenuItem> &, const std::vector<std::pair<int32_t, std::vector<std::string>>> &)>
         callback
 ) {
-    itemsPropertiesUpdatedCallback_ = std::move(callback);
+    itemsPropertiesUpdatedCallback_.store(
+        callback ? std::make_shared<const ItemsPropertiesUpdatedCallback>(std::move(callback)) : nullptr
+    );
+    subscribeItemsPropertiesUpdated();
 }
 
 void DBusMenu::registerLayoutUpdatedCallback(std::function<void(uint32_t, int32_t)> callback) {
-    layoutUpdatedCallback_ = std::move(callback);
+    layoutUpdatedCallback_.store(
+        callback ? std::make_shared<const LayoutUpdatedCallback>(std::move(callback)) : nullptr
+    );
+    subscribeLayoutUpdated();
 }
 
 void DBusMenu::registerItemActivationRequestedCallback(std::function<void(int32_t, uint32_t)> callback) {
-    itemActivationRequestedCallback_ = std::move(callback);
+    itemActivationRequestedCallback_.store(
+        callback ? std::make_shared<const ItemActivationRequestedCallback>(std::move(callback)) : nullptr
+    );
+    subscribeItemActivationRequested();
+}
+
+void DBusMenu::forwardSignalsTo(EventQueue<MenuSignal> &queue) {
+    registerItemsPropertiesUpdatedCallback(
+        [&queue](
+            const std::vector<MenuItem> &updated,
+            const std::vector<std::pair<int32_t, std::vector<std::string>>> &removed
+        ) {
+            MenuSignal signal;
+            signal.kind = MenuSignalKind::ItemsPropertiesUpdated;
+            signal.updated = updated;
+            signal.removed = removed;
+            queue.post(std::move(signal));
+        }
+    );
+    registerLayoutUpdatedCallback([&queue](uint32_t revision, int32_t parent) {
+        MenuSignal signal;
+        signal.kind = MenuSignalKind::LayoutUpdated;
+        signal.id = parent;
+        signal.revision = revision;
+        queue.post(std::move(signal));
+    });
+    registerItemActivationRequestedCallback([&queue](int32_t id, uint32_t timestamp) {
+        MenuSignal signal;
+        signal.kind = MenuSignalKind::ItemActivationRequested;
+        signal.id = id;
+        signal.timestamp = timestamp;
+        queue.post(std::move(signal));
+    });
+}
+
+void DBusMenu::enableCoalescing(
+    const MenuCoalescingOptions &options, std::function<void(const MenuUpdateBatch &)> callback
+) {
+    auto coalescer = std::make_unique<MenuUpdateCoalescer>(
+        options.window,
+        [this, refreshDirty = options.refreshDirty, propertyNames = options.propertyNames,
+         callback = std::move(callback)](MenuUpdateBatch &&batch) {
+            // 所有脏项合并成一次 GetGroupProperties
+            if (refreshDirty && (!batch.updated.empty() || !batch.removed.empty())) {
+                std::vector<int32_t> ids;
+                for (const auto &item : batch.updated) {
+                    ids.push_back(item.id);
+                }
+                for (const auto &[id, keys] : batch.removed) {
+                    if (std::ranges::find(ids, id) == ids.end()) {
+                        ids.push_back(id);
+                    }
+                }
+
+                if (auto refreshed = getGroupProperties(ids, propertyNames)) {
+                    batch.updated = std::move(refreshed.value());
+                    batch.removed.clear();
+                }
+            }
+
+            callback(batch);
+        }
+    );
+
+    std::unique_ptr<MenuUpdateCoalescer> previous;
+    {
+        std::lock_guard lock(coalescerMutex_);
+        previous = std::exchange(coalescer_, std::move(coalescer));
+    }
+    subscribeItemsPropertiesUpdated();
+    subscribeLayoutUpdated();
+}
+
+void DBusMenu::disableCoalescing() {
+    std::unique_ptr<MenuUpdateCoalescer> previous;
+    {
+        std::lock_guard lock(coalescerMutex_);
+        previous = std::move(coalescer_);
+    }
+    // 在锁外析构，等待合并线程退出
 }
 
-void DBusMenu::registerSignalHandlers() {
-    if (!proxy_) {
+// 按需订阅：只有存在使用者的信号才会安装匹配规则（发送者、路径、接口和成员都受限），
+// 列出或点击菜单这类一次性操作不会因菜单的信号而被唤醒
+void DBusMenu::subscribeItemsPropertiesUpdated() {
+    std::lock_guard lock(subscriptionMutex_);
+    auto *proxy = proxies_.primary();
+    if (!proxy || itemsPropertiesUpdatedSlot_) {
         return;
     }
 
-    // 注册 ItemsPropertiesUpdated 信号处理
     try {
-        proxy_->uponSignal("ItemsPropertiesUpdated")
+        itemsPropertiesUpdatedSlot_ = proxy->uponSignal("ItemsPropertiesUpdated")
             .onInterface("com.canonical.dbusmenu")
-            .call([this](
-                      const std::vector<sdbus::Struct<int32_t, MenuPropertyMap>> &updatedProps,
-                      const std::vector<sdbus::Struct<int32_t, std::vector<std::string>>> &removedProps
-                  ) {
-                if (!itemsPropertiesUpdatedCallback_) {
-                    return;
-                }
-
-                try {
-                    // 转换为 MenuItem 结构
-                    std::vector<MenuItem> updatedItems;
-                    for (const auto &itemStruct : updatedProps) {
-                        MenuItem item;
-                        item.id = std::get<0>(itemStruct);
-                        item.properties = std::get<1>(itemStruct);
-                        updatedItems.push_back(std::move(item));
+            .call(
+                [this](
+                    const std::vector<sdbus::Struct<int32_t, MenuPropertyMap>> &updatedProps,
+                    const std::vector<sdbus::Struct<int32_t, std::vector<std::string>>> &removedProps
+                ) {
+                    const auto callback = itemsPropertiesUpdatedCallback_.load();
+                    std::unique_lock coalescerLock(coalescerMutex_);
+                    const bool wanted = callback || coalescer_;
+                    if (!wanted) {
+                        return;
                     }
+                    countSignalDispatched();
 
-                    // 转换移除的属性
-                    std::vector<std::pair<int32_t, std::vector<std::string>>> removedItems;
-                    for (const auto &itemStruct : removedProps) {
-                        removedItems.emplace_back(std::get<0>(itemStruct), std::get<1>(itemStruct));
-                    }
+                    try {
+                        // 转换为 MenuItem 结构
+                        std::vector<MenuItem> updatedItems;
+                        for (const auto &itemStruct : updatedProps) {
+                            MenuItem item;
+                            item.id = std::get<0>(itemStruct);
+                            item.properties = std::get<1>(itemStruct);
+                            updatedItems.push_back(std::move(item));
+                        }
 
-                    // 调用回调
-                    itemsPropertiesUpdatedCallback_(updatedItems, removedItems);
-                } catch (const sdbus::Error &err) {
-                    // 错误处理
-                }
-            });
+                        // 转换移除的属性
+                        std::vector<std::pair<int32_t, std::vector<std::string>>> removedItems;
+                        for (const auto &itemStruct : removedProps) {
+                            removedItems.emplace_back(std::get<0>(itemStruct), std::get<1>(itemStruct));
+                        }
+
+                        if (coalescer_) {
+                            coalescer_->addProperties(updatedItems, removedItems);
+                        }
+                        coalescerLock.unlock();
+
+                        // 调用回调
+                        if (callback) {
+                            (*callback)(updatedItems, removedItems);
+                        }
+                    } catch (const sdbus::Error &err) {
+                        // 错误处理
+                    }
+                },
+                sdbus::return_slot
+            );
     } catch (const sdbus::Error &err) {
         // 信号注册失败
     }
+}
+
+void DBusMenu::subscribeLayoutUpdated() {
+    std::lock_guard lock(subscriptionMutex_);
+    auto *proxy = proxies_.primary();
+    if (!proxy || layoutUpdatedSlot_) {
+        return;
+    }
 
-    // 注册 LayoutUpdated 信号处理
     try {
-        proxy_->uponSignal("LayoutUpdated")
+        layoutUpdatedSlot_ = proxy->uponSignal("LayoutUpdated")
             .onInterface("com.canonical.dbusmenu")
-            .call([this](uint32_t revision, int32_t parent) {
-                if (!layoutUpdatedCallback_) {
-                    return;
-                }
+            .call(
+                [this](uint32_t revision, int32_t parent) {
+                    const auto callback = layoutUpdatedCallback_.load();
+                    bool wanted = static_cast<bool>(callback);
+                    {
+                        std::lock_guard lock(coalescerMutex_);
+                        if (coalescer_) {
+                            coalescer_->addLayout(revision, parent);
+                            wanted = true;
+                        }
+                    }
 
-                try {
-                    // 调用回调
-                    layoutUpdatedCallback_(revision, parent);
-                } catch (const sdbus::Error &err) {
-                    // 错误处理
-                }
-            });
+                    {
+                        std::lock_guard lock(layoutUpdatesMutex_);
+                        if (!layoutCollectors_.empty()) {
+                            for (auto *updates : layoutCollectors_) {
+                                updates->emplace_back(revision, parent);
+                            }
+                            layoutUpdatesCv_.notify_all();
+                            wanted = true;
+                        }
+                    }
+
+                    if (wanted)
+                        countSignalDispatched();
+                    if (!callback) {
+                        return;
+                    }
+
+                    try {
+                        // 调用回调
+                        (*callback)(revision, parent);
+                    } catch (const sdbus::Error &err) {
+                        // 错误处理
+                    }
+                },
+                sdbus::return_slot
+            );
     } catch (const sdbus::Error &err) {
         // 信号注册失败
     }
+}
+
+void DBusMenu::subscribeItemActivationRequested() {
+    std::lock_guard lock(subscriptionMutex_);
+    auto *proxy = proxies_.primary();
+    if (!proxy || itemActivationRequestedSlot_) {
+        return;
+    }
 
-    // 注册 ItemActivationRequested 信号处理
     try {
-        proxy_->uponSignal("ItemActivationRequested")
+        itemActivationRequestedSlot_ = proxy->uponSignal("ItemActivationRequested")
             .onInterface("com.canonical.dbusmenu")
-            .call([this](int32_t id, uint32_t timestamp) {
-                if (!itemActivationRequestedCallback_) {
-                    return;
-                }
+            .call(
+                [this](int32_t id, uint32_t timestamp) {
+                    const auto callback = itemActivationRequestedCallback_.load();
+                    if (!callback) {
+                        return;
+                    }
+                    countSignalDispatched();
 
-                try {
-                    // 调用回调
-                    itemActivationRequestedCallback_(id, timestamp);
-                } catch (const sdbus::Error &err) {
-                    // 错误处理
-                }
-            });
+                    try {
+                        // 调用回调
+                        (*callback)(id, timestamp);
+                    } catch (const sdbus::Error &err) {
+                        // 错误处理
+                    }
+                },
+                sdbus::return_slot
+            );
     } catch (const sdbus::Error &err) {
         // 信号注册失败
     }
 }
 
+MenuTransferStats DBusMenu::transferStats() const {
+    MenuTransferStats stats;
+    stats.calls = transferCalls_.load(std::memory_order_relaxed);
+    stats.totalBytes = transferTotalBytes_.load(std::memory_order_relaxed);
+    stats.lastBytes = transferLastBytes_.load(std::memory_order_relaxed);
+    return stats;
+}
+
+void DBusMenu::recordTransfer(size_t bytes) {
+    // 三个计数各自原子，快照之间不保证一致，只用于统计
+    transferCalls_.fetch_add(1, std::memory_order_relaxed);
+    transferTotalBytes_.fetch_add(bytes, std::memory_order_relaxed);
+    transferLastBytes_.store(bytes, std::memory_order_relaxed);
+}
+
 // 递归解析布局项
-MenuLayoutItem
-DBusMenu::parseLayout(const sdbus::Struct<int32_t, MenuPropertyMap, std::vector<sdbus::Variant>> &layout) {
+MenuLayoutItem parseMenuLayout(const MenuLayoutStruct &layout, size_t &bytes) {
     MenuLayoutItem item;
     item.id = std::get<0>(layout);
     item.properties = std::get<1>(layout);
+    bytes += sizeof(int32_t) + propertiesPayloadSize(item.properties);
 
     // 递归解析子菜单项
     const auto &children = std::get<2>(layout);
+    item.children.reserve(children.size());
     for (const auto &childVariant : children) {
         // 子菜单项也是相同的结构，递归解析
-        auto childLayout = childVariant.get<sdbus::Struct<int32_t, MenuPropertyMap, std::vector<sdbus::Variant>>>();
-        MenuLayoutItem childItem = parseLayout(childLayout);
-        item.children.push_back(childItem);
+        auto childLayout = childVariant.get<MenuLayoutStruct>();
+        item.children.push_back(parseMenuLayout(childLayout, bytes));
     }
 
     return item;
@@ -11,20 +11,37 @@
 #include <variant>
 #include <expected>
 #include <functional>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+#include <optional>
+#include <span>
+#include <string_view>
+#include <atomic>
 
 #include "Errors.h"
+#include "IconStore.h"
+#include "ProxyPool.h"
 
 namespace sdbus {
 class IProxy;
+class Message;
 }
 
+class BusThread;
+template <typename T> class EventQueue;
+class MenuUpdateCoalescer;
+struct MenuUpdateBatch;
+class MenuLayoutArena;
+struct PmrMenuLayoutItem;
+
 // 定义菜单项属性类型
 using MenuPropertyMap = std::map<
     std::string, std::variant<
                      bool,                                 // enabled, visible
                      int32_t,                              // toggle-state
                      std::string,                          // type, label, icon-name, toggle-type, children-display
-                     std::vector<uint8_t>,                 // icon-data
+                     IconData,                             // icon-data，按内容共享
                      std::vector<std::vector<std::string>> // shortcut
                      >>;
 
@@ -41,18 +58,143 @@ struct MenuLayoutItem {
     std::vector<MenuLayoutItem> children;
 };
 
+// GetLayout 返回的布局项在线上的结构 (ia{sv}av)，子项是包在变体中的相同结构
+using MenuLayoutStruct = sdbus::Struct<int32_t, MenuPropertyMap, std::vector<sdbus::Variant>>;
+
+// 递归转换按签名接收的布局，bytes 累加解码出的负载大小
+MenuLayoutItem parseMenuLayout(const MenuLayoutStruct &layout, size_t &bytes);
+
+// 流式访问时的属性值，字符串和字节数组借用回复消息中的存储，只在回调期间有效
+using MenuPropertyView = std::variant<bool, int32_t, std::string_view, std::span<const uint8_t>>;
+
+// 流式访问中的一个菜单项
+struct MenuNodeView {
+    int32_t id;
+    int depth; // 相对于请求的父节点，父节点本身为 0
+    // 按服务端返回的顺序排列；shortcut 等其他类型的属性不会出现在这里
+    std::span<const std::pair<std::string_view, MenuPropertyView>> properties;
+
+    template <typename T> const T *get(std::string_view key) const {
+        for (const auto &[name, value] : properties) {
+            if (name == key)
+                return std::get_if<T>(&value);
+        }
+        return nullptr;
+    }
+};
+
+enum class MenuVisitAction {
+    Continue,
+    SkipChildren, // 不再为当前菜单项的子树调用回调
+    Stop,         // 立即结束遍历
+};
+
+// 菜单布局访问者，未设置的回调视为 Continue
+struct MenuLayoutVisitor {
+    // 开始遍历前调用，参数为布局版本
+    std::function<void(uint32_t)> begin;
+    // 菜单项的属性解码之后、子项解码之前调用（前序）
+    std::function<MenuVisitAction(const MenuNodeView &)> enter;
+    // 菜单项的子树访问完毕后调用，参数为 (id, depth)；enter 返回 Stop 时不会调用
+    std::function<MenuVisitAction(int32_t, int)> leave;
+};
+
+// 用访问者遍历已经构建好的布局树，与 DBusMenu::visitLayout 的回调顺序相同
+void visitMenuLayout(uint32_t revision, const MenuLayoutItem &root, const MenuLayoutVisitor &visitor);
+
+// 从消息的当前位置流式解码一个 (ia{sv}av) 布局项并调用访问者（不调用 begin），bytes 累加解码出的负载大小
+void visitMenuLayout(sdbus::Message &message, const MenuLayoutVisitor &visitor, size_t &bytes);
+
+// 从消息的当前位置解码 GetGroupProperties 返回的 a(ia{sv})，bytes 累加解码出的负载大小
+std::vector<MenuItem> parseGroupProperties(sdbus::Message &message, size_t &bytes);
+
+// 常用的菜单项属性投影，传给 GetLayout/GetGroupProperties 以免传输用不到的属性（尤其是 icon-data）
+// 空列表表示获取全部属性
+inline const std::vector<std::string> MENU_LIST_PROPERTIES = {
+    "type", "label", "enabled", "visible", "toggle-type", "toggle-state", "children-display"
+};
+inline const std::vector<std::string> MENU_NAVIGATE_PROPERTIES = {
+    "type", "label", "enabled", "visible", "children-display"
+};
+inline const std::vector<std::string> MENU_LOOKUP_PROPERTIES = {"enabled", "visible"};
+// 点击和查询开关状态时只对目标菜单项请求这些属性，不获取布局
+inline const std::vector<std::string> MENU_ENTRY_PROPERTIES = {
+    "type", "enabled", "visible", "toggle-type", "toggle-state"
+};
+
+// 单个菜单项的状态，回复中缺失的属性取 dbusmenu 规范的默认值
+struct MenuEntryState {
+    int32_t id = 0;
+    std::string type = "standard";
+    bool enabled = true;
+    bool visible = true;
+    std::string toggleType;   // checkmark 或 radio，空表示不是开关
+    int32_t toggleState = -1; // 0 关、1 开、-1 不确定
+
+    bool isToggle() const { return !toggleType.empty(); }
+};
+
+MenuEntryState menuEntryState(const MenuItem &item);
+
+// 返回数据量统计（按解码后的负载估算，不含 DBus 消息头）
+struct MenuTransferStats {
+    size_t calls = 0;
+    size_t totalBytes = 0;
+    size_t lastBytes = 0;
+};
+
+// 信号合并选项
+struct MenuCoalescingOptions {
+    // 合并窗口，从一批中的第一个信号开始计时
+    std::chrono::milliseconds window{50};
+    // 刷新时用一次 GetGroupProperties 重新获取所有脏项，而不是只交付信号携带的增量
+    bool refreshDirty = false;
+    // refreshDirty 时请求的属性，空表示全部
+    std::vector<std::string> propertyNames;
+};
+
+// 单个菜单事件，对应 Event/EventGroup 的参数
+struct MenuEvent {
+    int32_t id;
+    std::string eventId;
+    std::variant<bool, int32_t, std::string> data;
+    uint32_t timestamp;
+};
+
 // 事件类型枚举
 enum class MenuEventType { Clicked, Hovered };
 
-// DBusMenu 类，包装 com.canonical.dbusmenu 接口
+enum class MenuSignalKind { ItemsPropertiesUpdated, LayoutUpdated, ItemActivationRequested };
+
+// 经 EventQueue 转交给使用者线程的菜单信号，按 kind 只有对应的字段有意义
+struct MenuSignal {
+    MenuSignalKind kind = MenuSignalKind::LayoutUpdated;
+    // ItemsPropertiesUpdated
+    std::vector<MenuItem> updated;
+    std::vector<std::pair<int32_t, std::vector<std::string>>> removed;
+    // LayoutUpdated 的父节点，或 ItemActivationRequested 的菜单项
+    int32_t id = 0;
+    uint32_t revision = 0;  // LayoutUpdated
+    uint32_t timestamp = 0; // ItemActivationRequested
+};
+
+// DBusMenu 类，包装 com.canonical.dbusmenu 接口。
+// connect 之后的方法可以被多个线程同时调用：每个线程使用自己的代理（见 ProxyPool），缓存和统计是无锁的
 class DBusMenu {
   public:
-    explicit DBusMenu(const std::string &service, const std::string &path);
+    // bus 为会话总线地址，空表示默认会话总线
+    explicit DBusMenu(const std::string &service, const std::string &path, const std::string &bus = {});
     ~DBusMenu();
 
-    // 连接到 DBus 服务
+    // 连接到 DBus 服务，代理独占一条连接和它的事件循环线程
     std::expected<void, Error> connect();
 
+    // 使用 BusThread 的共享连接，信号在 BusThread 的线程上分发。bus 必须比 DBusMenu 活得久
+    std::expected<void, Error> connect(BusThread &bus);
+
+    // 所有线程共用主代理，见 ProxyPool::setShared
+    void shareProxy(bool shared) { proxies_.setShared(shared); }
+
     // 获取版本
     std::expected<uint32_t, Error> getVersion() const;
 
@@ -63,10 +205,29 @@ class DBusMenu {
     std::expected<std::pair<uint32_t, MenuLayoutItem>, Error>
     getLayout(int32_t parentId, int32_t recursionDepth, const std::vector<std::string> &propertyNames = {});
 
+    // 获取菜单布局并直接解码到 arena 中，不经过 sdbus::Variant 和 std::map。
+    // 收到回复后会 reset arena，返回的根节点在下一次 reset 前有效
+    std::expected<std::pair<uint32_t, const PmrMenuLayoutItem *>, Error> getLayoutInto(
+        MenuLayoutArena &arena, int32_t parentId, int32_t recursionDepth,
+        const std::vector<std::string> &propertyNames = {}
+    );
+
+    // 获取菜单布局并在解码回复的同时调用访问者，不构建布局树，内存占用只与菜单深度有关。
+    // 访问者返回 Stop 时剩余的回复不再解码。timeout 为 0 时使用 sd-bus 的默认超时（25 秒）。返回布局版本
+    std::expected<uint32_t, Error> visitLayout(
+        int32_t parentId, int32_t recursionDepth, const MenuLayoutVisitor &visitor,
+        const std::vector<std::string> &propertyNames = {},
+        std::chrono::milliseconds timeout = std::chrono::milliseconds{0}
+    );
+
     // 获取一组菜单项的属性
     std::expected<std::vector<MenuItem>, Error>
     getGroupProperties(const std::vector<int32_t> &ids, const std::vector<std::string> &propertyNames = {});
 
+    // 用一次 GetGroupProperties 获取菜单项的状态，消息大小与菜单规模无关。
+    // 服务端没有返回的 ID（不存在，或位于尚未加载的子菜单中）不在结果中
+    std::expected<std::vector<MenuEntryState>, Error> getEntryStates(const std::vector<int32_t> &ids);
+
     // 获取单个菜单项的属性
     std::expected<std::variant<bool, int32_t, std::string>, Error> getProperty(int32_t id, const std::string &name);
 
@@ -75,9 +236,37 @@ class DBusMenu {
         int32_t id, const std::string &eventId, const std::variant<bool, int32_t, std::string> &data, uint32_t timestamp
     );
 
+    // 通过主代理异步发送事件，调用线程不等待回复。done 在回复或错误到达时在主代理连接的事件循环线程上调用
+    // （connect(BusThread &) 时即 BusThread 的线程），发送失败时在调用线程上立即调用。
+    // DBusMenu 析构时尚未回复的调用被取消，done 不再被调用
+    void sendEventAsync(
+        int32_t id, const std::string &eventId, const std::variant<bool, int32_t, std::string> &data,
+        uint32_t timestamp, std::function<void(std::expected<void, Error>)> done
+    );
+
+    // 在一条消息中发送多个事件（dbusmenu v3+ 的 EventGroup），单个事件或旧版本服务端逐个调用 Event。
+    // 两种方式都等待回复，应用已经退出或拒绝事件时返回错误（可重试的错误按 RetryPolicy 重试）。
+    // 返回服务端报告找不到的菜单项 ID；逐个发送时找不到的 ID 表现为错误，返回空列表
+    std::expected<std::vector<int32_t>, Error> sendEventGroup(const std::vector<MenuEvent> &events);
+
     // 通知菜单即将显示
     std::expected<bool, Error> aboutToShow(int32_t id);
 
+    // 在一条消息中通知多个菜单即将显示（dbusmenu v3+ 的 AboutToShowGroup），旧版本服务端退化为逐个 AboutToShow。
+    // 返回 (需要更新的 ID, 找不到的 ID)
+    std::expected<std::pair<std::vector<int32_t>, std::vector<int32_t>>, Error>
+    aboutToShowGroup(const std::vector<int32_t> &ids);
+
+    // 获取完整菜单布局：对所有子菜单发送 AboutToShowGroup，等待应用发出 LayoutUpdated 后只重新获取变化的子树。
+    // 每轮只处理上一轮新出现的子菜单，最多 maxRounds 轮；每轮最多等待 timeout
+    std::expected<std::pair<uint32_t, MenuLayoutItem>, Error> getLayoutPrefetched(
+        const std::vector<std::string> &propertyNames = {}, int maxRounds = 3,
+        std::chrono::milliseconds timeout = std::chrono::milliseconds{250}
+    );
+
+    // GetLayout/GetGroupProperties 返回数据量统计的快照
+    MenuTransferStats transferStats() const;
+
     // 注册菜单项属性更新回调
     void registerItemsPropertiesUpdatedCallback(
         std::function<
@@ -91,21 +280,59 @@ class DBusMenu {
     // 注册菜单项激活请求回调
     void registerItemActivationRequestedCallback(std::function<void(int32_t, uint32_t)> callback);
 
+    // 把三种信号转为 MenuSignal 投递到 queue，替换上面注册的逐信号回调。
+    // 信号处理函数只做拷贝和无锁入队，使用者在自己的线程上 drain，不与信号线程竞争。queue 必须比 DBusMenu 活得久
+    void forwardSignalsTo(EventQueue<MenuSignal> &queue);
+
+    // 开启信号合并：窗口内的属性变化按 id 合并，布局更新合并为最高 revision 和最低公共父节点，
+    // 窗口结束时在合并线程上调用 callback。与上面的逐信号回调互不影响
+    void enableCoalescing(const MenuCoalescingOptions &options, std::function<void(const MenuUpdateBatch &)> callback);
+
+    // 关闭信号合并，未刷新的更新会被丢弃；不能在合并回调中调用
+    void disableCoalescing();
+
   private:
+    using ItemsPropertiesUpdatedCallback = std::function<
+        void(const std::vector<MenuItem> &, const std::vector<std::pair<int32_t, std::vector<std::string>>> &)>;
+    using LayoutUpdatedCallback = std::function<void(uint32_t, int32_t)>;
+    using ItemActivationRequestedCallback = std::function<void(int32_t, uint32_t)>;
+
     std::string service_;
     std::string path_;
-    std::unique_ptr<sdbus::IProxy> proxy_;
+    std::string bus_;
+    mutable ProxyPool proxies_;
+
+    std::atomic<size_t> transferCalls_{0};
+    std::atomic<size_t> transferTotalBytes_{0};
+    std::atomic<size_t> transferLastBytes_{0};
+
+    // 缓存的 dbusmenu 版本
+    mutable std::atomic<bool> versionKnown_{false};
+    mutable std::atomic<uint32_t> version_{0};
+
+    // 回调函数；注册时整体替换，信号线程只做一次原子读取
+    std::atomic<std::shared_ptr<const ItemsPropertiesUpdatedCallback>> itemsPropertiesUpdatedCallback_;
+    std::atomic<std::shared_ptr<const LayoutUpdatedCallback>> layoutUpdatedCallback_;
+    std::atomic<std::shared_ptr<const ItemActivationRequestedCallback>> itemActivationRequestedCallback_;
+
+    // 正在预取的调用各自收集的 LayoutUpdated 信号 (revision, parent)
+    std::mutex layoutUpdatesMutex_;
+    std::condition_variable layoutUpdatesCv_;
+    std::vector<std::vector<std::pair<uint32_t, int32_t>> *> layoutCollectors_;
+
+    // 信号合并；信号线程与调用线程都会访问，由 coalescerMutex_ 保护
+    std::mutex coalescerMutex_;
+    std::unique_ptr<MenuUpdateCoalescer> coalescer_;
 
-    // 回调函数
-    std::function<
-        void(const std::vector<MenuItem> &, const std::vector<std::pair<int32_t, std::vector<std::string>>> &)>
-        itemsPropertiesUpdatedCallback_;
-    std::function<void(uint32_t, int32_t)> layoutUpdatedCallback_;
-    std::function<void(int32_t, uint32_t)> itemActivationRequestedCallback_;
+    // 信号订阅在第一次需要时安装，析构时显式移除
+    std::mutex subscriptionMutex_;
+    sdbus::Slot itemsPropertiesUpdatedSlot_;
+    sdbus::Slot layoutUpdatedSlot_;
+    sdbus::Slot itemActivationRequestedSlot_;
 
-    // 注册信号处理
-    void registerSignalHandlers();
+    void subscribeItemsPropertiesUpdated();
+    void subscribeLayoutUpdated();
+    void subscribeItemActivationRequested();
 
-    // 辅助函数：解析 DBus 返回的菜单布局
-    MenuLayoutItem parseLayout(const sdbus::Struct<int32_t, MenuPropertyMap, std::vector<sdbus::Variant>> &item);
+    void recordTransfer(size_t bytes);
 };
\ No newline at end of file
@@ -5,23 +5,67 @@
 
 #include <sdbus-c++/sdbus-c++.h>
 #include "Errors.h"
+#include <algorithm>
+#include <chrono>
 #include <functional>
+#include <thread>
+
+// 保留 DBus 错误名；NoReply/Timeout 归为 TimeoutError，便于调用方区分挂起的应用
+inline auto makeError(const sdbus::Error &err) {
+    const std::string &name = err.getName();
+    const bool timedOut = name == "org.freedesktop.DBus.Error.NoReply" || name == "org.freedesktop.DBus.Error.Timeout" ||
+                          name == "System.Error.ETIMEDOUT";
+    return makeError(timedOut ? ErrorKind::TimeoutError : ErrorKind::DBusError, err.getMessage(), name);
+}
 
 template <std::invocable F> std::invoke_result_t<F> safelyExec(F &&f) {
     try {
         return std::invoke(std::forward<F>(f));
     } catch (sdbus::Error &err) {
-        return makeError(ErrorKind::DBusError, err.what());
+        return makeError(err);
     } catch (std::exception &err) {
         return makeError(ErrorKind::UnknownError, err.what());
     }
 }
 
+// 遇到暂时性错误（见 Error::transient）时的重试策略，默认不重试
+struct RetryPolicy {
+    uint32_t retries = 0;
+    // 第一次重试前的等待，之后每次翻倍，不超过 maxDelay
+    std::chrono::milliseconds initialDelay{50};
+    std::chrono::milliseconds maxDelay{1000};
+};
+
+// 进程级的默认重试策略，供下面的 safelyCall 系列使用；只应在启动其他线程之前设置
+inline RetryPolicy &defaultRetryPolicy() {
+    static RetryPolicy policy;
+    return policy;
+}
+
+// 执行 f，结果为暂时性错误时按策略退避重试。destination 为 f 调用的目标名称，f 可能被调用多次
+template <std::invocable F>
+std::invoke_result_t<F> retrying(const RetryPolicy &policy, std::string_view destination, F &&f) {
+    auto delay = policy.initialDelay;
+    for (uint32_t attempt = 0;; ++attempt) {
+        auto res = safelyExec(f);
+        if (res || attempt >= policy.retries || !res.error().transient(destination))
+            return res;
+        std::this_thread::sleep_for(delay);
+        delay = std::min(delay * 2, policy.maxDelay);
+    }
+}
+
+// 只包含一次 DBus 调用的操作使用 safelyCall：暂时性错误意味着调用没有送达，按默认策略重试是安全的。
+// 包含多次调用的操作应使用 safelyExec，以免重试时重复执行已经成功的调用
+template <std::invocable F> std::invoke_result_t<F> safelyCall(std::string_view destination, F &&f) {
+    return retrying(defaultRetryPolicy(), destination, std::forward<F>(f));
+}
+
 template <typename T>
 std::expected<T, Error> safelyGetProperty(
-    const std::unique_ptr<sdbus::IProxy> &proxy, const std::string &interface, const std::string &property
+    sdbus::IProxy *proxy, std::string_view destination, const std::string &interface, const std::string &property
 ) {
-    return safelyExec([&] -> std::expected<T, Error> {
+    return safelyCall(destination, [&] -> std::expected<T, Error> {
         if (!proxy)
             return makeError(ErrorKind::ConnectionError);
 
@@ -35,9 +79,10 @@ std::expected<T, Error> safelyGetProperty(
 
 template <typename Dest, typename... Args>
 std::expected<Dest, Error> safelyCallMethod(
-    const std::unique_ptr<sdbus::IProxy> &proxy, const std::string &interface, const std::string &method, Args &&...args
+    sdbus::IProxy *proxy, std::string_view destination, const std::string &interface, const std::string &method,
+    Args &&...args
 ) {
-    return safelyExec([&] -> std::expected<Dest, Error> {
+    return safelyCall(destination, [&] -> std::expected<Dest, Error> {
         if (!proxy)
             return makeError(ErrorKind::ConnectionError);
 
@@ -53,9 +98,10 @@ std::expected<Dest, Error> safelyCallMethod(
 template <typename Dest, typename... Args>
     requires std::same_as<Dest, void>
 std::expected<void, Error> safelyCallMethod(
-    const std::unique_ptr<sdbus::IProxy> &proxy, const std::string &interface, const std::string &method, Args &&...args
+    sdbus::IProxy *proxy, std::string_view destination, const std::string &interface, const std::string &method,
+    Args &&...args
 ) {
-    return safelyExec([&] -> std::expected<void, Error> {
+    return safelyCall(destination, [&] -> std::expected<void, Error> {
         if (!proxy)
             return makeError(ErrorKind::ConnectionError);
 
@@ -3,7 +3,14 @@
 //
 #pragma once
 
+#include <algorithm>
+#include <cstddef>
 #include <expected>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
 #include <magic_enum.hpp>
 
 enum class ErrorKind {
@@ -11,21 +18,97 @@ enum class ErrorKind {
     ConnectionError,
     TypeError,
     DBusError,
+    IOError,
+    TimeoutError,
     UnknownError,
 };
 
+// 持有自己内容的字符串，N 字节以内存放在对象内部，更长时才分配堆内存。
+// 错误大多在异常处理中构造，常见的 DBus 错误信息都放得下，不会为此分配
+template <size_t N> class SmallString {
+  public:
+    SmallString() = default;
+    SmallString(std::string_view str) { assign(str); }
+    SmallString(const char *str) { assign(str ? std::string_view(str) : std::string_view()); }
+
+    SmallString(const SmallString &other) { assign(other.view()); }
+    SmallString(SmallString &&other) noexcept { *this = std::move(other); }
+
+    SmallString &operator=(const SmallString &other) {
+        if (this != &other)
+            assign(other.view());
+        return *this;
+    }
+
+    SmallString &operator=(SmallString &&other) noexcept {
+        if (this != &other) {
+            heap_ = std::move(other.heap_);
+            size_ = std::exchange(other.size_, 0);
+            if (!heap_)
+                std::copy_n(other.inline_, size_, inline_);
+        }
+        return *this;
+    }
+
+    std::string_view view() const { return {heap_ ? heap_.get() : inline_, size_}; }
+    operator std::string_view() const { return view(); }
+    bool empty() const { return size_ == 0; }
+
+  private:
+    std::unique_ptr<char[]> heap_;
+    size_t size_ = 0;
+    char inline_[N];
+
+    void assign(std::string_view str) {
+        if (str.size() <= N) {
+            heap_.reset();
+            std::copy_n(str.data(), str.size(), inline_);
+        } else {
+            heap_ = std::make_unique_for_overwrite<char[]>(str.size());
+            std::copy_n(str.data(), str.size(), heap_.get());
+        }
+        size_ = str.size();
+    }
+};
+
 struct Error {
     ErrorKind kind = ErrorKind::NoError;
-    std::string_view msg;
+    SmallString<120> msg;
+    // DBus 错误名，例如 org.freedesktop.DBus.Error.ServiceUnknown；不是来自 DBus 的错误为空
+    SmallString<56> name;
+
+    // 暂时性错误：调用肯定没有被对方处理，稍后重试可能成功。destination 为调用的目标名称。
+    // ServiceUnknown/NameHasNoOwner 对众所周知的名称表示应用正在启动或重启；唯一名称（:1.57）不会被重新持有，
+    // 重启后的应用换了新的唯一名称，这时重试只会得到同样的错误。UnknownObject 表示对象尚未导出，
+    // LimitsExceeded 表示总线暂时拒绝。NoReply/Timeout 说明应用挂起，重试只会再等一次超时，视为永久错误
+    bool transient(std::string_view destination) const {
+        static constexpr std::string_view transientNames[] = {
+            "org.freedesktop.DBus.Error.UnknownObject",
+            "org.freedesktop.DBus.Error.LimitsExceeded",
+        };
+        static constexpr std::string_view ownerNames[] = {
+            "org.freedesktop.DBus.Error.ServiceUnknown",
+            "org.freedesktop.DBus.Error.NameHasNoOwner",
+        };
+        if (kind != ErrorKind::DBusError)
+            return false;
+        if (std::ranges::find(ownerNames, name.view()) != std::end(ownerNames))
+            return !destination.starts_with(':');
+        return std::ranges::find(transientNames, name.view()) != std::end(transientNames);
+    }
 
     std::string show() const {
         std::string res(magic_enum::enum_name(kind));
         res += '\n';
-        res += msg;
+        if (!name.empty()) {
+            res += name.view();
+            res += ": ";
+        }
+        res += msg.view();
         return res;
     }
 };
 
-constexpr auto makeError(ErrorKind kind, std::string_view msg = "") noexcept {
-    return std::unexpected{Error{kind, msg}};
+inline auto makeError(ErrorKind kind, std::string_view msg = "", std::string_view name = "") {
+    return std::unexpected{Error{kind, msg, name}};
 }
@@ -0,0 +1,43 @@
+//
+// Created by tray-control on 2024/05/04.
+//
+
+#include "EventQueue.h"
+
+#include <cstdint>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <thread>
+#include <unistd.h>
+
+EventFd::EventFd() : fd_(eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) {}
+
+EventFd::~EventFd() {
+    if (fd_ >= 0)
+        close(fd_);
+}
+
+void EventFd::notify() {
+    if (fd_ < 0)
+        return;
+    const uint64_t one = 1;
+    // 计数器溢出之前 fd 早已可读，写失败（EAGAIN）可以忽略
+    [[maybe_unused]] const auto written = write(fd_, &one, sizeof(one));
+}
+
+void EventFd::clear() {
+    if (fd_ < 0)
+        return;
+    uint64_t count;
+    [[maybe_unused]] const auto read = ::read(fd_, &count, sizeof(count));
+}
+
+bool EventFd::wait(std::chrono::milliseconds timeout) const {
+    if (fd_ < 0) {
+        std::this_thread::sleep_for(timeout);
+        return true;
+    }
+
+    pollfd pfd{fd_, POLLIN, 0};
+    return poll(&pfd, 1, static_cast<int>(timeout.count())) > 0;
+}
@@ -0,0 +1,131 @@
+//
+// Created by tray-control on 2024/05/04.
+//
+// 从总线线程向使用者线程传递事件：有界的单生产者单消费者无锁队列，配合 eventfd 唤醒。
+// 生产者（信号处理函数）从不阻塞也不加锁，使用者可以在自己的线程上 poll fd() 或调用 wait()，再 drain()
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cstddef>
+#include <optional>
+#include <utility>
+#include <vector>
+
+// 固定容量的环形缓冲区，只允许一个线程 tryPush、一个线程 tryPop
+template <typename T> class SpscQueue {
+  public:
+    // 容量向上取整为 2 的幂
+    explicit SpscQueue(size_t capacity)
+        : slots_(std::bit_ceil(std::max<size_t>(capacity, 2))), mask_(slots_.size() - 1) {}
+
+    SpscQueue(const SpscQueue &) = delete;
+    SpscQueue &operator=(const SpscQueue &) = delete;
+
+    size_t capacity() const { return slots_.size(); }
+
+    // 生产者调用，队列满时返回 false
+    bool tryPush(T &&value) {
+        const size_t tail = tail_.load(std::memory_order_relaxed);
+        if (tail - headCache_ == slots_.size()) {
+            headCache_ = head_.load(std::memory_order_acquire);
+            if (tail - headCache_ == slots_.size())
+                return false;
+        }
+        slots_[tail & mask_] = std::move(value);
+        tail_.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    // 消费者调用
+    std::optional<T> tryPop() {
+        const size_t head = head_.load(std::memory_order_relaxed);
+        if (head == tailCache_) {
+            tailCache_ = tail_.load(std::memory_order_acquire);
+            if (head == tailCache_)
+                return std::nullopt;
+        }
+        std::optional<T> value(std::move(slots_[head & mask_]));
+        head_.store(head + 1, std::memory_order_release);
+        return value;
+    }
+
+  private:
+    // 生产者和消费者各自写的索引放在不同的缓存行上，避免伪共享
+    static constexpr size_t CacheLine = 64;
+
+    std::vector<T> slots_;
+    const size_t mask_;
+    // 消费者拥有
+    alignas(CacheLine) std::atomic<size_t> head_{0};
+    size_t tailCache_ = 0;
+    // 生产者拥有
+    alignas(CacheLine) std::atomic<size_t> tail_{0};
+    size_t headCache_ = 0;
+};
+
+// eventfd 包装，用作跨线程的唤醒计数器
+class EventFd {
+  public:
+    EventFd();
+    ~EventFd();
+
+    EventFd(const EventFd &) = delete;
+    EventFd &operator=(const EventFd &) = delete;
+
+    // eventfd 创建失败时为 -1，wait 退化为按 timeout 轮询
+    int fd() const { return fd_; }
+
+    void notify();
+    // 清零计数，之后的 notify 会再次使 fd 可读
+    void clear();
+    // 等待 fd 可读，超时返回 false
+    bool wait(std::chrono::milliseconds timeout) const;
+
+  private:
+    int fd_;
+};
+
+// 总线线程投递、使用者线程取出的事件队列。
+// 生产者必须是同一个线程：所有向同一队列投递的代理应共享一个 BusThread（或各自只有一条连接）
+template <typename T> class EventQueue {
+  public:
+    explicit EventQueue(size_t capacity = 256) : queue_(capacity) {}
+
+    // 生产者调用，从不阻塞。队列满时丢弃事件并计数，返回 false
+    bool post(T event) {
+        const bool pushed = queue_.tryPush(std::move(event));
+        if (!pushed)
+            dropped_.fetch_add(1, std::memory_order_relaxed);
+        wakeup_.notify();
+        return pushed;
+    }
+
+    // 消费者调用，依次把已投递的事件交给 f，返回处理的事件数
+    template <typename F> size_t drain(F &&f) {
+        // 先清零再取出：清零之后投递的事件要么在本次取到，要么使 fd 再次可读
+        wakeup_.clear();
+        size_t count = 0;
+        while (auto event = queue_.tryPop()) {
+            f(std::move(*event));
+            ++count;
+        }
+        return count;
+    }
+
+    // 自上次调用以来因队列满而丢弃的事件数；非 0 时使用者应整体刷新状态
+    size_t takeDropped() { return dropped_.exchange(0, std::memory_order_relaxed); }
+
+    // 有事件待取时可读，可以加入使用者自己的 poll/epoll 循环
+    int fd() const { return wakeup_.fd(); }
+
+    // 阻塞等待事件到达，超时返回 false
+    bool wait(std::chrono::milliseconds timeout) const { return wakeup_.wait(timeout); }
+
+  private:
+    SpscQueue<T> queue_;
+    EventFd wakeup_;
+    std::atomic<size_t> dropped_{0};
+};
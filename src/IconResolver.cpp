@@ -0,0 +1,580 @@
+//
+// Created by tray-control on 2024/05/25.
+//
+
+#include "IconResolver.h"
+
+#include <algorithm>
+#include <charconv>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utility>
+
+namespace {
+
+constexpr uint32_t CACHE_END = 0xffffffff;
+
+// gtk-update-icon-cache 使用的哈希，字符按 signed char 参与运算
+uint32_t iconNameHash(std::string_view name) {
+    uint32_t hash = 0;
+    for (char c : name)
+        hash = (hash << 5) - hash + static_cast<uint32_t>(static_cast<signed char>(c));
+    return hash;
+}
+
+std::string_view trim(std::string_view text) {
+    const auto begin = text.find_first_not_of(" \t\r");
+    if (begin == std::string_view::npos)
+        return {};
+    const auto end = text.find_last_not_of(" \t\r");
+    return text.substr(begin, end - begin + 1);
+}
+
+std::vector<std::string> splitList(std::string_view text) {
+    std::vector<std::string> items;
+    while (!text.empty()) {
+        const auto comma = text.find(',');
+        if (auto item = trim(text.substr(0, comma)); !item.empty())
+            items.emplace_back(item);
+        if (comma == std::string_view::npos)
+            break;
+        text.remove_prefix(comma + 1);
+    }
+    return items;
+}
+
+int toInt(std::string_view text, int fallback) {
+    int value = 0;
+    const auto [end, ec] = std::from_chars(text.data(), text.data() + text.size(), value);
+    return ec == std::errc() ? value : fallback;
+}
+
+// 逐行读取 ini 格式的文件，对每个键值对调用 f(节名, 键, 值)
+template <typename F> bool readIni(const std::filesystem::path &path, F &&f) {
+    std::ifstream in(path);
+    if (!in)
+        return false;
+
+    std::string line;
+    std::string section;
+    while (std::getline(in, line)) {
+        const auto text = trim(line);
+        if (text.empty() || text.front() == '#' || text.front() == ';')
+            continue;
+        if (text.front() == '[' && text.back() == ']') {
+            section = text.substr(1, text.size() - 2);
+            continue;
+        }
+        if (const auto eq = text.find('='); eq != std::string_view::npos)
+            f(std::string_view(section), trim(text.substr(0, eq)), trim(text.substr(eq + 1)));
+    }
+    return true;
+}
+
+// 同一图标的后缀按 png、svg、xpm 的顺序优先
+const char *preferredSuffix(uint16_t flags) {
+    if (flags & ICON_SUFFIX_PNG)
+        return ".png";
+    if (flags & ICON_SUFFIX_SVG)
+        return ".svg";
+    if (flags & ICON_SUFFIX_XPM)
+        return ".xpm";
+    return nullptr;
+}
+
+uint16_t suffixFlag(const std::filesystem::path &extension) {
+    if (extension == ".png")
+        return ICON_SUFFIX_PNG;
+    if (extension == ".svg")
+        return ICON_SUFFIX_SVG;
+    if (extension == ".xpm")
+        return ICON_SUFFIX_XPM;
+    return 0;
+}
+
+void addImage(std::vector<IconImage> &images, uint16_t directory, uint16_t flag) {
+    for (auto &image : images) {
+        if (image.directory == directory) {
+            image.flags |= flag;
+            return;
+        }
+    }
+    images.push_back({directory, flag});
+}
+
+} // namespace
+
+IconThemeCache::IconThemeCache(IconThemeCache &&other) noexcept { *this = std::move(other); }
+
+IconThemeCache &IconThemeCache::operator=(IconThemeCache &&other) noexcept {
+    if (this != &other) {
+        if (data_)
+            munmap(const_cast<uint8_t *>(data_), size_);
+        data_ = std::exchange(other.data_, nullptr);
+        size_ = std::exchange(other.size_, 0);
+    }
+    return *this;
+}
+
+IconThemeCache::~IconThemeCache() {
+    if (data_)
+        munmap(const_cast<uint8_t *>(data_), size_);
+}
+
+std::expected<IconThemeCache, Error> IconThemeCache::open(const std::string &path) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return makeError(ErrorKind::IOError, "Could not open icon theme cache");
+
+    struct stat st {};
+    if (fstat(fd, &st) < 0 || st.st_size < 12) {
+        close(fd);
+        return makeError(ErrorKind::IOError, "Icon theme cache is truncated");
+    }
+
+    const size_t size = static_cast<size_t>(st.st_size);
+    void *data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return makeError(ErrorKind::IOError, "Could not map icon theme cache");
+
+    IconThemeCache cache;
+    cache.data_ = static_cast<const uint8_t *>(data);
+    cache.size_ = size;
+
+    if (cache.u16(0) != 1 || cache.u16(2) != 0)
+        return makeError(ErrorKind::TypeError, "Unsupported icon theme cache version");
+    return cache;
+}
+
+uint32_t IconThemeCache::u32(size_t offset) const {
+    if (offset > size_ || size_ - offset < 4)
+        return CACHE_END;
+    const uint8_t *p = data_ + offset;
+    return uint32_t{p[0]} << 24 | uint32_t{p[1]} << 16 | uint32_t{p[2]} << 8 | uint32_t{p[3]};
+}
+
+uint16_t IconThemeCache::u16(size_t offset) const {
+    if (offset > size_ || size_ - offset < 2)
+        return 0xffff;
+    return static_cast<uint16_t>(data_[offset] << 8 | data_[offset + 1]);
+}
+
+std::string_view IconThemeCache::string(uint32_t offset) const {
+    if (offset >= size_)
+        return {};
+    const auto *begin = reinterpret_cast<const char *>(data_ + offset);
+    const auto *end = static_cast<const char *>(std::memchr(begin, '\0', size_ - offset));
+    return end ? std::string_view(begin, end - begin) : std::string_view();
+}
+
+std::vector<std::string_view> IconThemeCache::directories() const {
+    const uint32_t listOffset = u32(8);
+    const uint32_t count = u32(listOffset);
+    std::vector<std::string_view> directories;
+    // 数量来自文件，按剩余字节数限制，避免损坏的文件导致巨大的分配
+    for (uint32_t i = 0; i < count && i < size_ / 4; ++i)
+        directories.push_back(string(u32(size_t{listOffset} + 4 + size_t{i} * 4)));
+    return directories;
+}
+
+bool IconThemeCache::lookup(std::string_view name, std::vector<IconImage> &images) const {
+    const uint32_t hashOffset = u32(4);
+    const uint32_t buckets = u32(hashOffset);
+    if (buckets == 0 || buckets == CACHE_END)
+        return false;
+
+    uint32_t offset = u32(size_t{hashOffset} + 4 + size_t{iconNameHash(name) % buckets} * 4);
+    // 每个图标至少 12 字节，链表长度不会超过 size_ / 12，损坏的文件形成环时也能退出
+    for (size_t steps = 0; offset != CACHE_END && steps < size_ / 12; ++steps) {
+        if (string(u32(size_t{offset} + 4)) == name) {
+            const uint32_t listOffset = u32(size_t{offset} + 8);
+            const uint32_t count = u32(listOffset);
+            for (uint32_t i = 0; i < count; ++i) {
+                const size_t image = size_t{listOffset} + 4 + size_t{i} * 8;
+                if (image + 8 > size_)
+                    break;
+                images.push_back({u16(image), u16(image + 2)});
+            }
+            return true;
+        }
+        offset = u32(offset);
+    }
+    return false;
+}
+
+int IconDirectory::distance(int iconSize) const {
+    switch (type) {
+    case Type::Fixed:
+        return std::abs(size * scale - iconSize);
+    case Type::Scalable:
+        if (iconSize < minSize * scale)
+            return minSize * scale - iconSize;
+        if (iconSize > maxSize * scale)
+            return iconSize - maxSize * scale;
+        return 0;
+    case Type::Threshold:
+        if (iconSize < (size - threshold) * scale)
+            return minSize * scale - iconSize;
+        if (iconSize > (size + threshold) * scale)
+            return iconSize - maxSize * scale;
+        return 0;
+    }
+    return 0;
+}
+
+// 某个基目录下的一份主题目录，图标来自映射的缓存或一次性遍历的结果
+struct IconResolver::ThemeRoot {
+    std::filesystem::path path;
+    std::optional<IconThemeCache> cache;
+    // 缓存中的目录下标到 Theme::directories 下标，index.theme 中没有的目录为 -1
+    std::vector<int> cacheDirectories;
+    std::unordered_map<std::string, std::vector<IconImage>> scanned;
+
+    // 把 name 在本目录中的图像追加到 images，目录下标为 Theme::directories 的下标
+    void images(std::string_view name, std::vector<IconImage> &images) const {
+        if (cache) {
+            std::vector<IconImage> cached;
+            cache->lookup(name, cached);
+            for (const auto &image : cached) {
+                if (image.directory < cacheDirectories.size() && cacheDirectories[image.directory] >= 0)
+                    images.push_back({static_cast<uint16_t>(cacheDirectories[image.directory]), image.flags});
+            }
+        } else if (auto it = scanned.find(std::string(name)); it != scanned.end()) {
+            images.insert(images.end(), it->second.begin(), it->second.end());
+        }
+    }
+};
+
+struct IconResolver::Theme {
+    std::string name;
+    std::vector<IconDirectory> directories;
+    std::unordered_map<std::string, int> directoryIndex;
+    std::vector<std::string> inherits;
+    // 包含该主题的基目录，第一次在该主题中查找时才打开
+    std::vector<std::filesystem::path> rootPaths;
+    std::vector<ThemeRoot> roots;
+    bool rootsOpened = false;
+};
+
+// 不属于任何主题的平铺目录：名称（不含后缀）到文件路径
+struct IconResolver::LooseDirectory {
+    std::unordered_map<std::string, std::filesystem::path> files;
+};
+
+// 托盘项的 IconThemePath，按主题名保存其中的主题目录
+struct IconResolver::ItemPath {
+    std::unordered_map<const Theme *, ThemeRoot> roots;
+    LooseDirectory loose;
+};
+
+IconResolver::IconResolver(std::string theme, int size)
+    : size_(size), baseDirectories_(defaultBaseDirectories()) {
+    if (theme.empty())
+        theme = defaultTheme();
+    if (Theme *root = loadTheme(theme))
+        addToChain(root);
+    // 规范要求最后总是回退到 hicolor
+    if (Theme *hicolor = loadTheme("hicolor"))
+        addToChain(hicolor);
+}
+
+IconResolver::~IconResolver() = default;
+
+std::string IconResolver::defaultTheme() {
+    std::filesystem::path config;
+    if (const char *dir = std::getenv("XDG_CONFIG_HOME"); dir && *dir)
+        config = dir;
+    else if (const char *home = std::getenv("HOME"); home && *home)
+        config = std::filesystem::path(home) / ".config";
+
+    std::string theme;
+    if (!config.empty()) {
+        for (const char *gtk : {"gtk-4.0", "gtk-3.0"}) {
+            readIni(config / gtk / "settings.ini", [&](std::string_view, std::string_view key, std::string_view value) {
+                if (key == "gtk-icon-theme-name" && theme.empty())
+                    theme = value;
+            });
+            if (!theme.empty())
+                return theme;
+        }
+    }
+    return "hicolor";
+}
+
+std::vector<std::filesystem::path> IconResolver::defaultBaseDirectories() {
+    std::vector<std::filesystem::path> directories;
+    const char *home = std::getenv("HOME");
+    if (home && *home)
+        directories.push_back(std::filesystem::path(home) / ".icons");
+
+    if (const char *dataHome = std::getenv("XDG_DATA_HOME"); dataHome && *dataHome)
+        directories.push_back(std::filesystem::path(dataHome) / "icons");
+    else if (home && *home)
+        directories.push_back(std::filesystem::path(home) / ".local" / "share" / "icons");
+
+    const char *dataDirs = std::getenv("XDG_DATA_DIRS");
+    std::string_view dirs = dataDirs && *dataDirs ? dataDirs : "/usr/local/share:/usr/share";
+    while (!dirs.empty()) {
+        const auto colon = dirs.find(':');
+        if (const auto dir = dirs.substr(0, colon); !dir.empty())
+            directories.push_back(std::filesystem::path(dir) / "icons");
+        if (colon == std::string_view::npos)
+            break;
+        dirs.remove_prefix(colon + 1);
+    }
+    return directories;
+}
+
+std::vector<std::string> IconResolver::themeChain() const {
+    std::vector<std::string> names;
+    for (const Theme *theme : chain_)
+        names.push_back(theme->name);
+    return names;
+}
+
+IconResolver::Theme *IconResolver::loadTheme(const std::string &name) {
+    if (auto it = themes_.find(name); it != themes_.end())
+        return it->second.get();
+
+    auto theme = std::make_unique<Theme>();
+    theme->name = name;
+
+    // 使用第一个含有 index.theme 的基目录中的描述，其余基目录中的同名目录共享这份描述
+    bool described = false;
+    for (const auto &base : baseDirectories_) {
+        std::error_code ec;
+        const auto root = base / name;
+        if (!std::filesystem::is_directory(root, ec))
+            continue;
+        theme->rootPaths.push_back(root);
+        if (described)
+            continue;
+
+        std::vector<std::string> directoryNames;
+        std::unordered_map<std::string, IconDirectory> sections;
+        described = readIni(root / "index.theme", [&](std::string_view section, std::string_view key,
+                                                      std::string_view value) {
+            if (section == "Icon Theme") {
+                if (key == "Directories" || key == "ScaledDirectories") {
+                    for (auto &dir : splitList(value))
+                        directoryNames.push_back(std::move(dir));
+                } else if (key == "Inherits") {
+                    theme->inherits = splitList(value);
+                }
+                return;
+            }
+
+            auto &dir = sections[std::string(section)];
+            if (key == "Size")
+                dir.size = toInt(value, 0);
+            else if (key == "Scale")
+                dir.scale = toInt(value, 1);
+            else if (key == "MinSize")
+                dir.minSize = toInt(value, 0);
+            else if (key == "MaxSize")
+                dir.maxSize = toInt(value, 0);
+            else if (key == "Threshold")
+                dir.threshold = toInt(value, 2);
+            else if (key == "Type")
+                dir.type = value == "Fixed"      ? IconDirectory::Type::Fixed
+                           : value == "Scalable" ? IconDirectory::Type::Scalable
+                                                 : IconDirectory::Type::Threshold;
+        });
+
+        for (auto &dirName : directoryNames) {
+            // 缓存中的目录下标只有 16 位
+            if (theme->directories.size() >= 0xffff || theme->directoryIndex.contains(dirName))
+                continue;
+            auto it = sections.find(dirName);
+            if (it == sections.end() || it->second.size <= 0)
+                continue;
+            auto dir = it->second;
+            dir.path = dirName;
+            // MinSize、MaxSize 未给出时等于 Size
+            if (dir.minSize <= 0)
+                dir.minSize = dir.size;
+            if (dir.maxSize <= 0)
+                dir.maxSize = dir.size;
+            theme->directoryIndex.emplace(dirName, static_cast<int>(theme->directories.size()));
+            theme->directories.push_back(std::move(dir));
+        }
+    }
+
+    if (!described)
+        return nullptr;
+    ++stats_.themes;
+    return themes_.emplace(name, std::move(theme)).first->second.get();
+}
+
+void IconResolver::addToChain(Theme *theme) {
+    if (std::ranges::find(chain_, theme) != chain_.end())
+        return;
+    chain_.push_back(theme);
+    // 深度优先展开 Inherits，hicolor 留到最后
+    for (const auto &parent : theme->inherits) {
+        if (parent == "hicolor")
+            continue;
+        if (Theme *inherited = loadTheme(parent))
+            addToChain(inherited);
+    }
+}
+
+IconResolver::ThemeRoot IconResolver::openRoot(const Theme &theme, std::filesystem::path root) {
+    ThemeRoot themeRoot;
+    themeRoot.path = std::move(root);
+
+    // 与 GTK 相同：缓存不早于主题目录的修改时间才认为有效，否则目录中可能有缓存之外的新图标
+    std::error_code ec;
+    const auto cachePath = themeRoot.path / "icon-theme.cache";
+    const auto cacheTime = std::filesystem::last_write_time(cachePath, ec);
+    if (!ec) {
+        const auto rootTime = std::filesystem::last_write_time(themeRoot.path, ec);
+        if (!ec && cacheTime >= rootTime) {
+            if (auto cache = IconThemeCache::open(cachePath.string())) {
+                for (const auto dir : cache->directories()) {
+                    auto it = theme.directoryIndex.find(std::string(dir));
+                    themeRoot.cacheDirectories.push_back(it != theme.directoryIndex.end() ? it->second : -1);
+                }
+                themeRoot.cache = std::move(*cache);
+                ++stats_.mappedCaches;
+                return themeRoot;
+            }
+        }
+    }
+
+    // 没有可用的缓存：遍历一次主题目录，只记录 index.theme 中列出的子目录里的图标
+    ++stats_.scannedRoots;
+    constexpr int maxDepth = 3;
+    std::filesystem::recursive_directory_iterator it(
+        themeRoot.path, std::filesystem::directory_options::skip_permission_denied, ec
+    );
+    for (; !ec && it != std::filesystem::recursive_directory_iterator(); it.increment(ec)) {
+        if (it.depth() >= maxDepth)
+            it.disable_recursion_pending();
+        const auto &entry = *it;
+        const uint16_t flag = suffixFlag(entry.path().extension());
+        if (!flag || !entry.is_regular_file(ec))
+            continue;
+        const auto relative = entry.path().parent_path().lexically_relative(themeRoot.path).string();
+        if (auto dir = theme.directoryIndex.find(relative); dir != theme.directoryIndex.end())
+            addImage(themeRoot.scanned[entry.path().stem().string()], static_cast<uint16_t>(dir->second), flag);
+    }
+    return themeRoot;
+}
+
+IconResolver::LooseDirectory IconResolver::scanLoose(const std::filesystem::path &directory) {
+    LooseDirectory loose;
+    std::unordered_map<std::string, uint16_t> found;
+    std::error_code ec;
+    std::filesystem::directory_iterator it(directory, ec);
+    for (; !ec && it != std::filesystem::directory_iterator(); it.increment(ec)) {
+        const uint16_t flag = suffixFlag(it->path().extension());
+        if (!flag)
+            continue;
+        // 同名文件按 png、svg、xpm 的顺序保留一个
+        auto stem = it->path().stem().string();
+        auto &flags = found[stem];
+        if (flags >= flag)
+            continue;
+        flags = flag;
+        loose.files[std::move(stem)] = it->path();
+    }
+    return loose;
+}
+
+IconResolver::ItemPath &IconResolver::itemPath(std::string_view themePath) {
+    auto &item = itemPaths_[std::string(themePath)];
+    if (item)
+        return *item;
+
+    item = std::make_unique<ItemPath>();
+    const std::filesystem::path path(themePath);
+    for (const Theme *theme : chain_) {
+        std::error_code ec;
+        if (std::filesystem::is_directory(path / theme->name, ec))
+            item->roots.emplace(theme, openRoot(*theme, path / theme->name));
+    }
+    item->loose = scanLoose(path);
+    return *item;
+}
+
+std::optional<std::filesystem::path> IconResolver::resolve(std::string_view name, std::string_view themePath) {
+    ++stats_.lookups;
+    std::string key;
+    key.reserve(themePath.size() + 1 + name.size());
+    key.append(themePath).append(1, '\n').append(name);
+    if (auto it = resolved_.find(key); it != resolved_.end()) {
+        ++stats_.memoHits;
+        return it->second;
+    }
+
+    auto path = lookup(name, themePath);
+    resolved_.emplace(std::move(key), path);
+    return path;
+}
+
+std::optional<std::filesystem::path> IconResolver::lookup(std::string_view name, std::string_view themePath) {
+    if (name.empty())
+        return std::nullopt;
+    // 有的应用直接把图标文件的绝对路径放在 IconName 中
+    if (name.front() == '/')
+        return std::filesystem::path(name);
+
+    ItemPath *item = themePath.empty() ? nullptr : &itemPath(themePath);
+    std::vector<IconImage> images;
+    for (Theme *theme : chain_) {
+        if (!theme->rootsOpened) {
+            for (const auto &root : theme->rootPaths)
+                theme->roots.push_back(openRoot(*theme, root));
+            theme->rootsOpened = true;
+        }
+
+        // 每个候选记录所在的主题目录，托盘项自带的目录排在系统目录之前
+        const ThemeRoot *bestRoot = nullptr;
+        IconImage best{};
+        int bestDistance = 0;
+        auto consider = [&](const ThemeRoot &root) {
+            images.clear();
+            root.images(name, images);
+            for (const auto &image : images) {
+                if (image.directory >= theme->directories.size() || !preferredSuffix(image.flags))
+                    continue;
+                const int distance = theme->directories[image.directory].distance(size_);
+                if (!bestRoot || distance < bestDistance) {
+                    bestRoot = &root;
+                    best = image;
+                    bestDistance = distance;
+                }
+            }
+        };
+
+        if (item) {
+            if (auto it = item->roots.find(theme); it != item->roots.end())
+                consider(it->second);
+        }
+        for (const auto &root : theme->roots)
+            consider(root);
+
+        if (bestRoot) {
+            return bestRoot->path / theme->directories[best.directory].path /
+                   (std::string(name) + preferredSuffix(best.flags));
+        }
+    }
+
+    if (item) {
+        if (auto it = item->loose.files.find(std::string(name)); it != item->loose.files.end())
+            return it->second;
+    }
+
+    if (!pixmaps_)
+        pixmaps_ = std::make_unique<LooseDirectory>(scanLoose("/usr/share/pixmaps"));
+    if (auto it = pixmaps_->files.find(std::string(name)); it != pixmaps_->files.end())
+        return it->second;
+    return std::nullopt;
+}
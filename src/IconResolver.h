@@ -0,0 +1,139 @@
+//
+// Created by tray-control on 2024/05/25.
+//
+// 把托盘项的 IconName（加上可选的 IconThemePath）解析为图标文件路径，按 freedesktop 图标主题规范查找。
+// 有 GTK icon-theme.cache 的主题直接在映射的缓存里查哈希表，没有缓存的主题目录只遍历一次；
+// 之后的查找和重复查找都只读内存，不再 stat/open 任何文件
+#pragma once
+
+#include <cstdint>
+#include <expected>
+#include <filesystem>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "Errors.h"
+
+// 图像的文件后缀，与 icon-theme.cache 中的标志位一致
+enum IconImageFlags : uint16_t {
+    ICON_SUFFIX_XPM = 1 << 0,
+    ICON_SUFFIX_SVG = 1 << 1,
+    ICON_SUFFIX_PNG = 1 << 2,
+};
+
+// 主题中某个子目录下的一个同名图标，flags 为已有的后缀
+struct IconImage {
+    uint16_t directory;
+    uint16_t flags;
+};
+
+// gtk-update-icon-cache 生成的 icon-theme.cache（大端序），只读映射。格式：
+//   头部：uint16 主版本 1 | uint16 次版本 0 | uint32 哈希表偏移 | uint32 目录表偏移
+//   目录表：uint32 数量 | uint32 字符串偏移[数量]（相对主题目录的子目录）
+//   哈希表：uint32 桶数 | uint32 图标偏移[桶数]，空桶为 0xffffffff
+//   图标：uint32 链表下一项 | uint32 名称偏移 | uint32 图像表偏移
+//   图像表：uint32 数量 | { uint16 目录下标 | uint16 标志位 | uint32 附加数据偏移 }[数量]
+class IconThemeCache {
+  public:
+    IconThemeCache() = default;
+    IconThemeCache(const IconThemeCache &) = delete;
+    IconThemeCache &operator=(const IconThemeCache &) = delete;
+    IconThemeCache(IconThemeCache &&other) noexcept;
+    IconThemeCache &operator=(IconThemeCache &&other) noexcept;
+    ~IconThemeCache();
+
+    // 映射并校验缓存文件头
+    static std::expected<IconThemeCache, Error> open(const std::string &path);
+
+    // 缓存中记录的子目录，下标即 IconImage::directory
+    std::vector<std::string_view> directories() const;
+
+    // 把 name 的全部图像追加到 images，没有该图标时返回 false
+    bool lookup(std::string_view name, std::vector<IconImage> &images) const;
+
+  private:
+    const uint8_t *data_ = nullptr;
+    size_t size_ = 0;
+
+    // 越界时返回 0xffffffff，与空桶、链表结尾相同，损坏的文件不会越界读取
+    uint32_t u32(size_t offset) const;
+    uint16_t u16(size_t offset) const;
+    std::string_view string(uint32_t offset) const;
+};
+
+// index.theme 中一个子目录的尺寸描述
+struct IconDirectory {
+    enum class Type { Fixed, Scalable, Threshold };
+
+    std::string path;
+    Type type = Type::Threshold;
+    int size = 0;
+    int scale = 1;
+    int minSize = 0;
+    int maxSize = 0;
+    int threshold = 2;
+
+    // 规范中的 DirectorySizeDistance，0 表示尺寸匹配
+    int distance(int iconSize) const;
+};
+
+struct IconResolverStats {
+    uint64_t lookups = 0;
+    uint64_t memoHits = 0;     // 直接命中已解析结果的次数
+    size_t themes = 0;         // 已读取 index.theme 的主题数
+    size_t mappedCaches = 0;   // 映射的 icon-theme.cache 数
+    size_t scannedRoots = 0;   // 没有可用缓存、遍历过的主题目录数
+};
+
+// 非线程安全；同一进程内应复用一个实例，索引和解析结果都保存在其中
+class IconResolver {
+  public:
+    // theme 为空时使用 defaultTheme()；size 为期望的图标像素尺寸
+    explicit IconResolver(std::string theme = {}, int size = 24);
+    ~IconResolver();
+
+    IconResolver(const IconResolver &) = delete;
+    IconResolver &operator=(const IconResolver &) = delete;
+
+    // GTK 设置中的 gtk-icon-theme-name，没有设置时为 hicolor
+    static std::string defaultTheme();
+
+    // 规范中的图标基目录：~/.icons、$XDG_DATA_HOME/icons、$XDG_DATA_DIRS/icons
+    static std::vector<std::filesystem::path> defaultBaseDirectories();
+
+    // themePath 为托盘项的 IconThemePath：其中的主题子目录优先于系统主题，
+    // 直接放在其中的图标文件在所有主题之后、/usr/share/pixmaps 之前查找
+    std::optional<std::filesystem::path> resolve(std::string_view name, std::string_view themePath = {});
+
+    // 主题及其 Inherits 链，最后总是 hicolor
+    std::vector<std::string> themeChain() const;
+
+    IconResolverStats stats() const { return stats_; }
+
+  private:
+    struct ThemeRoot;
+    struct Theme;
+    struct LooseDirectory;
+    struct ItemPath;
+
+    int size_;
+    std::vector<std::filesystem::path> baseDirectories_;
+    std::unordered_map<std::string, std::unique_ptr<Theme>> themes_;
+    std::vector<Theme *> chain_;
+    std::unordered_map<std::string, std::unique_ptr<ItemPath>> itemPaths_;
+    std::unique_ptr<LooseDirectory> pixmaps_;
+    // themePath + '\n' + name 到解析结果
+    std::unordered_map<std::string, std::optional<std::filesystem::path>> resolved_;
+    IconResolverStats stats_;
+
+    Theme *loadTheme(const std::string &name);
+    void addToChain(Theme *theme);
+    ThemeRoot openRoot(const Theme &theme, std::filesystem::path root);
+    LooseDirectory scanLoose(const std::filesystem::path &directory);
+    ItemPath &itemPath(std::string_view themePath);
+    std::optional<std::filesystem::path> lookup(std::string_view name, std::string_view themePath);
+};
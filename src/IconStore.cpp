@@ -0,0 +1,138 @@
+//
+// Created by tray-control on 2024/05/18.
+//
+
+#include "IconStore.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <sdbus-c++/sdbus-c++.h>
+#include <fmt/format.h>
+
+#include "AtomicFile.h"
+
+uint64_t iconHash(std::span<const uint8_t> bytes) {
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (uint8_t byte : bytes) {
+        hash ^= byte;
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
+}
+
+IconData::IconData(std::span<const uint8_t> bytes) {
+    if (!bytes.empty())
+        blob_ = IconStore::global().intern(bytes);
+}
+
+bool IconData::operator==(const IconData &other) const {
+    return blob_ == other.blob_ || std::ranges::equal(bytes(), other.bytes());
+}
+
+sdbus::Message &operator<<(sdbus::Message &message, const IconData &icon) {
+    const auto bytes = icon.bytes();
+    return message << std::vector<uint8_t>(bytes.begin(), bytes.end());
+}
+
+sdbus::Message &operator>>(sdbus::Message &message, IconData &icon) {
+    std::span<uint8_t> data;
+    message >> data;
+    icon = IconData(data);
+    return message;
+}
+
+IconStore &IconStore::global() {
+    static IconStore store;
+    return store;
+}
+
+std::shared_ptr<const IconBlob> IconStore::intern(std::span<const uint8_t> bytes) {
+    // 哈希在锁外计算
+    const uint64_t hash = iconHash(bytes);
+
+    std::lock_guard lock(mutex_);
+    ++lookups_;
+    auto &bucket = entries_[hash];
+    for (auto it = bucket.begin(); it != bucket.end();) {
+        if (auto blob = it->lock()) {
+            if (std::ranges::equal(blob->bytes, bytes)) {
+                ++hits_;
+                return blob;
+            }
+            ++it;
+        } else {
+            it = bucket.erase(it);
+        }
+    }
+
+    auto blob = std::make_shared<const IconBlob>(IconBlob{hash, std::vector<uint8_t>(bytes.begin(), bytes.end())});
+    bucket.push_back(blob);
+    // 过期条目平时只在访问同一个桶时清理，插入次数翻倍时整体清理一次
+    if (++inserted_ >= sweepAt_) {
+        sweep();
+        inserted_ = 0;
+        sweepAt_ = std::max<size_t>(64, entries_.size() * 2);
+    }
+    return blob;
+}
+
+void IconStore::sweep() {
+    for (auto it = entries_.begin(); it != entries_.end();) {
+        std::erase_if(it->second, [](const auto &entry) { return entry.expired(); });
+        it = it->second.empty() ? entries_.erase(it) : std::next(it);
+    }
+}
+
+IconStoreStats IconStore::stats() const {
+    std::lock_guard lock(mutex_);
+    IconStoreStats stats;
+    stats.lookups = lookups_;
+    stats.hits = hits_;
+    for (const auto &[hash, bucket] : entries_) {
+        for (const auto &entry : bucket) {
+            if (auto blob = entry.lock()) {
+                ++stats.entries;
+                stats.bytes += blob->bytes.size();
+            }
+        }
+    }
+    return stats;
+}
+
+IconCache::IconCache(std::filesystem::path directory) : directory_(std::move(directory)) {}
+
+std::filesystem::path IconCache::defaultDirectory() {
+    if (const char *cache = std::getenv("XDG_CACHE_HOME"); cache && *cache)
+        return std::filesystem::path(cache) / "tray-control" / "icons";
+    if (const char *home = std::getenv("HOME"); home && *home)
+        return std::filesystem::path(home) / ".cache" / "tray-control" / "icons";
+    return std::filesystem::temp_directory_path() / "tray-control" / "icons";
+}
+
+std::expected<std::filesystem::path, Error> IconCache::store(std::span<const uint8_t> bytes) {
+    // 文件名带上大小，哈希碰撞时也不会覆盖另一个图标
+    const std::string name = fmt::format("{:016x}-{}.png", iconHash(bytes), bytes.size());
+    auto path = directory_ / name;
+    if (known_.contains(name))
+        return path;
+
+    std::error_code ec;
+    if (!directoryReady_) {
+        std::filesystem::create_directories(directory_, ec);
+        if (ec)
+            return makeError(ErrorKind::IOError, directory_.string() + ": " + ec.message());
+        directoryReady_ = true;
+    }
+
+    const auto size = std::filesystem::file_size(path, ec);
+    if (ec || size != bytes.size()) {
+        // 先写临时文件再改名，并发的进程不会读到写了一半的图标
+        const std::string_view content(reinterpret_cast<const char *>(bytes.data()), bytes.size());
+        if (auto res = writeFileAtomically(path.string(), content); !res)
+            return std::unexpected(res.error());
+        ++written_;
+    }
+
+    known_.insert(name);
+    return path;
+}
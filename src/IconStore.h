@@ -0,0 +1,106 @@
+//
+// Created by tray-control on 2024/05/18.
+//
+#pragma once
+
+#include <cstdint>
+#include <expected>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include <sdbus-c++/Types.h>
+
+#include "Errors.h"
+
+// 图标内容的 64 位哈希（FNV-1a），跨进程稳定，可用作文件名
+uint64_t iconHash(std::span<const uint8_t> bytes);
+
+struct IconBlob {
+    uint64_t hash;
+    std::vector<uint8_t> bytes;
+};
+
+// 菜单项的 icon-data（PNG）。按内容登记在全局 IconStore 中，内容相同的副本共享同一块只读缓冲区，
+// 跨菜单项、菜单和多次刷新都只保存一份；最后一个引用释放时缓冲区随之释放
+class IconData {
+  public:
+    IconData() = default;
+    explicit IconData(std::span<const uint8_t> bytes);
+
+    std::span<const uint8_t> bytes() const {
+        return blob_ ? std::span<const uint8_t>(blob_->bytes) : std::span<const uint8_t>();
+    }
+    uint64_t hash() const { return blob_ ? blob_->hash : 0; }
+    size_t size() const { return blob_ ? blob_->bytes.size() : 0; }
+    bool empty() const { return size() == 0; }
+
+    // 是否与 other 共享同一块缓冲区
+    bool shares(const IconData &other) const { return blob_ == other.blob_; }
+
+    bool operator==(const IconData &other) const;
+
+  private:
+    std::shared_ptr<const IconBlob> blob_;
+};
+
+// 按签名 ay 收发，解码时直接从消息中借用字节再登记，不为重复的图标分配
+namespace sdbus {
+template <> struct signature_of<IconData> : signature_of<std::vector<uint8_t>> {};
+} // namespace sdbus
+sdbus::Message &operator<<(sdbus::Message &message, const IconData &icon);
+sdbus::Message &operator>>(sdbus::Message &message, IconData &icon);
+
+struct IconStoreStats {
+    uint64_t lookups = 0;
+    uint64_t hits = 0;   // 找到已有缓冲区的次数
+    size_t entries = 0;  // 仍被引用的缓冲区数
+    size_t bytes = 0;    // 仍被引用的缓冲区总大小
+};
+
+// 按内容去重的图标缓冲区，只持有弱引用，线程安全
+class IconStore {
+  public:
+    static IconStore &global();
+
+    std::shared_ptr<const IconBlob> intern(std::span<const uint8_t> bytes);
+
+    IconStoreStats stats() const;
+
+  private:
+    mutable std::mutex mutex_;
+    std::unordered_map<uint64_t, std::vector<std::weak_ptr<const IconBlob>>> entries_;
+    uint64_t lookups_ = 0;
+    uint64_t hits_ = 0;
+    size_t inserted_ = 0;
+    size_t sweepAt_ = 64;
+
+    void sweep();
+};
+
+// 以内容哈希命名的图标文件目录：同样的内容总是对应同一个路径，已经存在的文件不会重写
+class IconCache {
+  public:
+    explicit IconCache(std::filesystem::path directory);
+
+    // $XDG_CACHE_HOME/tray-control/icons，未设置时为 ~/.cache/tray-control/icons
+    static std::filesystem::path defaultDirectory();
+
+    const std::filesystem::path &directory() const { return directory_; }
+
+    // 返回保存 bytes 的文件路径；文件不存在或大小不符时先写入临时文件再改名
+    std::expected<std::filesystem::path, Error> store(std::span<const uint8_t> bytes);
+
+    // 本进程实际写入的文件数
+    size_t written() const { return written_; }
+
+  private:
+    std::filesystem::path directory_;
+    bool directoryReady_ = false;
+    size_t written_ = 0;
+    // 本进程已经确认存在的文件，不再检查
+    std::unordered_set<std::string> known_;
+};
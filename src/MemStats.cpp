@@ -0,0 +1,106 @@
+//
+// Created by tray-control on 2024/06/15.
+//
+
+#include "MemStats.h"
+
+#include <sys/resource.h>
+
+#ifdef TRAY_CONTROL_MEM_STATS
+#include <atomic>
+#include <cstdlib>
+#include <malloc.h>
+#include <new>
+#include <utility>
+
+namespace {
+
+// 全部是常量初始化，静态构造之前发生的分配也能安全计数
+struct PhaseCounters {
+    std::atomic<uint64_t> allocations;
+    std::atomic<uint64_t> bytes;
+};
+
+PhaseCounters counters[MEM_PHASE_COUNT];
+std::atomic<uint64_t> liveBytes;
+std::atomic<uint64_t> peakLiveBytes;
+thread_local MemPhase currentPhase = MemPhase::Other;
+
+void *counted(void *p, size_t size) {
+    if (!p)
+        return p;
+    auto &phase = counters[static_cast<size_t>(currentPhase)];
+    phase.allocations.fetch_add(1, std::memory_order_relaxed);
+    phase.bytes.fetch_add(size, std::memory_order_relaxed);
+
+    const uint64_t usable = malloc_usable_size(p);
+    const uint64_t live = liveBytes.fetch_add(usable, std::memory_order_relaxed) + usable;
+    uint64_t peak = peakLiveBytes.load(std::memory_order_relaxed);
+    while (live > peak && !peakLiveBytes.compare_exchange_weak(peak, live, std::memory_order_relaxed)) {
+    }
+    return p;
+}
+
+void release(void *p) {
+    if (p)
+        liveBytes.fetch_sub(malloc_usable_size(p), std::memory_order_relaxed);
+    std::free(p);
+}
+
+void *alignedAlloc(size_t size, std::align_val_t align) {
+    // aligned_alloc 要求大小是对齐的整数倍
+    const auto alignment = static_cast<size_t>(align);
+    const size_t rounded = size == 0 ? alignment : (size + alignment - 1) / alignment * alignment;
+    return counted(std::aligned_alloc(alignment, rounded), size);
+}
+
+} // namespace
+
+// nothrow 版本和数组版本的默认实现都转发到这里
+void *operator new(size_t size) {
+    if (void *p = counted(std::malloc(size ? size : 1), size))
+        return p;
+    throw std::bad_alloc();
+}
+
+void *operator new[](size_t size) { return ::operator new(size); }
+
+void *operator new(size_t size, std::align_val_t align) {
+    if (void *p = alignedAlloc(size, align))
+        return p;
+    throw std::bad_alloc();
+}
+
+void *operator new[](size_t size, std::align_val_t align) { return ::operator new(size, align); }
+
+void operator delete(void *p) noexcept { release(p); }
+void operator delete[](void *p) noexcept { release(p); }
+void operator delete(void *p, size_t) noexcept { release(p); }
+void operator delete[](void *p, size_t) noexcept { release(p); }
+void operator delete(void *p, std::align_val_t) noexcept { release(p); }
+void operator delete[](void *p, std::align_val_t) noexcept { release(p); }
+void operator delete(void *p, size_t, std::align_val_t) noexcept { release(p); }
+void operator delete[](void *p, size_t, std::align_val_t) noexcept { release(p); }
+
+MemPhaseScope::MemPhaseScope(MemPhase phase) : previous_(std::exchange(currentPhase, phase)) {}
+
+MemPhaseScope::~MemPhaseScope() { currentPhase = previous_; }
+#endif
+
+MemStats memStats() {
+    MemStats stats;
+#ifdef TRAY_CONTROL_MEM_STATS
+    stats.instrumented = true;
+    for (size_t i = 0; i < MEM_PHASE_COUNT; ++i) {
+        stats.phases[i].allocations = counters[i].allocations.load(std::memory_order_relaxed);
+        stats.phases[i].bytes = counters[i].bytes.load(std::memory_order_relaxed);
+    }
+    stats.liveBytes = liveBytes.load(std::memory_order_relaxed);
+    stats.peakLiveBytes = peakLiveBytes.load(std::memory_order_relaxed);
+#endif
+    // Linux 上 ru_maxrss 的单位是 KiB
+    rusage usage{};
+    if (getrusage(RUSAGE_SELF, &usage) == 0)
+        stats.peakRssBytes = static_cast<uint64_t>(usage.ru_maxrss) * 1024;
+    return stats;
+}
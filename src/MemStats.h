@@ -0,0 +1,61 @@
+//
+// Created by tray-control on 2024/06/15.
+//
+// 按阶段统计堆分配。以 -DTRAY_CONTROL_MEM_STATS=ON 构建时 core 替换全局 operator new/delete，
+// 每次分配计入当前线程所处的阶段；默认构建不替换，MemPhaseScope 为空操作，memStats() 只报告峰值 RSS
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+// core 在各入口设置阶段：发现托盘项和建立连接、获取属性、获取和解码菜单布局、打印结果
+enum class MemPhase : uint8_t {
+    Other,
+    Discovery,
+    Properties,
+    Layout,
+    Output,
+};
+
+inline constexpr size_t MEM_PHASE_COUNT = static_cast<size_t>(MemPhase::Output) + 1;
+
+struct MemPhaseStats {
+    uint64_t allocations = 0;
+    uint64_t bytes = 0; // 请求的字节数
+};
+
+struct MemStats {
+    // 是否以 TRAY_CONTROL_MEM_STATS 构建；为 false 时只有 peakRssBytes 有效
+    bool instrumented = false;
+    std::array<MemPhaseStats, MEM_PHASE_COUNT> phases{};
+    // 尚未释放的堆内存及其峰值，按 malloc_usable_size 计算
+    uint64_t liveBytes = 0;
+    uint64_t peakLiveBytes = 0;
+    uint64_t peakRssBytes = 0;
+};
+
+MemStats memStats();
+
+#ifdef TRAY_CONTROL_MEM_STATS
+// 作用域内当前线程的分配计入 phase，析构时恢复之前的阶段，可以嵌套
+class MemPhaseScope {
+  public:
+    explicit MemPhaseScope(MemPhase phase);
+    ~MemPhaseScope();
+
+    MemPhaseScope(const MemPhaseScope &) = delete;
+    MemPhaseScope &operator=(const MemPhaseScope &) = delete;
+
+  private:
+    MemPhase previous_;
+};
+#else
+class MemPhaseScope {
+  public:
+    explicit MemPhaseScope(MemPhase) {}
+
+    MemPhaseScope(const MemPhaseScope &) = delete;
+    MemPhaseScope &operator=(const MemPhaseScope &) = delete;
+};
+#endif
@@ -0,0 +1,58 @@
+//
+// Created by tray-control on 2024/04/06.
+//
+
+#include "MenuEffectWaiter.h"
+
+#include <algorithm>
+
+void MenuEffectWaiter::arm(std::vector<int32_t> ids, std::optional<uint32_t> staleRevision) {
+    std::lock_guard lock(mutex_);
+    armed_ = true;
+    ids_ = std::move(ids);
+    staleRevision_ = staleRevision;
+    effect_.reset();
+    start_ = std::chrono::steady_clock::now();
+}
+
+void MenuEffectWaiter::notifyProperties(const std::vector<int32_t> &updatedIds) {
+    std::lock_guard lock(mutex_);
+    if (!armed_ || effect_)
+        return;
+
+    std::vector<int32_t> matched;
+    for (int32_t id : updatedIds) {
+        if (std::ranges::find(ids_, id) != ids_.end())
+            matched.push_back(id);
+    }
+    if (!matched.empty())
+        record("ItemsPropertiesUpdated", std::move(matched));
+}
+
+void MenuEffectWaiter::notifyLayout(uint32_t revision) {
+    std::lock_guard lock(mutex_);
+    if (!armed_ || effect_ || (staleRevision_ && revision <= *staleRevision_))
+        return;
+    record("LayoutUpdated", {});
+}
+
+void MenuEffectWaiter::notify(std::string signal) {
+    std::lock_guard lock(mutex_);
+    if (armed_ && !effect_)
+        record(std::move(signal), {});
+}
+
+std::optional<MenuEffect> MenuEffectWaiter::wait(std::chrono::milliseconds timeout) {
+    std::unique_lock lock(mutex_);
+    cv_.wait_until(lock, start_ + timeout, [this] { return effect_.has_value(); });
+    armed_ = false;
+    return effect_;
+}
+
+void MenuEffectWaiter::record(std::string signal, std::vector<int32_t> ids) {
+    // 在信号到达时取时间，而不是在 wait 返回时
+    const auto latency =
+        std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start_);
+    effect_ = MenuEffect{std::move(signal), std::move(ids), latency};
+    cv_.notify_all();
+}
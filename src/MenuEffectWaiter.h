@@ -0,0 +1,51 @@
+//
+// Created by tray-control on 2024/04/06.
+//
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <vector>
+
+// 点击后观察到的第一个效果
+struct MenuEffect {
+    std::string signal;                // 信号名，例如 ItemsPropertiesUpdated、LayoutUpdated、NewIcon
+    std::vector<int32_t> ids;         // ItemsPropertiesUpdated 中属于被点击菜单项的 ID
+    std::chrono::microseconds latency; // 从发送事件到收到信号
+};
+
+// 等待菜单点击的效果：arm 记录起点，之后第一个相关信号被记为效果。
+// notify* 在信号线程上调用，wait 在调用线程上阻塞到效果出现或超时
+class MenuEffectWaiter {
+  public:
+    // 在发送事件之前调用；ids 为被点击的菜单项，只有涉及这些 ID 的属性变化才算作效果。
+    // staleRevision 为点击前预取得到的布局版本，版本号不超过它的 LayoutUpdated 是预取自己引起的，不算作效果
+    void arm(std::vector<int32_t> ids, std::optional<uint32_t> staleRevision = std::nullopt);
+
+    // 菜单项属性变化，updatedIds 为信号中出现的所有 ID
+    void notifyProperties(const std::vector<int32_t> &updatedIds);
+
+    // 布局变化，revision 为信号携带的布局版本
+    void notifyLayout(uint32_t revision);
+
+    // 托盘项 New* 信号，不区分菜单项
+    void notify(std::string signal);
+
+    std::optional<MenuEffect> wait(std::chrono::milliseconds timeout);
+
+  private:
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    bool armed_ = false;
+    std::vector<int32_t> ids_;
+    std::optional<uint32_t> staleRevision_;
+    std::chrono::steady_clock::time_point start_;
+    std::optional<MenuEffect> effect_;
+
+    // 调用方需持有 mutex_
+    void record(std::string signal, std::vector<int32_t> ids);
+};
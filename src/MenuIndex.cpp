@@ -0,0 +1,319 @@
+//
+// Created by tray-control on 2024/03/02.
+//
+
+#include "MenuIndex.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utility>
+
+#include "AtomicFile.h"
+#include "DBusMenu.h"
+#include "MenuLayoutArena.h"
+#include "StatusNotifierItem.h"
+#include "StatusNotifierWatcher.h"
+#include "Utils.h"
+
+namespace {
+
+// 索引中各段按 4 字节对齐
+constexpr size_t alignUp(size_t value) { return (value + 3) & ~size_t{3}; }
+
+uint16_t nodeFlags(const PmrMenuLayoutItem &item) {
+    uint16_t flags = 0;
+
+    const bool *enabled = item.get<bool>("enabled");
+    if (!enabled || *enabled)
+        flags |= MENU_NODE_ENABLED;
+
+    const bool *visible = item.get<bool>("visible");
+    if (!visible || *visible)
+        flags |= MENU_NODE_VISIBLE;
+
+    if (const auto *type = item.get<std::pmr::string>("type"); type && *type == "separator")
+        flags |= MENU_NODE_SEPARATOR;
+
+    if (const auto *display = item.get<std::pmr::string>("children-display"); display && *display == "submenu")
+        flags |= MENU_NODE_SUBMENU;
+    else if (!item.children.empty())
+        flags |= MENU_NODE_SUBMENU;
+
+    if (const auto *toggleType = item.get<std::pmr::string>("toggle-type")) {
+        if (*toggleType == "checkmark")
+            flags |= MENU_NODE_CHECKMARK;
+        else if (*toggleType == "radio")
+            flags |= MENU_NODE_RADIO;
+    }
+
+    if (const int32_t *state = item.get<int32_t>("toggle-state"); state && *state == 1)
+        flags |= MENU_NODE_TOGGLED;
+
+    return flags;
+}
+
+} // namespace
+
+MenuIndex::MenuIndex(MenuIndex &&other) noexcept { *this = std::move(other); }
+
+MenuIndex &MenuIndex::operator=(MenuIndex &&other) noexcept {
+    if (this != &other) {
+        if (data_)
+            munmap(data_, size_);
+        data_ = std::exchange(other.data_, nullptr);
+        size_ = std::exchange(other.size_, 0);
+        apps_ = std::exchange(other.apps_, {});
+        nodes_ = std::exchange(other.nodes_, {});
+        strings_ = std::exchange(other.strings_, {});
+    }
+    return *this;
+}
+
+MenuIndex::~MenuIndex() {
+    if (data_)
+        munmap(data_, size_);
+}
+
+std::expected<std::string, Error> MenuIndex::defaultPath() {
+    if (const char *runtimeDir = std::getenv("XDG_RUNTIME_DIR"); runtimeDir && *runtimeDir)
+        return std::string(runtimeDir) + "/tray-control/menu-index";
+
+    // /tmp 对所有用户可写，别的用户可能抢先创建同名目录并放入伪造的索引，
+    // 因此目录必须是当前用户所有的真实目录，且其他人没有任何权限
+    const std::string dir = "/tmp/tray-control-" + std::to_string(getuid());
+    if (mkdir(dir.c_str(), 0700) != 0 && errno != EEXIST)
+        return makeError(ErrorKind::IOError, "Could not create menu index directory " + dir);
+    struct stat st {};
+    if (lstat(dir.c_str(), &st) != 0 || !S_ISDIR(st.st_mode) || st.st_uid != getuid() || (st.st_mode & 077) != 0)
+        return makeError(ErrorKind::IOError, "Menu index directory " + dir + " is not private to the current user");
+    return dir + "/menu-index";
+}
+
+std::expected<MenuIndex, Error> MenuIndex::open(const std::string &path) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return makeError(ErrorKind::IOError, "Could not open menu index");
+
+    struct stat st {};
+    if (fstat(fd, &st) < 0 || static_cast<size_t>(st.st_size) < sizeof(MenuIndexHeader)) {
+        close(fd);
+        return makeError(ErrorKind::IOError, "Menu index is truncated");
+    }
+
+    const size_t size = static_cast<size_t>(st.st_size);
+    void *data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return makeError(ErrorKind::IOError, "Could not map menu index");
+
+    MenuIndex index;
+    index.data_ = data;
+    index.size_ = size;
+
+    const auto *base = static_cast<const char *>(data);
+    const auto *header = reinterpret_cast<const MenuIndexHeader *>(base);
+    if (std::memcmp(header->magic, MENU_INDEX_MAGIC, sizeof(MENU_INDEX_MAGIC)) != 0 ||
+        header->version != MENU_INDEX_VERSION)
+        return makeError(ErrorKind::TypeError, "Unsupported menu index format");
+
+    // 校验各段边界，避免读取被截断或损坏的文件时越界
+    const size_t appEnd = size_t{header->appOffset} + size_t{header->appCount} * sizeof(MenuIndexApp);
+    const size_t nodeEnd = size_t{header->nodeOffset} + size_t{header->nodeCount} * sizeof(MenuIndexNode);
+    const size_t stringEnd = size_t{header->stringOffset} + header->stringBytes;
+    if (header->appOffset % 4 || header->nodeOffset % 4 || appEnd > size || nodeEnd > size || stringEnd > size ||
+        header->stringBytes == 0 || base[stringEnd - 1] != '\0')
+        return makeError(ErrorKind::TypeError, "Corrupted menu index");
+
+    index.apps_ = {reinterpret_cast<const MenuIndexApp *>(base + header->appOffset), header->appCount};
+    index.nodes_ = {reinterpret_cast<const MenuIndexNode *>(base + header->nodeOffset), header->nodeCount};
+    index.strings_ = {base + header->stringOffset, header->stringBytes};
+
+    return index;
+}
+
+std::string_view MenuIndex::string(uint32_t offset) const {
+    if (offset >= strings_.size())
+        return {};
+    return strings_.data() + offset;
+}
+
+std::string MenuIndex::labelPath(uint32_t nodeIndex) const {
+    std::vector<std::string_view> labels;
+    // 最多走节点总数步，损坏的索引中 parent 成环时不会死循环
+    for (int32_t i = static_cast<int32_t>(nodeIndex);
+         i >= 0 && static_cast<size_t>(i) < nodes_.size() && labels.size() < nodes_.size(); i = nodes_[i].parent) {
+        // 根节点没有标签，不参与拼接
+        if (nodes_[i].depth == 0)
+            break;
+        labels.push_back(string(nodes_[i].label));
+    }
+
+    std::string res;
+    for (auto it = labels.rbegin(); it != labels.rend(); ++it) {
+        if (!res.empty())
+            res += " > ";
+        res += *it;
+    }
+    return res;
+}
+
+uint32_t MenuIndexBuilder::intern(std::string_view str) {
+    if (str.empty())
+        return 0;
+
+    auto [it, inserted] = stringOffsets_.try_emplace(std::string(str), static_cast<uint32_t>(strings_.size()));
+    if (inserted) {
+        strings_ += str;
+        strings_ += '\0';
+    }
+    return it->second;
+}
+
+void MenuIndexBuilder::addLayout(const PmrMenuLayoutItem &item, uint32_t app, int32_t parent, uint16_t depth) {
+    std::string_view label;
+    if (const auto *value = item.get<std::pmr::string>("label"))
+        label = *value;
+
+    const auto index = static_cast<int32_t>(nodes_.size());
+    nodes_.push_back(MenuIndexNode{item.id, app, parent, intern(label), depth, nodeFlags(item)});
+
+    for (const auto &child : item.children) {
+        addLayout(child, app, index, depth + 1);
+    }
+}
+
+void MenuIndexBuilder::copyApp(
+    const MenuIndex &previous, const MenuIndexApp &app, uint32_t revision, std::string_view itemId,
+    std::string_view title
+) {
+    const auto appIndex = static_cast<uint32_t>(apps_.size());
+    const auto firstNode = static_cast<uint32_t>(nodes_.size());
+    apps_.push_back(MenuIndexApp{
+        intern(previous.string(app.address)), intern(previous.string(app.menuPath)), intern(itemId), intern(title),
+        revision, firstNode, app.nodeCount
+    });
+
+    // 父节点下标需要从旧索引的位置平移到新索引的位置
+    const auto shift = static_cast<int32_t>(firstNode) - static_cast<int32_t>(app.firstNode);
+    for (const auto &node : previous.nodes().subspan(app.firstNode, app.nodeCount)) {
+        nodes_.push_back(MenuIndexNode{
+            node.menuId, appIndex, node.parent < 0 ? -1 : node.parent + shift, intern(previous.string(node.label)),
+            node.depth, node.flags
+        });
+    }
+}
+
+std::expected<MenuIndexBuilder::Stats, Error>
+MenuIndexBuilder::build(const std::string &path, const MenuIndex *previous) {
+    apps_.clear();
+    nodes_.clear();
+    strings_.assign(1, '\0');
+    stringOffsets_.clear();
+
+    StatusNotifierWatcher watcher;
+    if (auto connRes = watcher.connect(); !connRes)
+        return std::unexpected(connRes.error());
+
+    auto maybeAddrs = watcher.getRegisteredAddresses();
+    if (!maybeAddrs)
+        return std::unexpected(maybeAddrs.error());
+
+    // 所有应用的布局依次解码到同一个内存池，每个应用只在池中保留到写入节点为止
+    MenuLayoutArena arena;
+    Stats stats;
+    for (const auto &fullAddr : maybeAddrs.value()) {
+        auto [addr, itemPath] = splitAddress(fullAddr);
+        StatusNotifierItem item(addr, itemPath);
+        if (!item.connect())
+            continue;
+
+        std::string menuPath;
+        ifExpected(item.getMenu(), [&menuPath](const sdbus::ObjectPath &path) { menuPath = path; });
+        if (menuPath.empty())
+            continue;
+
+        DBusMenu dbusMenu(addr, menuPath);
+        if (!dbusMenu.connect())
+            continue;
+
+        // 只取根节点即可拿到当前布局版本，版本未变化时无需获取整个菜单
+        auto head = dbusMenu.getLayoutInto(arena, 0, 0);
+        if (!head)
+            continue;
+        ++stats.appsScanned;
+
+        // NewTitle 不会改变布局版本，复用的应用同样要重新读取 Id 和标题，一次 GetAll 取得两者
+        std::string itemId, title;
+        if (auto properties = item.getAll()) {
+            if (const auto &value = properties->get<SNIProperty::Id>())
+                itemId = *value;
+            if (const auto &value = properties->get<SNIProperty::Title>())
+                title = *value;
+        }
+
+        if (previous) {
+            const MenuIndexApp *reusable = nullptr;
+            for (const auto &app : previous->apps()) {
+                if (previous->string(app.address) == addr && previous->string(app.menuPath) == menuPath &&
+                    app.revision == head->first &&
+                    size_t{app.firstNode} + app.nodeCount <= previous->nodes().size()) {
+                    reusable = &app;
+                    break;
+                }
+            }
+            if (reusable) {
+                copyApp(*previous, *reusable, head->first, itemId, title);
+                ++stats.appsReused;
+                continue;
+            }
+        }
+
+        auto layout = dbusMenu.getLayoutInto(arena, 0, -1);
+        if (!layout)
+            continue;
+
+        const auto appIndex = static_cast<uint32_t>(apps_.size());
+        const auto firstNode = static_cast<uint32_t>(nodes_.size());
+        apps_.push_back(MenuIndexApp{
+            intern(addr), intern(menuPath), intern(itemId), intern(title), layout->first, firstNode, 0
+        });
+        addLayout(*layout->second, appIndex, -1, 0);
+        apps_.back().nodeCount = static_cast<uint32_t>(nodes_.size()) - firstNode;
+    }
+
+    if (auto writeRes = write(path); !writeRes)
+        return std::unexpected(writeRes.error());
+
+    stats.nodesWritten = nodes_.size();
+    return stats;
+}
+
+std::expected<void, Error> MenuIndexBuilder::write(const std::string &path) const {
+    MenuIndexHeader header{};
+    std::memcpy(header.magic, MENU_INDEX_MAGIC, sizeof(MENU_INDEX_MAGIC));
+    header.version = MENU_INDEX_VERSION;
+    header.appCount = static_cast<uint32_t>(apps_.size());
+    header.nodeCount = static_cast<uint32_t>(nodes_.size());
+    header.stringBytes = static_cast<uint32_t>(strings_.size());
+    header.appOffset = static_cast<uint32_t>(alignUp(sizeof(MenuIndexHeader)));
+    header.nodeOffset = static_cast<uint32_t>(alignUp(header.appOffset + apps_.size() * sizeof(MenuIndexApp)));
+    header.stringOffset = static_cast<uint32_t>(alignUp(header.nodeOffset + nodes_.size() * sizeof(MenuIndexNode)));
+
+    std::string buffer(header.stringOffset + strings_.size(), '\0');
+    std::memcpy(buffer.data(), &header, sizeof(header));
+    std::memcpy(buffer.data() + header.appOffset, apps_.data(), apps_.size() * sizeof(MenuIndexApp));
+    std::memcpy(buffer.data() + header.nodeOffset, nodes_.data(), nodes_.size() * sizeof(MenuIndexNode));
+    std::memcpy(buffer.data() + header.stringOffset, strings_.data(), strings_.size());
+
+    // 先写临时文件再 rename，保证读者始终看到完整的索引
+    if (auto slash = path.rfind('/'); slash != std::string::npos && slash > 0)
+        mkdir(path.substr(0, slash).c_str(), 0700);
+
+    return writeFileAtomically(path, buffer);
+}
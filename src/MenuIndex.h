@@ -0,0 +1,129 @@
+//
+// Created by tray-control on 2024/03/02.
+//
+#pragma once
+
+#include <cstdint>
+#include <expected>
+#include <span>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "Errors.h"
+
+struct PmrMenuLayoutItem;
+
+// 扁平化菜单索引文件格式（本机字节序，所有偏移均相对文件起始位置）：
+//   MenuIndexHeader | MenuIndexApp[appCount] | MenuIndexNode[nodeCount] | 字符串表
+// 字符串以 '\0' 结尾，字符串表偏移 0 处固定为空字符串。
+inline constexpr char MENU_INDEX_MAGIC[8] = {'T', 'R', 'A', 'Y', 'I', 'D', 'X', '\0'};
+inline constexpr uint32_t MENU_INDEX_VERSION = 1;
+
+struct MenuIndexHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t appCount;
+    uint32_t nodeCount;
+    uint32_t stringBytes;
+    uint32_t appOffset;
+    uint32_t nodeOffset;
+    uint32_t stringOffset;
+    uint32_t reserved;
+};
+
+// 每个托盘应用一条记录，revision 用于增量刷新
+struct MenuIndexApp {
+    uint32_t address;  // 字符串表偏移：DBus 服务地址
+    uint32_t menuPath; // 字符串表偏移：DBusMenu 对象路径
+    uint32_t itemId;   // 字符串表偏移：StatusNotifierItem 的 Id
+    uint32_t title;    // 字符串表偏移：StatusNotifierItem 的 Title
+    uint32_t revision; // GetLayout 返回的布局版本
+    uint32_t firstNode;
+    uint32_t nodeCount;
+};
+
+// 菜单节点标志位
+enum MenuIndexNodeFlags : uint16_t {
+    MENU_NODE_ENABLED = 1 << 0,
+    MENU_NODE_VISIBLE = 1 << 1,
+    MENU_NODE_SEPARATOR = 1 << 2,
+    MENU_NODE_SUBMENU = 1 << 3,
+    MENU_NODE_CHECKMARK = 1 << 4,
+    MENU_NODE_RADIO = 1 << 5,
+    MENU_NODE_TOGGLED = 1 << 6,
+};
+
+struct MenuIndexNode {
+    int32_t menuId;  // DBusMenu 菜单项 ID
+    uint32_t app;    // 所属应用在应用表中的下标
+    int32_t parent;  // 父节点在节点表中的下标，根节点为 -1
+    uint32_t label;  // 字符串表偏移：菜单项标签
+    uint16_t depth;  // 根节点深度为 0
+    uint16_t flags;  // MenuIndexNodeFlags
+};
+
+static_assert(sizeof(MenuIndexHeader) == 40);
+static_assert(sizeof(MenuIndexApp) == 28);
+static_assert(sizeof(MenuIndexNode) == 20);
+
+// 只读的菜单索引，通过 mmap 映射索引文件
+class MenuIndex {
+  public:
+    MenuIndex() = default;
+    MenuIndex(const MenuIndex &) = delete;
+    MenuIndex &operator=(const MenuIndex &) = delete;
+    MenuIndex(MenuIndex &&other) noexcept;
+    MenuIndex &operator=(MenuIndex &&other) noexcept;
+    ~MenuIndex();
+
+    // 默认索引路径：$XDG_RUNTIME_DIR/tray-control/menu-index；没有 XDG_RUNTIME_DIR 时使用
+    // /tmp/tray-control-<uid>/menu-index，该目录不属于当前用户或其他人可以访问时返回错误
+    static std::expected<std::string, Error> defaultPath();
+
+    // 映射并校验索引文件
+    static std::expected<MenuIndex, Error> open(const std::string &path);
+
+    std::span<const MenuIndexApp> apps() const { return apps_; }
+    std::span<const MenuIndexNode> nodes() const { return nodes_; }
+    std::string_view string(uint32_t offset) const;
+
+    // 以 "父标签 > 子标签" 的形式拼出节点的菜单路径
+    std::string labelPath(uint32_t nodeIndex) const;
+
+  private:
+    void *data_ = nullptr;
+    size_t size_ = 0;
+    std::span<const MenuIndexApp> apps_;
+    std::span<const MenuIndexNode> nodes_;
+    std::string_view strings_;
+};
+
+// 遍历所有已注册托盘项的菜单布局并写出索引文件
+class MenuIndexBuilder {
+  public:
+    struct Stats {
+        size_t appsScanned = 0;
+        size_t appsReused = 0; // revision 未变化、直接复用旧索引的应用数
+        size_t nodesWritten = 0;
+    };
+
+    // previous 不为空时，revision 未变化的应用直接复用旧索引中的节点
+    std::expected<Stats, Error> build(const std::string &path, const MenuIndex *previous = nullptr);
+
+  private:
+    std::vector<MenuIndexApp> apps_;
+    std::vector<MenuIndexNode> nodes_;
+    std::string strings_;
+    std::unordered_map<std::string, uint32_t> stringOffsets_;
+
+    uint32_t intern(std::string_view str);
+    void addLayout(const PmrMenuLayoutItem &item, uint32_t app, int32_t parent, uint16_t depth);
+    // 复制旧索引中版本未变的菜单；Id 和标题的变化不会改变布局版本，使用调用方重新读取的值
+    void copyApp(
+        const MenuIndex &previous, const MenuIndexApp &app, uint32_t revision, std::string_view itemId,
+        std::string_view title
+    );
+    std::expected<void, Error> write(const std::string &path) const;
+};
@@ -0,0 +1,165 @@
+//
+// Created by tray-control on 2024/04/20.
+//
+
+#include "MenuLayoutArena.h"
+#include <sdbus-c++/sdbus-c++.h>
+
+#include <type_traits>
+
+#include "DBusMenu.h"
+
+MenuLayoutArena::MenuLayoutArena(size_t initialBytes) : buffer_(initialBytes) {
+    resource_.emplace(buffer_.data(), buffer_.size(), &upstream_);
+}
+
+void MenuLayoutArena::reset() {
+    // 池中的对象只引用池内存，直接丢弃而不运行析构函数
+    resource_.reset();
+    if (upstream_.bytes > 0) {
+        // monotonic_buffer_resource 按几何级数向上游申请，扩大到两者之和即可容纳上一次的布局
+        buffer_.resize(buffer_.size() + upstream_.bytes);
+    }
+    upstream_.allocations = 0;
+    upstream_.bytes = 0;
+    resource_.emplace(buffer_.data(), buffer_.size(), &upstream_);
+}
+
+PmrMenuLayoutItem *MenuLayoutArena::newRoot() {
+    std::pmr::polymorphic_allocator<> alloc(resource());
+    return alloc.new_object<PmrMenuLayoutItem>();
+}
+
+void *MenuLayoutArena::CountingResource::do_allocate(size_t size, size_t alignment) {
+    ++allocations;
+    bytes += size;
+    return std::pmr::new_delete_resource()->allocate(size, alignment);
+}
+
+void MenuLayoutArena::CountingResource::do_deallocate(void *p, size_t size, size_t alignment) {
+    std::pmr::new_delete_resource()->deallocate(p, size, alignment);
+}
+
+namespace {
+
+bool isMenuPropertySignature(std::string_view signature) {
+    return signature == "b" || signature == "i" || signature == "s" || signature == "ay" || signature == "aas";
+}
+
+// 解码属性值，签名需已通过 isMenuPropertySignature 检查
+void parsePropertyValue(
+    sdbus::Message &message, std::string_view signature, PmrMenuProperty &property, size_t &bytes
+) {
+    auto *resource = property.key.get_allocator().resource();
+    if (signature == "b") {
+        bool value;
+        message >> value;
+        property.value = value;
+        bytes += sizeof(bool);
+    } else if (signature == "i") {
+        int32_t value;
+        message >> value;
+        property.value = value;
+        bytes += sizeof(int32_t);
+    } else if (signature == "s") {
+        char *value = nullptr;
+        message >> value;
+        property.value.emplace<std::pmr::string>(value ? value : "", resource);
+        bytes += std::get<std::pmr::string>(property.value).size() + 5;
+    } else if (signature == "ay") {
+        auto &data = property.value.emplace<std::pmr::vector<uint8_t>>(resource);
+        message >> data;
+        bytes += data.size() + 4;
+    } else if (signature == "aas") {
+        // 快捷键很少出现，经由普通容器解码后再复制进池
+        std::vector<std::vector<std::string>> shortcuts;
+        message >> shortcuts;
+        auto &value = property.value.emplace<std::pmr::vector<std::pmr::vector<std::pmr::string>>>(resource);
+        bytes += 4;
+        for (const auto &keys : shortcuts) {
+            auto &pmrKeys = value.emplace_back();
+            bytes += 4;
+            for (const auto &key : keys) {
+                pmrKeys.emplace_back(key);
+                bytes += key.size() + 5;
+            }
+        }
+    }
+}
+
+} // namespace
+
+void parseMenuLayout(sdbus::Message &message, PmrMenuLayoutItem &item, size_t &bytes) {
+    message.enterStruct("ia{sv}av");
+    message >> item.id;
+    bytes += sizeof(int32_t);
+
+    if (message.enterContainer("{sv}")) {
+        while (message.enterDictEntry("sv")) {
+            char *key = nullptr;
+            message >> key;
+            const char *contents = message.peekType().second;
+
+            if (contents && isMenuPropertySignature(contents)) {
+                auto &property = item.properties.emplace_back();
+                property.key = key ? key : "";
+                message.enterVariant(contents);
+                parsePropertyValue(message, contents, property, bytes);
+                message.exitVariant();
+                bytes += property.key.size() + 8;
+            } else {
+                // 未知类型的属性直接跳过
+                sdbus::Variant ignored;
+                message >> ignored;
+            }
+
+            message.exitDictEntry();
+        }
+        message.clearFlags();
+        message.exitContainer();
+    }
+
+    // 子菜单项是包在变体中的相同结构
+    if (message.enterContainer("v")) {
+        while (message.enterVariant("(ia{sv}av)")) {
+            parseMenuLayout(message, item.children.emplace_back(), bytes);
+            message.exitVariant();
+        }
+        message.clearFlags();
+        message.exitContainer();
+    }
+
+    message.exitStruct();
+}
+
+MenuLayoutItem toMenuLayoutItem(const PmrMenuLayoutItem &item) {
+    MenuLayoutItem result;
+    result.id = item.id;
+    for (const auto &property : item.properties) {
+        std::visit(
+            [&](const auto &value) {
+                using T = std::decay_t<decltype(value)>;
+                if constexpr (std::is_same_v<T, std::pmr::string>) {
+                    result.properties.emplace(std::string(property.key), std::string(value));
+                } else if constexpr (std::is_same_v<T, std::pmr::vector<uint8_t>>) {
+                    result.properties.emplace(
+                        std::string(property.key), IconData(std::span<const uint8_t>(value))
+                    );
+                } else if constexpr (std::is_same_v<T, std::pmr::vector<std::pmr::vector<std::pmr::string>>>) {
+                    std::vector<std::vector<std::string>> shortcuts;
+                    for (const auto &keys : value)
+                        shortcuts.emplace_back(keys.begin(), keys.end());
+                    result.properties.emplace(std::string(property.key), std::move(shortcuts));
+                } else {
+                    result.properties.emplace(std::string(property.key), value);
+                }
+            },
+            property.value
+        );
+    }
+
+    result.children.reserve(item.children.size());
+    for (const auto &child : item.children)
+        result.children.push_back(toMenuLayoutItem(child));
+    return result;
+}
@@ -0,0 +1,109 @@
+//
+// Created by tray-control on 2024/04/20.
+//
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory_resource>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <variant>
+#include <vector>
+
+namespace sdbus {
+class Message;
+}
+
+struct MenuLayoutItem;
+
+// 与 MenuPropertyMap 的值类型一一对应，字符串和数组都从所在布局的内存资源分配
+using PmrMenuPropertyValue = std::variant<
+    bool, int32_t, std::pmr::string, std::pmr::vector<uint8_t>, std::pmr::vector<std::pmr::vector<std::pmr::string>>>;
+
+struct PmrMenuProperty {
+    using allocator_type = std::pmr::polymorphic_allocator<>;
+
+    std::pmr::string key;
+    PmrMenuPropertyValue value;
+
+    explicit PmrMenuProperty(allocator_type alloc = {}) : key(alloc) {}
+    PmrMenuProperty(const PmrMenuProperty &other, allocator_type alloc) : key(other.key, alloc), value(other.value) {}
+    PmrMenuProperty(PmrMenuProperty &&other, allocator_type alloc)
+        : key(std::move(other.key), alloc), value(std::move(other.value)) {}
+};
+
+// 可使用分配器的菜单布局项。属性按服务端返回的顺序平铺存放，菜单项的属性很少，线性查找比 map 更快
+struct PmrMenuLayoutItem {
+    using allocator_type = std::pmr::polymorphic_allocator<>;
+
+    int32_t id = 0;
+    std::pmr::vector<PmrMenuProperty> properties;
+    std::pmr::vector<PmrMenuLayoutItem> children;
+
+    explicit PmrMenuLayoutItem(allocator_type alloc = {}) : properties(alloc), children(alloc) {}
+    PmrMenuLayoutItem(const PmrMenuLayoutItem &other, allocator_type alloc)
+        : id(other.id), properties(other.properties, alloc), children(other.children, alloc) {}
+    PmrMenuLayoutItem(PmrMenuLayoutItem &&other, allocator_type alloc)
+        : id(other.id), properties(std::move(other.properties), alloc), children(std::move(other.children), alloc) {}
+
+    const PmrMenuPropertyValue *find(std::string_view key) const {
+        for (const auto &property : properties) {
+            if (property.key == key)
+                return &property.value;
+        }
+        return nullptr;
+    }
+
+    template <typename T> const T *get(std::string_view key) const {
+        const auto *value = find(key);
+        return value ? std::get_if<T>(value) : nullptr;
+    }
+};
+
+// 菜单布局的单调内存池。一次 GetLayout 的整棵树都分配在池内，reset 时整体丢弃：
+// 不调用析构函数、不逐个释放节点，初始缓冲区在多次解析之间复用，
+// 某次解析溢出到上游时，下一次 reset 会把缓冲区扩大到足以容纳它
+class MenuLayoutArena {
+  public:
+    explicit MenuLayoutArena(size_t initialBytes = 64 * 1024);
+
+    MenuLayoutArena(const MenuLayoutArena &) = delete;
+    MenuLayoutArena &operator=(const MenuLayoutArena &) = delete;
+
+    std::pmr::memory_resource *resource() { return &*resource_; }
+
+    // 使之前解析出的布局全部失效
+    void reset();
+
+    // 在池中创建一个空的根节点，生命周期到下一次 reset 为止
+    PmrMenuLayoutItem *newRoot();
+
+    size_t capacity() const { return buffer_.size(); }
+    // 自上次 reset 以来向上游申请的次数和字节数，缓冲区足够时均为 0
+    size_t upstreamAllocations() const { return upstream_.allocations; }
+    size_t upstreamBytes() const { return upstream_.bytes; }
+
+  private:
+    // 统计溢出到全局堆的分配
+    struct CountingResource : std::pmr::memory_resource {
+        size_t allocations = 0;
+        size_t bytes = 0;
+
+        void *do_allocate(size_t size, size_t alignment) override;
+        void do_deallocate(void *p, size_t size, size_t alignment) override;
+        bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override { return this == &other; }
+    };
+
+    std::vector<std::byte> buffer_;
+    CountingResource upstream_;
+    std::optional<std::pmr::monotonic_buffer_resource> resource_;
+};
+
+// 从消息的当前位置解码一个 (ia{sv}av) 布局项到 item（item 的分配器决定内存来源），
+// 字符串直接从消息复制到池中，不经过 sdbus::Variant 和 std::map。bytes 累加解码出的负载大小
+void parseMenuLayout(sdbus::Message &message, PmrMenuLayoutItem &item, size_t &bytes);
+
+// 转换为普通的 MenuLayoutItem，供需要长期保存布局的调用方使用
+MenuLayoutItem toMenuLayoutItem(const PmrMenuLayoutItem &item);
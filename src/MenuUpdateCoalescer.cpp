@@ -0,0 +1,190 @@
+//
+// Created by tray-control on 2024/03/09.
+//
+
+#include "MenuUpdateCoalescer.h"
+
+#include <algorithm>
+
+MenuUpdateCoalescer::MenuUpdateCoalescer(std::chrono::milliseconds window, FlushHandler handler)
+    : window_(window), handler_(std::move(handler)), thread_([this] { run(); }) {}
+
+MenuUpdateCoalescer::~MenuUpdateCoalescer() {
+    {
+        std::lock_guard lock(mutex_);
+        stopping_ = true;
+    }
+    cv_.notify_all();
+    thread_.join();
+}
+
+void MenuUpdateCoalescer::addProperties(
+    const std::vector<MenuItem> &updated, const std::vector<std::pair<int32_t, std::vector<std::string>>> &removed
+) {
+    std::lock_guard lock(mutex_);
+    // 后到的值覆盖先到的值；同一属性先更新后移除，以最后一次为准
+    for (const auto &item : updated) {
+        auto &merged = properties_[item.id];
+        auto removedIt = removed_.find(item.id);
+        for (const auto &[key, value] : item.properties) {
+            merged.insert_or_assign(key, value);
+            if (removedIt != removed_.end())
+                removedIt->second.erase(key);
+        }
+    }
+    for (const auto &[id, keys] : removed) {
+        auto mergedIt = properties_.find(id);
+        auto &mergedRemoved = removed_[id];
+        for (const auto &key : keys) {
+            if (mergedIt != properties_.end())
+                mergedIt->second.erase(key);
+            mergedRemoved.insert(key);
+        }
+    }
+    ++signalsMerged_;
+    schedule();
+}
+
+void MenuUpdateCoalescer::addLayout(uint32_t revision, int32_t parent) {
+    std::lock_guard lock(mutex_);
+    if (layoutRevision_) {
+        layoutRevision_ = std::max(*layoutRevision_, revision);
+        layoutParent_ = commonParent(layoutParent_, parent);
+    } else {
+        layoutRevision_ = revision;
+        layoutParent_ = parent;
+    }
+    ++signalsMerged_;
+    schedule();
+}
+
+template <typename Item> void MenuUpdateCoalescer::recordParentsOf(const Item &root) {
+    std::lock_guard lock(mutex_);
+    forgetDescendants(root.id);
+    std::vector<const Item *> stack{&root};
+    while (!stack.empty()) {
+        const auto *item = stack.back();
+        stack.pop_back();
+        for (const auto &child : item->children) {
+            parentOf_[child.id] = item->id;
+            stack.push_back(&child);
+        }
+    }
+}
+
+// 调用方需持有 mutex_。子树重新获取之后，其中已被移除或移到别处的菜单项不能保留旧的父节点，
+// 否则 commonParent 可能返回过时的祖先；移到未重新获取的子树中的菜单项暂时按未知处理，退回到根节点
+void MenuUpdateCoalescer::forgetDescendants(int32_t root) {
+    if (root == 0) {
+        parentOf_.clear();
+        return;
+    }
+
+    std::multimap<int32_t, int32_t> childrenOf;
+    for (const auto &[child, parent] : parentOf_)
+        childrenOf.emplace(parent, child);
+    std::vector<int32_t> pending{root};
+    while (!pending.empty()) {
+        const int32_t id = pending.back();
+        pending.pop_back();
+        auto [begin, end] = childrenOf.equal_range(id);
+        for (auto it = begin; it != end; ++it) {
+            // 只展开第一次删除的菜单项，过时的记录即使构成环也能结束
+            if (parentOf_.erase(it->second) > 0)
+                pending.push_back(it->second);
+        }
+    }
+}
+
+void MenuUpdateCoalescer::recordParents(const MenuLayoutItem &root) { recordParentsOf(root); }
+
+void MenuUpdateCoalescer::recordParents(const PmrMenuLayoutItem &root) { recordParentsOf(root); }
+
+void MenuUpdateCoalescer::flushNow() {
+    MenuUpdateBatch batch;
+    {
+        std::lock_guard lock(mutex_);
+        if (!deadline_)
+            return;
+        batch = takeBatch();
+    }
+    handler_(std::move(batch));
+}
+
+// 调用方需持有 mutex_
+void MenuUpdateCoalescer::schedule() {
+    if (!deadline_) {
+        deadline_ = std::chrono::steady_clock::now() + window_;
+        cv_.notify_all();
+    }
+}
+
+// 调用方需持有 mutex_；父子关系未知时退回到根节点 0
+int32_t MenuUpdateCoalescer::commonParent(int32_t a, int32_t b) const {
+    std::set<int32_t> ancestors;
+    for (int32_t id = a;;) {
+        ancestors.insert(id);
+        auto it = parentOf_.find(id);
+        if (it == parentOf_.end() || ancestors.contains(it->second))
+            break;
+        id = it->second;
+    }
+
+    std::set<int32_t> visited;
+    for (int32_t id = b; visited.insert(id).second;) {
+        if (ancestors.contains(id))
+            return id;
+        auto it = parentOf_.find(id);
+        if (it == parentOf_.end())
+            break;
+        id = it->second;
+    }
+    return 0;
+}
+
+// 调用方需持有 mutex_
+MenuUpdateBatch MenuUpdateCoalescer::takeBatch() {
+    MenuUpdateBatch batch;
+    for (auto &[id, properties] : properties_) {
+        if (!properties.empty())
+            batch.updated.push_back(MenuItem{id, std::move(properties)});
+    }
+    for (auto &[id, keys] : removed_) {
+        if (!keys.empty())
+            batch.removed.emplace_back(id, std::vector<std::string>(keys.begin(), keys.end()));
+    }
+    batch.layoutRevision = layoutRevision_;
+    batch.layoutParent = layoutParent_;
+    batch.signalsMerged = signalsMerged_;
+
+    properties_.clear();
+    removed_.clear();
+    layoutRevision_.reset();
+    layoutParent_ = 0;
+    signalsMerged_ = 0;
+    deadline_.reset();
+    return batch;
+}
+
+void MenuUpdateCoalescer::run() {
+    std::unique_lock lock(mutex_);
+    while (!stopping_) {
+        if (!deadline_) {
+            cv_.wait(lock, [this] { return stopping_ || deadline_; });
+            continue;
+        }
+
+        const auto deadline = *deadline_;
+        if (cv_.wait_until(lock, deadline, [this] { return stopping_; }))
+            break;
+
+        // 等待期间可能已被 flushNow 取走，或开始了新的一批
+        if (!deadline_ || *deadline_ > std::chrono::steady_clock::now())
+            continue;
+
+        MenuUpdateBatch batch = takeBatch();
+        lock.unlock();
+        handler_(std::move(batch));
+        lock.lock();
+    }
+}
@@ -0,0 +1,84 @@
+//
+// Created by tray-control on 2024/03/09.
+//
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "DBusMenu.h"
+#include "MenuLayoutArena.h"
+
+// 一个合并窗口内累积的菜单更新
+struct MenuUpdateBatch {
+    // 按 id 合并后的属性变化；开启 refreshDirty 时为一次 GetGroupProperties 的结果
+    std::vector<MenuItem> updated;
+    // 按 id 合并后被移除的属性
+    std::vector<std::pair<int32_t, std::vector<std::string>>> removed;
+    // 窗口内收到的最高布局版本，以及所有 LayoutUpdated 父节点的最低公共祖先
+    std::optional<uint32_t> layoutRevision;
+    int32_t layoutParent = 0;
+    // 本批次合并的信号数量
+    size_t signalsMerged = 0;
+};
+
+// 合并 ItemsPropertiesUpdated/LayoutUpdated 信号，在窗口结束时一次性交给处理函数。
+// 窗口从一批中的第一个信号开始计时，持续不断的信号流也会按窗口周期被刷新。
+class MenuUpdateCoalescer {
+  public:
+    using FlushHandler = std::function<void(MenuUpdateBatch &&)>;
+
+    MenuUpdateCoalescer(std::chrono::milliseconds window, FlushHandler handler);
+    ~MenuUpdateCoalescer();
+
+    MenuUpdateCoalescer(const MenuUpdateCoalescer &) = delete;
+    MenuUpdateCoalescer &operator=(const MenuUpdateCoalescer &) = delete;
+
+    // 合并一次 ItemsPropertiesUpdated
+    void addProperties(
+        const std::vector<MenuItem> &updated, const std::vector<std::pair<int32_t, std::vector<std::string>>> &removed
+    );
+
+    // 合并一次 LayoutUpdated
+    void addLayout(uint32_t revision, int32_t parent);
+
+    // 记录布局中的父子关系，用于计算最低公共父节点。root 以下原有的记录先被丢弃，传入根节点 0 时重建全部记录
+    void recordParents(const MenuLayoutItem &root);
+    void recordParents(const PmrMenuLayoutItem &root);
+
+    // 立即刷新当前累积的更新（在调用线程上执行处理函数）
+    void flushNow();
+
+  private:
+    std::chrono::milliseconds window_;
+    FlushHandler handler_;
+
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    bool stopping_ = false;
+    std::optional<std::chrono::steady_clock::time_point> deadline_;
+
+    std::map<int32_t, MenuPropertyMap> properties_;
+    std::map<int32_t, std::set<std::string>> removed_;
+    std::optional<uint32_t> layoutRevision_;
+    int32_t layoutParent_ = 0;
+    size_t signalsMerged_ = 0;
+    std::map<int32_t, int32_t> parentOf_;
+
+    std::thread thread_;
+
+    void schedule();
+    template <typename Item> void recordParentsOf(const Item &root);
+    void forgetDescendants(int32_t root);
+    int32_t commonParent(int32_t a, int32_t b) const;
+    MenuUpdateBatch takeBatch();
+    void run();
+};
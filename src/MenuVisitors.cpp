@@ -0,0 +1,154 @@
+//
+// Created by tray-control on 2024/04/27.
+//
+
+#include "MenuVisitors.h"
+#include "IconStore.h"
+#include "MemStats.h"
+
+#include <algorithm>
+#include <ranges>
+#include <fmt/printf.h>
+
+std::string stripMnemonic(std::string_view label) {
+    std::string res;
+    for (size_t i = 0; i < label.size(); ++i) {
+        if (label[i] == '_') {
+            if (i + 1 < label.size() && label[i + 1] == '_') {
+                res += '_';
+                ++i;
+            }
+            continue;
+        }
+        res += label[i];
+    }
+    return res;
+}
+
+std::vector<std::string> splitLabelPath(std::string_view path) {
+    std::vector<std::string> parts;
+    for (auto part : std::views::split(path, '>')) {
+        std::string_view sv(part.begin(), part.end());
+        const auto begin = sv.find_first_not_of(" \t");
+        const auto end = sv.find_last_not_of(" \t");
+        parts.emplace_back(begin == std::string_view::npos ? std::string_view{} : sv.substr(begin, end - begin + 1));
+    }
+    return parts;
+}
+
+MenuLayoutVisitor menuItemFinder(const std::vector<int32_t> &targetIds, std::vector<int32_t> &foundIds) {
+    MenuLayoutVisitor visitor;
+    visitor.enter = [&targetIds, &foundIds](const MenuNodeView &node) {
+        if (std::ranges::find(targetIds, node.id) != targetIds.end() &&
+            std::ranges::find(foundIds, node.id) == foundIds.end()) {
+            foundIds.push_back(node.id);
+            if (foundIds.size() == targetIds.size()) {
+                return MenuVisitAction::Stop;
+            }
+        }
+        return MenuVisitAction::Continue;
+    };
+    return visitor;
+}
+
+MenuLayoutVisitor menuLabelFinder(
+    const std::vector<std::string> &labelPath, std::vector<std::string> &ancestors, int32_t &foundId
+) {
+    MenuLayoutVisitor visitor;
+    visitor.enter = [&labelPath, &ancestors, &foundId](const MenuNodeView &node) {
+        if (node.depth == 0) {
+            return MenuVisitAction::Continue;
+        }
+        if (const auto *type = node.get<std::string_view>("type"); type && *type == "separator") {
+            return MenuVisitAction::SkipChildren;
+        }
+
+        const auto *label = node.get<std::string_view>("label");
+        ancestors.push_back(label ? stripMnemonic(*label) : std::string());
+        if (ancestors.size() >= labelPath.size() &&
+            std::equal(labelPath.begin(), labelPath.end(), ancestors.end() - labelPath.size())) {
+            foundId = node.id;
+            return MenuVisitAction::Stop;
+        }
+        return MenuVisitAction::Continue;
+    };
+    visitor.leave = [&ancestors](int32_t, int depth) {
+        // 分隔符没有压入标签
+        if (depth > 0 && ancestors.size() == static_cast<size_t>(depth)) {
+            ancestors.pop_back();
+        }
+        return MenuVisitAction::Continue;
+    };
+    return visitor;
+}
+
+MenuLayoutVisitor menuPrinter(std::FILE *out, IconCache *icons) {
+    MenuLayoutVisitor visitor;
+    visitor.enter = [out, icons](const MenuNodeView &node) {
+        MemPhaseScope memPhase(MemPhase::Output);
+        // 打印缩进和菜单项ID
+        for (int i = 0; i < node.depth; ++i) {
+            std::fputs("  ", out);
+        }
+        fmt::fprintf(out, "ID: %d", node.id);
+
+        // 打印菜单项属性
+        for (const auto &[key, value] : node.properties) {
+            std::visit(
+                [out, icons, &key](const auto &arg) {
+                    using T = std::decay_t<decltype(arg)>;
+                    if constexpr (std::is_same_v<T, std::string_view>) {
+                        fmt::fprintf(out, ", %s: %s", key, arg);
+                    } else if constexpr (std::is_same_v<T, bool>) {
+                        fmt::fprintf(out, ", %s: %s", key, arg ? "true" : "false");
+                    } else if constexpr (std::is_same_v<T, int32_t>) {
+                        fmt::fprintf(out, ", %s: %d", key, arg);
+                    } else if constexpr (std::is_same_v<T, std::span<const uint8_t>>) {
+                        if (!icons) {
+                            return;
+                        }
+                        if (auto path = icons->store(arg)) {
+                            fmt::fprintf(out, ", %s: %s", key, path->string());
+                        } else {
+                            fmt::fprintf(out, ", %s: (%d bytes, %s)", key, arg.size(), path.error().show());
+                        }
+                    }
+                },
+                value
+            );
+        }
+
+        std::fputc('\n', out);
+        return MenuVisitAction::Continue;
+    };
+    return visitor;
+}
+
+MenuLayoutVisitor menuItemInfoBuilder(std::vector<MenuItemInfo> &menuItems, std::vector<int> &parents) {
+    MenuLayoutVisitor visitor;
+    visitor.enter = [&menuItems, &parents](const MenuNodeView &node) {
+        MenuItemInfo info;
+        info.id = node.id;
+        info.depth = node.depth;
+        info.parentIndex = node.depth > 0 ? parents[node.depth - 1] : -1;
+
+        // 获取标签
+        const auto *label = node.get<std::string_view>("label");
+        info.label = label ? std::string(*label) : "(无标签)";
+
+        // 获取启用状态
+        const bool *enabled = node.get<bool>("enabled");
+        info.enabled = !enabled || *enabled;
+
+        // 检查是否为分隔符
+        const auto *type = node.get<std::string_view>("type");
+        info.isSeparator = type && *type == "separator";
+
+        // 添加到菜单项列表
+        menuItems.push_back(std::move(info));
+        parents.resize(node.depth);
+        parents.push_back(static_cast<int>(menuItems.size()) - 1);
+        return MenuVisitAction::Continue;
+    };
+    return visitor;
+}
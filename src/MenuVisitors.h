@@ -0,0 +1,47 @@
+//
+// Created by tray-control on 2024/04/27.
+//
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "DBusMenu.h"
+
+class IconCache;
+
+// 去掉标签中的助记符下划线，"__" 表示字面下划线
+std::string stripMnemonic(std::string_view label);
+
+// 将 "父菜单 > 子菜单" 拆分为去掉首尾空白的各级标签
+std::vector<std::string> splitLabelPath(std::string_view path);
+
+// 下面的访问者以引用方式保存参数，调用方需保证它们在遍历期间有效
+
+// 查找 ID 在 targetIds 中的菜单项，找到的 ID 追加到 foundIds，全部找到后停止遍历
+MenuLayoutVisitor menuItemFinder(const std::vector<int32_t> &targetIds, std::vector<int32_t> &foundIds);
+
+// 查找标签路径以 labelPath 结尾的菜单项，找到后停止遍历；分隔符及其子树被跳过。
+// ancestors 为从根到当前节点的标签，根节点本身不参与匹配
+MenuLayoutVisitor menuLabelFinder(
+    const std::vector<std::string> &labelPath, std::vector<std::string> &ancestors, int32_t &foundId
+);
+
+// 逐项打印菜单到 out，按深度缩进。字节数组（icon-data）只在给出 icons 时打印，内容存入 icons 后打印文件路径
+MenuLayoutVisitor menuPrinter(std::FILE *out, IconCache *icons = nullptr);
+
+// tray-navigate 中展示的菜单项
+struct MenuItemInfo {
+    int32_t id;
+    std::string label;
+    bool enabled;
+    bool isSeparator;
+    int depth;       // 菜单项深度
+    int parentIndex; // 父菜单项在列表中的下标，根节点为 -1
+};
+
+// 在遍历布局的同时构建扁平的菜单项列表，parents[depth] 为该层最近一个菜单项的下标
+MenuLayoutVisitor menuItemInfoBuilder(std::vector<MenuItemInfo> &menuItems, std::vector<int> &parents);
@@ -0,0 +1,95 @@
+//
+// Created by tray-control on 2024/05/11.
+//
+
+#include "ProxyPool.h"
+
+#include <algorithm>
+#include <mutex>
+#include <sdbus-c++/sdbus-c++.h>
+
+#include "SessionBus.h"
+
+ProxyPool::ProxyPool(std::string service, std::string path, std::string bus)
+    : service_(std::move(service)), path_(std::move(path)), bus_(std::move(bus)),
+      threads_(std::make_shared<Threads>()) {}
+
+ProxyPool::~ProxyPool() = default;
+
+void ProxyPool::reset(std::unique_ptr<sdbus::IProxy> primary) {
+    std::lock_guard lock(threads_->mutex);
+    threads_->proxies.clear();
+    primary_ = std::move(primary);
+    owner_ = std::this_thread::get_id();
+}
+
+void ProxyPool::Threads::release(std::thread::id thread) {
+    // 关闭连接可能要刷新缓冲区，在锁外析构
+    std::unique_ptr<sdbus::IProxy> released;
+    std::lock_guard lock(mutex);
+    auto it = std::ranges::find(proxies, thread, &decltype(proxies)::value_type::first);
+    if (it == proxies.end())
+        return;
+    released = std::move(it->second);
+    proxies.erase(it);
+}
+
+void ProxyPool::releaseOnExit(std::weak_ptr<Threads> threads) {
+    // 每个线程一份，记录它在哪些池中创建过代理，线程退出时析构
+    struct Registry {
+        std::vector<std::weak_ptr<Threads>> pools;
+
+        ~Registry() {
+            for (const auto &pool : pools) {
+                if (auto alive = pool.lock())
+                    alive->release(std::this_thread::get_id());
+            }
+        }
+    };
+    thread_local Registry registry;
+
+    // 已经析构的池不必再记录，长期存活的线程不会因为池反复创建而无限增长
+    std::erase_if(registry.pools, [](const auto &pool) { return pool.expired(); });
+    // reset 之后同一个线程会在同一个池里重新创建代理，只登记一次
+    const auto samePool = [&threads](const auto &pool) {
+        return !pool.owner_before(threads) && !threads.owner_before(pool);
+    };
+    if (std::ranges::none_of(registry.pools, samePool))
+        registry.pools.push_back(std::move(threads));
+}
+
+sdbus::IProxy *ProxyPool::get() {
+    if (!primary_)
+        return nullptr;
+
+    const auto self = std::this_thread::get_id();
+    if (shared_ || self == owner_)
+        return primary_.get();
+
+    {
+        std::shared_lock lock(threads_->mutex);
+        for (const auto &[thread, proxy] : threads_->proxies) {
+            if (thread == self)
+                return proxy.get();
+        }
+    }
+
+    // 只有当前线程会插入自己的代理，建立连接时不需要持有锁
+    std::unique_ptr<sdbus::IProxy> proxy;
+    try {
+        proxy = sdbus::createProxy(
+            connectSessionBus(bus_), sdbus::ServiceName{service_}, sdbus::ObjectPath{path_},
+            sdbus::dont_run_event_loop_thread
+        );
+    } catch (const sdbus::Error &) {
+        return nullptr;
+    }
+    releaseOnExit(threads_);
+    std::lock_guard lock(threads_->mutex);
+    return threads_->proxies.emplace_back(self, std::move(proxy)).second.get();
+}
+
+size_t ProxyPool::threadProxies() const {
+    std::shared_lock lock(threads_->mutex);
+    return threads_->proxies.size();
+}
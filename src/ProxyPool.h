@@ -0,0 +1,65 @@
+//
+// Created by tray-control on 2024/05/11.
+//
+#pragma once
+
+#include <memory>
+#include <shared_mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace sdbus {
+class IProxy;
+}
+
+// 按线程分配的方法调用代理。sd-bus 的连接不能被多个线程同时使用，共享一个代理只能整体串行。
+// 调用 reset 的线程直接使用主代理（它同时负责信号订阅），其余线程第一次调用时各自创建一条
+// 不带事件循环线程的连接和代理，之后在读锁下查找，互不等待。
+// 线程退出时释放它在所有仍然存在的池中的代理，池中的代理数不超过同时存活的线程数
+class ProxyPool {
+  public:
+    // bus 为线程代理连接的会话总线地址，空表示默认会话总线，应与主代理一致
+    ProxyPool(std::string service, std::string path, std::string bus = {});
+    ~ProxyPool();
+
+    ProxyPool(const ProxyPool &) = delete;
+    ProxyPool &operator=(const ProxyPool &) = delete;
+
+    // 替换主代理并丢弃所有线程的代理，调用线程成为主代理的使用者；不能与 get() 并发调用
+    void reset(std::unique_ptr<sdbus::IProxy> primary);
+
+    // 用于订阅信号的主代理，未连接时为 nullptr
+    sdbus::IProxy *primary() const { return primary_.get(); }
+
+    // shared 为 true 时所有线程都使用主代理，调用在主代理的连接上排队，用于和按线程分配对比；
+    // 不能与 get() 并发调用
+    void setShared(bool shared) { shared_ = shared; }
+
+    // 当前线程使用的代理，未连接或为当前线程建立连接失败时为 nullptr
+    sdbus::IProxy *get();
+
+    // 除主代理外已经创建的线程代理数
+    size_t threadProxies() const;
+
+  private:
+    std::string service_;
+    std::string path_;
+    std::string bus_;
+    std::unique_ptr<sdbus::IProxy> primary_;
+    std::thread::id owner_;
+    bool shared_ = false;
+
+    // 线程代理放在共享状态里，线程退出时池可能已经析构
+    struct Threads {
+        mutable std::shared_mutex mutex;
+        std::vector<std::pair<std::thread::id, std::unique_ptr<sdbus::IProxy>>> proxies;
+
+        void release(std::thread::id thread);
+    };
+    std::shared_ptr<Threads> threads_;
+
+    // 登记当前线程在 threads 中有代理，线程退出时释放
+    static void releaseOnExit(std::weak_ptr<Threads> threads);
+};
@@ -0,0 +1,121 @@
+//
+// Created by tray-control on 2024/06/01.
+//
+
+#include "SessionBus.h"
+
+#include <algorithm>
+#include <charconv>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <sdbus-c++/sdbus-c++.h>
+#include <systemd/sd-bus.h>
+#include <unordered_set>
+#include <utility>
+
+#include "SignalMatch.h"
+
+namespace {
+
+// 连接读到的每个信号都经过过滤器，无论之后是否有匹配的处理函数，因此这里计数的就是进程实际被唤醒的次数
+int countIncomingSignal(sd_bus_message *message, void *, sd_bus_error *) {
+    if (sd_bus_message_is_signal(message, nullptr, nullptr) > 0 &&
+        sd_bus_message_is_signal(message, "org.freedesktop.DBus.Local", nullptr) <= 0)
+        countSignalReceived();
+    return 0;
+}
+
+// 地址为空时按 DBUS_SESSION_BUS_ADDRESS、XDG_RUNTIME_DIR 的顺序确定默认会话总线
+std::expected<std::string, Error> resolveAddress(const std::string &address) {
+    if (!address.empty())
+        return address;
+    if (const char *env = std::getenv("DBUS_SESSION_BUS_ADDRESS"); env && *env)
+        return std::string(env);
+    if (const char *runtime = std::getenv("XDG_RUNTIME_DIR"); runtime && *runtime)
+        return std::string("unix:path=") + runtime + "/bus";
+    return makeError(ErrorKind::ConnectionError, "No session bus address");
+}
+
+// 本进程打开过的连接，键为"地址\n唯一名"：不同总线上的唯一名可能相同。
+// 录制器据此认出发送者，不依赖连接在处理消息时仍然存在
+std::mutex ownNamesMutex;
+std::unordered_set<std::string> ownNames;
+
+std::string ownNameKey(const std::string &address, const char *name) { return address + '\n' + name; }
+
+} // namespace
+
+std::unique_ptr<sdbus::IConnection> connectSessionBus(const std::string &address) {
+    // 自己打开 sd-bus 连接再交给 sdbus-c++，才能在上面安装消息过滤器
+    auto bus = openSdBus(address);
+    if (!bus)
+        throw sdbus::Error(sdbus::Error::Name{"org.freedesktop.DBus.Error.Failed"}, std::string(bus.error().msg.view()));
+    sd_bus_add_filter(*bus, nullptr, countIncomingSignal, nullptr);
+    return sdbus::createBusConnection(*bus);
+}
+
+std::expected<sd_bus *, Error> openSdBus(const std::string &address, bool monitor) {
+    auto resolvedAddress = resolveAddress(address);
+    if (!resolvedAddress)
+        return std::unexpected(resolvedAddress.error());
+    const std::string &resolved = *resolvedAddress;
+
+    sd_bus *bus = nullptr;
+    int r = sd_bus_new(&bus);
+    if (r >= 0 && monitor)
+        r = sd_bus_set_monitor(bus, 1);
+    if (r >= 0)
+        r = sd_bus_set_address(bus, resolved.c_str());
+    if (r >= 0)
+        r = sd_bus_set_bus_client(bus, 1);
+    if (r >= 0)
+        r = sd_bus_start(bus);
+    // 等待 Hello 的回复取得唯一名；monitor 连接不发送调用，不需要登记
+    const char *unique = nullptr;
+    if (r >= 0 && !monitor)
+        r = sd_bus_get_unique_name(bus, &unique);
+    if (r < 0) {
+        sd_bus_unref(bus);
+        return makeError(ErrorKind::ConnectionError, "Could not connect to " + resolved + ": " + std::strerror(-r));
+    }
+    if (unique) {
+        std::lock_guard lock(ownNamesMutex);
+        ownNames.insert(ownNameKey(resolved, unique));
+    }
+    return bus;
+}
+
+bool isOwnUniqueName(const std::string &address, const std::string &name) {
+    auto resolved = resolveAddress(address);
+    if (!resolved)
+        return false;
+    std::lock_guard lock(ownNamesMutex);
+    return ownNames.contains(ownNameKey(*resolved, name.c_str()));
+}
+
+std::vector<std::string> userSessionBuses(const std::filesystem::path &runtimeRoot) {
+    std::vector<std::pair<uint32_t, std::string>> buses;
+    std::error_code ec;
+    std::filesystem::directory_iterator it(runtimeRoot, ec);
+    for (; !ec && it != std::filesystem::directory_iterator(); it.increment(ec)) {
+        // 只考虑以 uid 命名的目录
+        const auto name = it->path().filename().string();
+        uint32_t uid = 0;
+        const auto [end, parseEc] = std::from_chars(name.data(), name.data() + name.size(), uid);
+        if (parseEc != std::errc() || end != name.data() + name.size())
+            continue;
+
+        std::error_code statEc;
+        const auto socket = it->path() / "bus";
+        if (std::filesystem::is_socket(socket, statEc))
+            buses.emplace_back(uid, "unix:path=" + socket.string());
+    }
+
+    std::ranges::sort(buses);
+    std::vector<std::string> addresses;
+    addresses.reserve(buses.size());
+    for (auto &[uid, address] : buses)
+        addresses.push_back(std::move(address));
+    return addresses;
+}
@@ -0,0 +1,35 @@
+//
+// Created by tray-control on 2024/06/01.
+//
+#pragma once
+
+#include <expected>
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "Errors.h"
+
+namespace sdbus {
+class IConnection;
+}
+
+struct sd_bus;
+
+// 连接会话总线。address 为空时使用默认会话总线（DBUS_SESSION_BUS_ADDRESS），
+// 否则连接给定的地址，例如 unix:path=/run/user/1000/bus。连接收到的信号计入 signalStats().received。
+// 失败时抛出 sdbus::Error
+std::unique_ptr<sdbus::IConnection> connectSessionBus(const std::string &address);
+
+// 与 connectSessionBus 相同的地址规则，返回 sd-bus 的底层连接，用于 sdbus-c++ 没有提供的功能（monitor、消息过滤器）。
+// monitor 为真时连接以 monitor 方式打开，之后只能调用一次 BecomeMonitor。调用方负责 sd_bus_flush_close_unref
+std::expected<sd_bus *, Error> openSdBus(const std::string &address, bool monitor = false);
+
+// name 是否为本进程经 openSdBus/connectSessionBus 在 address（规则同上）上打开的连接的唯一名。
+// 连接关闭之后仍然返回 true，总线不会重用唯一名
+bool isOwnUniqueName(const std::string &address, const std::string &name);
+
+// 本机每个已登录用户的会话总线：runtimeRoot/<uid>/bus 存在的套接字，按 uid 排序，返回 unix:path= 形式的地址。
+// 连接其他用户的会话总线需要以该用户或 root 身份运行
+std::vector<std::string> userSessionBuses(const std::filesystem::path &runtimeRoot = "/run/user");
@@ -0,0 +1,135 @@
+//
+// Created by tray-control on 2024/04/13.
+//
+
+#include "SignalMatch.h"
+#include <sdbus-c++/sdbus-c++.h>
+
+#include <atomic>
+
+#include "DBusUtils.h"
+
+namespace {
+std::atomic<uint64_t> receivedSignals{0};
+std::atomic<uint64_t> dispatchedSignals{0};
+
+// 匹配规则中的值用单引号包围，单引号本身需写成 '\''
+void appendRuleField(std::string &rule, std::string_view key, std::string_view value) {
+    if (value.empty())
+        return;
+
+    rule += ',';
+    rule += key;
+    rule += "='";
+    for (char c : value) {
+        if (c == '\'')
+            rule += "'\\''";
+        else
+            rule += c;
+    }
+    rule += '\'';
+}
+} // namespace
+
+SignalStats signalStats() {
+    return SignalStats{receivedSignals.load(std::memory_order_relaxed), dispatchedSignals.load(std::memory_order_relaxed)};
+}
+
+void countSignalReceived() { receivedSignals.fetch_add(1, std::memory_order_relaxed); }
+
+void countSignalDispatched() { dispatchedSignals.fetch_add(1, std::memory_order_relaxed); }
+
+std::string makeSignalMatchRule(
+    std::string_view sender, std::string_view path, std::string_view interface, std::string_view member,
+    std::string_view arg0
+) {
+    std::string rule = "type='signal'";
+    appendRuleField(rule, "sender", sender);
+    appendRuleField(rule, "path", path);
+    appendRuleField(rule, "interface", interface);
+    appendRuleField(rule, "member", member);
+    appendRuleField(rule, "arg0", arg0);
+    return rule;
+}
+
+NameOwnerWatcher::NameOwnerWatcher(sdbus::IConnection &connection, Callback callback)
+    : connection_(connection), callback_(std::move(callback)) {}
+
+NameOwnerWatcher::~NameOwnerWatcher() {
+    // 显式移除所有规则，不依赖连接关闭
+    std::map<std::string, Watch> watches;
+    {
+        std::lock_guard lock(mutex_);
+        watches.swap(watches_);
+    }
+}
+
+std::expected<void, Error> NameOwnerWatcher::watch(const std::string &name) {
+    {
+        std::lock_guard lock(mutex_);
+        if (auto it = watches_.find(name); it != watches_.end()) {
+            ++it->second.refs;
+            return {};
+        }
+    }
+
+    return safelyExec([&] -> std::expected<void, Error> {
+        auto slot = connection_.addMatch(
+            makeSignalMatchRule(
+                "org.freedesktop.DBus", "/org/freedesktop/DBus", "org.freedesktop.DBus", "NameOwnerChanged", name
+            ),
+            [this](sdbus::Message message) { dispatch(message); }
+        );
+
+        std::lock_guard lock(mutex_);
+        auto &watch = watches_[name];
+        ++watch.refs;
+        // 并发关注同一名称时只保留先安装的规则
+        if (!watch.slot)
+            watch.slot = std::move(slot);
+        return {};
+    });
+}
+
+void NameOwnerWatcher::unwatch(const std::string &name) {
+    sdbus::Slot slot;
+    {
+        std::lock_guard lock(mutex_);
+        auto it = watches_.find(name);
+        if (it == watches_.end() || --it->second.refs > 0)
+            return;
+        slot = std::move(it->second.slot);
+        watches_.erase(it);
+    }
+    // 在锁外移除规则
+}
+
+std::expected<bool, Error> NameOwnerWatcher::hasOwner(const std::string &name) {
+    return safelyExec([&] -> std::expected<bool, Error> {
+        auto proxy = sdbus::createProxy(
+            connection_, sdbus::ServiceName{"org.freedesktop.DBus"}, sdbus::ObjectPath{"/org/freedesktop/DBus"}
+        );
+        bool owned = false;
+        proxy->callMethod("NameHasOwner").onInterface("org.freedesktop.DBus").withArguments(name).storeResultsTo(owned);
+        return owned;
+    });
+}
+
+void NameOwnerWatcher::dispatch(sdbus::Message &message) {
+    std::string name, oldOwner, newOwner;
+    try {
+        message >> name >> oldOwner >> newOwner;
+    } catch (const sdbus::Error &) {
+        return;
+    }
+
+    bool watched;
+    {
+        std::lock_guard lock(mutex_);
+        watched = watches_.contains(name);
+    }
+    if (!watched)
+        return;
+    countSignalDispatched();
+    callback_(name, oldOwner, newOwner);
+}
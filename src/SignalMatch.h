@@ -0,0 +1,73 @@
+//
+// Created by tray-control on 2024/04/13.
+//
+#pragma once
+
+#include <cstdint>
+#include <expected>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <string_view>
+
+#include <sdbus-c++/Types.h>
+
+#include "Errors.h"
+
+namespace sdbus {
+class IConnection;
+class Message;
+} // namespace sdbus
+
+// 进程内信号计数：received 为经 connectSessionBus 建立的连接从总线读到的全部信号（在连接的消息过滤器中计数，
+// sdbus-c++ 分发之前），dispatched 为实际交给使用者的信号，两者之差就是无用的唤醒
+struct SignalStats {
+    uint64_t received = 0;
+    uint64_t dispatched = 0;
+};
+
+SignalStats signalStats();
+void countSignalReceived();
+void countSignalDispatched();
+
+// 构造只匹配指定发送者、路径、接口和成员的信号规则，空字段不参与匹配
+std::string makeSignalMatchRule(
+    std::string_view sender, std::string_view path, std::string_view interface, std::string_view member,
+    std::string_view arg0 = {}
+);
+
+// 共享的 NameOwnerChanged 订阅。每个关注的名称安装一条带 arg0 过滤的规则（多次关注同一名称共享一条），
+// 总线只投递与这些名称有关的变化，全部交给同一个回调
+class NameOwnerWatcher {
+  public:
+    using Callback =
+        std::function<void(const std::string &name, const std::string &oldOwner, const std::string &newOwner)>;
+
+    NameOwnerWatcher(sdbus::IConnection &connection, Callback callback);
+    ~NameOwnerWatcher();
+
+    NameOwnerWatcher(const NameOwnerWatcher &) = delete;
+    NameOwnerWatcher &operator=(const NameOwnerWatcher &) = delete;
+
+    std::expected<void, Error> watch(const std::string &name);
+    // 最后一次取消关注时移除规则
+    void unwatch(const std::string &name);
+
+    // 名称当前是否有所有者。规则安装之前所有者就已退出时不会再收到 NameOwnerChanged，
+    // 调用方在 watch 之后用它确认一次
+    std::expected<bool, Error> hasOwner(const std::string &name);
+
+  private:
+    struct Watch {
+        size_t refs = 0;
+        sdbus::Slot slot;
+    };
+
+    sdbus::IConnection &connection_;
+    Callback callback_;
+    std::mutex mutex_;
+    std::map<std::string, Watch> watches_;
+
+    void dispatch(sdbus::Message &message);
+};
@@ -6,75 +6,116 @@
 #include <sdbus-c++/sdbus-c++.h>
 
 #include "DBusUtils.h"
-
-template <typename T>
-static constexpr auto safelyGetSNIProperty =
-    std::bind(safelyGetProperty<T>, std::placeholders::_1, "org.kde.StatusNotifierItem", std::placeholders::_2);
-
-StatusNotifierItem::StatusNotifierItem(std::string_view destination, std::string_view objectPath)
-    : destination_(destination), objectPath_(objectPath) {}
-
-StatusNotifierItem::~StatusNotifierItem() = default;
-
-std::expected<void, Error> StatusNotifierItem::connect() {
-    return safelyExec([this] -> std::expected<void, Error> {
-        proxy_ = sdbus::createProxy(
-            sdbus::createSessionBusConnection(), sdbus::ServiceName{std::string(destination_)},
-            sdbus::ObjectPath{objectPath_}
-        );
-        if (proxy_)
-            return {};
-        else
-            return makeError(ErrorKind::ConnectionError);
+#include "SessionBus.h"
+#include "SignalMatch.h"
+#include "Utils.h"
+
+std::map<std::string, sdbus::Variant> toSNIVariantMap(const SNIPropertySet &properties) {
+    std::map<std::string, sdbus::Variant> values;
+    forEachSNIProperty([&]<SNIProperty P>() {
+        if (const auto &value = properties.get<P>())
+            values.emplace(sniPropertyInfo<P>.name, sdbus::Variant(*value));
     });
+    return values;
 }
 
-std::expected<std::string, Error> StatusNotifierItem::getCategory() {
-    return safelyGetSNIProperty<std::string>(proxy_, "Category");
-}
+SNIPropertySet fromSNIVariantMap(const std::map<std::string, sdbus::Variant> &values) {
+    SNIPropertySet properties;
+    forEachSNIProperty([&]<SNIProperty P>() {
+        auto it = values.find(std::string(sniPropertyInfo<P>.name));
+        if (it != values.end() && it->second.containsValueOfType<SNIPropertyType<P>>())
+            properties.get<P>() = it->second.get<SNIPropertyType<P>>();
+    });
+    return properties;
+}
+
+SNIPropertySet parseSNIProperties(sdbus::Message &message) {
+    // 直接在消息上逐项解码 a{sv}：键以 char* 借用消息内的存储，按预先计算的哈希分派
+    SNIPropertySet result;
+    if (!message.enterContainer("{sv}"))
+        return result;
+
+    while (message.enterDictEntry("sv")) {
+        char *key = nullptr;
+        message >> key;
+        const std::string_view name = key ? key : "";
+        const uint64_t hash = hashPropertyName(name);
+        const char *contents = message.peekType().second;
+
+        bool decoded = false;
+        forEachSNIProperty([&]<SNIProperty P>() {
+            constexpr auto &info = sniPropertyInfo<P>;
+            // 哈希命中后再比较一次名称，防止未知属性的哈希碰撞
+            if (decoded || hash != info.hash || name != info.name || !contents ||
+                std::string_view(contents) != info.signature)
+                return;
+
+            SNIPropertyType<P> value;
+            message.enterVariant(info.signature);
+            message >> value;
+            message.exitVariant();
+            result.get<P>() = std::move(value);
+            decoded = true;
+        });
+
+        // 未知属性或类型不符的属性直接跳过
+        if (!decoded) {
+            sdbus::Variant ignored;
+            message >> ignored;
+        }
+
+        message.exitDictEntry();
+    }
+    message.clearFlags();
+    message.exitContainer();
 
-std::expected<std::string, Error> StatusNotifierItem::getId() {
-    return safelyGetSNIProperty<std::string>(proxy_, "Id");
+    return result;
 }
 
-std::expected<std::string, Error> StatusNotifierItem::getTitle() {
-    return safelyGetSNIProperty<std::string>(proxy_, "Title");
-}
+StatusNotifierItem::StatusNotifierItem(std::string_view destination, std::string_view objectPath, std::string_view bus)
+    : destination_(destination), objectPath_(objectPath), bus_(bus), proxies_(destination_, objectPath_, bus_) {}
 
-std::expected<std::string, Error> StatusNotifierItem::getStatus() {
-    return safelyGetSNIProperty<std::string>(proxy_, "Status");
+StatusNotifierItem::~StatusNotifierItem() {
+    // 先移除匹配规则，再销毁代理停止事件循环
+    signalSlots_.clear();
+    proxies_.reset(nullptr);
 }
 
-std::expected<uint32_t, Error> StatusNotifierItem::getWindowId() {
-    return safelyGetSNIProperty<uint32_t>(proxy_, "WindowId");
-}
+std::expected<void, Error> StatusNotifierItem::connect() {
+    MemPhaseScope memPhase(MemPhase::Discovery);
+    return safelyExec([this] -> std::expected<void, Error> {
+        auto proxy = sdbus::createProxy(
+            connectSessionBus(bus_), sdbus::ServiceName{destination_}, sdbus::ObjectPath{objectPath_}
+        );
+        if (!proxy)
+            return makeError(ErrorKind::ConnectionError);
 
-std::expected<std::string, Error> StatusNotifierItem::getIconName() {
-    return safelyGetSNIProperty<std::string>(proxy_, "IconName");
+        proxies_.reset(std::move(proxy));
+        return {};
+    });
 }
 
-std::expected<std::string, Error> StatusNotifierItem::getOverlayIconName() {
-    return safelyGetSNIProperty<std::string>(proxy_, "OverlayIconName");
-}
+std::expected<SNIPropertySet, Error> StatusNotifierItem::getAll() const {
+    MemPhaseScope memPhase(MemPhase::Properties);
+    return safelyCall(destination_, [this] -> std::expected<SNIPropertySet, Error> {
+        auto *proxy = proxies_.get();
+        if (!proxy)
+            return makeError(ErrorKind::ConnectionError);
 
-std::expected<std::string, Error> StatusNotifierItem::getAttentionIconName() {
-    return safelyGetSNIProperty<std::string>(proxy_, "AttentionIconName");
-}
+        auto call = proxy->createMethodCall("org.freedesktop.DBus.Properties", "GetAll");
+        call << "org.kde.StatusNotifierItem";
+        auto reply = proxy->callMethod(call);
 
-std::expected<std::string, Error> StatusNotifierItem::getAttentionMovieName() {
-    return safelyGetSNIProperty<std::string>(proxy_, "AttentionMovieName");
+        return parseSNIProperties(reply);
+    });
 }
 
 std::expected<std::string, Error> StatusNotifierItem::getToolTip() const {
-    return safelyGetSNIProperty<std::string>(proxy_, "ToolTip");
-}
-
-std::expected<std::string, Error> StatusNotifierItem::getIconThemePath() {
-    return safelyGetSNIProperty<std::string>(proxy_, "IconThemePath");
+    return mapExpected(get<SNIProperty::ToolTip>(), [](const SNIToolTip &toolTip) { return formatSNIValue(toolTip); });
 }
 
 std::expected<sdbus::ObjectPath, Error> StatusNotifierItem::getMenu() const {
-    auto result = safelyGetSNIProperty<sdbus::ObjectPath>(proxy_, "Menu");
+    auto result = get<SNIProperty::Menu>();
     if (!result) {
         // 如果获取菜单路径失败，返回默认路径 "/MenuBar"
         return sdbus::ObjectPath{"/MenuBar"};
@@ -82,26 +123,72 @@ std::expected<sdbus::ObjectPath, Error> StatusNotifierItem::getMenu() const {
     return result;
 }
 
-std::expected<bool, Error> StatusNotifierItem::getItemIsMenu() {
-    return safelyGetSNIProperty<bool>(proxy_, "ItemIsMenu");
-}
-
 std::expected<void, Error> StatusNotifierItem::contextMenu(int x, int y) {
-    return safelyCallMethod<void>(proxy_, "org.kde.StatusNotifierItem", "ContextMenu", x, y);
+    return safelyCallMethod<void>(proxies_.get(), destination_, "org.kde.StatusNotifierItem", "ContextMenu", x, y);
 }
 
 std::expected<void, Error> StatusNotifierItem::activate(int x, int y) {
-    return safelyCallMethod<void>(proxy_, "org.kde.StatusNotifierItem", "Activate", x, y);
+    return safelyCallMethod<void>(proxies_.get(), destination_, "org.kde.StatusNotifierItem", "Activate", x, y);
 }
 
 std::expected<void, Error> StatusNotifierItem::secondaryActivate(int x, int y) {
-    return safelyCallMethod<void>(proxy_, "org.kde.StatusNotifierItem", "SecondaryActivate", x, y);
+    return safelyCallMethod<void>(proxies_.get(), destination_, "org.kde.StatusNotifierItem", "SecondaryActivate", x, y);
 }
 
 std::expected<void, Error> StatusNotifierItem::scroll(int delta, const std::string &orientation) {
-    return safelyCallMethod<void>(proxy_, "org.kde.StatusNotifierItem", "Scroll", delta, orientation);
+    return safelyCallMethod<void>(proxies_.get(), destination_, "org.kde.StatusNotifierItem", "Scroll", delta, orientation);
 }
 
 std::expected<void, Error> StatusNotifierItem::provideXdgActivationToken(const std::string &token) {
-    return safelyCallMethod<void>(proxy_, "org.kde.StatusNotifierItem", "ProvideXdgActivationToken", token);
+    return safelyCallMethod<void>(
+        proxies_.get(), destination_, "org.kde.StatusNotifierItem", "ProvideXdgActivationToken", token
+    );
+}
+
+std::expected<void, Error>
+StatusNotifierItem::registerSignalCallback(std::function<void(SNISignal, const std::string &status)> callback) {
+    return safelyExec([this, &callback] -> std::expected<void, Error> {
+        auto *proxy = proxies_.primary();
+        if (!proxy)
+            return makeError(ErrorKind::ConnectionError);
+
+        signalCallback_.store(callback ? std::make_shared<const SignalCallback>(std::move(callback)) : nullptr);
+        std::lock_guard lock(signalsMutex_);
+        if (signalsRegistered_)
+            return {};
+
+        for (auto signal : magic_enum::enum_values<SNISignal>()) {
+            if (signal == SNISignal::NewStatus)
+                continue;
+            auto slot = proxy->uponSignal(std::string(magic_enum::enum_name(signal)))
+                            .onInterface("org.kde.StatusNotifierItem")
+                            .call(
+                                [this, signal]() {
+                                    const auto callback = signalCallback_.load();
+                                    if (!callback)
+                                        return;
+                                    countSignalDispatched();
+                                    (*callback)(signal, {});
+                                },
+                                sdbus::return_slot
+                            );
+            signalSlots_.push_back(std::move(slot));
+        }
+        auto statusSlot = proxy->uponSignal("NewStatus")
+                              .onInterface("org.kde.StatusNotifierItem")
+                              .call(
+                                  [this](const std::string &status) {
+                                      const auto callback = signalCallback_.load();
+                                      if (!callback)
+                                          return;
+                                      countSignalDispatched();
+                                      (*callback)(SNISignal::NewStatus, status);
+                                  },
+                                  sdbus::return_slot
+                              );
+        signalSlots_.push_back(std::move(statusSlot));
+
+        signalsRegistered_ = true;
+        return {};
+    });
 }
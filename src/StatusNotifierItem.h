@@ -7,7 +7,18 @@
 #include <memory>
 #include <vector>
 #include <expected>
+#include <functional>
+#include <map>
+#include <optional>
+#include <span>
+#include <tuple>
+#include <utility>
+#include <atomic>
+#include <mutex>
 #include "Errors.h"
+#include "DBusUtils.h"
+#include "MemStats.h"
+#include "ProxyPool.h"
 #include <sdbus-c++/sdbus-c++.h>
 
 namespace sdbus {
@@ -27,6 +38,156 @@ inline std::pair<std::string, std::string> splitAddress(const std::string &addre
     return {service, path};
 }
 
+// ToolTip 属性的线上格式 (sa(iiay)ss)：图标名、图标像素数据、标题、描述
+using SNIToolTip = sdbus::Struct<
+    std::string, std::vector<sdbus::Struct<int32_t, int32_t, std::vector<uint8_t>>>, std::string, std::string>;
+
+// FNV-1a，用于在编译期预先计算属性名的哈希
+constexpr uint64_t hashPropertyName(std::string_view name) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (char c : name) {
+        hash ^= static_cast<unsigned char>(c);
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+// 单个 SNI 属性的描述：名称、DBus 类型签名和对应的 C++ 类型
+template <typename T> struct SNIPropertyInfo {
+    using type = T;
+    std::string_view name;
+    const char *signature;
+    uint64_t hash;
+
+    constexpr SNIPropertyInfo(std::string_view name, const char *signature)
+        : name(name), signature(signature), hash(hashPropertyName(name)) {}
+};
+
+// StatusNotifierItem 属性表，新增属性只需同时修改 SNIProperty 和 SNI_PROPERTIES，
+// 顺序即 --show -v 的输出顺序
+enum class SNIProperty : size_t {
+    Category,
+    Title,
+    Id,
+    Status,
+    WindowId,
+    IconName,
+    IconThemePath,
+    OverlayIconName,
+    AttentionIconName,
+    AttentionMovieName,
+    Menu,
+    ItemIsMenu,
+    ToolTip,
+};
+
+inline constexpr std::tuple SNI_PROPERTIES{
+    SNIPropertyInfo<std::string>{"Category", "s"},
+    SNIPropertyInfo<std::string>{"Title", "s"},
+    SNIPropertyInfo<std::string>{"Id", "s"},
+    SNIPropertyInfo<std::string>{"Status", "s"},
+    SNIPropertyInfo<uint32_t>{"WindowId", "u"},
+    SNIPropertyInfo<std::string>{"IconName", "s"},
+    SNIPropertyInfo<std::string>{"IconThemePath", "s"},
+    SNIPropertyInfo<std::string>{"OverlayIconName", "s"},
+    SNIPropertyInfo<std::string>{"AttentionIconName", "s"},
+    SNIPropertyInfo<std::string>{"AttentionMovieName", "s"},
+    SNIPropertyInfo<sdbus::ObjectPath>{"Menu", "o"},
+    SNIPropertyInfo<bool>{"ItemIsMenu", "b"},
+    SNIPropertyInfo<SNIToolTip>{"ToolTip", "(sa(iiay)ss)"},
+};
+
+inline constexpr size_t SNI_PROPERTY_COUNT = std::tuple_size_v<decltype(SNI_PROPERTIES)>;
+
+template <SNIProperty P> inline constexpr auto &sniPropertyInfo = std::get<static_cast<size_t>(P)>(SNI_PROPERTIES);
+
+template <SNIProperty P> using SNIPropertyType = typename std::remove_cvref_t<decltype(sniPropertyInfo<P>)>::type;
+
+// 按表中顺序对每个属性调用 f.template operator()<P>()
+template <typename F> constexpr void forEachSNIProperty(F &&f) {
+    [&f]<size_t... I>(std::index_sequence<I...>) {
+        (f.template operator()<static_cast<SNIProperty>(I)>(), ...);
+    }(std::make_index_sequence<SNI_PROPERTY_COUNT>{});
+}
+
+// 枚举与属性表必须一一对应，且属性名哈希互不冲突
+static_assert(magic_enum::enum_count<SNIProperty>() == SNI_PROPERTY_COUNT);
+static_assert([]<size_t... I>(std::index_sequence<I...>) {
+    return ((magic_enum::enum_name(static_cast<SNIProperty>(I)) == std::get<I>(SNI_PROPERTIES).name) && ...);
+}(std::make_index_sequence<SNI_PROPERTY_COUNT>{}));
+static_assert([]<size_t... I>(std::index_sequence<I...>) {
+    const uint64_t hashes[] = {std::get<I>(SNI_PROPERTIES).hash...};
+    for (size_t i = 0; i < SNI_PROPERTY_COUNT; ++i)
+        for (size_t j = i + 1; j < SNI_PROPERTY_COUNT; ++j)
+            if (hashes[i] == hashes[j])
+                return false;
+    return true;
+}(std::make_index_sequence<SNI_PROPERTY_COUNT>{}));
+
+// GetAll 的解码结果，缺失或类型不符的属性为空
+class SNIPropertySet {
+  public:
+    template <SNIProperty P> const std::optional<SNIPropertyType<P>> &get() const {
+        return std::get<static_cast<size_t>(P)>(values_);
+    }
+
+    template <SNIProperty P> std::optional<SNIPropertyType<P>> &get() {
+        return std::get<static_cast<size_t>(P)>(values_);
+    }
+
+  private:
+    template <typename Seq> struct Storage;
+    template <size_t... I> struct Storage<std::index_sequence<I...>> {
+        using type = std::tuple<std::optional<SNIPropertyType<static_cast<SNIProperty>(I)>>...>;
+    };
+
+    typename Storage<std::make_index_sequence<SNI_PROPERTY_COUNT>>::type values_;
+};
+
+// 将属性值格式化为 --show 输出的文本
+inline std::string formatSNIValue(const std::string &value) { return value; }
+inline std::string formatSNIValue(uint32_t value) { return std::to_string(value); }
+inline std::string formatSNIValue(bool value) { return value ? "true" : "false"; }
+inline std::string formatSNIValue(const sdbus::ObjectPath &value) { return value; }
+inline std::string formatSNIValue(const SNIToolTip &value) { return std::get<2>(value); }
+
+// 属性集与 a{sv} 之间的转换，用于内置 watcher 的扩展接口
+std::map<std::string, sdbus::Variant> toSNIVariantMap(const SNIPropertySet &properties);
+SNIPropertySet fromSNIVariantMap(const std::map<std::string, sdbus::Variant> &values);
+
+// 从消息的当前位置解码 GetAll 返回的 a{sv}
+SNIPropertySet parseSNIProperties(sdbus::Message &message);
+
+// StatusNotifierItem 的属性变化信号
+enum class SNISignal { NewTitle, NewIcon, NewAttentionIcon, NewOverlayIcon, NewToolTip, NewStatus };
+
+// 信号对应需要重新获取的属性
+inline std::span<const SNIProperty> sniSignalProperties(SNISignal signal) {
+    static constexpr SNIProperty title[] = {SNIProperty::Title};
+    static constexpr SNIProperty icon[] = {SNIProperty::IconName, SNIProperty::IconThemePath};
+    static constexpr SNIProperty attention[] = {SNIProperty::AttentionIconName, SNIProperty::AttentionMovieName};
+    static constexpr SNIProperty overlay[] = {SNIProperty::OverlayIconName};
+    static constexpr SNIProperty toolTip[] = {SNIProperty::ToolTip};
+    static constexpr SNIProperty status[] = {SNIProperty::Status};
+
+    switch (signal) {
+    case SNISignal::NewTitle:
+        return title;
+    case SNISignal::NewIcon:
+        return icon;
+    case SNISignal::NewAttentionIcon:
+        return attention;
+    case SNISignal::NewOverlayIcon:
+        return overlay;
+    case SNISignal::NewToolTip:
+        return toolTip;
+    case SNISignal::NewStatus:
+        return status;
+    }
+    return {};
+}
+
+// connect 之后的方法可以被多个线程同时调用，每个线程使用自己的代理（见 ProxyPool）
 class StatusNotifierItem {
   public:
     // 工具提示结构体，对应(sa(iiay)ss)
@@ -36,11 +197,15 @@ class StatusNotifierItem {
         std::string description;
     };
 
-    StatusNotifierItem(std::string_view destination, std::string_view objectPath);
+    // bus 为会话总线地址，空表示默认会话总线
+    StatusNotifierItem(std::string_view destination, std::string_view objectPath, std::string_view bus = {});
     ~StatusNotifierItem();
 
     std::expected<void, Error> connect();
 
+    // 所有线程共用主代理，见 ProxyPool::setShared
+    void shareProxy(bool shared) { proxies_.setShared(shared); }
+
     /**
      * @name Properties
      * @brief Properties interface for StatusNotifierItem:
@@ -48,33 +213,43 @@ class StatusNotifierItem {
      * @return
      */
     ///@{
-    std::expected<std::string, Error> getCategory();
+    template <SNIProperty P> std::expected<SNIPropertyType<P>, Error> get() const {
+        MemPhaseScope memPhase(MemPhase::Properties);
+        constexpr auto &info = sniPropertyInfo<P>;
+        return safelyGetProperty<SNIPropertyType<P>>(
+            proxies_.get(), destination_, "org.kde.StatusNotifierItem", std::string(info.name)
+        );
+    }
+
+    // 通过一次 Properties.GetAll 获取全部属性
+    std::expected<SNIPropertySet, Error> getAll() const;
+
+    std::expected<std::string, Error> getCategory() { return get<SNIProperty::Category>(); }
 
-    std::expected<std::string, Error> getId();
+    std::expected<std::string, Error> getId() { return get<SNIProperty::Id>(); }
 
-    std::expected<std::string, Error> getTitle();
+    std::expected<std::string, Error> getTitle() { return get<SNIProperty::Title>(); }
 
-    std::expected<std::string, Error> getStatus();
+    std::expected<std::string, Error> getStatus() { return get<SNIProperty::Status>(); }
 
-    std::expected<uint32_t, Error> getWindowId();
+    std::expected<uint32_t, Error> getWindowId() { return get<SNIProperty::WindowId>(); }
 
-    std::expected<std::string, Error> getIconName();
+    std::expected<std::string, Error> getIconName() { return get<SNIProperty::IconName>(); }
 
-    std::expected<std::string, Error> getOverlayIconName();
+    std::expected<std::string, Error> getOverlayIconName() { return get<SNIProperty::OverlayIconName>(); }
 
-    std::expected<std::string, Error> getAttentionIconName();
+    std::expected<std::string, Error> getAttentionIconName() { return get<SNIProperty::AttentionIconName>(); }
 
-    std::expected<std::string, Error> getAttentionMovieName();
+    std::expected<std::string, Error> getAttentionMovieName() { return get<SNIProperty::AttentionMovieName>(); }
 
+    // 返回工具提示的标题
     std::expected<std::string, Error> getToolTip() const;
 
-    std::expected<std::string, Error> getIconThemePath();
+    std::expected<std::string, Error> getIconThemePath() { return get<SNIProperty::IconThemePath>(); }
 
     std::expected<sdbus::ObjectPath, Error> getMenu() const;
 
-    std::expected<bool, Error> getItemIsMenu();
-
-    // menu
+    std::expected<bool, Error> getItemIsMenu() { return get<SNIProperty::ItemIsMenu>(); }
     ///@}
 
     /**
@@ -95,8 +270,29 @@ class StatusNotifierItem {
     std::expected<void, Error> provideXdgActivationToken(const std::string &token);
     ///@}
 
+    /**
+     * @name Signals
+     * @brief 订阅 NewTitle/NewIcon/NewAttentionIcon/NewOverlayIcon/NewToolTip/NewStatus。
+     * 首次注册时才添加匹配规则，回调在连接的事件循环线程上执行；NewStatus 的参数通过 status 传入
+     */
+    ///@{
+    std::expected<void, Error>
+    registerSignalCallback(std::function<void(SNISignal, const std::string &status)> callback);
+    ///@}
+
   private:
-    std::unique_ptr<sdbus::IProxy> proxy_;
-    std::string_view destination_;
+    std::string destination_;
     std::string objectPath_;
+    std::string bus_;
+
+    using SignalCallback = std::function<void(SNISignal, const std::string &)>;
+
+    // 注册时整体替换，信号线程只做一次原子读取
+    std::atomic<std::shared_ptr<const SignalCallback>> signalCallback_;
+    std::mutex signalsMutex_;
+    bool signalsRegistered_ = false;
+    std::vector<sdbus::Slot> signalSlots_;
+
+    // 最后声明、最先析构：停止事件循环后才销毁信号回调
+    mutable ProxyPool proxies_;
 };
@@ -5,17 +5,78 @@
 #include "StatusNotifierWatcher.h"
 #include <sdbus-c++/sdbus-c++.h>
 
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <set>
+
+#include "DBusMenu.h"
+#include "MemStats.h"
+#include "SessionBus.h"
+#include "SignalMatch.h"
+
 #include "Utils.h"
 #include "DBusUtils.h"
+#include "StatusNotifierWatcherService.h"
+
+namespace {
+// 信号线程写入、等待线程读取的新注册地址队列
+struct RegistrationQueue {
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<std::string> addresses;
+
+    void push(std::string address) {
+        {
+            std::lock_guard lock(mutex);
+            addresses.push_back(std::move(address));
+        }
+        cv.notify_all();
+    }
+
+    std::optional<std::string> pop(std::chrono::steady_clock::time_point until) {
+        std::unique_lock lock(mutex);
+        if (!cv.wait_until(lock, until, [this] { return !addresses.empty(); }))
+            return std::nullopt;
+        auto address = std::move(addresses.front());
+        addresses.pop_front();
+        return address;
+    }
+};
+
+enum class Candidate { NoMatch, Ready, MenuPending };
 
-StatusNotifierWatcher::StatusNotifierWatcher() = default;
+Candidate checkCandidate(
+    const std::string &bus, const std::string &address, const std::function<bool(StatusNotifierItem &)> &matches,
+    bool requireMenu
+) {
+    auto [service, path] = splitAddress(address);
+    StatusNotifierItem item(service, path, bus);
+    if (!item.connect() || !matches(item))
+        return Candidate::NoMatch;
+    if (!requireMenu)
+        return Candidate::Ready;
+
+    // 应用可能先注册托盘项再导出菜单
+    auto menuPath = item.getMenu();
+    if (!menuPath)
+        return Candidate::MenuPending;
+    DBusMenu menu(service, *menuPath, bus);
+    if (!menu.connect() || !menu.getLayout(0, 0, MENU_LOOKUP_PROPERTIES))
+        return Candidate::MenuPending;
+    return Candidate::Ready;
+}
+} // namespace
+
+StatusNotifierWatcher::StatusNotifierWatcher(std::string bus) : bus_(std::move(bus)) {}
 
 StatusNotifierWatcher::~StatusNotifierWatcher() = default;
 
 std::expected<void, Error> StatusNotifierWatcher::connect() {
+    MemPhaseScope memPhase(MemPhase::Discovery);
     return safelyExec([this] -> std::expected<void, Error> {
         proxy_ = sdbus::createProxy(
-            sdbus::createSessionBusConnection(), sdbus::ServiceName{"org.kde.StatusNotifierWatcher"},
+            connectSessionBus(bus_), sdbus::ServiceName{"org.kde.StatusNotifierWatcher"},
             sdbus::ObjectPath{"/StatusNotifierWatcher"}
         );
         if (proxy_)
@@ -26,8 +87,9 @@ std::expected<void, Error> StatusNotifierWatcher::connect() {
 }
 
 std::expected<std::vector<std::string>, Error> StatusNotifierWatcher::getRegisteredAddresses() {
+    MemPhaseScope memPhase(MemPhase::Discovery);
     auto result = safelyGetProperty<std::vector<std::string>>(
-        proxy_, "org.kde.StatusNotifierWatcher", "RegisteredStatusNotifierItems"
+        proxy_.get(), "org.kde.StatusNotifierWatcher", "org.kde.StatusNotifierWatcher", "RegisteredStatusNotifierItems"
     );
 
     if (result) {
@@ -36,3 +98,118 @@ std::expected<std::vector<std::string>, Error> StatusNotifierWatcher::getRegiste
         return std::unexpected(result.error());
     }
 }
+
+std::expected<std::vector<std::pair<std::string, SNIPropertySet>>, Error>
+StatusNotifierWatcher::getItemsWithProperties() {
+    MemPhaseScope memPhase(MemPhase::Discovery);
+    using Reply = std::vector<sdbus::Struct<std::string, std::map<std::string, sdbus::Variant>>>;
+    return mapExpected(
+        safelyCallMethod<Reply>(
+            proxy_.get(), "org.kde.StatusNotifierWatcher", TRAY_CONTROL_WATCHER_INTERFACE, "GetItemsWithProperties"
+        ),
+        [](Reply &&reply) {
+            std::vector<std::pair<std::string, SNIPropertySet>> items;
+            items.reserve(reply.size());
+            for (auto &item : reply) {
+                items.emplace_back(std::move(std::get<0>(item)), fromSNIVariantMap(std::get<1>(item)));
+            }
+            return items;
+        }
+    );
+}
+
+std::expected<std::string, Error> StatusNotifierWatcher::waitForItem(
+    const std::function<bool(StatusNotifierItem &)> &matches, bool requireMenu, std::chrono::milliseconds timeout
+) {
+    MemPhaseScope memPhase(MemPhase::Discovery);
+    using Clock = std::chrono::steady_clock;
+    const auto deadline = Clock::now() + timeout;
+
+    // 信号回调可能在 slot 注销过程中仍在运行，因此队列由回调共同持有
+    auto queue = std::make_shared<RegistrationQueue>();
+    auto slot = safelyExec([&] -> std::expected<sdbus::Slot, Error> {
+        if (!proxy_)
+            return makeError(ErrorKind::ConnectionError);
+        return proxy_->uponSignal("StatusNotifierItemRegistered")
+            .onInterface("org.kde.StatusNotifierWatcher")
+            .call(
+                [queue](const std::string &address) {
+                    countSignalDispatched();
+                    queue->push(address);
+                },
+                sdbus::return_slot
+            );
+    });
+    if (!slot)
+        return std::unexpected(slot.error());
+
+    // watcher 尚未启动时列表为空，之后它启动并收到注册时仍会发出信号
+    if (auto addresses = getRegisteredAddresses()) {
+        for (auto &address : *addresses)
+            queue->push(std::move(address));
+    }
+
+    // 已匹配但菜单尚未导出的托盘项，按指数退避重新检查
+    constexpr auto initialRetryDelay = std::chrono::milliseconds{20};
+    constexpr auto maxRetryDelay = std::chrono::milliseconds{500};
+    std::set<std::string> menuPending;
+    auto retryDelay = initialRetryDelay;
+    auto nextRetry = Clock::time_point::max();
+
+    while (true) {
+        const auto now = Clock::now();
+        if (now >= deadline)
+            return makeError(ErrorKind::TimeoutError, "No matching item appeared before the deadline");
+
+        if (!menuPending.empty() && now >= nextRetry) {
+            for (auto it = menuPending.begin(); it != menuPending.end();) {
+                switch (checkCandidate(bus_, *it, matches, requireMenu)) {
+                case Candidate::Ready:
+                    return *it;
+                case Candidate::NoMatch:
+                    it = menuPending.erase(it);
+                    break;
+                case Candidate::MenuPending:
+                    ++it;
+                    break;
+                }
+            }
+            retryDelay = std::min(retryDelay * 2, maxRetryDelay);
+            nextRetry = menuPending.empty() ? Clock::time_point::max() : Clock::now() + retryDelay;
+            continue;
+        }
+
+        auto address = queue->pop(std::min(deadline, nextRetry));
+        if (!address)
+            continue;
+
+        switch (checkCandidate(bus_, *address, matches, requireMenu)) {
+        case Candidate::Ready:
+            return *address;
+        case Candidate::MenuPending:
+            if (menuPending.empty()) {
+                retryDelay = initialRetryDelay;
+                nextRetry = Clock::now() + retryDelay;
+            }
+            menuPending.insert(*address);
+            break;
+        case Candidate::NoMatch:
+            break;
+        }
+    }
+}
+
+bool matchesItem(StatusNotifierItem &item, const std::string &id, const std::string &title) {
+    bool found = false;
+    if (!title.empty())
+        ifExpected(item.getTitle(), [&title, &found](const std::string &ctitle) { found = ctitle == title; });
+    else if (!id.empty())
+        ifExpected(item.getId(), [&id, &found](const std::string &cid) { found = cid == id; });
+    return found;
+}
+
+std::chrono::milliseconds waitTimeout(uint32_t seconds) {
+    if (seconds == 0)
+        return std::chrono::hours(24 * 365);
+    return std::chrono::seconds(seconds);
+}
@@ -7,21 +7,43 @@
 #include <string>
 #include <memory>
 #include <expected>
+#include <chrono>
+#include <functional>
 
 #include "Errors.h"
+#include "StatusNotifierItem.h"
 
 namespace sdbus {
 class IProxy;
 }
 
+// 按 title 匹配托盘项，title 为空时按 id 匹配；两者都为空时不匹配任何托盘项
+bool matchesItem(StatusNotifierItem &item, const std::string &id, const std::string &title);
+
+// --wait 的秒数转换为 waitForItem 的超时时间，0 表示一直等待
+std::chrono::milliseconds waitTimeout(uint32_t seconds);
+
 class StatusNotifierWatcher {
   public:
-    StatusNotifierWatcher();
+    // bus 为会话总线地址，空表示默认会话总线；找到的托盘项也在这条总线上
+    explicit StatusNotifierWatcher(std::string bus = {});
     ~StatusNotifierWatcher();
 
     std::expected<void, Error> connect();
     std::expected<std::vector<std::string>, Error> getRegisteredAddresses();
 
+    // 通过内置 watcher 的扩展接口一次获取所有托盘项及其属性；其他 watcher 实现返回 DBusError
+    std::expected<std::vector<std::pair<std::string, SNIPropertySet>>, Error> getItemsWithProperties();
+
+    // 等待满足 matches 的托盘项出现，返回其完整地址。先订阅 StatusNotifierItemRegistered 再读取当前列表，
+    // 两者之间注册的托盘项不会丢失；requireMenu 时还要等到其菜单可以 GetLayout。超时返回 TimeoutError
+    std::expected<std::string, Error> waitForItem(
+        const std::function<bool(StatusNotifierItem &)> &matches, bool requireMenu, std::chrono::milliseconds timeout
+    );
+
+    const std::string &bus() const { return bus_; }
+
   private:
+    std::string bus_;
     std::unique_ptr<sdbus::IProxy> proxy_;
 };
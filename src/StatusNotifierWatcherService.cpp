@@ -0,0 +1,213 @@
+//
+// Created by tray-control on 2024/03/23.
+//
+
+#include "StatusNotifierWatcherService.h"
+#include <sdbus-c++/sdbus-c++.h>
+
+#include "CachedStatusNotifierItem.h"
+#include "DBusUtils.h"
+#include "SessionBus.h"
+#include "SignalMatch.h"
+
+namespace {
+constexpr const char *WATCHER_SERVICE = "org.kde.StatusNotifierWatcher";
+constexpr const char *WATCHER_INTERFACE = "org.kde.StatusNotifierWatcher";
+} // namespace
+
+StatusNotifierWatcherService::StatusNotifierWatcherService() = default;
+
+StatusNotifierWatcherService::~StatusNotifierWatcherService() {
+    {
+        std::lock_guard lock(mutex_);
+        stopping_ = true;
+    }
+    pendingCv_.notify_all();
+    if (worker_.joinable())
+        worker_.join();
+}
+
+std::expected<void, Error> StatusNotifierWatcherService::start() {
+    return safelyExec([this] -> std::expected<void, Error> {
+        connection_ = connectSessionBus({});
+        object_ = sdbus::createObject(*connection_, sdbus::ObjectPath{"/StatusNotifierWatcher"});
+
+        object_
+            ->addVTable(
+                sdbus::registerMethod("RegisterStatusNotifierItem").implementedAs([this](const std::string &service) {
+                    registerItem(service, object_->getCurrentlyProcessedMessage().getSender());
+                }),
+                sdbus::registerMethod("RegisterStatusNotifierHost").implementedAs([this](const std::string &service) {
+                    registerHost(service);
+                }),
+                sdbus::registerProperty("RegisteredStatusNotifierItems").withGetter([this] {
+                    return registeredItems();
+                }),
+                // 我们自身充当宿主：应用看到没有宿主时会退回到 XEmbed 托盘而不注册
+                sdbus::registerProperty("IsStatusNotifierHostRegistered").withGetter([] { return true; }),
+                sdbus::registerProperty("ProtocolVersion").withGetter([] { return int32_t{0}; }),
+                sdbus::registerSignal("StatusNotifierItemRegistered").withParameters<std::string>(),
+                sdbus::registerSignal("StatusNotifierItemUnregistered").withParameters<std::string>(),
+                sdbus::registerSignal("StatusNotifierHostRegistered"),
+                sdbus::registerSignal("StatusNotifierHostUnregistered")
+            )
+            .forInterface(sdbus::InterfaceName{WATCHER_INTERFACE});
+
+        object_
+            ->addVTable(
+                sdbus::registerMethod("GetItemsWithProperties").implementedAs([this] {
+                    std::vector<sdbus::Struct<std::string, std::map<std::string, sdbus::Variant>>> result;
+                    std::lock_guard lock(mutex_);
+                    for (const auto &[address, cache] : items_) {
+                        result.emplace_back(
+                            address,
+                            cache ? toSNIVariantMap(cache->snapshot()) : std::map<std::string, sdbus::Variant>{}
+                        );
+                    }
+                    return result;
+                }),
+                // (收到的信号数, 交给使用者的信号数)，用于确认唤醒率
+                sdbus::registerProperty("SignalStats").withGetter([] {
+                    const auto stats = signalStats();
+                    return sdbus::Struct<uint64_t, uint64_t>{stats.received, stats.dispatched};
+                })
+            )
+            .forInterface(sdbus::InterfaceName{TRAY_CONTROL_WATCHER_INTERFACE});
+
+        // 托盘项所在进程退出时注销
+        nameWatcher_ = std::make_unique<NameOwnerWatcher>(
+            *connection_,
+            [this](const std::string &name, const std::string &oldOwner, const std::string &newOwner) {
+                onNameOwnerChanged(name, oldOwner, newOwner);
+            }
+        );
+
+        worker_ = std::thread([this] { connectPending(); });
+
+        // 导出对象之后再申请服务名，保证客户端看到服务名时方法已经可用
+        connection_->requestName(sdbus::ServiceName{WATCHER_SERVICE});
+        return {};
+    });
+}
+
+std::expected<void, Error> StatusNotifierWatcherService::run() {
+    return safelyExec([this] -> std::expected<void, Error> {
+        if (!connection_)
+            return makeError(ErrorKind::ConnectionError);
+
+        connection_->enterEventLoop();
+        return {};
+    });
+}
+
+std::vector<std::string> StatusNotifierWatcherService::registeredItems() const {
+    std::lock_guard lock(mutex_);
+    std::vector<std::string> addresses;
+    for (const auto &[address, cache] : items_)
+        addresses.push_back(address);
+    return addresses;
+}
+
+void StatusNotifierWatcherService::registerItem(const std::string &serviceOrPath, const std::string &sender) {
+    // 参数可以是服务名（使用默认路径），也可以是对象路径（服务为调用者的唯一名称）
+    std::string address = serviceOrPath.starts_with('/') ? sender + serviceOrPath
+                                                          : serviceOrPath + "/StatusNotifierItem";
+
+    {
+        std::lock_guard lock(mutex_);
+        if (!items_.try_emplace(address).second)
+            return;
+        pending_.push_back(address);
+    }
+    pendingCv_.notify_all();
+    const auto service = splitAddress(address).first;
+    nameWatcher_->watch(service);
+
+    object_->emitSignal("StatusNotifierItemRegistered").onInterface(WATCHER_INTERFACE).withArguments(address);
+    unregisterIfGone(service);
+}
+
+void StatusNotifierWatcherService::registerHost(const std::string &service) {
+    bool inserted;
+    {
+        std::lock_guard lock(mutex_);
+        inserted = hosts_.insert(service).second;
+    }
+    if (!inserted)
+        return;
+
+    nameWatcher_->watch(service);
+    object_->emitSignal("StatusNotifierHostRegistered").onInterface(WATCHER_INTERFACE).withArguments();
+    unregisterIfGone(service);
+}
+
+void StatusNotifierWatcherService::unregisterIfGone(const std::string &name) {
+    // 所有者在插入之后、规则安装之前退出时，NameOwnerChanged 已经错过，只能主动查询
+    if (auto owned = nameWatcher_->hasOwner(name); owned && !*owned)
+        onNameOwnerChanged(name, name, "");
+}
+
+void StatusNotifierWatcherService::onNameOwnerChanged(
+    const std::string &name, const std::string & /*oldOwner*/, const std::string &newOwner
+) {
+    if (!newOwner.empty())
+        return;
+
+    std::vector<std::string> removed;
+    std::vector<std::unique_ptr<CachedStatusNotifierItem>> caches;
+    bool hostRemoved;
+    {
+        std::lock_guard lock(mutex_);
+        for (auto it = items_.begin(); it != items_.end();) {
+            if (splitAddress(it->first).first == name) {
+                removed.push_back(it->first);
+                caches.push_back(std::move(it->second));
+                it = items_.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        hostRemoved = hosts_.erase(name) > 0;
+    }
+
+    // 在锁外销毁缓存，它们会等待各自的事件循环线程退出
+    caches.clear();
+
+    for (size_t i = 0; i < removed.size(); ++i)
+        nameWatcher_->unwatch(name);
+    if (hostRemoved)
+        nameWatcher_->unwatch(name);
+
+    for (const auto &address : removed)
+        object_->emitSignal("StatusNotifierItemUnregistered").onInterface(WATCHER_INTERFACE).withArguments(address);
+    if (hostRemoved)
+        object_->emitSignal("StatusNotifierHostUnregistered").onInterface(WATCHER_INTERFACE).withArguments();
+}
+
+void StatusNotifierWatcherService::connectPending() {
+    std::unique_lock lock(mutex_);
+    while (true) {
+        pendingCv_.wait(lock, [this] { return stopping_ || !pending_.empty(); });
+        if (stopping_)
+            return;
+
+        std::string address = std::move(pending_.front());
+        pending_.pop_front();
+        lock.unlock();
+
+        auto [service, path] = splitAddress(address);
+        auto cache = std::make_unique<CachedStatusNotifierItem>(service, path);
+        const bool connected = cache->connect().has_value();
+
+        lock.lock();
+        // 连接期间托盘项可能已经注销
+        if (auto it = items_.find(address); connected && it != items_.end() && !it->second) {
+            it->second = std::move(cache);
+            continue;
+        }
+
+        lock.unlock();
+        cache.reset();
+        lock.lock();
+    }
+}
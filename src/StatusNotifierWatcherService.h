@@ -0,0 +1,72 @@
+//
+// Created by tray-control on 2024/03/23.
+//
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <expected>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Errors.h"
+
+namespace sdbus {
+class IConnection;
+class IObject;
+} // namespace sdbus
+
+class CachedStatusNotifierItem;
+class NameOwnerWatcher;
+
+// 扩展接口：GetItemsWithProperties 一次返回所有托盘项及其属性（签名 a(sa{sv})），
+// SignalStats 属性返回本进程收到和交给使用者的信号数
+inline constexpr const char *TRAY_CONTROL_WATCHER_INTERFACE = "io.github.acd407.TrayControl.Watcher";
+
+// 内置的 org.kde.StatusNotifierWatcher 实现，用于没有托盘宿主的环境。
+// 跟踪托盘项注册和名称所有者变化，并缓存每个托盘项的属性
+class StatusNotifierWatcherService {
+  public:
+    StatusNotifierWatcherService();
+    ~StatusNotifierWatcherService();
+
+    StatusNotifierWatcherService(const StatusNotifierWatcherService &) = delete;
+    StatusNotifierWatcherService &operator=(const StatusNotifierWatcherService &) = delete;
+
+    // 申请服务名并导出对象；服务名已被占用时返回错误
+    std::expected<void, Error> start();
+
+    // 在当前线程运行事件循环，直到出错
+    std::expected<void, Error> run();
+
+    std::vector<std::string> registeredItems() const;
+
+  private:
+    std::unique_ptr<sdbus::IConnection> connection_;
+    std::unique_ptr<sdbus::IObject> object_;
+    // 只关注已注册托盘项和宿主所在的名称，而不是总线上所有的名称变化
+    std::unique_ptr<NameOwnerWatcher> nameWatcher_;
+
+    mutable std::mutex mutex_;
+    // 地址 -> 属性缓存，缓存建立之前为空
+    std::map<std::string, std::unique_ptr<CachedStatusNotifierItem>> items_;
+    std::set<std::string> hosts_;
+
+    // 在后台线程中连接新注册的托盘项，避免阻塞事件循环
+    std::condition_variable pendingCv_;
+    std::deque<std::string> pending_;
+    bool stopping_ = false;
+    std::thread worker_;
+
+    void registerItem(const std::string &serviceOrPath, const std::string &sender);
+    void registerHost(const std::string &service);
+    void onNameOwnerChanged(const std::string &name, const std::string &oldOwner, const std::string &newOwner);
+    // watch 之后确认名称仍有所有者，否则按所有者退出处理
+    void unregisterIfGone(const std::string &name);
+    void connectPending();
+};
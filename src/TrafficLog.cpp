@@ -0,0 +1,409 @@
+//
+// Created by tray-control on 2024/06/08.
+//
+
+#include "TrafficLog.h"
+
+#include <algorithm>
+#include <bit>
+#include <cerrno>
+#include <cstring>
+#include <iterator>
+#include <systemd/sd-bus.h>
+
+namespace {
+
+constexpr std::string_view MAGIC{"TRAYREC\1", 8};
+
+void putVarint(std::string &out, uint64_t value) {
+    while (value >= 0x80) {
+        out += static_cast<char>((value & 0x7f) | 0x80);
+        value >>= 7;
+    }
+    out += static_cast<char>(value);
+}
+
+std::optional<uint64_t> getVarint(std::string_view &in) {
+    uint64_t value = 0;
+    for (unsigned shift = 0; shift < 64 && !in.empty(); shift += 7) {
+        const auto byte = static_cast<uint8_t>(in.front());
+        in.remove_prefix(1);
+        value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+        if (!(byte & 0x80))
+            return value;
+    }
+    return std::nullopt;
+}
+
+uint64_t zigzag(int64_t value) { return (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63); }
+
+int64_t unzigzag(uint64_t value) { return static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1); }
+
+void putString(std::string &out, std::string_view str) {
+    putVarint(out, str.size());
+    out += str;
+}
+
+std::optional<std::string_view> getString(std::string_view &in) {
+    const auto size = getVarint(in);
+    if (!size || *size > in.size())
+        return std::nullopt;
+    const auto str = in.substr(0, *size);
+    in.remove_prefix(*size);
+    return str;
+}
+
+bool isContainer(char type) { return type == 'a' || type == 'v' || type == 'r' || type == 'e'; }
+
+// 编码当前容器中剩余的值，到达容器末尾时返回 0
+int encodeValues(sd_bus_message *message, std::string &out) {
+    for (;;) {
+        char type;
+        const char *contents;
+        int r = sd_bus_message_peek_type(message, &type, &contents);
+        if (r <= 0)
+            return r;
+
+        out += type;
+        if (isContainer(type)) {
+            putString(out, contents);
+            if ((r = sd_bus_message_enter_container(message, type, contents)) < 0)
+                return r;
+            if ((r = encodeValues(message, out)) < 0)
+                return r;
+            if ((r = sd_bus_message_exit_container(message)) < 0)
+                return r;
+            out += '\0';
+            continue;
+        }
+
+        switch (type) {
+        case 'y': {
+            uint8_t value;
+            r = sd_bus_message_read_basic(message, type, &value);
+            out += static_cast<char>(value);
+            break;
+        }
+        case 'b': {
+            int value;
+            r = sd_bus_message_read_basic(message, type, &value);
+            putVarint(out, value ? 1 : 0);
+            break;
+        }
+        case 'n': {
+            int16_t value;
+            r = sd_bus_message_read_basic(message, type, &value);
+            putVarint(out, zigzag(value));
+            break;
+        }
+        case 'q': {
+            uint16_t value;
+            r = sd_bus_message_read_basic(message, type, &value);
+            putVarint(out, value);
+            break;
+        }
+        case 'i': {
+            int32_t value;
+            r = sd_bus_message_read_basic(message, type, &value);
+            putVarint(out, zigzag(value));
+            break;
+        }
+        case 'u': {
+            uint32_t value;
+            r = sd_bus_message_read_basic(message, type, &value);
+            putVarint(out, value);
+            break;
+        }
+        case 'x': {
+            int64_t value;
+            r = sd_bus_message_read_basic(message, type, &value);
+            putVarint(out, zigzag(value));
+            break;
+        }
+        case 't': {
+            uint64_t value;
+            r = sd_bus_message_read_basic(message, type, &value);
+            putVarint(out, value);
+            break;
+        }
+        case 'd': {
+            double value;
+            r = sd_bus_message_read_basic(message, type, &value);
+            const auto bits = std::bit_cast<uint64_t>(value);
+            for (int i = 0; i < 8; ++i)
+                out += static_cast<char>(bits >> (8 * i));
+            break;
+        }
+        case 's':
+        case 'o':
+        case 'g': {
+            const char *value;
+            r = sd_bus_message_read_basic(message, type, &value);
+            if (r >= 0)
+                putString(out, value);
+            break;
+        }
+        default:
+            // 文件描述符（h）不能脱离原进程重放
+            return -ENOTSUP;
+        }
+        if (r < 0)
+            return r;
+    }
+}
+
+int appendValues(sd_bus_message *message, std::string_view &in) {
+    while (!in.empty()) {
+        const char type = in.front();
+        in.remove_prefix(1);
+        if (type == '\0')
+            return 0;
+
+        int r;
+        if (isContainer(type)) {
+            const auto contents = getString(in);
+            if (!contents)
+                return -EBADMSG;
+            if ((r = sd_bus_message_open_container(message, type, std::string(*contents).c_str())) < 0)
+                return r;
+            if ((r = appendValues(message, in)) < 0)
+                return r;
+            if ((r = sd_bus_message_close_container(message)) < 0)
+                return r;
+            continue;
+        }
+
+        switch (type) {
+        case 'y': {
+            if (in.empty())
+                return -EBADMSG;
+            const auto value = static_cast<uint8_t>(in.front());
+            in.remove_prefix(1);
+            r = sd_bus_message_append_basic(message, type, &value);
+            break;
+        }
+        case 'b':
+        case 'n':
+        case 'q':
+        case 'i':
+        case 'u':
+        case 'x':
+        case 't': {
+            const auto raw = getVarint(in);
+            if (!raw)
+                return -EBADMSG;
+            if (type == 'b') {
+                const int value = *raw != 0;
+                r = sd_bus_message_append_basic(message, type, &value);
+            } else if (type == 'n') {
+                const auto value = static_cast<int16_t>(unzigzag(*raw));
+                r = sd_bus_message_append_basic(message, type, &value);
+            } else if (type == 'q') {
+                const auto value = static_cast<uint16_t>(*raw);
+                r = sd_bus_message_append_basic(message, type, &value);
+            } else if (type == 'i') {
+                const auto value = static_cast<int32_t>(unzigzag(*raw));
+                r = sd_bus_message_append_basic(message, type, &value);
+            } else if (type == 'u') {
+                const auto value = static_cast<uint32_t>(*raw);
+                r = sd_bus_message_append_basic(message, type, &value);
+            } else if (type == 'x') {
+                const int64_t value = unzigzag(*raw);
+                r = sd_bus_message_append_basic(message, type, &value);
+            } else {
+                const uint64_t value = *raw;
+                r = sd_bus_message_append_basic(message, type, &value);
+            }
+            break;
+        }
+        case 'd': {
+            if (in.size() < 8)
+                return -EBADMSG;
+            uint64_t bits = 0;
+            for (int i = 0; i < 8; ++i)
+                bits |= static_cast<uint64_t>(static_cast<uint8_t>(in[i])) << (8 * i);
+            in.remove_prefix(8);
+            const auto value = std::bit_cast<double>(bits);
+            r = sd_bus_message_append_basic(message, type, &value);
+            break;
+        }
+        case 's':
+        case 'o':
+        case 'g': {
+            const auto value = getString(in);
+            if (!value)
+                return -EBADMSG;
+            r = sd_bus_message_append_basic(message, type, std::string(*value).c_str());
+            break;
+        }
+        default:
+            return -EBADMSG;
+        }
+        if (r < 0)
+            return r;
+    }
+    return 0;
+}
+
+// 把 in 中的值原样复制到 out，只替换字符串；格式错误时返回 false
+bool copyValues(
+    std::string_view &in, std::string &out, const std::function<std::optional<std::string>(std::string_view)> &map
+) {
+    while (!in.empty()) {
+        const char type = in.front();
+        in.remove_prefix(1);
+        out += type;
+        if (type == '\0')
+            return true;
+
+        if (isContainer(type)) {
+            const auto contents = getString(in);
+            if (!contents)
+                return false;
+            putString(out, *contents);
+            if (!copyValues(in, out, map))
+                return false;
+        } else if (type == 's' || type == 'o' || type == 'g') {
+            const auto value = getString(in);
+            if (!value)
+                return false;
+            const auto mapped = type == 's' ? map(*value) : std::nullopt;
+            putString(out, mapped ? std::string_view(*mapped) : *value);
+        } else if (type == 'y' || type == 'd') {
+            const size_t size = type == 'y' ? 1 : 8;
+            if (in.size() < size)
+                return false;
+            out += in.substr(0, size);
+            in.remove_prefix(size);
+        } else {
+            const auto value = getVarint(in);
+            if (!value)
+                return false;
+            putVarint(out, *value);
+        }
+    }
+    return true;
+}
+
+} // namespace
+
+std::expected<TrafficWriter, Error> TrafficWriter::create(const std::string &path) {
+    TrafficWriter writer;
+    writer.path_ = path;
+    writer.out_.open(path, std::ios::binary | std::ios::trunc);
+    if (!writer.out_)
+        return makeError(ErrorKind::IOError, "Could not create " + path);
+    writer.out_.write(MAGIC.data(), MAGIC.size());
+    return writer;
+}
+
+void TrafficWriter::writeString(const std::string &str) {
+    std::string buffer;
+    const auto [it, inserted] = strings_.try_emplace(str, strings_.size());
+    putVarint(buffer, it->second);
+    if (inserted)
+        putString(buffer, str);
+    out_.write(buffer.data(), buffer.size());
+}
+
+void TrafficWriter::write(const TrafficRecord &record) {
+    std::string buffer;
+    buffer += static_cast<char>(record.kind);
+    putVarint(buffer, record.time >= lastTime_ ? record.time - lastTime_ : 0);
+    putVarint(buffer, record.serial);
+    out_.write(buffer.data(), buffer.size());
+    lastTime_ = std::max(lastTime_, record.time);
+
+    for (const auto *field :
+         {&record.sender, &record.destination, &record.path, &record.interface, &record.member, &record.body})
+        writeString(*field);
+}
+
+std::expected<void, Error> TrafficWriter::close() {
+    out_.flush();
+    const bool ok = out_.good();
+    out_.close();
+    if (!ok)
+        return makeError(ErrorKind::IOError, "Could not write " + path_);
+    return {};
+}
+
+std::expected<std::vector<TrafficRecord>, Error> readTraffic(const std::string &path) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file)
+        return makeError(ErrorKind::IOError, "Could not open " + path);
+    const std::string data{std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>()};
+
+    std::string_view in(data);
+    if (!in.starts_with(MAGIC))
+        return makeError(ErrorKind::TypeError, path + " is not a tray traffic recording");
+    in.remove_prefix(MAGIC.size());
+
+    const auto corrupt = [&] { return makeError(ErrorKind::TypeError, "Corrupt recording " + path); };
+    std::vector<std::string> strings;
+    std::vector<TrafficRecord> records;
+    uint64_t time = 0;
+    while (!in.empty()) {
+        TrafficRecord record;
+        const auto kind = static_cast<uint8_t>(in.front());
+        in.remove_prefix(1);
+        if (kind < static_cast<uint8_t>(TrafficKind::Call) || kind > static_cast<uint8_t>(TrafficKind::Signal))
+            return corrupt();
+        record.kind = static_cast<TrafficKind>(kind);
+
+        const auto delta = getVarint(in);
+        const auto serial = getVarint(in);
+        if (!delta || !serial)
+            return corrupt();
+        time += *delta;
+        record.time = time;
+        record.serial = *serial;
+
+        for (auto *field :
+             {&record.sender, &record.destination, &record.path, &record.interface, &record.member, &record.body}) {
+            const auto index = getVarint(in);
+            if (!index || *index > strings.size())
+                return corrupt();
+            if (*index == strings.size()) {
+                const auto str = getString(in);
+                if (!str)
+                    return corrupt();
+                strings.emplace_back(*str);
+            }
+            *field = strings[*index];
+        }
+        records.push_back(std::move(record));
+    }
+    return records;
+}
+
+std::expected<std::string, Error> encodeBody(sd_bus_message *message) {
+    std::string body;
+    int r = sd_bus_message_rewind(message, 1);
+    if (r >= 0)
+        r = encodeValues(message, body);
+    if (r == -ENOTSUP)
+        return makeError(ErrorKind::TypeError, "Messages carrying file descriptors cannot be recorded");
+    if (r < 0)
+        return makeError(ErrorKind::TypeError, std::string("Could not read the message: ") + std::strerror(-r));
+    return body;
+}
+
+int appendBody(sd_bus_message *message, std::string_view body) {
+    const int r = appendValues(message, body);
+    // 顶层没有容器结束标记，提前结束说明数据损坏
+    if (r >= 0 && !body.empty())
+        return -EBADMSG;
+    return r;
+}
+
+std::string mapBodyStrings(
+    std::string_view body, const std::function<std::optional<std::string>(std::string_view)> &map
+) {
+    std::string out;
+    out.reserve(body.size());
+    std::string_view in(body);
+    if (!copyValues(in, out, map))
+        return std::string(body);
+    return out;
+}
@@ -0,0 +1,80 @@
+//
+// Created by tray-control on 2024/06/08.
+//
+// 录制的 DBus 流量：方法调用、回复、错误和信号，带时间戳，供 tray-replay 重放。
+// 文件格式（整数均为 LEB128 变长编码）：
+//   头部：8 字节魔数 "TRAYREC" + 版本号 1
+//   记录：uint8 类型 | 距上一条记录的微秒数 | 序号 | 发送者 | 目标 | 路径 | 接口 | 成员 | 正文
+//   字符串字段是字符串表的下标：下标等于当前表长时其后紧跟长度和内容，并追加到表中。
+//   名称、路径和重复的回复正文因此只保存一次
+// 正文是消息参数的自描述编码：每个值以类型字符开头，基本类型之后是值，
+// 容器（a、v、r、e）之后是内容签名、各个子值和一个 0 字节
+#pragma once
+
+#include <cstdint>
+#include <expected>
+#include <fstream>
+#include <functional>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "Errors.h"
+
+struct sd_bus_message;
+
+enum class TrafficKind : uint8_t {
+    Call = 1,
+    Return = 2,
+    Error = 3,
+    Signal = 4,
+};
+
+struct TrafficRecord {
+    TrafficKind kind = TrafficKind::Call;
+    // 录制开始后的微秒数
+    uint64_t time = 0;
+    // Call 为调用自身的序号，Return/Error 为所回复调用的序号，Signal 为 0
+    uint64_t serial = 0;
+    std::string sender;
+    std::string destination;
+    // Return/Error 没有路径和接口；Error 的成员为错误名
+    std::string path;
+    std::string interface;
+    std::string member;
+    std::string body;
+};
+
+// 录制文件的写入端，只在一个线程上使用
+class TrafficWriter {
+  public:
+    static std::expected<TrafficWriter, Error> create(const std::string &path);
+
+    void write(const TrafficRecord &record);
+    void flush() { out_.flush(); }
+    // 刷新并关闭文件，报告之前的写入错误
+    std::expected<void, Error> close();
+
+  private:
+    std::ofstream out_;
+    std::string path_;
+    std::unordered_map<std::string, uint64_t> strings_;
+    uint64_t lastTime_ = 0;
+
+    void writeString(const std::string &str);
+};
+
+std::expected<std::vector<TrafficRecord>, Error> readTraffic(const std::string &path);
+
+// 从头编码消息的全部参数；含有文件描述符的消息无法录制，返回 TypeError
+std::expected<std::string, Error> encodeBody(sd_bus_message *message);
+
+// 把编码的参数依次追加到消息，失败时返回负的 errno
+int appendBody(sd_bus_message *message, std::string_view body);
+
+// 对正文中每个字符串（s 类型）调用 map，返回值非空时替换为该值
+std::string mapBodyStrings(
+    std::string_view body, const std::function<std::optional<std::string>(std::string_view)> &map
+);
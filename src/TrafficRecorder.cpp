@@ -0,0 +1,248 @@
+//
+// Created by tray-control on 2024/06/08.
+//
+
+#include "TrafficRecorder.h"
+
+#include <cstring>
+#include <systemd/sd-bus.h>
+#include <unistd.h>
+
+#include "SessionBus.h"
+
+namespace {
+
+constexpr const char *BUS_NAME = "org.freedesktop.DBus";
+constexpr const char *BUS_PATH = "/org/freedesktop/DBus";
+// 停止时等待标记的最长时间，总线不向 monitor 转发发给它自己的消息时靠它退出
+constexpr std::chrono::seconds STOP_TIMEOUT{1};
+
+std::string str(const char *value) { return value ? value : ""; }
+
+auto busError(const sd_bus_error &error, int r, const std::string &what) {
+    if (error.name)
+        return makeError(ErrorKind::DBusError, str(error.message), error.name);
+    return makeError(ErrorKind::ConnectionError, what + ": " + std::strerror(-r));
+}
+
+} // namespace
+
+TrafficRecorder::TrafficRecorder(std::string bus) : bus_(std::move(bus)) {}
+
+TrafficRecorder::~TrafficRecorder() {
+    if (thread_.joinable())
+        stop();
+    release();
+}
+
+std::expected<std::unique_ptr<TrafficRecorder>, Error>
+TrafficRecorder::start(const std::string &path, const std::string &bus) {
+    std::unique_ptr<TrafficRecorder> recorder(new TrafficRecorder(bus));
+
+    auto writer = TrafficWriter::create(path);
+    if (!writer)
+        return std::unexpected(writer.error());
+    recorder->writer_ = std::move(*writer);
+
+    auto monitor = openSdBus(bus, true);
+    if (!monitor)
+        return std::unexpected(monitor.error());
+    recorder->monitor_ = *monitor;
+    auto query = openSdBus(bus);
+    if (!query)
+        return std::unexpected(query.error());
+    recorder->query_ = *query;
+
+    // 空的规则列表表示旁听全部消息，本进程的消息在 handle 中挑出
+    sd_bus_message *call = nullptr;
+    sd_bus_error error = SD_BUS_ERROR_NULL;
+    int r = sd_bus_message_new_method_call(
+        recorder->monitor_, &call, BUS_NAME, BUS_PATH, "org.freedesktop.DBus.Monitoring", "BecomeMonitor"
+    );
+    if (r >= 0)
+        r = sd_bus_message_append(call, "asu", 0u, uint32_t{0});
+    if (r >= 0)
+        r = sd_bus_call(recorder->monitor_, call, 0, &error, nullptr);
+    sd_bus_message_unref(call);
+    if (r < 0) {
+        auto res = busError(error, r, "BecomeMonitor");
+        sd_bus_error_free(&error);
+        return res;
+    }
+
+    recorder->start_ = std::chrono::steady_clock::now();
+    recorder->thread_ = std::thread([self = recorder.get()] { self->run(); });
+    return recorder;
+}
+
+std::expected<TrafficRecorderStats, Error> TrafficRecorder::stop() {
+    if (!thread_.joinable())
+        return makeError(ErrorKind::UnknownError, "The recorder is not running");
+
+    // 从一条新连接向总线发送一个调用作为标记：总线按顺序转发消息，monitor 收到标记时，
+    // 本进程在此之前发出和收到的消息都已经录制
+    stopDeadline_ = std::chrono::steady_clock::now() + STOP_TIMEOUT;
+    if (auto marker = openSdBus(bus_)) {
+        const char *unique = nullptr;
+        if (sd_bus_get_unique_name(*marker, &unique) >= 0) {
+            std::lock_guard lock(markerMutex_);
+            marker_ = str(unique);
+        }
+        stopping_.store(true, std::memory_order_release);
+        sd_bus_call_method(*marker, BUS_NAME, BUS_PATH, "org.freedesktop.DBus.Peer", "Ping", nullptr, nullptr, nullptr);
+        sd_bus_flush_close_unref(*marker);
+    } else {
+        stopping_.store(true, std::memory_order_release);
+    }
+
+    thread_.join();
+    release();
+    if (auto res = writer_.close(); !res)
+        return std::unexpected(res.error());
+    return stats_;
+}
+
+void TrafficRecorder::release() {
+    monitor_ = sd_bus_flush_close_unref(monitor_);
+    query_ = sd_bus_flush_close_unref(query_);
+}
+
+void TrafficRecorder::run() {
+    for (;;) {
+        sd_bus_message *message = nullptr;
+        const int r = sd_bus_process(monitor_, &message);
+        if (r < 0)
+            break;
+        if (message) {
+            const bool done = handle(message);
+            sd_bus_message_unref(message);
+            if (done)
+                break;
+            continue;
+        }
+        if (r > 0)
+            continue;
+
+        // 空闲时把已录制的部分写入文件，工具被杀死时也只丢失最后一小段
+        writer_.flush();
+        if (stopping_.load(std::memory_order_acquire) && std::chrono::steady_clock::now() >= stopDeadline_)
+            break;
+        sd_bus_wait(monitor_, 50'000);
+    }
+}
+
+bool TrafficRecorder::handle(sd_bus_message *message) {
+    if (sd_bus_message_is_signal(message, "org.freedesktop.DBus.Local", "Disconnected") > 0)
+        return true;
+
+    TrafficRecord record;
+    record.time =
+        std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start_).count();
+    record.sender = str(sd_bus_message_get_sender(message));
+    record.destination = str(sd_bus_message_get_destination(message));
+    if (stopping_.load(std::memory_order_acquire)) {
+        std::lock_guard lock(markerMutex_);
+        if (!marker_.empty() && record.sender == marker_)
+            return true;
+    }
+
+    uint8_t type = 0;
+    sd_bus_message_get_type(message, &type);
+    switch (type) {
+    case SD_BUS_MESSAGE_METHOD_CALL: {
+        if (record.destination == BUS_NAME)
+            return false;
+        const auto ours = isOurs(record.sender);
+        if (!ours) {
+            ++stats_.skipped;
+            return false;
+        }
+        if (!*ours)
+            return false;
+        record.kind = TrafficKind::Call;
+        sd_bus_message_get_cookie(message, &record.serial);
+        record.path = str(sd_bus_message_get_path(message));
+        record.interface = str(sd_bus_message_get_interface(message));
+        record.member = str(sd_bus_message_get_member(message));
+        if (sd_bus_message_get_expect_reply(message) > 0)
+            pending_.emplace(record.sender, record.serial);
+        break;
+    }
+    case SD_BUS_MESSAGE_METHOD_RETURN:
+    case SD_BUS_MESSAGE_METHOD_ERROR: {
+        sd_bus_message_get_reply_cookie(message, &record.serial);
+        if (!pending_.erase({record.destination, record.serial}))
+            return false;
+        peers_.insert(record.sender);
+        if (type == SD_BUS_MESSAGE_METHOD_ERROR) {
+            record.kind = TrafficKind::Error;
+            const sd_bus_error *error = sd_bus_message_get_error(message);
+            record.member = str(error ? error->name : nullptr);
+        } else {
+            record.kind = TrafficKind::Return;
+        }
+        break;
+    }
+    case SD_BUS_MESSAGE_SIGNAL:
+        if (!peers_.contains(record.sender))
+            return false;
+        record.kind = TrafficKind::Signal;
+        record.path = str(sd_bus_message_get_path(message));
+        record.interface = str(sd_bus_message_get_interface(message));
+        record.member = str(sd_bus_message_get_member(message));
+        break;
+    default:
+        return false;
+    }
+
+    auto body = encodeBody(message);
+    if (!body) {
+        ++stats_.skipped;
+        return false;
+    }
+    record.body = std::move(*body);
+    writer_.write(record);
+
+    switch (record.kind) {
+    case TrafficKind::Call:
+        ++stats_.calls;
+        break;
+    case TrafficKind::Return:
+    case TrafficKind::Error:
+        ++stats_.replies;
+        break;
+    case TrafficKind::Signal:
+        ++stats_.signals;
+        break;
+    }
+    return false;
+}
+
+std::optional<bool> TrafficRecorder::isOurs(const std::string &name) {
+    if (name.empty())
+        return false;
+    if (auto it = ours_.find(name); it != ours_.end())
+        return it->second;
+    // 本进程的连接在打开时登记了唯一名，调用之后立即关闭的连接（如线程代理）也能认出
+    if (isOwnUniqueName(bus_, name)) {
+        ours_.emplace(name, true);
+        return true;
+    }
+
+    // 其他连接（例如不经过 openSdBus 的库）按进程号判断，每个名称只查询一次。
+    // 发送者已经断开时查询失败，无法确认来源
+    sd_bus_message *reply = nullptr;
+    uint32_t pid = 0;
+    int r = sd_bus_call_method(
+        query_, BUS_NAME, BUS_PATH, BUS_NAME, "GetConnectionUnixProcessID", nullptr, &reply, "s", name.c_str()
+    );
+    if (r >= 0)
+        r = sd_bus_message_read(reply, "u", &pid);
+    sd_bus_message_unref(reply);
+
+    std::optional<bool> ours;
+    if (r >= 0)
+        ours = pid == static_cast<uint32_t>(getpid());
+    ours_.emplace(name, ours);
+    return ours;
+}
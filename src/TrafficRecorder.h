@@ -0,0 +1,79 @@
+//
+// Created by tray-control on 2024/06/08.
+//
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <expected>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <set>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+
+#include "Errors.h"
+#include "TrafficLog.h"
+
+struct sd_bus;
+struct sd_bus_message;
+
+struct TrafficRecorderStats {
+    uint64_t calls = 0;
+    uint64_t replies = 0;   // 包括错误回复
+    uint64_t signals = 0;
+    uint64_t skipped = 0;   // 无法编码（携带文件描述符）的消息，以及发送者已经断开、无法确认来源的调用
+};
+
+// 以 monitor 身份旁听总线，录制本进程发出的方法调用、被调用方的回复和错误，以及这些被调用方发出的信号。
+// 录制与库中的代理相互独立，不需要改动任何调用点；发往总线自身（org.freedesktop.DBus）的调用不录制，
+// 重放时由私有总线回答。需要总线允许同一用户成为 monitor（dbus-daemon 与 dbus-broker 的默认配置都允许）
+class TrafficRecorder {
+  public:
+    // 开始录制到 path；bus 为会话总线地址，空表示默认会话总线。返回之后本进程发出的调用都会被录制
+    static std::expected<std::unique_ptr<TrafficRecorder>, Error>
+    start(const std::string &path, const std::string &bus = {});
+
+    // 没有调用 stop 时自动停止并丢弃其结果
+    ~TrafficRecorder();
+
+    TrafficRecorder(const TrafficRecorder &) = delete;
+    TrafficRecorder &operator=(const TrafficRecorder &) = delete;
+
+    // 等待本进程此前发出的消息都被录制后关闭文件。只能调用一次
+    std::expected<TrafficRecorderStats, Error> stop();
+
+  private:
+    explicit TrafficRecorder(std::string bus);
+
+    std::string bus_;
+    sd_bus *monitor_ = nullptr;
+    // 查询发送者进程号，monitor 连接不能发送消息
+    sd_bus *query_ = nullptr;
+    TrafficWriter writer_;
+    std::thread thread_;
+    std::chrono::steady_clock::time_point start_;
+    TrafficRecorderStats stats_;
+
+    std::atomic<bool> stopping_{false};
+    std::chrono::steady_clock::time_point stopDeadline_;
+    std::mutex markerMutex_;
+    std::string marker_;
+
+    // 以下只在录制线程上访问
+    // 发送者是否属于本进程，nullopt 表示发送者已经断开、无法查询
+    std::unordered_map<std::string, std::optional<bool>> ours_;
+    std::set<std::pair<std::string, uint64_t>> pending_;
+    std::unordered_set<std::string> peers_;
+
+    void run();
+    // 处理一条旁听到的消息，看到停止标记时返回 true
+    bool handle(sd_bus_message *message);
+    std::optional<bool> isOurs(const std::string &name);
+    void release();
+};
@@ -0,0 +1,300 @@
+//
+// Created by tray-control on 2024/03/30.
+//
+
+#include "TrayProbe.h"
+#include <sdbus-c++/sdbus-c++.h>
+
+#include <algorithm>
+#include <cmath>
+#include <thread>
+#include <fmt/format.h>
+
+#include "DBusUtils.h"
+#include "StatusNotifierItem.h"
+#include "Utils.h"
+
+namespace {
+constexpr const char *PROPERTIES_INTERFACE = "org.freedesktop.DBus.Properties";
+constexpr const char *ITEM_INTERFACE = "org.kde.StatusNotifierItem";
+constexpr const char *MENU_INTERFACE = "com.canonical.dbusmenu";
+
+// Prometheus 标签使用的调用名，与 ProbeCall 顺序一致
+constexpr std::array<const char *, PROBE_CALL_COUNT> PROBE_CALL_LABELS = {"item_id", "menu_layout", "menu_version"};
+constexpr std::array<double, 3> PROBE_QUANTILES = {0.5, 0.9, 0.99};
+
+bool isTimeout(const sdbus::Error &err) {
+    // 总线超时返回 NoReply，sd-bus 客户端自身超时映射为 ETIMEDOUT
+    const auto &name = err.getName();
+    return name == "org.freedesktop.DBus.Error.NoReply" || name == "org.freedesktop.DBus.Error.Timeout" ||
+           name == "System.Error.ETIMEDOUT";
+}
+
+template <typename F> void timedCall(ProbeCallStats &stats, F &&f) {
+    const auto start = std::chrono::steady_clock::now();
+    try {
+        std::invoke(std::forward<F>(f));
+        stats.latenciesMs.push_back(
+            std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count()
+        );
+    } catch (const sdbus::Error &err) {
+        if (isTimeout(err))
+            ++stats.timeouts;
+        else
+            ++stats.errors;
+    } catch (const std::exception &) {
+        ++stats.errors;
+    }
+}
+
+sdbus::Variant getPropertyWithTimeout(
+    sdbus::IProxy &proxy, const char *interface, const char *property, std::chrono::milliseconds timeout
+) {
+    sdbus::Variant value;
+    proxy.callMethod("Get")
+        .onInterface(PROPERTIES_INTERFACE)
+        .withTimeout(timeout)
+        .withArguments(interface, property)
+        .storeResultsTo(value);
+    return value;
+}
+
+ProbeAppReport probeApp(const std::string &address, const ProbeOptions &options) {
+    ProbeAppReport report;
+    report.address = address;
+    auto [service, path] = splitAddress(address);
+
+    std::unique_ptr<sdbus::IConnection> connection;
+    std::unique_ptr<sdbus::IProxy> itemProxy;
+    try {
+        // 每个应用独占一个连接，同步调用互不阻塞；不需要信号，因此不启动事件循环
+        connection = sdbus::createSessionBusConnection();
+        itemProxy = sdbus::createProxy(*connection, sdbus::ServiceName{service}, sdbus::ObjectPath{path});
+    } catch (const std::exception &) {
+        for (auto &stats : report.calls)
+            stats.errors = options.rounds;
+        return report;
+    }
+
+    // 菜单路径只解析一次，不计入统计；与 StatusNotifierItem::getMenu 一样退回到 /MenuBar
+    report.menuPath = "/MenuBar";
+    try {
+        auto menu = getPropertyWithTimeout(*itemProxy, ITEM_INTERFACE, "Menu", options.timeout);
+        if (menu.containsValueOfType<sdbus::ObjectPath>())
+            report.menuPath = menu.get<sdbus::ObjectPath>();
+    } catch (const std::exception &) {
+    }
+
+    std::unique_ptr<sdbus::IProxy> menuProxy;
+    try {
+        menuProxy = sdbus::createProxy(*connection, sdbus::ServiceName{service}, sdbus::ObjectPath{report.menuPath});
+    } catch (const std::exception &) {
+    }
+
+    for (uint32_t round = 0; round < options.rounds; ++round) {
+        if (round > 0)
+            std::this_thread::sleep_for(options.interval);
+
+        timedCall(report.stats(ProbeCall::ItemId), [&] {
+            auto id = getPropertyWithTimeout(*itemProxy, ITEM_INTERFACE, "Id", options.timeout);
+            if (report.id.empty() && id.containsValueOfType<std::string>())
+                report.id = id.get<std::string>();
+        });
+
+        if (!menuProxy) {
+            ++report.stats(ProbeCall::MenuLayout).errors;
+            ++report.stats(ProbeCall::MenuVersion).errors;
+            continue;
+        }
+
+        timedCall(report.stats(ProbeCall::MenuLayout), [&] {
+            uint32_t revision;
+            sdbus::Struct<int32_t, std::map<std::string, sdbus::Variant>, std::vector<sdbus::Variant>> layout;
+            menuProxy->callMethod("GetLayout")
+                .onInterface(MENU_INTERFACE)
+                .withTimeout(options.timeout)
+                .withArguments(int32_t{0}, int32_t{0}, std::vector<std::string>{})
+                .storeResultsTo(revision, layout);
+        });
+
+        timedCall(report.stats(ProbeCall::MenuVersion), [&] {
+            getPropertyWithTimeout(*menuProxy, MENU_INTERFACE, "Version", options.timeout);
+        });
+    }
+
+    return report;
+}
+
+std::string escapeLabel(std::string_view value) {
+    std::string escaped;
+    escaped.reserve(value.size());
+    for (char c : value) {
+        if (c == '\\' || c == '"')
+            escaped += '\\';
+        if (c == '\n') {
+            escaped += "\\n";
+            continue;
+        }
+        escaped += c;
+    }
+    return escaped;
+}
+
+// 文本报告中的延迟，没有成功样本时为 "-"
+std::string formatLatency(std::optional<double> latencyMs) {
+    return latencyMs ? fmt::format("{:.2f}ms", *latencyMs) : std::string("-");
+}
+
+std::string joinNames(const ProbeReport &report, auto &&predicate) {
+    std::string names;
+    for (const auto &app : report.apps) {
+        if (!predicate(app))
+            continue;
+        if (!names.empty())
+            names += ", ";
+        names += app.name();
+    }
+    return names.empty() ? "none" : names;
+}
+} // namespace
+
+std::optional<double> ProbeCallStats::percentile(double q) const {
+    if (latenciesMs.empty())
+        return std::nullopt;
+
+    // nearest-rank 百分位
+    auto sorted = latenciesMs;
+    std::ranges::sort(sorted);
+    const auto rank = static_cast<size_t>(std::ceil(q * static_cast<double>(sorted.size())));
+    return sorted[std::clamp<size_t>(rank, 1, sorted.size()) - 1];
+}
+
+bool ProbeAppReport::unresponsive() const {
+    return std::ranges::any_of(calls, [](const ProbeCallStats &stats) {
+        return stats.timeouts > 0 && stats.latenciesMs.empty();
+    });
+}
+
+bool ProbeAppReport::slow(std::chrono::milliseconds threshold) const {
+    return std::ranges::any_of(calls, [threshold](const ProbeCallStats &stats) {
+        if (stats.timeouts > 0)
+            return true;
+        const auto p90 = stats.percentile(0.9);
+        return p90 && *p90 > static_cast<double>(threshold.count());
+    });
+}
+
+std::expected<ProbeReport, Error>
+probeTrayItems(const std::vector<std::string> &addresses, const ProbeOptions &options) {
+    return safelyExec([&] -> std::expected<ProbeReport, Error> {
+        const auto start = std::chrono::steady_clock::now();
+
+        ProbeReport report;
+        report.options = options;
+        report.apps.resize(addresses.size());
+
+        parallelFor(addresses.size(), options.jobs, [&](size_t i) {
+            report.apps[i] = probeApp(addresses[i], options);
+        });
+
+        report.elapsed =
+            std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+        return report;
+    });
+}
+
+std::string formatProbeReport(const ProbeReport &report) {
+    std::string out = fmt::format(
+        "Probed {} items in {} rounds (timeout {}ms, slow threshold {}ms), took {}ms\n", report.apps.size(),
+        report.options.rounds, report.options.timeout.count(), report.options.slowThreshold.count(),
+        report.elapsed.count()
+    );
+
+    for (const auto &app : report.apps) {
+        out += fmt::format("\n{} ({}{})\n", app.name(), app.address, app.menuPath.empty() ? "" : " " + app.menuPath);
+        for (size_t i = 0; i < PROBE_CALL_COUNT; ++i) {
+            const auto &stats = app.calls[i];
+            out += fmt::format(
+                "  {:<12} p50 {:>10}  p90 {:>10}  p99 {:>10}  ok {}  errors {}  timeouts {}\n",
+                magic_enum::enum_name(static_cast<ProbeCall>(i)), formatLatency(stats.percentile(0.5)),
+                formatLatency(stats.percentile(0.9)), formatLatency(stats.percentile(0.99)), stats.latenciesMs.size(),
+                stats.errors, stats.timeouts
+            );
+        }
+    }
+
+    out += fmt::format(
+        "\nSlow: {}\nUnresponsive: {}\n",
+        joinNames(
+            report,
+            [&](const ProbeAppReport &app) { return app.slow(report.options.slowThreshold) && !app.unresponsive(); }
+        ),
+        joinNames(report, [](const ProbeAppReport &app) { return app.unresponsive(); })
+    );
+    return out;
+}
+
+std::string formatProbePrometheus(const ProbeReport &report) {
+    std::string out;
+    out += "# HELP tray_probe_latency_seconds Latency of D-Bus calls to tray items.\n";
+    out += "# TYPE tray_probe_latency_seconds summary\n";
+    for (const auto &app : report.apps) {
+        const auto labels = fmt::format("app=\"{}\",address=\"{}\"", escapeLabel(app.name()), escapeLabel(app.address));
+        for (size_t i = 0; i < PROBE_CALL_COUNT; ++i) {
+            const auto &stats = app.calls[i];
+            for (double q : PROBE_QUANTILES) {
+                // 没有样本时按 Prometheus 的约定输出 NaN，而不是看起来像真实延迟的 0
+                const auto latency = stats.percentile(q);
+                const auto value = latency ? fmt::format("{}", *latency / 1000) : std::string("NaN");
+                out += fmt::format(
+                    "tray_probe_latency_seconds{{{},call=\"{}\",quantile=\"{}\"}} {}\n", labels, PROBE_CALL_LABELS[i],
+                    q, value
+                );
+            }
+            double sum = 0;
+            for (double latency : stats.latenciesMs)
+                sum += latency;
+            out += fmt::format(
+                "tray_probe_latency_seconds_sum{{{},call=\"{}\"}} {}\n", labels, PROBE_CALL_LABELS[i], sum / 1000
+            );
+            out += fmt::format(
+                "tray_probe_latency_seconds_count{{{},call=\"{}\"}} {}\n", labels, PROBE_CALL_LABELS[i],
+                stats.latenciesMs.size()
+            );
+        }
+    }
+
+    auto counter = [&](std::string_view name, std::string_view help, auto member) {
+        out += fmt::format("# HELP {} {}\n# TYPE {} counter\n", name, help, name);
+        for (const auto &app : report.apps) {
+            for (size_t i = 0; i < PROBE_CALL_COUNT; ++i) {
+                out += fmt::format(
+                    "{}{{app=\"{}\",address=\"{}\",call=\"{}\"}} {}\n", name, escapeLabel(app.name()),
+                    escapeLabel(app.address), PROBE_CALL_LABELS[i], app.calls[i].*member
+                );
+            }
+        }
+    };
+    counter("tray_probe_timeouts_total", "Calls that got no reply before the deadline.", &ProbeCallStats::timeouts);
+    counter("tray_probe_errors_total", "Calls that failed with a D-Bus error.", &ProbeCallStats::errors);
+
+    auto gauge = [&](std::string_view name, std::string_view help, auto &&predicate) {
+        out += fmt::format("# HELP {} {}\n# TYPE {} gauge\n", name, help, name);
+        for (const auto &app : report.apps) {
+            out += fmt::format(
+                "{}{{app=\"{}\",address=\"{}\"}} {}\n", name, escapeLabel(app.name()), escapeLabel(app.address),
+                predicate(app) ? 1 : 0
+            );
+        }
+    };
+    gauge("tray_probe_slow", "Whether the item exceeded the slow threshold.", [&](const ProbeAppReport &app) {
+        return app.slow(report.options.slowThreshold);
+    });
+    gauge("tray_probe_unresponsive", "Whether every call of some kind timed out.", [](const ProbeAppReport &app) {
+        return app.unresponsive();
+    });
+
+    out += "# HELP tray_probe_items Number of registered tray items.\n# TYPE tray_probe_items gauge\n";
+    out += fmt::format("tray_probe_items {}\n", report.apps.size());
+    return out;
+}
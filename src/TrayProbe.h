@@ -0,0 +1,76 @@
+//
+// Created by tray-control on 2024/03/30.
+//
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <expected>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "Errors.h"
+
+// 健康探测中对每个托盘应用发起的调用
+enum class ProbeCall {
+    ItemId,      // org.freedesktop.DBus.Properties.Get(StatusNotifierItem, Id)
+    MenuLayout,  // com.canonical.dbusmenu.GetLayout(0, 0, [])
+    MenuVersion, // org.freedesktop.DBus.Properties.Get(com.canonical.dbusmenu, Version)
+};
+
+inline constexpr size_t PROBE_CALL_COUNT = 3;
+
+struct ProbeOptions {
+    uint32_t rounds = 5;
+    // 单次调用的截止时间，超时记为无响应
+    std::chrono::milliseconds timeout{500};
+    // p90 超过该值的应用记为慢
+    std::chrono::milliseconds slowThreshold{100};
+    std::chrono::milliseconds interval{200};
+    // 同时探测的应用数，每个应用占用一个线程和一条连接
+    size_t jobs = 8;
+};
+
+struct ProbeCallStats {
+    std::vector<double> latenciesMs; // 成功调用的耗时
+    uint32_t errors = 0;             // 返回了 DBus 错误（例如未实现菜单）
+    uint32_t timeouts = 0;           // 在截止时间内没有回复
+
+    // q 取 0~1，没有成功样本时返回 nullopt：全部超时的应用不能显示成延迟为 0
+    std::optional<double> percentile(double q) const;
+};
+
+struct ProbeAppReport {
+    std::string address;
+    std::string menuPath;
+    std::string id; // 获取失败时为空
+    std::array<ProbeCallStats, PROBE_CALL_COUNT> calls;
+
+    ProbeCallStats &stats(ProbeCall call) { return calls[static_cast<size_t>(call)]; }
+    const ProbeCallStats &stats(ProbeCall call) const { return calls[static_cast<size_t>(call)]; }
+
+    // 报告中使用的应用名：优先 Id，其次地址
+    std::string_view name() const { return id.empty() ? std::string_view(address) : std::string_view(id); }
+    // 任意一类调用全部超时
+    bool unresponsive() const;
+    // 任意一类调用出现超时或 p90 超过阈值
+    bool slow(std::chrono::milliseconds threshold) const;
+};
+
+struct ProbeReport {
+    ProbeOptions options;
+    std::vector<ProbeAppReport> apps;
+    std::chrono::milliseconds elapsed{0};
+};
+
+// 每个托盘应用在独立的连接上探测，最多 options.jobs 个应用同时进行，挂起的应用只占用一个工作线程
+std::expected<ProbeReport, Error>
+probeTrayItems(const std::vector<std::string> &addresses, const ProbeOptions &options);
+
+std::string formatProbeReport(const ProbeReport &report);
+// Prometheus textfile collector 格式
+std::string formatProbePrometheus(const ProbeReport &report);
+
@@ -7,6 +7,10 @@
 #include <expected>
 #include <ranges>
 #include <functional>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
 
 template <typename T, typename E> constexpr std::variant<T, E> toVariant(std::expected<T, E> &&expected) {
     if (expected)
@@ -29,4 +33,19 @@ template <typename T, typename E, typename F> constexpr void ifExpected(std::exp
     if (exp) {
         std::invoke(std::forward<F>(f), std::move(exp.value()));
     }
-}
\ No newline at end of file
+}
+
+// 以最多 limit 个线程并发调用 f(0) ... f(count - 1)，全部完成后返回
+template <typename F> void parallelFor(size_t count, size_t limit, F &&f) {
+    const size_t workers = std::min(count, std::max<size_t>(limit, 1));
+    std::atomic<size_t> next{0};
+    std::vector<std::jthread> threads;
+    threads.reserve(workers);
+    for (size_t w = 0; w < workers; ++w) {
+        threads.emplace_back([&] {
+            for (size_t i; (i = next.fetch_add(1)) < count;) {
+                f(i);
+            }
+        });
+    }
+}
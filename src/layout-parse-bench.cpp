@@ -0,0 +1,65 @@
+//
+// Created by tray-control on 2024/04/20.
+//
+// 比较两种菜单布局解码方式的分配次数和耗时：
+//   map   —— 按签名接收为 sdbus::Struct，再转换为 std::map 属性的 MenuLayoutItem 树（DBusMenu::getLayout）
+//   arena —— 直接从消息解码到复用的 MenuLayoutArena（DBusMenu::getLayoutInto）
+// 布局是合成的，不需要会话总线
+#include <chrono>
+#include <cxxopts.hpp>
+#include <iostream>
+#include <sdbus-c++/sdbus-c++.h>
+#include <fmt/printf.h>
+
+#include "BenchSupport.h"
+#include "DBusMenu.h"
+#include "MenuLayoutArena.h"
+
+int main(int argc, char *argv[]) {
+    cxxopts::Options optionsDecl("layout-parse-bench", "Compare menu layout parsing into std::map trees and arenas");
+    optionsDecl.add_options()("h,help", "Print help and exit", cxxopts::value<bool>()->default_value("false"))
+        ("breadth", "Children per submenu", cxxopts::value<uint32_t>()->default_value("8"))
+        ("depth", "Submenu levels below the root", cxxopts::value<uint32_t>()->default_value("3"))
+        ("min-time", "Minimum run time of each method in milliseconds", cxxopts::value<uint32_t>()->default_value("500"));
+
+    const auto options = optionsDecl.parse(argc, argv);
+    if (options["help"].as<bool>()) {
+        std::cout << optionsDecl.help();
+        return 0;
+    }
+    const auto breadth = options["breadth"].as<uint32_t>();
+    const auto depth = options["depth"].as<uint32_t>();
+    const std::chrono::milliseconds minTime(options["min-time"].as<uint32_t>());
+
+    auto fixture = makeUniformLayout(breadth, depth);
+    auto &message = fixture.message;
+
+    size_t bytes = 0;
+    const auto mapResult = measure(minTime, [&message, &bytes] {
+        message.rewind(true);
+        MenuLayoutStruct layout;
+        message >> layout;
+        bytes = 0;
+        const MenuLayoutItem root = parseMenuLayout(layout, bytes);
+    });
+
+    // 预热时 arena 的缓冲区会长到足够大
+    MenuLayoutArena arena;
+    const auto arenaResult = measure(minTime, [&message, &arena] {
+        message.rewind(true);
+        arena.reset();
+        size_t arenaBytes = 0;
+        parseMenuLayout(message, *arena.newRoot(), arenaBytes);
+    });
+
+    fmt::print("{} items, {} payload bytes\n", fixture.nodes, bytes);
+    fmt::print("{:<8}{:>14}{:>16}\n", "method", "us/parse", "allocs/parse");
+    fmt::print("{:<8}{:>14.1f}{:>16.1f}\n", "map", mapResult.nsPerIteration / 1000, mapResult.allocationsPerIteration);
+    fmt::print(
+        "{:<8}{:>14.1f}{:>16.1f}\n", "arena", arenaResult.nsPerIteration / 1000, arenaResult.allocationsPerIteration
+    );
+    fmt::print(
+        "arena capacity {} bytes, last upstream allocations {}\n", arena.capacity(), arena.upstreamAllocations()
+    );
+    return 0;
+}
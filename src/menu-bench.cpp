@@ -0,0 +1,120 @@
+//
+// Created by tray-control on 2024/04/27.
+//
+// CPU 侧热路径的微基准：在合成的回复消息上反复解码和遍历，不经过总线。
+// 每项结果按菜单项（或属性集）折算为 ns 和堆分配次数
+#include <chrono>
+#include <cstdio>
+#include <cxxopts.hpp>
+#include <iostream>
+#include <sdbus-c++/sdbus-c++.h>
+#include <fmt/printf.h>
+
+#include "BenchSupport.h"
+#include "DBusMenu.h"
+#include "MenuLayoutArena.h"
+#include "MenuVisitors.h"
+#include "StatusNotifierItem.h"
+
+namespace {
+
+void report(std::string_view fixture, std::string_view name, size_t units, const BenchResult &result) {
+    fmt::print(
+        "{:<12}{:<22}{:>8}{:>12.1f}{:>14.2f}\n", fixture, name, units, result.nsPerIteration / units,
+        result.allocationsPerIteration / units
+    );
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+    cxxopts::Options optionsDecl("menu-bench", "Microbenchmarks of menu decoding and output on synthetic replies");
+    optionsDecl.add_options()("h,help", "Print help and exit", cxxopts::value<bool>()->default_value("false"))
+        ("min-time", "Minimum run time of each benchmark in milliseconds", cxxopts::value<uint32_t>()->default_value("200"));
+
+    const auto options = optionsDecl.parse(argc, argv);
+    if (options["help"].as<bool>()) {
+        std::cout << optionsDecl.help();
+        return 0;
+    }
+    const std::chrono::milliseconds minTime(options["min-time"].as<uint32_t>());
+
+    // 打印的输出丢弃掉，只测格式化本身
+    std::FILE *devNull = std::fopen("/dev/null", "w");
+    if (!devNull) {
+        std::perror("/dev/null");
+        return 1;
+    }
+
+    fmt::print("{:<12}{:<22}{:>8}{:>12}{:>14}\n", "fixture", "benchmark", "units", "ns/unit", "allocs/unit");
+
+    for (auto &fixture : makeLayoutFixtures()) {
+        auto &message = fixture.message;
+        const size_t nodes = fixture.nodes;
+
+        // DBusMenu::getLayout 的解码：sdbus::Struct + std::map 构成的树
+        report(fixture.name, "parseLayout", nodes, measure(minTime, [&message] {
+                   message.rewind(true);
+                   MenuLayoutStruct layout;
+                   message >> layout;
+                   size_t bytes = 0;
+                   const MenuLayoutItem root = parseMenuLayout(layout, bytes);
+               }));
+
+        MenuLayoutArena arena;
+        report(fixture.name, "parseLayout/arena", nodes, measure(minTime, [&message, &arena] {
+                   message.rewind(true);
+                   arena.reset();
+                   size_t bytes = 0;
+                   parseMenuLayout(message, *arena.newRoot(), bytes);
+               }));
+
+        const MenuLayoutVisitor noop;
+        report(fixture.name, "visitLayout", nodes, measure(minTime, [&message, &noop] {
+                   message.rewind(true);
+                   size_t bytes = 0;
+                   visitMenuLayout(message, noop, bytes);
+               }));
+
+        report(fixture.name, "buildMenuItemInfo", nodes, measure(minTime, [&message] {
+                   message.rewind(true);
+                   std::vector<MenuItemInfo> menuItems;
+                   std::vector<int> parents;
+                   size_t bytes = 0;
+                   visitMenuLayout(message, menuItemInfoBuilder(menuItems, parents), bytes);
+               }));
+
+        // 查找前序遍历中的最后一项，必须走完整个菜单
+        const std::vector<int32_t> targetIds{fixture.lastId};
+        report(fixture.name, "findMenuItem", nodes, measure(minTime, [&message, &targetIds] {
+                   message.rewind(true);
+                   std::vector<int32_t> foundIds;
+                   size_t bytes = 0;
+                   visitMenuLayout(message, menuItemFinder(targetIds, foundIds), bytes);
+               }));
+
+        const auto printer = menuPrinter(devNull);
+        report(fixture.name, "printMenuItems", nodes, measure(minTime, [&message, &printer] {
+                   message.rewind(true);
+                   size_t bytes = 0;
+                   visitMenuLayout(message, printer, bytes);
+               }));
+    }
+
+    constexpr size_t groupSize = 200;
+    auto group = makeGroupPropertiesFixture(groupSize);
+    report("group", "parseGroupProperties", groupSize, measure(minTime, [&group] {
+               group.rewind(true);
+               size_t bytes = 0;
+               const auto items = parseGroupProperties(group, bytes);
+           }));
+
+    auto getAll = makeSNIPropertiesFixture();
+    report("sni", "parseSNIProperties", 1, measure(minTime, [&getAll] {
+               getAll.rewind(true);
+               const auto properties = parseSNIProperties(getAll);
+           }));
+
+    std::fclose(devNull);
+    return 0;
+}
@@ -1,12 +1,15 @@
 //
 // Created by tray-control on 2023/11/24.
 //
+#include <chrono>
+#include <cstdlib>
 #include <cxxopts.hpp>
 #include <iostream>
 #include <string>
 #include <vector>
 #include <memory>
 #include <optional>
+#include <thread>
 
 #include "ftxui/screen/screen.hpp"
 #include "ftxui/dom/elements.hpp"
@@ -15,72 +18,42 @@
 
 #include "StatusNotifierWatcher.h"
 #include "StatusNotifierItem.h"
+#include "BusThread.h"
 #include "DBusMenu.h"
+#include "EventQueue.h"
+#include "MenuVisitors.h"
+#include "TrafficRecorder.h"
 #include "Utils.h"
 
-void exitWithMsg(std::string_view msg, int code = -1) {
-    std::cerr << msg << std::endl;
-    exit(code);
-}
-
-// 菜单项信息
-struct MenuItemInfo {
-    int32_t id;
-    std::string label;
-    bool enabled;
-    bool isSeparator;
-    std::vector<MenuItemInfo> children;
-    int depth;       // 菜单项深度
-    int parentIndex; // 在父菜单中的索引
-};
-
-// 递归构建菜单项信息
-void buildMenuItemInfo(
-    const MenuLayoutItem &item, std::vector<MenuItemInfo> &menuItems, int depth = 0, int parentIndex = -1
-) {
-    MenuItemInfo info;
-    info.id = item.id;
-    info.depth = depth;
-    info.parentIndex = parentIndex;
-
-    // 获取标签
-    auto labelIt = item.properties.find("label");
-    if (labelIt != item.properties.end() && std::holds_alternative<std::string>(labelIt->second)) {
-        info.label = std::get<std::string>(labelIt->second);
-    } else {
-        info.label = "(无标签)";
-    }
-
-    // 获取启用状态
-    auto enabledIt = item.properties.find("enabled");
-    if (enabledIt != item.properties.end() && std::holds_alternative<bool>(enabledIt->second)) {
-        info.enabled = std::get<bool>(enabledIt->second);
-    } else {
-        info.enabled = true;
-    }
+// 刷新线程获取布局的超时。界面退出时要等刷新线程结束，默认的 25 秒超时会让挂起的应用拖住退出
+constexpr std::chrono::milliseconds REFRESH_TIMEOUT{2000};
 
-    // 检查是否为分隔符
-    auto typeIt = item.properties.find("type");
-    if (typeIt != item.properties.end() && std::holds_alternative<std::string>(typeIt->second)) {
-        info.isSeparator = (std::get<std::string>(typeIt->second) == "separator");
-    } else {
-        info.isSeparator = false;
-    }
+// --record 的录制器，在 atexit 中停止
+std::unique_ptr<TrafficRecorder> recorder;
 
-    // 添加到菜单项列表
-    menuItems.push_back(info);
-    int currentIndex = menuItems.size() - 1;
+void stopRecording() {
+    if (!recorder)
+        return;
+    if (auto stats = recorder->stop(); !stats)
+        std::cerr << "Could not write the recording with error: " << stats.error().show() << std::endl;
+    recorder.reset();
+}
 
-    // 递归处理子菜单项
-    for (const auto &child : item.children) {
-        buildMenuItemInfo(child, menuItems, depth + 1, currentIndex);
-    }
+void exitWithMsg(std::string_view msg, int code = -1) {
+    std::cerr << msg << std::endl;
+    exit(code);
 }
 
 int main(int argc, char **argv) {
     cxxopts::Options optionsDecl("tray-navigate", "Interactive menu navigation for system tray items");
     optionsDecl.add_options()("h,help", "Print help and exit", cxxopts::value<bool>()->default_value("false"))("i,id", "Find items by id", cxxopts::value<std::string>())("t,title", "Find items by title", cxxopts::value<std::string>())("a,addr", "Directly specify the address of the item", cxxopts::value<std::string>())(
         "p,path", "Directly specify the path of the item", cxxopts::value<std::string>()
+    )(
+        "wait", "Wait up to the given seconds (default 30, 0 for no limit) for the item found by id/title to register and export its menu",
+        cxxopts::value<uint32_t>()->implicit_value("30")
+    )(
+        "record", "Record the D-Bus calls, replies and signals exchanged with the item into this file (replay it with tray-replay)",
+        cxxopts::value<std::string>()
     );
 
     const auto options = optionsDecl.parse(argc, argv);
@@ -120,6 +93,14 @@ int main(int argc, char **argv) {
         exitWithMsg("Please specify either addr/path or id/title", 0);
     }
 
+    if (options.count("record")) {
+        auto started = TrafficRecorder::start(options["record"].as<std::string>());
+        if (!started)
+            exitWithMsg("Could not start recording with error: " + started.error().show(), -1);
+        recorder = std::move(*started);
+        std::atexit(stopRecording);
+    }
+
     StatusNotifierWatcher watcher;
     if (auto connRes = watcher.connect(); !connRes)
         exitWithMsg("Could not connect to the StatusNotifierWatcher with error: " + connRes.error().show(), -1);
@@ -134,6 +115,18 @@ int main(int argc, char **argv) {
         service = addr;
         foundTarget = true;
     }
+    // 等待模式：由注册信号驱动，托盘项出现且菜单已导出后立即继续
+    else if (options.count("wait")) {
+        auto found = watcher.waitForItem(
+            [&id, &title](StatusNotifierItem &item) { return matchesItem(item, id, title); }, true,
+            waitTimeout(options["wait"].as<uint32_t>())
+        );
+        if (!found)
+            exitWithMsg("Could not find the item with error: " + found.error().show(), -1);
+
+        std::tie(service, path) = splitAddress(*found);
+        foundTarget = true;
+    }
     // 传统搜索模式：遍历查找匹配项
     else if (auto maybeAddrs = watcher.getRegisteredAddresses()) {
         for (const auto &fullAddr : maybeAddrs.value()) {
@@ -142,13 +135,7 @@ int main(int argc, char **argv) {
             if (!item.connect())
                 continue;
 
-            bool found = false;
-            if (!title.empty())
-                ifExpected(item.getTitle(), [&title, &found](const std::string &ctitle) { found = ctitle == title; });
-            else if (!id.empty())
-                ifExpected(item.getId(), [&id, &found](const std::string &cid) { found = cid == id; });
-
-            if (found) {
+            if (matchesItem(item, id, title)) {
                 service = itemAddr;
                 path = itemPath; // Store the actual item path
                 foundTarget = true;
@@ -157,6 +144,20 @@ int main(int argc, char **argv) {
         }
     }
 
+    // 菜单信号在专用的总线线程上分发，经无锁队列交给刷新线程，界面线程只接收刷新好的菜单，从不等待总线
+    BusThread bus;
+    EventQueue<MenuSignal> menuSignals;
+    std::unique_ptr<DBusMenu> dbusMenu;
+
+    // 获取菜单布局，边解码边展开，不构建布局树。timeout 为 0 时使用默认超时
+    auto fetchMenu = [&dbusMenu](std::chrono::milliseconds timeout) -> std::optional<std::vector<MenuItemInfo>> {
+        std::vector<MenuItemInfo> items;
+        std::vector<int> parents;
+        if (!dbusMenu->visitLayout(0, -1, menuItemInfoBuilder(items, parents), MENU_NAVIGATE_PROPERTIES, timeout))
+            return std::nullopt;
+        return items;
+    };
+
     // 统一处理找到的目标项
     if (foundTarget) {
         StatusNotifierItem item(service, !path.empty() ? path : "/StatusNotifierItem");
@@ -172,14 +173,18 @@ int main(int argc, char **argv) {
         ifExpected(item.getMenu(), [&menuPath](const sdbus::ObjectPath &path) { menuPath = path; });
 
         if (!menuPath.empty()) {
+            if (auto busRes = bus.start(); !busRes) {
+                std::cerr << "Could not connect to the session bus with error: " << busRes.error().show() << '\n';
+                return 1;
+            }
+
             // 创建DBusMenu对象
-            DBusMenu dbusMenu(service, menuPath);
-            if (auto connRes = dbusMenu.connect()) {
-                // 获取菜单布局
-                ifExpected(dbusMenu.getLayout(0, -1), [&menuItems](const auto &layoutResult) {
-                    const auto &[revision, rootItem] = layoutResult;
-                    buildMenuItemInfo(rootItem, menuItems);
-                });
+            dbusMenu = std::make_unique<DBusMenu>(service, menuPath);
+            if (auto connRes = dbusMenu->connect(bus)) {
+                // 先订阅再获取，不会错过两者之间的更新
+                dbusMenu->forwardSignalsTo(menuSignals);
+                if (auto items = fetchMenu(std::chrono::milliseconds{0}))
+                    menuItems = std::move(*items);
             } else {
                 std::cerr << "Could not connect to the DBusMenu with error: " << connRes.error().show() << '\n';
                 return 1;
@@ -209,29 +214,55 @@ int main(int argc, char **argv) {
     std::vector<int32_t> menuIds;
     std::vector<bool> menuEnabled;
 
-    for (const auto &item : menuItems) {
-        std::string entry;
-        for (int i = 0; i < item.depth; ++i) {
-            entry += "  ";
+    int selected = 0;
+
+    auto selectId = [&menuIds, &selected](int32_t id) {
+        for (size_t i = 0; i < menuIds.size(); ++i) {
+            if (menuIds[i] == id) {
+                selected = static_cast<int>(i);
+                return;
+            }
         }
+    };
+
+    // 只在界面线程上调用，刷新后尽量保持选中同一个菜单项
+    auto setMenuItems = [&](std::vector<MenuItemInfo> items) {
+        const int32_t selectedId =
+            selected >= 0 && selected < static_cast<int>(menuIds.size()) ? menuIds[selected] : -1;
+        menuItems = std::move(items);
+        menuEntries.clear();
+        menuIds.clear();
+        menuEnabled.clear();
+
+        for (const auto &item : menuItems) {
+            std::string entry;
+            for (int i = 0; i < item.depth; ++i) {
+                entry += "  ";
+            }
 
-        if (item.isSeparator) {
-            entry += "------------------------";
-        } else {
-            if (!item.enabled) {
-                entry += "(" + item.label + ")"; // 禁用项用括号表示
+            if (item.isSeparator) {
+                entry += "------------------------";
             } else {
-                entry += item.label;
+                if (!item.enabled) {
+                    entry += "(" + item.label + ")"; // 禁用项用括号表示
+                } else {
+                    entry += item.label;
+                }
             }
+
+            menuEntries.push_back(entry);
+            menuIds.push_back(item.id);
+            menuEnabled.push_back(item.enabled && !item.isSeparator);
         }
 
-        menuEntries.push_back(entry);
-        menuIds.push_back(item.id);
-        menuEnabled.push_back(item.enabled && !item.isSeparator);
-    }
+        selected = 0;
+        selectId(selectedId);
+    };
+    setMenuItems(std::move(menuItems));
 
-    int selected = 0;
     std::string statusMessage = "使用方向键导航，Enter选择，q退出";
+    // 点击的回复到达之前不接受新的点击
+    bool clicking = false;
 
     // 创建菜单组件
     auto menu = Menu(&menuEntries, &selected);
@@ -253,23 +284,37 @@ int main(int argc, char **argv) {
         }
 
         if (event == Event::Return) {
-            // 检查选中的菜单项是否可用
+            // 检查选中的菜单项是否可用；点击在总线线程上等待回复，界面线程不阻塞
+            if (clicking) {
+                return true;
+            }
             if (selected >= 0 && selected < static_cast<int>(menuItems.size())) {
                 if (menuEnabled[selected]) {
-                    // 创建DBusMenu对象并发送事件
-                    DBusMenu dbusMenu(service, menuPath);
-                    if (auto connRes = dbusMenu.connect()) {
-                        std::variant<bool, int32_t, std::string> data = static_cast<int32_t>(0);
-                        if (auto clickRes = dbusMenu.sendEvent(menuIds[selected], "clicked", data, 0)) {
-                            statusMessage = "已点击菜单项: " + menuItems[selected].label;
-                            // 成功点击菜单项后自动退出
-                            screen.ExitLoopClosure()();
-                        } else {
-                            statusMessage = "点击菜单项失败: " + clickRes.error().show();
+                    std::variant<bool, int32_t, std::string> data = static_cast<int32_t>(0);
+                    const std::string label = menuItems[selected].label;
+                    clicking = true;
+                    statusMessage = "正在点击菜单项: " + label;
+                    dbusMenu->sendEventAsync(
+                        menuIds[selected], "clicked", data, 0,
+                        [&screen, &statusMessage, &clicking, label](std::expected<void, Error> res) {
+                            // 回复在总线线程上到达，界面状态交回界面线程修改
+                            std::optional<std::string> failure;
+                            if (!res) {
+                                failure = res.error().show();
+                            }
+                            screen.Post([&screen, &statusMessage, &clicking, label, failure] {
+                                clicking = false;
+                                if (failure) {
+                                    statusMessage = "点击菜单项失败: " + *failure;
+                                    return;
+                                }
+                                statusMessage = "已点击菜单项: " + label;
+                                // 成功点击菜单项后自动退出
+                                screen.ExitLoopClosure()();
+                            });
+                            screen.PostEvent(Event::Custom);
                         }
-                    } else {
-                        statusMessage = "无法连接到DBusMenu: " + connRes.error().show();
-                    }
+                    );
                 } else {
                     statusMessage = "菜单项已禁用，无法点击";
                 }
@@ -280,8 +325,49 @@ int main(int argc, char **argv) {
         return false; // 让菜单组件自己处理方向键
     });
 
+    // 刷新线程是队列唯一的消费者：一批信号只重新获取一次布局，再把结果交给界面线程。
+    // 获取布局使用较短的超时，挂起的应用最多让退出推迟 REFRESH_TIMEOUT
+    std::jthread refresher([&](std::stop_token stop) {
+        while (!stop.stop_requested()) {
+            if (!menuSignals.wait(std::chrono::milliseconds(100)))
+                continue;
+
+            bool layoutChanged = false;
+            std::optional<int32_t> activated;
+            menuSignals.drain([&layoutChanged, &activated](MenuSignal &&signal) {
+                if (signal.kind == MenuSignalKind::ItemActivationRequested)
+                    activated = signal.id;
+                else
+                    layoutChanged = true;
+            });
+            // 队列溢出时丢失的信号也可能是布局变化
+            if (menuSignals.takeDropped() > 0)
+                layoutChanged = true;
+
+            std::optional<std::vector<MenuItemInfo>> items;
+            if (layoutChanged && !stop.stop_requested())
+                items = fetchMenu(REFRESH_TIMEOUT);
+            if (!items && !activated)
+                continue;
+
+            screen.Post([&setMenuItems, &selectId, items = std::move(items), activated]() mutable {
+                if (items)
+                    setMenuItems(std::move(*items));
+                // 应用请求显示某个菜单项时把它选中
+                if (activated)
+                    selectId(*activated);
+            });
+            screen.PostEvent(Event::Custom);
+        }
+    });
+
     // 运行界面
     screen.Loop(component);
 
+    // 先停止刷新线程，再销毁菜单代理以取消尚未回复的点击，之后它们都不会再访问 screen
+    refresher.request_stop();
+    refresher.join();
+    dbusMenu.reset();
+
     return 0;
 }
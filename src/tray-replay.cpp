@@ -0,0 +1,509 @@
+//
+// Created by tray-control on 2024/06/08.
+//
+// 重放 tray-trigger --record 录制的流量：在私有总线上为录制中的每个应用打开一条连接并取得它原来的名称，
+// 按录制的内容回答同样的方法调用，回复按原始延迟（或乘以 --latency-scale）发出；
+// 录制到的信号从收到第一个调用开始按原来的时间间隔重新发出。
+// 这样真实应用的慢回复可以离线复现，用来对比优化前后的工具。需要 dbus-daemon
+#include <algorithm>
+#include <csignal>
+#include <cstring>
+#include <cxxopts.hpp>
+#include <fcntl.h>
+#include <iostream>
+#include <map>
+#include <optional>
+#include <spawn.h>
+#include <string>
+#include <sys/wait.h>
+#include <systemd/sd-bus.h>
+#include <systemd/sd-event.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+#include <fmt/printf.h>
+
+#include "SessionBus.h"
+#include "TrafficLog.h"
+
+extern char **environ;
+
+namespace {
+
+struct Response {
+    TrafficKind kind = TrafficKind::Return;
+    std::string errorName;
+    std::string body;
+    uint64_t latency = 0; // 微秒
+};
+
+// 同一个调用录制到的回复依次使用，用完之后一直重复最后一个
+struct Responses {
+    std::vector<Response *> list;
+    size_t next = 0;
+
+    const Response &take() { return *list[std::min(next++, list.size() - 1)]; }
+};
+
+struct Replay;
+struct Peer;
+
+struct PendingSignal {
+    Peer *peer;
+    const TrafficRecord *record;
+};
+
+// 录制中的一个被调用方，重放时对应私有总线上的一条连接
+struct Peer {
+    Replay *replay = nullptr;
+    std::string recordedName;
+    std::vector<std::string> wellKnownNames;
+    sd_bus *bus = nullptr;
+    std::string name;
+    std::vector<std::unique_ptr<Response>> responses;
+    // 路径、接口、成员和参数都相同的调用
+    std::unordered_map<std::string, Responses> exact;
+    // 参数不同时退而使用同一方法的回复
+    std::unordered_map<std::string, Responses> byMethod;
+};
+
+struct ReplayStats {
+    uint64_t calls = 0;
+    uint64_t inexact = 0;   // 参数与录制不同，使用了同一方法的回复
+    uint64_t unmatched = 0; // 录制中没有的方法，回复 UnknownMethod
+    uint64_t signals = 0;
+};
+
+struct Replay {
+    sd_event *event = nullptr;
+    double latencyScale = 1;
+    bool signals = true;
+    bool verbose = false;
+    std::map<std::string, Peer> peers;
+    std::vector<TrafficRecord> signalRecords;
+    std::vector<PendingSignal> pendingSignals;
+    uint64_t firstCall = 0;
+    bool started = false;
+    // 录制时的唯一名与重放时唯一名的双向映射
+    std::unordered_map<std::string, std::string> renamed;
+    std::unordered_map<std::string, std::string> restored;
+    ReplayStats stats;
+};
+
+// 定时器精度 1 微秒；传 0 时 sd-event 使用默认的 250 毫秒，回复延迟会被合并放大
+constexpr uint64_t TIMER_ACCURACY = 1;
+
+struct PendingReply {
+    Peer *peer;
+    sd_bus_message *call;
+    const Response *response;
+    sd_event_source *source = nullptr;
+};
+
+std::string methodKey(std::string_view path, std::string_view interface, std::string_view member) {
+    std::string key;
+    key.reserve(path.size() + interface.size() + member.size() + 2);
+    key.append(path).append(1, '\0').append(interface).append(1, '\0').append(member);
+    return key;
+}
+
+// 替换以唯一名开头的字符串：整个字符串是唯一名，或者唯一名之后是对象路径（如 :1.52/StatusNotifierItem）
+std::optional<std::string>
+renameBusName(std::string_view value, const std::unordered_map<std::string, std::string> &names) {
+    if (!value.starts_with(':'))
+        return std::nullopt;
+    const auto slash = value.find('/');
+    const auto it = names.find(std::string(value.substr(0, slash)));
+    if (it == names.end())
+        return std::nullopt;
+    return slash == std::string_view::npos ? it->second : it->second + std::string(value.substr(slash));
+}
+
+std::string renameBody(std::string_view body, const std::unordered_map<std::string, std::string> &names) {
+    return mapBodyStrings(body, [&](std::string_view value) { return renameBusName(value, names); });
+}
+
+// 按回复把录制中的调用归到各个被调用方
+Replay load(const std::vector<TrafficRecord> &records) {
+    Replay replay;
+    std::map<std::pair<std::string, uint64_t>, const TrafficRecord *> calls;
+    bool anyCall = false;
+    for (const auto &record : records) {
+        switch (record.kind) {
+        case TrafficKind::Call:
+            calls[{record.sender, record.serial}] = &record;
+            if (!anyCall) {
+                replay.firstCall = record.time;
+                anyCall = true;
+            }
+            break;
+        case TrafficKind::Return:
+        case TrafficKind::Error: {
+            const auto it = calls.find({record.destination, record.serial});
+            if (it == calls.end())
+                break;
+            const TrafficRecord &call = *it->second;
+
+            Peer &peer = replay.peers[record.sender];
+            peer.recordedName = record.sender;
+            if (!call.destination.starts_with(':') && std::ranges::find(peer.wellKnownNames, call.destination) ==
+                                                          peer.wellKnownNames.end()) {
+                peer.wellKnownNames.push_back(call.destination);
+            }
+
+            auto response = std::make_unique<Response>();
+            response->kind = record.kind;
+            response->body = record.body;
+            response->latency = record.time - call.time;
+            if (record.kind == TrafficKind::Error)
+                response->errorName = record.member;
+
+            const auto method = methodKey(call.path, call.interface, call.member);
+            peer.exact[method + '\0' + call.body].list.push_back(response.get());
+            peer.byMethod[method].list.push_back(response.get());
+            peer.responses.push_back(std::move(response));
+            break;
+        }
+        case TrafficKind::Signal:
+            replay.signalRecords.push_back(record);
+            break;
+        }
+    }
+    return replay;
+}
+
+uint64_t scaled(const Replay &replay, uint64_t usec) { return static_cast<uint64_t>(usec * replay.latencyScale); }
+
+int sendResponse(Peer &peer, sd_bus_message *call, const Response &response) {
+    sd_bus_message *reply = nullptr;
+    int r;
+    if (response.kind == TrafficKind::Error) {
+        // 错误信息就是录制的正文中的第一个字符串，这里不再单独附加
+        const sd_bus_error error{response.errorName.c_str(), nullptr, 0};
+        r = sd_bus_message_new_method_error(call, &reply, &error);
+    } else {
+        r = sd_bus_message_new_method_return(call, &reply);
+    }
+    if (r >= 0)
+        r = appendBody(reply, response.body);
+    if (r >= 0)
+        r = sd_bus_send(peer.bus, reply, nullptr);
+    sd_bus_message_unref(reply);
+    return r;
+}
+
+int onReplyDue(sd_event_source *, uint64_t, void *userdata) {
+    auto *pending = static_cast<PendingReply *>(userdata);
+    sendResponse(*pending->peer, pending->call, *pending->response);
+    sd_bus_message_unref(pending->call);
+    sd_event_source_unref(pending->source);
+    delete pending;
+    return 0;
+}
+
+int onSignalDue(sd_event_source *, uint64_t, void *userdata) {
+    const auto *pending = static_cast<PendingSignal *>(userdata);
+    const TrafficRecord &record = *pending->record;
+    sd_bus_message *signal = nullptr;
+    int r = sd_bus_message_new_signal(
+        pending->peer->bus, &signal, record.path.c_str(), record.interface.c_str(), record.member.c_str()
+    );
+    if (r >= 0)
+        r = appendBody(signal, record.body);
+    if (r >= 0)
+        r = sd_bus_send(pending->peer->bus, signal, nullptr);
+    sd_bus_message_unref(signal);
+    if (r >= 0)
+        ++pending->peer->replay->stats.signals;
+    return 0;
+}
+
+// 第一次收到调用时开始信号的时间线，信号与录制中的第一个调用保持原来的间隔
+void startSignals(Replay &replay) {
+    if (replay.started)
+        return;
+    replay.started = true;
+    if (!replay.signals)
+        return;
+
+    uint64_t now = 0;
+    sd_event_now(replay.event, CLOCK_MONOTONIC, &now);
+    // 预留空间使元素地址不变；信号数量有限，事件源随事件循环一起释放
+    replay.pendingSignals.reserve(replay.signalRecords.size());
+    for (const auto &record : replay.signalRecords) {
+        const auto it = replay.peers.find(record.sender);
+        if (it == replay.peers.end())
+            continue;
+        auto *pending = &replay.pendingSignals.emplace_back(&it->second, &record);
+        const uint64_t offset = record.time > replay.firstCall ? record.time - replay.firstCall : 0;
+        sd_event_add_time(
+            replay.event, nullptr, CLOCK_MONOTONIC, now + scaled(replay, offset), TIMER_ACCURACY, onSignalDue, pending
+        );
+    }
+}
+
+int onMessage(sd_bus_message *message, void *userdata, sd_bus_error *) {
+    auto &peer = *static_cast<Peer *>(userdata);
+    auto &replay = *peer.replay;
+    uint8_t type = 0;
+    sd_bus_message_get_type(message, &type);
+    if (type != SD_BUS_MESSAGE_METHOD_CALL)
+        return 0;
+
+    ++replay.stats.calls;
+    startSignals(replay);
+
+    const char *path = sd_bus_message_get_path(message);
+    const char *interface = sd_bus_message_get_interface(message);
+    const char *member = sd_bus_message_get_member(message);
+    const auto method = methodKey(path ? path : "", interface ? interface : "", member ? member : "");
+    const auto body = encodeBody(message);
+
+    Responses *responses = nullptr;
+    if (body) {
+        // 参数中出现的重放唯一名换回录制时的名称再比较
+        const auto it = peer.exact.find(method + '\0' + renameBody(*body, replay.restored));
+        if (it != peer.exact.end())
+            responses = &it->second;
+    }
+    if (!responses) {
+        if (const auto it = peer.byMethod.find(method); it != peer.byMethod.end()) {
+            responses = &it->second;
+            ++replay.stats.inexact;
+        }
+    }
+    if (!responses) {
+        ++replay.stats.unmatched;
+        if (replay.verbose) {
+            fmt::print(
+                stderr, "Not in the recording: {} {} {}.{}\n", peer.name, path ? path : "", interface ? interface : "",
+                member ? member : ""
+            );
+        }
+        if (sd_bus_message_get_expect_reply(message) > 0) {
+            const sd_bus_error error{"org.freedesktop.DBus.Error.UnknownMethod", "Not in the recording", 0};
+            sd_bus_reply_method_error(message, &error);
+        }
+        return 1;
+    }
+
+    const Response &response = responses->take();
+    if (sd_bus_message_get_expect_reply(message) <= 0)
+        return 1;
+
+    const uint64_t delay = scaled(replay, response.latency);
+    if (delay == 0) {
+        sendResponse(peer, message, response);
+        return 1;
+    }
+    uint64_t now = 0;
+    sd_event_now(replay.event, CLOCK_MONOTONIC, &now);
+    auto *pending = new PendingReply{&peer, sd_bus_message_ref(message), &response, nullptr};
+    const int r = sd_event_add_time(
+        replay.event, &pending->source, CLOCK_MONOTONIC, now + delay, TIMER_ACCURACY, onReplyDue, pending
+    );
+    if (r < 0) {
+        sendResponse(peer, message, response);
+        sd_bus_message_unref(pending->call);
+        delete pending;
+    }
+    return 1;
+}
+
+// 启动私有的 dbus-daemon，返回它的进程号和地址
+std::optional<std::pair<pid_t, std::string>> startPrivateBus() {
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) < 0)
+        return std::nullopt;
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, fds[1], 3);
+    char *argv[] = {
+        const_cast<char *>("dbus-daemon"), const_cast<char *>("--session"), const_cast<char *>("--nofork"),
+        const_cast<char *>("--print-address=3"), nullptr
+    };
+    pid_t pid = 0;
+    const int r = posix_spawnp(&pid, "dbus-daemon", &actions, nullptr, argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    close(fds[1]);
+    if (r != 0) {
+        close(fds[0]);
+        return std::nullopt;
+    }
+
+    std::string address;
+    char c;
+    while (read(fds[0], &c, 1) == 1 && c != '\n')
+        address += c;
+    close(fds[0]);
+    if (address.empty()) {
+        kill(pid, SIGTERM);
+        waitpid(pid, nullptr, 0);
+        return std::nullopt;
+    }
+    return std::pair{pid, address};
+}
+
+// 以 address 作为会话总线运行 command，信号掩码恢复为空
+std::optional<pid_t> spawnCommand(const std::vector<std::string> &command, const std::string &address) {
+    std::vector<std::string> env;
+    for (char **var = environ; *var; ++var) {
+        if (!std::string_view(*var).starts_with("DBUS_SESSION_BUS_ADDRESS="))
+            env.emplace_back(*var);
+    }
+    env.push_back("DBUS_SESSION_BUS_ADDRESS=" + address);
+
+    std::vector<char *> argv, envp;
+    for (const auto &arg : command)
+        argv.push_back(const_cast<char *>(arg.c_str()));
+    argv.push_back(nullptr);
+    for (const auto &var : env)
+        envp.push_back(const_cast<char *>(var.c_str()));
+    envp.push_back(nullptr);
+
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    sigset_t empty;
+    sigemptyset(&empty);
+    posix_spawnattr_setsigmask(&attr, &empty);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK);
+    pid_t pid = 0;
+    const int r = posix_spawnp(&pid, argv[0], nullptr, &attr, argv.data(), envp.data());
+    posix_spawnattr_destroy(&attr);
+    if (r != 0)
+        return std::nullopt;
+    return pid;
+}
+
+int onCommandExit(sd_event_source *source, const siginfo_t *info, void *userdata) {
+    *static_cast<int *>(userdata) = info->si_code == CLD_EXITED ? info->si_status : 128 + info->si_status;
+    return sd_event_exit(sd_event_source_get_event(source), 0);
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+    cxxopts::Options optionsDecl("tray-replay", "Serve a recorded tray (tray-trigger --record) on a private bus");
+    optionsDecl.add_options()("h,help", "Print help and exit", cxxopts::value<bool>()->default_value("false"))
+        ("latency-scale", "Multiply the recorded reply latencies by this factor (0 replies immediately)", cxxopts::value<double>()->default_value("1"))
+        ("no-signals", "Do not re-emit the recorded signals", cxxopts::value<bool>()->default_value("false"))
+        ("bus", "Serve on this bus address instead of starting a private dbus-daemon", cxxopts::value<std::string>())
+        ("v,verbose", "Print calls that are not in the recording", cxxopts::value<bool>()->default_value("false"))
+        ("file", "Recording to replay", cxxopts::value<std::string>())
+        ("command", "Command to run against the replayed tray; the replay stops when it exits", cxxopts::value<std::vector<std::string>>());
+    optionsDecl.parse_positional({"file", "command"});
+    optionsDecl.positional_help("FILE [-- COMMAND...]");
+
+    const auto options = optionsDecl.parse(argc, argv);
+    if (options["help"].as<bool>() || !options.count("file")) {
+        std::cout << optionsDecl.help();
+        return 0;
+    }
+    const auto file = options["file"].as<std::string>();
+
+    auto records = readTraffic(file);
+    if (!records) {
+        std::cerr << "Could not read the recording with error: " << records.error().show() << '\n';
+        return 1;
+    }
+    Replay replay = load(*records);
+    replay.latencyScale = std::max(0.0, options["latency-scale"].as<double>());
+    replay.signals = !options["no-signals"].as<bool>();
+    replay.verbose = options["verbose"].as<bool>();
+    if (replay.peers.empty()) {
+        std::cerr << file << " contains no answered calls\n";
+        return 1;
+    }
+
+    std::optional<pid_t> daemon;
+    std::string address;
+    if (options.count("bus")) {
+        address = options["bus"].as<std::string>();
+    } else {
+        auto privateBus = startPrivateBus();
+        if (!privateBus) {
+            std::cerr << "Could not start dbus-daemon\n";
+            return 1;
+        }
+        daemon = privateBus->first;
+        address = std::move(privateBus->second);
+    }
+
+    // 事件循环处理的信号必须先屏蔽，子进程在 spawnCommand 中恢复
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, nullptr);
+    sd_event_default(&replay.event);
+    sd_event_add_signal(replay.event, nullptr, SIGINT, nullptr, nullptr);
+    sd_event_add_signal(replay.event, nullptr, SIGTERM, nullptr, nullptr);
+
+    int exitCode = 0;
+    const auto finish = [&](int code) {
+        for (auto &[recordedName, peer] : replay.peers)
+            sd_bus_flush_close_unref(peer.bus);
+        sd_event_unref(replay.event);
+        if (daemon) {
+            kill(*daemon, SIGTERM);
+            waitpid(*daemon, nullptr, 0);
+        }
+        return code;
+    };
+
+    for (auto &[recordedName, peer] : replay.peers) {
+        auto bus = openSdBus(address);
+        if (!bus) {
+            std::cerr << "Could not connect to " << address << " with error: " << bus.error().show() << '\n';
+            return finish(1);
+        }
+        peer.replay = &replay;
+        peer.bus = *bus;
+        const char *unique = nullptr;
+        sd_bus_get_unique_name(peer.bus, &unique);
+        peer.name = unique ? unique : "";
+        replay.renamed[recordedName] = peer.name;
+        replay.restored[peer.name] = recordedName;
+        sd_bus_add_filter(peer.bus, nullptr, onMessage, &peer);
+        sd_bus_attach_event(peer.bus, replay.event, SD_EVENT_PRIORITY_NORMAL);
+    }
+
+    // 所有连接的唯一名都确定之后，回复和信号中的录制唯一名才能替换
+    size_t calls = 0;
+    for (auto &[recordedName, peer] : replay.peers) {
+        for (auto &response : peer.responses)
+            response->body = renameBody(response->body, replay.renamed);
+        calls += peer.responses.size();
+        for (const auto &name : peer.wellKnownNames) {
+            if (const int r = sd_bus_request_name(peer.bus, name.c_str(), 0); r < 0)
+                std::cerr << "Could not acquire " << name << ": " << std::strerror(-r) << '\n';
+        }
+    }
+    for (auto &record : replay.signalRecords)
+        record.body = renameBody(record.body, replay.renamed);
+
+    fmt::print(
+        stderr, "Replaying {} calls to {} peers and {} signals from {}\n", calls, replay.peers.size(),
+        replay.signals ? replay.signalRecords.size() : 0, file
+    );
+    if (options.count("command")) {
+        const auto pid = spawnCommand(options["command"].as<std::vector<std::string>>(), address);
+        if (!pid) {
+            std::cerr << "Could not run the command\n";
+            return finish(1);
+        }
+        sd_event_add_child(replay.event, nullptr, *pid, WEXITED, onCommandExit, &exitCode);
+    } else {
+        fmt::print("DBUS_SESSION_BUS_ADDRESS={}\n", address);
+        std::fflush(stdout);
+    }
+
+    sd_event_loop(replay.event);
+    fmt::print(
+        stderr, "Served {} calls ({} with different arguments, {} not in the recording), emitted {} signals\n",
+        replay.stats.calls, replay.stats.inexact, replay.stats.unmatched, replay.stats.signals
+    );
+    return finish(exitCode);
+}
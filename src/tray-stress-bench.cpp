@@ -0,0 +1,175 @@
+//
+// Created by tray-control on 2024/05/11.
+//
+// 多线程压力测试：1 到 N 个线程同时通过同一个 DBusMenu/StatusNotifierItem 调用进程内的模拟托盘项，
+// 比较每个线程使用自己的代理（parallel）和所有线程在一把互斥锁下共用一个代理（serialized）时的吞吐量。
+// 需要会话总线；模拟托盘项和真实应用一样在一个线程上处理请求，它饱和之后吞吐量不再增长
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cxxopts.hpp>
+#include <functional>
+#include <iostream>
+#include <latch>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <variant>
+#include <vector>
+#include <fmt/printf.h>
+
+#include "BenchSupport.h"
+#include "DBusMenu.h"
+#include "StatusNotifierItem.h"
+
+namespace {
+
+// event 不等待回复，发出但模拟托盘项还没处理的事件超过这个数时发送方等待，避免请求在总线上无限堆积
+constexpr uint64_t MAX_EVENTS_IN_FLIGHT = 256;
+
+struct StressResult {
+    uint64_t calls = 0;
+    uint64_t errors = 0;
+    double seconds = 0;
+};
+
+// threads 个线程在 duration 内循环调用 call；serialize 非空时每次调用都持有它
+template <typename F>
+StressResult runThreads(unsigned threads, std::chrono::milliseconds duration, std::mutex *serialize, const F &call) {
+    std::atomic<bool> stop{false};
+    std::atomic<uint64_t> calls{0};
+    std::atomic<uint64_t> errors{0};
+    // 每个线程先调用一次建立自己的连接，连接建立不计入吞吐量
+    std::latch ready(threads + 1);
+
+    StressResult result;
+    {
+        std::vector<std::jthread> workers;
+        for (unsigned i = 0; i < threads; ++i) {
+            workers.emplace_back([&] {
+                call();
+                ready.arrive_and_wait();
+
+                uint64_t localCalls = 0;
+                uint64_t localErrors = 0;
+                while (!stop.load(std::memory_order_relaxed)) {
+                    bool ok;
+                    if (serialize) {
+                        std::lock_guard lock(*serialize);
+                        ok = call();
+                    } else {
+                        ok = call();
+                    }
+                    ++localCalls;
+                    localErrors += ok ? 0 : 1;
+                }
+                calls.fetch_add(localCalls, std::memory_order_relaxed);
+                errors.fetch_add(localErrors, std::memory_order_relaxed);
+            });
+        }
+
+        ready.arrive_and_wait();
+        const auto start = std::chrono::steady_clock::now();
+        std::this_thread::sleep_for(duration);
+        stop.store(true, std::memory_order_relaxed);
+        workers.clear();
+        result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    result.calls = calls.load();
+    result.errors = errors.load();
+    return result;
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+    cxxopts::Options optionsDecl("tray-stress-bench", "Throughput of concurrent calls against an in-process mock tray");
+    optionsDecl.add_options()("h,help", "Print help and exit", cxxopts::value<bool>()->default_value("false"))
+        ("threads", "Maximum number of worker threads", cxxopts::value<unsigned>()->default_value(
+            std::to_string(std::max(1u, std::thread::hardware_concurrency()))))
+        ("duration", "Run time of each step in milliseconds", cxxopts::value<uint32_t>()->default_value("1000"))
+        ("breadth", "Children per submenu of the mock menu", cxxopts::value<uint32_t>()->default_value("6"))
+        ("depth", "Submenu levels below the root of the mock menu", cxxopts::value<uint32_t>()->default_value("2"));
+
+    const auto options = optionsDecl.parse(argc, argv);
+    if (options["help"].as<bool>()) {
+        std::cout << optionsDecl.help();
+        return 0;
+    }
+    const auto maxThreads = std::max(1u, options["threads"].as<unsigned>());
+    const std::chrono::milliseconds duration(options["duration"].as<uint32_t>());
+
+    MockTray tray(options["breadth"].as<uint32_t>(), options["depth"].as<uint32_t>());
+    if (auto res = tray.start(); !res) {
+        std::cerr << "Could not start the mock tray with error: " << res.error().show() << '\n';
+        return 1;
+    }
+
+    DBusMenu menu(tray.service(), MockTray::MENU_PATH);
+    StatusNotifierItem item(tray.service(), MockTray::ITEM_PATH);
+    if (auto res = menu.connect(); !res) {
+        std::cerr << "Could not connect to the mock menu with error: " << res.error().show() << '\n';
+        return 1;
+    }
+    if (auto res = item.connect(); !res) {
+        std::cerr << "Could not connect to the mock item with error: " << res.error().show() << '\n';
+        return 1;
+    }
+
+    const MenuLayoutVisitor noop;
+    const std::vector<int32_t> groupIds{1, 2, 3, 4};
+    const std::variant<bool, int32_t, std::string> eventData = int32_t{0};
+    std::atomic<uint64_t> eventsSent{0};
+    const auto sendEvent = [&] {
+        while (eventsSent.load(std::memory_order_relaxed) - tray.events() >= MAX_EVENTS_IN_FLIGHT) {
+            std::this_thread::yield();
+        }
+        if (!menu.sendEvent(1, "clicked", eventData, 0))
+            return false;
+        eventsSent.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    };
+
+    struct Workload {
+        const char *name;
+        std::function<bool()> call;
+    };
+    const std::vector<Workload> workloads{
+        {"layout", [&] { return menu.visitLayout(0, -1, noop, MENU_LIST_PROPERTIES).has_value(); }},
+        {"group", [&] { return menu.getGroupProperties(groupIds, MENU_LIST_PROPERTIES).has_value(); }},
+        {"event", sendEvent},
+        {"getall", [&] { return item.getAll().has_value(); }},
+    };
+
+    std::vector<unsigned> threadCounts;
+    for (unsigned threads = 1; threads < maxThreads; threads *= 2) {
+        threadCounts.push_back(threads);
+    }
+    threadCounts.push_back(maxThreads);
+
+    fmt::print("mock tray: {} menu items, {} ms per step\n", tray.menuItems(), duration.count());
+    fmt::print("{:<10}{:<12}{:>8}{:>14}{:>10}{:>10}\n", "workload", "mode", "threads", "calls/s", "speedup", "errors");
+
+    std::mutex serialize;
+    for (const auto &workload : workloads) {
+        for (auto *lock : {static_cast<std::mutex *>(nullptr), &serialize}) {
+            // serialized 时所有线程都通过主代理调用，工作线程退出时各自的代理随之释放
+            menu.shareProxy(lock != nullptr);
+            item.shareProxy(lock != nullptr);
+            double baseline = 0;
+            for (unsigned threads : threadCounts) {
+                const auto result = runThreads(threads, duration, lock, workload.call);
+
+                const double rate = result.calls / result.seconds;
+                if (baseline == 0)
+                    baseline = rate;
+                fmt::print(
+                    "{:<10}{:<12}{:>8}{:>14.0f}{:>10.2f}{:>10}\n", workload.name, lock ? "serialized" : "parallel",
+                    threads, rate, rate / baseline, result.errors
+                );
+            }
+        }
+    }
+    return 0;
+}
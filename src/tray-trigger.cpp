@@ -1,13 +1,32 @@
 //
 // Created by tray-control on 2023/11/24.
 //
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstdlib>
 #include <cxxopts.hpp>
+#include <fnmatch.h>
 #include <iostream>
+#include <ranges>
 #include <fmt/printf.h>
 
+#include "AtomicFile.h"
 #include "StatusNotifierWatcher.h"
+#include "StatusNotifierWatcherService.h"
 #include "StatusNotifierItem.h"
 #include "DBusMenu.h"
+#include "DBusUtils.h"
+#include "IconResolver.h"
+#include "IconStore.h"
+#include "MenuEffectWaiter.h"
+#include "MemStats.h"
+#include "MenuIndex.h"
+#include "MenuVisitors.h"
+#include "SessionBus.h"
+#include "SignalMatch.h"
+#include "TrafficRecorder.h"
+#include "TrayProbe.h"
 #include "Utils.h"
 
 // 定义常量以提高可维护性
@@ -17,65 +36,508 @@ constexpr int EXIT_ERROR_CODE = -1;
 constexpr int MENU_ITEM_NOT_FOUND = -1;
 } // namespace
 
+// --record 的录制器。exitWithMsg 用 _Exit 退出，不会执行 atexit 注册的 stopRecording，需要自己调用
+std::unique_ptr<TrafficRecorder> recorder;
+
+void stopRecording() {
+    if (!recorder) {
+        return;
+    }
+    if (auto stats = recorder->stop(); !stats) {
+        std::cerr << "Could not write the recording with error: " << stats.error().show() << '\n';
+    }
+    recorder.reset();
+}
+
+// --mem-stats：退出时把各阶段的堆分配和峰值内存打印到 stderr，exitWithMsg 同样需要自己调用
+bool memStatsRequested = false;
+
+void printMemStats() {
+    if (!memStatsRequested) {
+        return;
+    }
+    memStatsRequested = false;
+    const auto stats = memStats();
+    if (stats.instrumented) {
+        fmt::print(stderr, "{:<12}{:>14}{:>16}\n", "phase", "allocations", "bytes");
+        for (size_t i = 0; i < MEM_PHASE_COUNT; ++i) {
+            const auto phase = magic_enum::enum_name(static_cast<MemPhase>(i));
+            fmt::print(stderr, "{:<12}{:>14}{:>16}\n", phase, stats.phases[i].allocations, stats.phases[i].bytes);
+        }
+        fmt::print(stderr, "live heap: {} bytes, peak heap: {} bytes\n", stats.liveBytes, stats.peakLiveBytes);
+    } else {
+        fmt::print(stderr, "allocation counts need a build with -DTRAY_CONTROL_MEM_STATS=ON\n");
+    }
+    fmt::print(stderr, "peak RSS: {} bytes\n", stats.peakRssBytes);
+}
+
 void exitWithMsg(std::string_view msg, int code = EXIT_ERROR_CODE) {
+    stopRecording();
+    printMemStats();
     std::cerr << msg << std::endl;
     std::_Exit(code); // 使用_std::Exit避免可能的清理问题
 }
 
-// 递归查找菜单项 - 优化版本
-bool findMenuItem(const MenuLayoutItem &item, int32_t targetId, int32_t &foundId) {
-    if (item.id == targetId) {
-        foundId = item.id;
+// 何时用 AboutToShowGroup 预取延迟加载的子菜单：列出菜单时总是预取；
+// 点击时先直接查找，找不到才预取后再找一次，找到时不产生额外的往返
+enum class MenuPrefetch {
+    Never,
+    OnMiss,
+    Always,
+};
+
+// 菜单布局的来源：预取之后的遍历都在完整的布局树上进行；
+// 否则每次遍历都直接流式解码一次 GetLayout 的回复，不构建布局树
+class MenuSource {
+  public:
+    MenuSource(DBusMenu &menu, MenuPrefetch prefetch, std::vector<std::string> propertyNames)
+        : menu_(menu), prefetch_(prefetch), propertyNames_(std::move(propertyNames)) {}
+
+    std::expected<uint32_t, Error> visit(const MenuLayoutVisitor &visitor) {
+        if (prefetch_ == MenuPrefetch::Always && !layout_) {
+            if (auto res = load(); !res) {
+                return std::unexpected(res.error());
+            }
+        }
+        if (!layout_) {
+            return menu_.visitLayout(0, -1, visitor, propertyNames_);
+        }
+        visitMenuLayout(layout_->first, layout_->second, visitor);
+        return layout_->first;
+    }
+
+    // 预取得到的布局版本，没有预取时为空
+    std::optional<uint32_t> prefetchedRevision() const {
+        if (!layout_) {
+            return std::nullopt;
+        }
+        return layout_->first;
+    }
+
+    // 查找失败后调用：OnMiss 时预取一次，返回 true 表示之后的遍历值得重试
+    std::expected<bool, Error> prefetchAfterMiss() {
+        if (prefetch_ != MenuPrefetch::OnMiss || layout_) {
+            return false;
+        }
+        if (auto res = load(); !res) {
+            return std::unexpected(res.error());
+        }
         return true;
     }
 
-    // 使用范围for循环和早期返回优化性能
-    for (const auto &child : item.children) {
-        if (findMenuItem(child, targetId, foundId)) {
-            return true;
+  private:
+    DBusMenu &menu_;
+    MenuPrefetch prefetch_;
+    std::vector<std::string> propertyNames_;
+    std::optional<std::pair<uint32_t, MenuLayoutItem>> layout_;
+
+    std::expected<void, Error> load() {
+        auto layout = menu_.getLayoutPrefetched(propertyNames_);
+        if (!layout) {
+            return std::unexpected(layout.error());
         }
+        layout_ = std::move(*layout);
+        return {};
     }
+};
 
-    return false;
+// 按标签路径查找菜单项，找不到时返回 MENU_ITEM_NOT_FOUND
+std::expected<int32_t, Error> findMenuLabel(MenuSource &menu, const std::vector<std::string> &labelPath) {
+    for (;;) {
+        std::vector<std::string> ancestors;
+        int32_t foundId = MENU_ITEM_NOT_FOUND;
+        if (auto res = menu.visit(menuLabelFinder(labelPath, ancestors, foundId)); !res) {
+            return std::unexpected(res.error());
+        }
+        if (foundId != MENU_ITEM_NOT_FOUND) {
+            return foundId;
+        }
+        auto retry = menu.prefetchAfterMiss();
+        if (!retry) {
+            return std::unexpected(retry.error());
+        }
+        if (!*retry) {
+            return MENU_ITEM_NOT_FOUND;
+        }
+    }
 }
 
-// 辅助函数：打印缩进
-inline void printIndent(int indent) {
-    for (int i = 0; i < indent; ++i) {
-        std::cout << "  ";
+// 确认要点击的菜单项存在并取得其状态：先用一次只包含这些 ID 的 GetGroupProperties 查询，与菜单规模无关；
+// 回复中缺少的（例如位于尚未加载的子菜单中）再退回到遍历布局查找
+std::expected<std::vector<MenuEntryState>, Error>
+lookupMenuEntries(DBusMenu &dbusMenu, MenuSource &menu, const std::vector<int32_t> &ids) {
+    std::vector<MenuEntryState> entries;
+    if (auto states = dbusMenu.getEntryStates(ids)) {
+        entries = std::move(*states);
+    }
+    std::vector<int32_t> missing;
+    for (int32_t id : ids) {
+        if (std::ranges::find(entries, id, &MenuEntryState::id) == entries.end()) {
+            missing.push_back(id);
+        }
     }
+    if (missing.empty()) {
+        return entries;
+    }
+
+    std::vector<int32_t> foundIds;
+    for (;;) {
+        foundIds.clear();
+        if (auto res = menu.visit(menuItemFinder(missing, foundIds)); !res) {
+            return std::unexpected(res.error());
+        }
+        if (foundIds.size() == missing.size()) {
+            break;
+        }
+        auto retry = menu.prefetchAfterMiss();
+        if (!retry) {
+            return std::unexpected(retry.error());
+        }
+        if (!*retry) {
+            break;
+        }
+    }
+    if (foundIds.empty()) {
+        return entries;
+    }
+    // 遍历时子菜单已经加载，再查询一次状态；仍然查不到时按默认状态处理，不影响点击
+    auto states = dbusMenu.getEntryStates(foundIds);
+    for (int32_t id : foundIds) {
+        MenuEntryState entry;
+        entry.id = id;
+        if (states) {
+            if (auto it = std::ranges::find(*states, id, &MenuEntryState::id); it != states->end()) {
+                entry = *it;
+            }
+        }
+        entries.push_back(std::move(entry));
+    }
+    return entries;
 }
 
-// 递归打印菜单项 - 优化版本
-void printMenuItems(const MenuLayoutItem &item, int indent = 0) {
-    printIndent(indent);
-
-    // 打印菜单项ID
-    fmt::printf("ID: %d", item.id);
-
-    // 打印菜单项属性 - 修复访问方式
-    for (const auto &[key, value] : item.properties) {
-        std::visit(
-            [&key](auto &&arg) {
-                using T = std::decay_t<decltype(arg)>;
-                if constexpr (std::is_same_v<T, std::string>) {
-                    fmt::printf(", %s: %s", key, arg);
-                } else if constexpr (std::is_same_v<T, bool>) {
-                    fmt::printf(", %s: %s", key, arg ? "true" : "false");
-                } else if constexpr (std::is_same_v<T, int32_t>) {
-                    fmt::printf(", %s: %d", key, arg);
-                }
-            },
-            value
+std::string_view toggleStateName(int32_t state) {
+    switch (state) {
+    case 0:
+        return "off";
+    case 1:
+        return "on";
+    default:
+        return "indeterminate";
+    }
+}
+
+// 菜单项不能点击的原因：禁用或隐藏
+std::optional<std::string> clickError(const MenuEntryState &entry) {
+    if (!entry.enabled) {
+        return "is disabled";
+    }
+    if (!entry.visible) {
+        return "is hidden";
+    }
+    return std::nullopt;
+}
+
+// --set-toggle 无法完成的原因：菜单项不是开关，或者要关闭一个单选项
+std::optional<std::string> toggleError(const MenuEntryState &entry, int32_t desired) {
+    if (!entry.isToggle()) {
+        return "is not a checkbox or radio item";
+    }
+    if (entry.toggleType == "radio" && desired == 0 && entry.toggleState != 0) {
+        return "is a radio item and can only be turned off by selecting another one";
+    }
+    return std::nullopt;
+}
+
+// 忽略大小写的子串匹配，用于过滤菜单索引
+bool containsIgnoreCase(std::string_view haystack, std::string_view needle) {
+    auto it = std::search(haystack.begin(), haystack.end(), needle.begin(), needle.end(), [](char a, char b) {
+        return std::tolower(static_cast<unsigned char>(a)) == std::tolower(static_cast<unsigned char>(b));
+    });
+    return it != haystack.end();
+}
+
+// 打印菜单索引中的所有可点击项，每行格式：地址\t菜单路径\t菜单项ID\t应用: 父标签 > 标签
+void dumpMenuIndex(const MenuIndex &index, std::string_view filter) {
+    const auto apps = index.apps();
+    const auto nodes = index.nodes();
+    for (uint32_t i = 0; i < nodes.size(); ++i) {
+        const auto &node = nodes[i];
+        if (node.depth == 0 || node.app >= apps.size() || (node.flags & MENU_NODE_SEPARATOR) ||
+            !(node.flags & MENU_NODE_VISIBLE) || index.string(node.label).empty()) {
+            continue;
+        }
+
+        const auto &app = apps[node.app];
+        auto appName = index.string(app.title);
+        if (appName.empty()) {
+            appName = index.string(app.itemId);
+        }
+
+        std::string entry = fmt::format("{}: {}", appName, index.labelPath(i));
+        if (!filter.empty() && !containsIgnoreCase(entry, filter)) {
+            continue;
+        }
+
+        fmt::printf(
+            "%s\t%s\t%d\t%s\n", std::string(index.string(app.address)), std::string(index.string(app.menuPath)),
+            node.menuId, entry
+        );
+    }
+}
+
+// 多目标模式中对每个托盘项执行的操作
+struct TargetAction {
+    bool activate = false;
+    bool contextMenu = false;
+    std::optional<int> scroll;
+    std::string orientation;
+    std::string label;
+    std::vector<int32_t> menuIds;
+    bool getToggle = false;
+    std::optional<int32_t> setToggle;
+    int x = DEFAULT_COORDINATE;
+    int y = DEFAULT_COORDINATE;
+    bool prefetch = true;
+};
+
+struct TargetResult {
+    std::string bus;
+    std::string address;
+    std::string id;
+    bool ok = false;
+    std::string message;
+    std::chrono::milliseconds elapsed{0};
+};
+
+// Error::show 带有换行，汇总报告中每个托盘项只占一行
+std::string oneLine(const Error &error) {
+    std::string text = error.show();
+    std::ranges::replace(text, '\n', ' ');
+    return text;
+}
+
+// 在 bus 上的单个托盘项上执行操作，每个调用方线程使用独立的连接
+TargetResult runTargetAction(const std::string &bus, const std::string &fullAddr, const TargetAction &action) {
+    const auto start = std::chrono::steady_clock::now();
+    TargetResult result;
+    result.bus = bus;
+    result.address = fullAddr;
+    auto finish = [&](bool ok, std::string message) {
+        result.ok = ok;
+        result.message = std::move(message);
+        result.elapsed =
+            std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+        return result;
+    };
+
+    auto [itemAddr, itemPath] = splitAddress(fullAddr);
+    StatusNotifierItem item(itemAddr, itemPath, bus);
+    if (auto connRes = item.connect(); !connRes) {
+        return finish(false, "connect failed: " + oneLine(connRes.error()));
+    }
+    ifExpected(item.getId(), [&result](const std::string &cid) { result.id = cid; });
+
+    if (action.activate) {
+        auto res = item.activate(action.x, action.y);
+        return finish(res.has_value(), res ? "activated" : oneLine(res.error()));
+    }
+    if (action.contextMenu) {
+        auto res = item.contextMenu(action.x, action.y);
+        return finish(res.has_value(), res ? "context menu shown" : oneLine(res.error()));
+    }
+    if (action.scroll) {
+        auto res = item.scroll(*action.scroll, action.orientation);
+        return finish(res.has_value(), res ? "scrolled" : oneLine(res.error()));
+    }
+
+    auto menuPath = item.getMenu();
+    if (!menuPath) {
+        return finish(false, "no menu: " + oneLine(menuPath.error()));
+    }
+    DBusMenu dbusMenu(itemAddr, *menuPath, bus);
+    if (auto connRes = dbusMenu.connect(); !connRes) {
+        return finish(false, "menu connect failed: " + oneLine(connRes.error()));
+    }
+
+    MenuSource menu(dbusMenu, action.prefetch ? MenuPrefetch::OnMiss : MenuPrefetch::Never, MENU_NAVIGATE_PROPERTIES);
+    std::vector<int32_t> targetIds;
+    std::vector<MenuEntryState> entries;
+    if (!action.label.empty()) {
+        auto found = findMenuLabel(menu, splitLabelPath(action.label));
+        if (!found) {
+            return finish(false, "layout failed: " + oneLine(found.error()));
+        }
+        const int32_t foundId = *found;
+        if (foundId == MENU_ITEM_NOT_FOUND) {
+            return finish(false, "label not found");
+        }
+        targetIds.push_back(foundId);
+        // 按标签找到的菜单项已经确认存在，再查询一次状态用于检查是否可用；开关操作必须取得状态
+        MenuEntryState entry;
+        entry.id = foundId;
+        auto states = dbusMenu.getEntryStates(targetIds);
+        if (states && !states->empty()) {
+            entry = states->front();
+        } else if (action.getToggle || action.setToggle) {
+            return finish(false, "could not query the state of the menu item");
+        }
+        entries.push_back(std::move(entry));
+    }
+    if (!action.menuIds.empty()) {
+        auto res = lookupMenuEntries(dbusMenu, menu, action.menuIds);
+        if (!res) {
+            return finish(false, "layout failed: " + oneLine(res.error()));
+        }
+        for (int32_t menuId : action.menuIds) {
+            if (std::ranges::find(*res, menuId, &MenuEntryState::id) == res->end()) {
+                return finish(false, fmt::format("menu item {} not found", menuId));
+            }
+            targetIds.push_back(menuId);
+        }
+        entries.insert(entries.end(), res->begin(), res->end());
+    }
+
+    auto entryOf = [&entries](int32_t id) -> const MenuEntryState & {
+        return *std::ranges::find(entries, id, &MenuEntryState::id);
+    };
+    if (action.getToggle) {
+        std::string states;
+        for (int32_t id : targetIds) {
+            const auto &entry = entryOf(id);
+            if (!entry.isToggle()) {
+                return finish(false, fmt::format("menu item {} is not a checkbox or radio item", id));
+            }
+            states += fmt::format("{}{}={}", states.empty() ? "" : " ", id, toggleStateName(entry.toggleState));
+        }
+        return finish(true, states);
+    }
+
+    std::vector<MenuEvent> events;
+    size_t unchanged = 0;
+    for (int32_t id : targetIds) {
+        const auto &entry = entryOf(id);
+        if (auto error = clickError(entry)) {
+            return finish(false, fmt::format("menu item {} {}", id, *error));
+        }
+        if (action.setToggle) {
+            if (auto error = toggleError(entry, *action.setToggle)) {
+                return finish(false, fmt::format("menu item {} {}", id, *error));
+            }
+            if (entry.toggleState == *action.setToggle) {
+                ++unchanged;
+                continue;
+            }
+        }
+        events.push_back(MenuEvent{id, "clicked", static_cast<int32_t>(0), 0});
+    }
+    if (events.empty() && unchanged > 0) {
+        return finish(true, fmt::format("{} menu item(s) already {}", unchanged, toggleStateName(*action.setToggle)));
+    }
+
+    auto clickRes = dbusMenu.sendEventGroup(events);
+    if (!clickRes) {
+        return finish(false, oneLine(clickRes.error()));
+    }
+    if (!clickRes->empty()) {
+        return finish(false, fmt::format("{} menu item(s) rejected by the application", clickRes->size()));
+    }
+    return finish(true, fmt::format("clicked {} menu item(s)", events.size()));
+}
+
+// 输出多目标操作的汇总报告，有任何目标失败时返回错误码；showBus 时每行带上托盘项所在的总线
+int reportTargetResults(const std::vector<TargetResult> &results, bool showBus) {
+    size_t succeeded = 0;
+    for (const auto &result : results) {
+        succeeded += result.ok;
+        fmt::printf(
+            "%-4s  %s%-24s  %-48s  %5dms  %s\n", result.ok ? "OK" : "FAIL", showBus ? result.bus + "  " : "",
+            result.id.empty() ? "-" : result.id, result.address, result.elapsed.count(), result.message
         );
     }
+    fmt::printf("%d of %d items succeeded\n", succeeded, results.size());
+    return succeeded == results.size() ? 0 : EXIT_ERROR_CODE;
+}
 
-    std::cout << std::endl;
+// 多总线模式中某条总线上的一个托盘项，无法获取属性时 properties 为空
+struct BusItem {
+    std::string bus;
+    std::string address;
+    std::optional<SNIPropertySet> properties;
+};
 
-    // 递归打印子菜单项
-    for (const auto &child : item.children) {
-        printMenuItems(child, indent + 1);
+// 并发扫描每条总线：先并发地连接各总线的 watcher 并列出托盘项（内置 watcher 同时返回属性），
+// 再对其余托盘项统一并发地调用 GetAll。结果按总线、再按注册顺序排列；无法访问的总线输出错误后跳过
+std::vector<BusItem> scanBuses(const std::vector<std::string> &buses, size_t jobs) {
+    std::vector<std::vector<BusItem>> perBus(buses.size());
+    std::vector<std::string> errors(buses.size());
+    parallelFor(buses.size(), jobs, [&](size_t b) {
+        StatusNotifierWatcher watcher(buses[b]);
+        if (auto connRes = watcher.connect(); !connRes) {
+            errors[b] = oneLine(connRes.error());
+            return;
+        }
+        if (auto items = watcher.getItemsWithProperties()) {
+            for (auto &[address, properties] : *items) {
+                perBus[b].push_back({buses[b], std::move(address), std::move(properties)});
+            }
+        } else if (auto addresses = watcher.getRegisteredAddresses()) {
+            for (auto &address : *addresses) {
+                perBus[b].push_back({buses[b], std::move(address), std::nullopt});
+            }
+        } else {
+            errors[b] = oneLine(addresses.error());
+        }
+    });
+
+    std::vector<BusItem> items;
+    for (size_t b = 0; b < buses.size(); ++b) {
+        if (!errors[b].empty()) {
+            std::cerr << "Could not list tray items on bus " << buses[b] << " with error: " << errors[b] << '\n';
+        }
+        std::ranges::move(perBus[b], std::back_inserter(items));
     }
+
+    parallelFor(items.size(), jobs, [&items](size_t i) {
+        auto &busItem = items[i];
+        if (busItem.properties) {
+            return;
+        }
+        auto [addr, path] = splitAddress(busItem.address);
+        StatusNotifierItem item(addr, path, busItem.bus);
+        if (item.connect()) {
+            ifExpected(item.getAll(), [&busItem](SNIPropertySet properties) {
+                busItem.properties = std::move(properties);
+            });
+        }
+    });
+    return items;
+}
+
+// 按属性表顺序输出托盘项属性；非 verbose 模式只输出 Category 和 Title
+void printSNIProperties(const SNIPropertySet &properties, bool verboseOutput) {
+    forEachSNIProperty([&]<SNIProperty P>() {
+        if (!verboseOutput && P != SNIProperty::Category && P != SNIProperty::Title) {
+            return;
+        }
+        if (const auto &value = properties.get<P>()) {
+            fmt::printf("%s: %s\n", std::string(sniPropertyInfo<P>.name), formatSNIValue(*value));
+        }
+    });
+}
+
+// 输出托盘项各个图标名解析得到的文件路径，找不到的图标不输出
+void printIconPaths(const SNIPropertySet &properties, IconResolver &resolver) {
+    const auto &themePath = properties.get<SNIProperty::IconThemePath>();
+    const std::string_view extraPath = themePath ? std::string_view(*themePath) : std::string_view();
+    auto print = [&](const char *label, const std::optional<std::string> &name) {
+        if (!name || name->empty())
+            return;
+        if (auto path = resolver.resolve(*name, extraPath))
+            fmt::printf("%s: %s\n", label, path->string());
+    };
+    print("IconPath", properties.get<SNIProperty::IconName>());
+    print("AttentionIconPath", properties.get<SNIProperty::AttentionIconName>());
+    print("OverlayIconPath", properties.get<SNIProperty::OverlayIconName>());
 }
 
 int main(int argc, char **argv) {
@@ -87,14 +549,48 @@ int main(int argc, char **argv) {
         ("t,title", "Find items by title", cxxopts::value<std::string>())
         ("a,addr", "Directly specify the address of the item", cxxopts::value<std::string>())
         ("p,path", "Directly specify the path of the item", cxxopts::value<std::string>())
-        ("m,menu-id", "Menu item ID to click", cxxopts::value<int32_t>())
+        ("label", "Menu item to click by label, optionally as a path like \"Settings > Dark mode\"", cxxopts::value<std::string>())
+        ("no-prefetch", "Do not send AboutToShowGroup to populate lazily loaded submenus (done before listing, and before a second lookup when a click target is not found)", cxxopts::value<bool>()->default_value("false"))
+        ("m,menu-id", "Menu item ID(s) to click, sent as one EventGroup when supported (e.g. -m 3,5 or -m 3 -m 5)", cxxopts::value<std::vector<int32_t>>())
+        ("get-toggle", "Print the toggle state of the menu item(s) given by --menu-id or --label instead of clicking", cxxopts::value<bool>()->default_value("false"))
+        ("set-toggle", "Turn the checkbox/radio menu item(s) given by --menu-id or --label on or off, clicking only those in the other state", cxxopts::value<std::string>())
         ("l,list", "List menu items instead of clicking", cxxopts::value<bool>()->default_value("false"))
+        ("properties", "Menu item properties to fetch for --list (default: type,label,enabled,visible,toggle-type,toggle-state,children-display)", cxxopts::value<std::vector<std::string>>())
+        ("all-properties", "Fetch all menu item properties for --list, including icon-data", cxxopts::value<bool>()->default_value("false"))
+        ("icons", "With --list, save icon-data to files named by content hash in the given directory (default: $XDG_CACHE_HOME/tray-control/icons) and print their paths", cxxopts::value<std::string>()->implicit_value(""))
         ("s,show", "Show all system tray items (equivalent to tray-show)", cxxopts::value<bool>()->default_value("false"))
+        ("resolve-icons", "With --show, resolve IconName/AttentionIconName/OverlayIconName to icon files using the icon theme and IconThemePath", cxxopts::value<bool>()->default_value("false"))
+        ("icon-theme", "Icon theme for --resolve-icons (default: gtk-icon-theme-name from the GTK settings, or hicolor)", cxxopts::value<std::string>())
+        ("icon-size", "Preferred icon size in pixels for --resolve-icons", cxxopts::value<int>()->default_value("24"))
         ("activate", "Activate the system tray item (equivalent to tray-activate)", cxxopts::value<bool>()->default_value("false"))
         ("context-menu", "Trigger the context menu of the system tray item", cxxopts::value<bool>()->default_value("false"))
         ("x", "X coordinate for activation (default: 0)", cxxopts::value<int>()->default_value("0"))
         ("y", "Y coordinate for activation (default: 0)", cxxopts::value<int>()->default_value("0"))
-        ("v,verbose", "Show full info about each item (when using --show)", cxxopts::value<bool>()->default_value("false"));
+        ("v,verbose", "Show full info about each item (when using --show)", cxxopts::value<bool>()->default_value("false"))
+        ("index", "Build or incrementally refresh the flattened menu index of all items", cxxopts::value<bool>()->default_value("false"))
+        ("index-dump", "Print all entries of the menu index (for rofi/dmenu)", cxxopts::value<bool>()->default_value("false"))
+        ("index-filter", "Only print index entries containing the given text (case-insensitive)", cxxopts::value<std::string>())
+        ("index-file", "Path of the menu index file (default: $XDG_RUNTIME_DIR/tray-control/menu-index)", cxxopts::value<std::string>())
+        ("watcher", "Run a built-in StatusNotifierWatcher (for sessions without a tray host) until killed", cxxopts::value<bool>()->default_value("false"))
+        ("probe", "Ping every item and its menu repeatedly and report latency percentiles and unresponsive apps", cxxopts::value<bool>()->default_value("false"))
+        ("probe-rounds", "Number of probe rounds", cxxopts::value<uint32_t>()->default_value("5"))
+        ("probe-timeout", "Deadline of each probe call in milliseconds", cxxopts::value<uint32_t>()->default_value("500"))
+        ("probe-slow", "Report items whose p90 latency exceeds this many milliseconds as slow", cxxopts::value<uint32_t>()->default_value("100"))
+        ("probe-format", "Probe report format: text or prometheus", cxxopts::value<std::string>()->default_value("text"))
+        ("probe-output", "Write the probe report to this file instead of stdout (replaced atomically)", cxxopts::value<std::string>())
+        ("wait", "Wait up to the given seconds (default 30, 0 for no limit) for the item found by id/title to register and export its menu", cxxopts::value<uint32_t>()->implicit_value("30"))
+        ("scroll", "Scroll the item by the given delta", cxxopts::value<int>())
+        ("orientation", "Scroll orientation: vertical or horizontal", cxxopts::value<std::string>()->default_value("vertical"))
+        ("all", "Apply the action to every registered item", cxxopts::value<bool>()->default_value("false"))
+        ("match-all", "Apply the action to every item whose id/title matches (shell glob patterns allowed) instead of the first", cxxopts::value<bool>()->default_value("false"))
+        ("j,jobs", "Maximum number of items acted on or probed concurrently with --all/--match-all/--probe", cxxopts::value<size_t>()->default_value("8"))
+        ("confirm", "After clicking, wait for the menu or item to signal a change and report the click-to-effect latency", cxxopts::value<bool>()->default_value("false"))
+        ("confirm-timeout", "How long --confirm waits for an effect in milliseconds", cxxopts::value<uint32_t>()->default_value("1000"))
+        ("retries", "Retry a D-Bus call this many times with backoff when the app is briefly unavailable (e.g. restarting)", cxxopts::value<uint32_t>()->default_value("1"))
+        ("bus", "Session bus address to scan instead of the default one, repeatable (e.g. unix:path=/run/user/1000/bus)", cxxopts::value<std::vector<std::string>>())
+        ("all-user-buses", "Scan the session bus of every logged-in user (/run/user/*/bus) concurrently", cxxopts::value<bool>()->default_value("false"))
+        ("record", "Record the D-Bus calls, replies and signals exchanged with tray items into this file (replay it with tray-replay)", cxxopts::value<std::string>())
+        ("mem-stats", "Print heap allocations and bytes per phase (discovery, properties, layout, output) and peak RSS to stderr on exit", cxxopts::value<bool>()->default_value("false"));
 
     const auto options = optionsDecl.parse(argc, argv);
     if (options["help"].as<bool>()) {
@@ -109,10 +605,171 @@ int main(int argc, char **argv) {
     const bool activateMode = options["activate"].as<bool>();
     const bool contextMenuMode = options["context-menu"].as<bool>();
     const bool listMode = options["list"].as<bool>();
+    const bool scrollMode = options.count("scroll") > 0;
+    const bool allMode = options["all"].as<bool>();
+    const bool matchAllMode = options["match-all"].as<bool>();
     const bool verboseOutput = options["verbose"].as<bool>();
+    const bool getToggle = options["get-toggle"].as<bool>();
+    std::optional<int32_t> setToggle;
+    if (options.count("set-toggle")) {
+        const auto &state = options["set-toggle"].as<std::string>();
+        if (state != "on" && state != "off") {
+            exitWithMsg("--set-toggle expects on or off", 0);
+        }
+        setToggle = state == "on" ? 1 : 0;
+    }
     const int x = options["x"].as<int>();
     const int y = options["y"].as<int>();
 
+    // 应用重启时名字短暂无人持有，一次快速重试就能避免命令失败
+    defaultRetryPolicy().retries = options["retries"].as<uint32_t>();
+
+    // 多总线模式：--bus 给出的地址加上 --all-user-buses 枚举到的全部用户会话总线
+    std::vector<std::string> buses;
+    if (options.count("bus")) {
+        buses = options["bus"].as<std::vector<std::string>>();
+    }
+    if (options["all-user-buses"].as<bool>()) {
+        for (auto &bus : userSessionBuses()) {
+            if (std::ranges::find(buses, bus) == buses.end()) {
+                buses.push_back(std::move(bus));
+            }
+        }
+        if (buses.empty()) {
+            exitWithMsg("No session bus found under /run/user", EXIT_ERROR_CODE);
+        }
+    }
+    const bool multiBusMode = !buses.empty();
+    if (multiBusMode &&
+        (listMode || options["index"].as<bool>() || options["index-dump"].as<bool>() || options["watcher"].as<bool>() ||
+         options["probe"].as<bool>() || options.count("wait"))) {
+        exitWithMsg(
+            "--bus and --all-user-buses cannot be combined with --list, --index, --index-dump, --watcher, --probe or "
+            "--wait",
+            0
+        );
+    }
+    // --confirm 订阅的是单个托盘项的信号，多总线模式下没有对应的等待方式
+    if (multiBusMode && options["confirm"].as<bool>()) {
+        exitWithMsg("--bus and --all-user-buses cannot be combined with --confirm", 0);
+    }
+    // 服务地址（尤其是唯一名）只在一条总线上有意义，多条总线时应按 Id/标题匹配
+    if (buses.size() > 1 && options.count("addr")) {
+        exitWithMsg("--addr can only be used with a single bus; use --id or --title to match on each bus", 0);
+    }
+
+    // 先于 stopRecording 注册，退出时最后执行，统计包括停止录制的开销
+    if (options["mem-stats"].as<bool>()) {
+        memStatsRequested = true;
+        std::atexit(printMemStats);
+    }
+
+    // 录制从第一个调用之前开始，到进程退出时结束
+    if (options.count("record")) {
+        if (buses.size() > 1) {
+            exitWithMsg("--record can only record one bus", 0);
+        }
+        auto started = TrafficRecorder::start(options["record"].as<std::string>(), buses.empty() ? "" : buses.front());
+        if (!started) {
+            exitWithMsg("Could not start recording with error: " + started.error().show(), EXIT_ERROR_CODE);
+        }
+        recorder = std::move(*started);
+        std::atexit(stopRecording);
+    }
+
+    // 菜单索引模式：不需要指定特定的项目，dump 时也无需连接 DBus
+    if (options["index"].as<bool>() || options["index-dump"].as<bool>()) {
+        std::string indexFile;
+        if (options.count("index-file")) {
+            indexFile = options["index-file"].as<std::string>();
+        } else if (auto defaultPath = MenuIndex::defaultPath()) {
+            indexFile = std::move(*defaultPath);
+        } else {
+            exitWithMsg("Could not locate the menu index with error: " + defaultPath.error().show(), EXIT_ERROR_CODE);
+        }
+        auto index = MenuIndex::open(indexFile);
+
+        if (options["index"].as<bool>()) {
+            MenuIndexBuilder builder;
+            auto stats = builder.build(indexFile, index ? &index.value() : nullptr);
+            if (!stats) {
+                exitWithMsg("Could not build the menu index with error: " + stats.error().show(), EXIT_ERROR_CODE);
+            }
+            if (verboseOutput) {
+                fmt::printf(
+                    "Indexed %d items (%d unchanged), %d menu entries into %s\n", stats->appsScanned,
+                    stats->appsReused, stats->nodesWritten, indexFile
+                );
+            }
+            if (!options["index-dump"].as<bool>()) {
+                return 0;
+            }
+            index = MenuIndex::open(indexFile);
+        }
+
+        if (!index) {
+            exitWithMsg("Could not open the menu index with error: " + index.error().show(), EXIT_ERROR_CODE);
+        }
+        dumpMenuIndex(*index, options.count("index-filter") ? options["index-filter"].as<std::string>() : "");
+        return 0;
+    }
+
+    // 内置 watcher 模式：占用 org.kde.StatusNotifierWatcher 并一直运行
+    if (options["watcher"].as<bool>()) {
+        StatusNotifierWatcherService service;
+        if (auto startRes = service.start(); !startRes) {
+            exitWithMsg(
+                "Could not start the StatusNotifierWatcher with error: " + startRes.error().show(), EXIT_ERROR_CODE
+            );
+        }
+        if (auto runRes = service.run(); !runRes) {
+            exitWithMsg("StatusNotifierWatcher stopped with error: " + runRes.error().show(), EXIT_ERROR_CODE);
+        }
+        return 0;
+    }
+
+    // 健康探测模式：对所有托盘项计时，不需要指定特定的项目
+    if (options["probe"].as<bool>()) {
+        const auto format = options["probe-format"].as<std::string>();
+        if (format != "text" && format != "prometheus") {
+            exitWithMsg("--probe-format must be text or prometheus", 0);
+        }
+
+        ProbeOptions probeOptions;
+        probeOptions.rounds = std::max(options["probe-rounds"].as<uint32_t>(), 1u);
+        probeOptions.timeout = std::chrono::milliseconds(options["probe-timeout"].as<uint32_t>());
+        probeOptions.slowThreshold = std::chrono::milliseconds(options["probe-slow"].as<uint32_t>());
+        probeOptions.jobs = options["jobs"].as<size_t>();
+
+        StatusNotifierWatcher probeWatcher;
+        if (auto connRes = probeWatcher.connect(); !connRes) {
+            exitWithMsg(
+                "Could not connect to the StatusNotifierWatcher with error: " + connRes.error().show(), EXIT_ERROR_CODE
+            );
+        }
+        auto addresses = probeWatcher.getRegisteredAddresses();
+        if (!addresses) {
+            exitWithMsg("Could not list tray items with error: " + addresses.error().show(), EXIT_ERROR_CODE);
+        }
+
+        auto report = probeTrayItems(*addresses, probeOptions);
+        if (!report) {
+            exitWithMsg("Could not probe tray items with error: " + report.error().show(), EXIT_ERROR_CODE);
+        }
+
+        const auto content = format == "prometheus" ? formatProbePrometheus(*report) : formatProbeReport(*report);
+        if (options.count("probe-output")) {
+            if (auto writeRes = writeFileAtomically(options["probe-output"].as<std::string>(), content); !writeRes) {
+                exitWithMsg(
+                    "Could not write the probe report with error: " + writeRes.error().show(), EXIT_ERROR_CODE
+                );
+            }
+        } else {
+            std::cout << content;
+        }
+        return 0;
+    }
+
     auto countId = options.count("id");
     auto countTitle = options.count("title");
     auto countAddr = options.count("addr");
@@ -145,87 +802,204 @@ int main(int argc, char **argv) {
             } else {
                 title = options["title"].as<std::string>();
             }
-        } else {
+        } else if (!allMode) {
             exitWithMsg("Please specify either addr/path or id/title", 0);
         }
 
+        if ((allMode || matchAllMode) && (listMode || countAddr)) {
+            exitWithMsg("--all and --match-all cannot be combined with --list or addr/path", 0);
+        }
+        if (matchAllMode && !countId && !countTitle) {
+            exitWithMsg("--match-all requires id or title", 0);
+        }
+        // 多目标模式只输出汇总报告，不等待托盘项出现，也不观察点击效果
+        if ((allMode || matchAllMode) && (options["confirm"].as<bool>() || options.count("wait"))) {
+            exitWithMsg("--all and --match-all cannot be combined with --confirm or --wait", 0);
+        }
+
         // 对于非show模式，检查是否需要菜单ID
-        if (!activateMode && !contextMenuMode && !listMode) {
-            if (options.count("menu-id") == 0) {
+        if (!activateMode && !contextMenuMode && !listMode && !scrollMode) {
+            if (options.count("menu-id") == 0 && options.count("label") == 0) {
                 exitWithMsg(
-                    "Please specify menu item ID to click (or use --list to list menu items, --activate to activate "
-                    "the item, --context-menu to trigger context menu, or --show to list all items)",
+                    "Please specify menu item ID or label to click (or use --list to list menu items, --activate to "
+                    "activate the item, --context-menu to trigger context menu, or --show to list all items)",
                     0
                 );
             }
         }
     }
 
+    // --show 的输出：图标索引在所有托盘项之间共享，同一主题目录只打开或遍历一次
+    std::optional<IconResolver> resolver;
+    if (showMode && options["resolve-icons"].as<bool>()) {
+        resolver.emplace(
+            options.count("icon-theme") ? options["icon-theme"].as<std::string>() : std::string(),
+            options["icon-size"].as<int>()
+        );
+    }
+    auto printItem = [&](const SNIPropertySet &properties) {
+        MemPhaseScope memPhase(MemPhase::Output);
+        printSNIProperties(properties, verboseOutput);
+        if (resolver)
+            printIconPaths(properties, *resolver);
+    };
+
+    // 多目标和多总线模式中对每个托盘项执行的操作
+    auto makeTargetAction = [&] {
+        TargetAction action;
+        action.activate = activateMode;
+        action.contextMenu = contextMenuMode;
+        if (scrollMode) {
+            action.scroll = options["scroll"].as<int>();
+        }
+        action.orientation = options["orientation"].as<std::string>();
+        if (options.count("label")) {
+            action.label = options["label"].as<std::string>();
+        }
+        if (options.count("menu-id")) {
+            action.menuIds = options["menu-id"].as<std::vector<int32_t>>();
+        }
+        action.getToggle = getToggle;
+        action.setToggle = setToggle;
+        action.x = x;
+        action.y = y;
+        action.prefetch = !options["no-prefetch"].as<bool>();
+        return action;
+    };
+
+    // 多总线模式：并发扫描所有总线，输出带总线标记的合并列表，或对各总线上的目标并发执行操作
+    if (multiBusMode) {
+        const size_t jobs = options["jobs"].as<size_t>();
+        if (showMode) {
+            for (const auto &busItem : scanBuses(buses, jobs)) {
+                auto [itemAddr, itemPath] = splitAddress(busItem.address);
+                fmt::printf("Bus: %s\n", busItem.bus);
+                fmt::printf("Address: %s\n", itemAddr);
+                fmt::printf("Path: %s\n", itemPath);
+                if (busItem.properties) {
+                    printItem(*busItem.properties);
+                }
+                std::cout << '\n';
+            }
+            return 0;
+        }
+
+        // 直接指定地址时只有一条总线，作用于该总线上的这个地址；否则 --all 选中全部托盘项，--match-all 选中所有 Id/标题
+        // 匹配通配符的托盘项，默认只选中每条总线上第一个 Id/标题相同的托盘项
+        std::vector<std::pair<std::string, std::string>> targets;
+        if (!addr.empty()) {
+            for (const auto &bus : buses) {
+                targets.emplace_back(bus, addr + path);
+            }
+        } else {
+            const std::string &pattern = !title.empty() ? title : id;
+            auto matches = [&](const BusItem &busItem) {
+                if (allMode) {
+                    return true;
+                }
+                if (!busItem.properties) {
+                    return false;
+                }
+                const auto &value = !title.empty() ? busItem.properties->get<SNIProperty::Title>()
+                                                   : busItem.properties->get<SNIProperty::Id>();
+                if (!value) {
+                    return false;
+                }
+                return matchAllMode ? fnmatch(pattern.c_str(), value->c_str(), 0) == 0 : *value == pattern;
+            };
+
+            const bool firstOnly = !allMode && !matchAllMode;
+            std::vector<std::string> matchedBuses;
+            for (auto &busItem : scanBuses(buses, jobs)) {
+                if (firstOnly && std::ranges::find(matchedBuses, busItem.bus) != matchedBuses.end()) {
+                    continue;
+                }
+                if (matches(busItem)) {
+                    matchedBuses.push_back(busItem.bus);
+                    targets.emplace_back(std::move(busItem.bus), std::move(busItem.address));
+                }
+            }
+        }
+        if (targets.empty()) {
+            exitWithMsg("No matching system tray item found", EXIT_ERROR_CODE);
+        }
+
+        const TargetAction action = makeTargetAction();
+        std::vector<TargetResult> results(targets.size());
+        parallelFor(targets.size(), jobs, [&](size_t i) {
+            results[i] = runTargetAction(targets[i].first, targets[i].second, action);
+        });
+        return reportTargetResults(results, true);
+    }
+
     StatusNotifierWatcher watcher;
     if (auto connRes = watcher.connect(); !connRes)
         exitWithMsg(
             "Could not connect to the StatusNotifierWatcher with error: " + connRes.error().show(), EXIT_ERROR_CODE
         );
 
+    // 多目标模式：并发地对所有匹配的托盘项执行同一操作，最后输出汇总报告
+    if (allMode || matchAllMode) {
+        auto maybeAddrs = watcher.getRegisteredAddresses();
+        if (!maybeAddrs) {
+            exitWithMsg("Could not list tray items with error: " + maybeAddrs.error().show(), EXIT_ERROR_CODE);
+        }
+        const auto &addrs = maybeAddrs.value();
+        const size_t jobs = options["jobs"].as<size_t>();
+
+        // 匹配本身也需要每个托盘项一次往返，同样并发进行
+        std::vector<std::string> targets;
+        if (allMode) {
+            targets = addrs;
+        } else {
+            const std::string &pattern = !title.empty() ? title : id;
+            std::vector<char> matched(addrs.size(), 0);
+            parallelFor(addrs.size(), jobs, [&](size_t i) {
+                auto [itemAddr, itemPath] = splitAddress(addrs[i]);
+                StatusNotifierItem item(itemAddr, itemPath);
+                if (!item.connect()) {
+                    return;
+                }
+                auto value = !title.empty() ? item.getTitle() : item.getId();
+                matched[i] = value && fnmatch(pattern.c_str(), value->c_str(), 0) == 0;
+            });
+            for (size_t i = 0; i < addrs.size(); ++i) {
+                if (matched[i]) {
+                    targets.push_back(addrs[i]);
+                }
+            }
+        }
+        if (targets.empty()) {
+            exitWithMsg("No matching system tray item found", EXIT_ERROR_CODE);
+        }
+
+        const TargetAction action = makeTargetAction();
+        std::vector<TargetResult> results(targets.size());
+        parallelFor(targets.size(), jobs, [&](size_t i) {
+            results[i] = runTargetAction(std::string(), targets[i], action);
+        });
+        return reportTargetResults(results, false);
+    }
+
     if (showMode) {
         // 实现tray-show的功能
-        if (auto maybeAddrs = watcher.getRegisteredAddresses()) {
+        // 内置 watcher 可以一次返回全部托盘项及其缓存的属性，其他 watcher 逐项 GetAll
+        if (auto maybeItems = watcher.getItemsWithProperties()) {
+            for (const auto &[fullAddr, properties] : maybeItems.value()) {
+                auto [addr, path] = splitAddress(fullAddr);
+                fmt::printf("Address: %s\n", addr);
+                fmt::printf("Path: %s\n", path);
+                printItem(properties);
+                std::cout << '\n';
+            }
+        } else if (auto maybeAddrs = watcher.getRegisteredAddresses()) {
             for (const auto &fullAddr : maybeAddrs.value()) {
                 auto [addr, path] = splitAddress(fullAddr);
                 fmt::printf("Address: %s\n", addr);
                 fmt::printf("Path: %s\n", path);
                 StatusNotifierItem item(addr, path);
                 if (auto connRes = item.connect()) {
-                    ifExpected(item.getCategory(), [](const std::string &category) {
-                        fmt::printf("Category: %s\n", category);
-                    });
-
-                    ifExpected(item.getTitle(), [](const std::string &title) { fmt::printf("Title: %s\n", title); });
-
-                    if (verboseOutput) {
-                        ifExpected(item.getId(), [](const std::string &id) { fmt::printf("Id: %s\n", id); });
-
-                        ifExpected(item.getStatus(), [](const std::string &status) {
-                            fmt::printf("Status: %s\n", status);
-                        });
-
-                        ifExpected(item.getWindowId(), [](uint32_t windowId) {
-                            fmt::printf("WindowId: %d\n", windowId);
-                        });
-
-                        ifExpected(item.getIconName(), [](const std::string &iconName) {
-                            fmt::printf("IconName: %s\n", iconName);
-                        });
-
-                        ifExpected(item.getIconThemePath(), [](const std::string &iconThemePath) {
-                            fmt::printf("IconThemePath: %s\n", iconThemePath);
-                        });
-
-                        ifExpected(item.getOverlayIconName(), [](const std::string &overlayIconName) {
-                            fmt::printf("OverlayIconName: %s\n", overlayIconName);
-                        });
-
-                        ifExpected(item.getAttentionIconName(), [](const std::string &attentionIconName) {
-                            fmt::printf("AttentionIconName: %s\n", attentionIconName);
-                        });
-
-                        ifExpected(item.getAttentionMovieName(), [](const std::string &attentionMovieName) {
-                            fmt::printf("AttentionMovieName: %s\n", attentionMovieName);
-                        });
-
-                        ifExpected(item.getMenu(), [](const sdbus::ObjectPath &menu) {
-                            fmt::printf("Menu: %s\n", menu.c_str());
-                        });
-
-                        ifExpected(item.getItemIsMenu(), [](bool itemIsMenu) {
-                            fmt::printf("ItemIsMenu: %s\n", itemIsMenu ? "true" : "false");
-                        });
-
-                        // ToolTip
-                        ifExpected(item.getToolTip(), [](const std::string &toolTip) {
-                            fmt::printf("ToolTip: %s\n", toolTip);
-                        });
-                    }
+                    ifExpected(item.getAll(), printItem);
                 } else {
                     std::cerr << "Could not connect to the StatusNotifierItem on address: " << fullAddr
                               << " with error: " << connRes.error().show() << '\n';
@@ -234,6 +1008,14 @@ int main(int argc, char **argv) {
                 std::cout << '\n';
             }
         }
+
+        if (resolver && verboseOutput) {
+            const auto stats = resolver->stats();
+            fmt::printf(
+                "Icon lookups: %d (%d repeated), %d themes, %d caches mapped, %d directories scanned\n", stats.lookups,
+                stats.memoHits, stats.themes, stats.mappedCaches, stats.scannedRoots
+            );
+        }
     } else {
         // 非show模式，需要定位到特定项目
         std::string targetAddr, targetPath;
@@ -246,30 +1028,27 @@ int main(int argc, char **argv) {
             targetPath = path;
             foundTarget = true;
         } else {
+            auto matchesTarget = [&id, &title](StatusNotifierItem &item) { return matchesItem(item, id, title); };
+
+            if (options.count("wait")) {
+                // 等待模式：由注册信号驱动，托盘项出现（且需要时菜单已导出）后立即继续
+                const bool requireMenu = !activateMode && !contextMenuMode;
+                auto found = watcher.waitForItem(matchesTarget, requireMenu, waitTimeout(options["wait"].as<uint32_t>()));
+                if (!found) {
+                    exitWithMsg("Could not find the item with error: " + found.error().show(), EXIT_ERROR_CODE);
+                }
+                std::tie(targetAddr, targetPath) = splitAddress(*found);
+                foundTarget = true;
+            }
             // 传统搜索模式：遍历查找匹配项
-            if (auto maybeAddrs = watcher.getRegisteredAddresses()) {
+            else if (auto maybeAddrs = watcher.getRegisteredAddresses()) {
                 for (const auto &fullAddr : maybeAddrs.value()) {
                     auto [itemAddr, itemPath] = splitAddress(fullAddr);
                     StatusNotifierItem item(itemAddr, itemPath);
                     if (!item.connect())
                         continue;
 
-                    bool matchFound = false;
-                    if (!title.empty()) {
-                        ifExpected(item.getTitle(), [&title, &matchFound](const std::string &ctitle) {
-                            if (ctitle == title) {
-                                matchFound = true;
-                            }
-                        });
-                    } else if (!id.empty()) {
-                        ifExpected(item.getId(), [&id, &matchFound](const std::string &cid) {
-                            if (cid == id) {
-                                matchFound = true;
-                            }
-                        });
-                    }
-
-                    if (matchFound) {
+                    if (matchesTarget(item)) {
                         targetAddr = itemAddr;
                         targetPath = itemPath;
                         foundTarget = true;
@@ -281,6 +1060,11 @@ int main(int argc, char **argv) {
 
         // 处理找到的目标项
         if (foundTarget) {
+            // 先于托盘项和菜单声明，保证信号线程停止之后才销毁
+            MenuEffectWaiter effectWaiter;
+            bool effectMissing = false;
+            const bool confirmMode = options["confirm"].as<bool>() && !listMode;
+
             StatusNotifierItem item(targetAddr, targetPath);
             if (!item.connect()) {
                 exitWithMsg(
@@ -294,6 +1078,10 @@ int main(int argc, char **argv) {
             } else if (contextMenuMode) {
                 // 执行上下文菜单操作
                 fmt::printf("Context menu %s\n", item.contextMenu(x, y) ? "succeeded" : "failed");
+            } else if (scrollMode) {
+                const bool scrolled =
+                    item.scroll(options["scroll"].as<int>(), options["orientation"].as<std::string>()).has_value();
+                fmt::printf("Scroll %s\n", scrolled ? "succeeded" : "failed");
             } else {
                 // 获取菜单路径并处理菜单项
                 std::string menuPath;
@@ -304,45 +1092,219 @@ int main(int argc, char **argv) {
                 } else {
                     DBusMenu dbusMenu(targetAddr, menuPath);
                     if (auto connRes = dbusMenu.connect()) {
-                        ifExpected(
-                            dbusMenu.getLayout(0, -1), [&options, listMode, &dbusMenu](const auto &layoutResult) {
-                                const auto &[revision, rootItem] = layoutResult;
-
-                                if (listMode) {
-                                    // 列出菜单项
-                                    fmt::printf("Menu revision: %d\n", revision);
-                                    fmt::printf("Menu items:\n");
-                                    printMenuItems(rootItem);
+                        // 确认模式：点击之前订阅菜单和托盘项的信号，未 arm 时收到的信号会被忽略
+                        if (confirmMode) {
+                            dbusMenu.registerItemsPropertiesUpdatedCallback(
+                                [&effectWaiter](const auto &updated, const auto &removed) {
+                                    std::vector<int32_t> ids;
+                                    for (const auto &updatedItem : updated) {
+                                        ids.push_back(updatedItem.id);
+                                    }
+                                    for (const auto &[removedId, keys] : removed) {
+                                        ids.push_back(removedId);
+                                    }
+                                    effectWaiter.notifyProperties(ids);
+                                }
+                            );
+                            dbusMenu.registerLayoutUpdatedCallback([&effectWaiter](uint32_t revision, int32_t) {
+                                effectWaiter.notifyLayout(revision);
+                            });
+                            if (auto subRes = item.registerSignalCallback(
+                                    [&effectWaiter](SNISignal signal, const std::string &) {
+                                        effectWaiter.notify(std::string(magic_enum::enum_name(signal)));
+                                    }
+                                );
+                                !subRes) {
+                                std::cerr << "Could not subscribe to item signals with error: "
+                                          << subRes.error().show() << '\n';
+                            }
+                        }
+
+                        // 只请求需要的属性；按 ID 点击时只需确认菜单项存在
+                        std::vector<std::string> propertyNames = MENU_LOOKUP_PROPERTIES;
+                        if (options.count("label")) {
+                            propertyNames = MENU_NAVIGATE_PROPERTIES;
+                        }
+                        if (listMode) {
+                            if (options["all-properties"].as<bool>()) {
+                                propertyNames.clear();
+                            } else if (options.count("properties")) {
+                                propertyNames = options["properties"].as<std::vector<std::string>>();
+                            } else {
+                                propertyNames = MENU_LIST_PROPERTIES;
+                            }
+                            if (options.count("icons") && !propertyNames.empty() &&
+                                std::ranges::find(propertyNames, "icon-data") == propertyNames.end()) {
+                                propertyNames.emplace_back("icon-data");
+                            }
+                        }
+
+                        // 列出菜单时先用 AboutToShowGroup 填充延迟加载的子菜单，点击时只在找不到目标时才预取；
+                        // --no-prefetch 时直接流式解码，不构建布局树
+                        auto prefetch = listMode ? MenuPrefetch::Always : MenuPrefetch::OnMiss;
+                        if (options["no-prefetch"].as<bool>()) {
+                            prefetch = MenuPrefetch::Never;
+                        }
+                        MenuSource menu(dbusMenu, prefetch, propertyNames);
+
+                        if (listMode) {
+                            // 列出菜单项；--icons 时图标按内容哈希存为文件，未变化的图标不会重写
+                            std::optional<IconCache> icons;
+                            if (options.count("icons")) {
+                                const auto &dir = options["icons"].as<std::string>();
+                                icons.emplace(dir.empty() ? IconCache::defaultDirectory() : std::filesystem::path(dir));
+                            }
+                            auto printer = menuPrinter(stdout, icons ? &*icons : nullptr);
+                            printer.begin = [](uint32_t revision) { fmt::printf("Menu revision: %d\nMenu items:\n", revision); };
+                            if (auto res = menu.visit(printer); !res) {
+                                std::cerr << "Could not get the menu layout with error: " << res.error().show() << '\n';
+                            } else if (verboseOutput) {
+                                const auto &stats = dbusMenu.transferStats();
+                                fmt::printf("Layout payload: %d bytes in %d replies\n", stats.totalBytes, stats.calls);
+                                const auto iconStats = IconStore::global().stats();
+                                fmt::printf(
+                                    "Icon data: %d decoded, %d shared, %d distinct (%d bytes)\n", iconStats.lookups,
+                                    iconStats.hits, iconStats.entries, iconStats.bytes
+                                );
+                                if (icons) {
+                                    fmt::printf(
+                                        "Icon files: %d written to %s\n", icons->written(), icons->directory().string()
+                                    );
+                                }
+                            }
+                        } else {
+                            // 点击菜单项，多个 ID 通过一次 EventGroup 发送
+                            std::vector<int32_t> menuIds;
+                            std::vector<MenuEntryState> entries;
+                            if (options.count("label")) {
+                                const auto &label = options["label"].as<std::string>();
+                                auto found = findMenuLabel(menu, splitLabelPath(label));
+                                if (!found) {
+                                    std::cerr << "Could not get the menu layout with error: " << found.error().show() << '\n';
+                                } else if (*found != MENU_ITEM_NOT_FOUND) {
+                                    const int32_t foundId = *found;
+                                    menuIds.push_back(foundId);
+                                    // 按标签找到的菜单项已经确认存在，再查询一次状态用于检查是否可用；
+                                    // 查询失败时按默认状态处理，与按 ID 查找一致
+                                    MenuEntryState entry;
+                                    entry.id = foundId;
+                                    if (auto states = dbusMenu.getEntryStates(menuIds); states && !states->empty()) {
+                                        entry = states->front();
+                                    }
+                                    entries.push_back(std::move(entry));
                                 } else {
-                                    // 点击菜单项
-                                    std::optional<int32_t> menuId = options["menu-id"].as<int32_t>();
-
-                                    // 查找菜单项
-                                    int32_t foundId = MENU_ITEM_NOT_FOUND;
-                                    if (findMenuItem(rootItem, *menuId, foundId)) {
-                                        fmt::printf("Found menu item with ID: %d\n", foundId);
-
-                                        // 发送点击事件
-                                        std::variant<bool, int32_t, std::string> data = static_cast<int32_t>(0);
-                                        if (auto clickRes = dbusMenu.sendEvent(foundId, "clicked", data, 0)) {
-                                            fmt::printf("Successfully clicked menu item with ID: %d\n", foundId);
-                                        } else {
-                                            fmt::printf(
-                                                "Failed to click menu item with ID: %d, error: %s\n", foundId,
-                                                clickRes.error().show().c_str()
-                                            );
-                                        }
+                                    fmt::printf("Menu item with label: %s not found\n", label);
+                                }
+                            } else {
+                                // 先只查询这些菜单项，服务端没有返回时才获取布局
+                                menuIds = options["menu-id"].as<std::vector<int32_t>>();
+                                if (auto res = lookupMenuEntries(dbusMenu, menu, menuIds)) {
+                                    entries = std::move(*res);
+                                } else {
+                                    std::cerr << "Could not get the menu layout with error: " << res.error().show() << '\n';
+                                    menuIds.clear();
+                                }
+                            }
+
+                            // 查找菜单项；--get-toggle 只输出状态，--set-toggle 跳过已经处于目标状态的菜单项
+                            std::vector<MenuEvent> events;
+                            for (int32_t menuId : menuIds) {
+                                auto entry = std::ranges::find(entries, menuId, &MenuEntryState::id);
+                                if (entry == entries.end()) {
+                                    fmt::printf("Menu item with ID: %d not found\n", menuId);
+                                    continue;
+                                }
+                                if (getToggle) {
+                                    if (entry->isToggle()) {
+                                        fmt::printf(
+                                            "Menu item with ID: %d is %s\n", menuId,
+                                            std::string(toggleStateName(entry->toggleState))
+                                        );
                                     } else {
-                                        fmt::printf("Menu item with ID: %d not found\n", *menuId);
+                                        fmt::printf("Menu item with ID: %d is not a checkbox or radio item\n", menuId);
                                     }
+                                    continue;
+                                }
+                                // 应用不会响应禁用或隐藏的菜单项，点击它们只会得到一个假的成功
+                                if (auto error = clickError(*entry)) {
+                                    fmt::printf("Menu item with ID: %d %s\n", menuId, *error);
+                                    continue;
                                 }
+                                if (setToggle) {
+                                    if (auto error = toggleError(*entry, *setToggle)) {
+                                        fmt::printf("Menu item with ID: %d %s\n", menuId, *error);
+                                        continue;
+                                    }
+                                    if (entry->toggleState == *setToggle) {
+                                        fmt::printf(
+                                            "Menu item with ID: %d is already %s\n", menuId,
+                                            std::string(toggleStateName(*setToggle))
+                                        );
+                                        continue;
+                                    }
+                                }
+                                fmt::printf("Found menu item with ID: %d\n", menuId);
+                                events.push_back(MenuEvent{menuId, "clicked", static_cast<int32_t>(0), 0});
                             }
-                        );
+
+                            // 发送点击事件
+                            if (confirmMode) {
+                                std::vector<int32_t> clickedIds;
+                                for (const auto &event : events) {
+                                    clickedIds.push_back(event.id);
+                                }
+                                // 预取发出的 AboutToShowGroup 可能在点击之后才引起 LayoutUpdated，不能算作点击的效果
+                                effectWaiter.arm(std::move(clickedIds), menu.prefetchedRevision());
+                            }
+                            if (auto clickRes = dbusMenu.sendEventGroup(events)) {
+                                for (const auto &event : events) {
+                                    if (std::ranges::find(*clickRes, event.id) != clickRes->end()) {
+                                        fmt::printf(
+                                            "Failed to click menu item with ID: %d, not found by the "
+                                            "application\n",
+                                            event.id
+                                        );
+                                    } else {
+                                        fmt::printf("Successfully clicked menu item with ID: %d\n", event.id);
+                                    }
+                                }
+
+                                if (confirmMode && !events.empty()) {
+                                    const auto timeout =
+                                        std::chrono::milliseconds(options["confirm-timeout"].as<uint32_t>());
+                                    if (auto effect = effectWaiter.wait(timeout)) {
+                                        fmt::printf(
+                                            "Effect observed: %s after %.2f ms\n", effect->signal,
+                                            static_cast<double>(effect->latency.count()) / 1000
+                                        );
+                                    } else {
+                                        fmt::printf("No effect observed within %d ms\n", timeout.count());
+                                        effectMissing = true;
+                                    }
+                                    if (verboseOutput) {
+                                        const auto stats = signalStats();
+                                        fmt::printf(
+                                            "Signals: %d received, %d dispatched\n", stats.received,
+                                            stats.dispatched
+                                        );
+                                    }
+                                }
+                            } else {
+                                fmt::printf(
+                                    "Failed to click menu items, error: %s\n", clickRes.error().show().c_str()
+                                );
+                            }
+                        }
                     } else {
                         std::cerr << "Could not connect to the DBusMenu with error: " << connRes.error().show() << '\n';
                     }
                 }
             }
+
+            // 确认模式下没有观察到效果时返回错误码，便于脚本判断
+            if (effectMissing) {
+                return EXIT_ERROR_CODE;
+            }
         } else {
             std::cerr << "No matching system tray item found\n";
         }